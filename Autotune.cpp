@@ -0,0 +1,172 @@
+/* Deathray - An Avisynth plug-in filter for spatial/temporal non-local means de-noising.
+ *
+ * version 1.04
+ *
+ * Copyright 2013, Jawed Ashraf - Deathray@cupidity.f9.co.uk
+ */
+
+#include <windows.h>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <mutex>
+#include "Autotune.h"
+#include "CLutil.h"
+#include "device.h"
+#include "SingleFrame.h"
+#include "nlm_algorithm.h"
+
+extern	device	*g_devices;
+
+// Serialises access to the file of tuned configurations by instances
+// on separate threads
+mutex g_autotune_mutex;
+
+// TuningKey
+// Identifies the configuration in the file of tuned configurations
+string TuningKey(
+	const	int				&device_id,
+	const	int				&width,
+	const	int				&height,
+	const	int				&sample_expand,
+	const	int				&linear,
+	const	int				&correction,
+	const	int				&target_min,
+	const	int				&balanced,
+	const	kernel_tuning	&requested,
+	const	int				&tune_half_tile) {
+
+	const cl_device_id id = g_devices[device_id].id();
+
+	ostringstream key;
+	key << DeviceInfo(id, CL_DEVICE_NAME) << '|'
+		<< DeviceInfo(id, CL_DRIVER_VERSION) << '|'
+		<< width << 'x' << height << '|'
+		<< sample_expand << ' ' << linear << ' ' << correction << ' ' << target_min << ' ' << balanced << ' '
+		<< requested.algorithm << ' ' << requested.half_tile << ' ' << tune_half_tile;
+	return key.str();
+}
+
+// LoadTuning
+// Finds the key in the file of tuned configurations
+bool LoadTuning(const string &key, kernel_tuning *tuned) {
+	ifstream file((ProgramCacheFolder() + AUTOTUNE_FILE).c_str());
+	string line;
+	while (getline(file, line)) {
+		size_t separator = line.rfind('\t');
+		if (separator == string::npos || line.substr(0, separator) != key) continue;
+
+		istringstream value(line.substr(separator + 1));
+		kernel_tuning stored;
+		if (value >> stored.algorithm >> stored.half_tile) {
+			*tuned = stored;
+			return true;
+		}
+	}
+	return false;
+}
+
+// SaveTuning
+// Appends the configuration to the file of tuned configurations
+void SaveTuning(const string &key, const kernel_tuning &tuned) {
+	ofstream file((ProgramCacheFolder() + AUTOTUNE_FILE).c_str(), ios::app);
+	file << key << '\t' << tuned.algorithm << ' ' << tuned.half_tile << '\n';
+}
+
+// TimeCandidate
+// Returns the time taken to filter the plane, in seconds, or a
+// negative value if the candidate cannot be used.
+double TimeCandidate(
+	const	int				&device_id,
+	const	int				&width,
+	const	int				&height,
+	const	int				&pitch,
+	const	unsigned char	*plane,
+	const	float			&h,
+	const	int				&sample_expand,
+	const	int				&linear,
+	const	int				&correction,
+	const	int				&target_min,
+	const	int				&balanced,
+	const	kernel_tuning	&candidate,
+	const	int				&gaussian) {
+
+	SingleFrame filter;
+	result status = filter.Init(device_id, width, height, pitch, pitch, 1, h, sample_expand, linear, correction, target_min, balanced, candidate.algorithm, candidate.half_tile, gaussian);
+	if (status != FILTER_OK) return -1.;
+
+	vector<unsigned char> filtered(pitch * height);
+
+	LARGE_INTEGER frequency, start, end;
+	QueryPerformanceFrequency(&frequency);
+
+	// The first run is not timed, as it includes building the kernel
+	for (int run = 0; run <= AUTOTUNE_RUNS; ++run) {
+		if (run == 1) QueryPerformanceCounter(&start);
+
+		cl_event copied;
+		if (filter.CopyTo(run, plane) != FILTER_OK) return -1.;
+		if (filter.Execute() != FILTER_OK) return -1.;
+		if (filter.CopyFrom(&filtered[0], &copied) != FILTER_OK) return -1.;
+		clWaitForEvents(1, &copied);
+		ReleaseEvent(copied);
+	}
+	QueryPerformanceCounter(&end);
+
+	return static_cast<double>(end.QuadPart - start.QuadPart) / frequency.QuadPart;
+}
+
+result Autotune(
+	const	int				&device_id,
+	const	int				&width,
+	const	int				&height,
+	const	int				&pitch,
+	const	unsigned char	*plane,
+	const	float			&h,
+	const	int				&sample_expand,
+	const	int				&linear,
+	const	int				&correction,
+	const	int				&target_min,
+	const	int				&balanced,
+	const	kernel_tuning	&requested,
+	const	int				&tune_half_tile,
+	const	int				&gaussian,
+			kernel_tuning	*tuned) {
+
+	lock_guard<mutex> serialise(g_autotune_mutex);
+
+	*tuned = requested;
+
+	const string key = TuningKey(device_id, width, height, sample_expand, linear, correction, target_min, balanced, requested, tune_half_tile);
+	if (LoadTuning(key, tuned)) return FILTER_OK;
+
+	// Gaussian weighting is computed either per window or separably,
+	// whereas box weighting has a single implementation
+	vector<kernel_tuning> candidates;
+	const int first_half_tile = tune_half_tile ? 0 : requested.half_tile;
+	const int last_half_tile = tune_half_tile ? 1 : requested.half_tile;
+	for (int half_tile = first_half_tile; half_tile <= last_half_tile; ++half_tile) {
+		kernel_tuning candidate = {requested.algorithm, half_tile};
+		if (requested.algorithm == NLM_INTEGRAL) {
+			candidates.push_back(candidate);
+		} else {
+			candidate.algorithm = NLM_GAUSSIAN;
+			candidates.push_back(candidate);
+			candidate.algorithm = NLM_SEPARABLE;
+			candidates.push_back(candidate);
+		}
+	}
+
+	double fastest = -1.;
+	for (size_t i = 0; i < candidates.size(); ++i) {
+		double time = TimeCandidate(device_id, width, height, pitch, plane, h, sample_expand, linear, correction, target_min, balanced, candidates[i], gaussian);
+		if (time >= 0. && (fastest < 0. || time < fastest)) {
+			fastest = time;
+			*tuned = candidates[i];
+		}
+	}
+	if (fastest < 0.) return FILTER_ERROR;
+
+	SaveTuning(key, *tuned);
+	return FILTER_OK;
+}
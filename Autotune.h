@@ -0,0 +1,58 @@
+/* Deathray - An Avisynth plug-in filter for spatial/temporal non-local means de-noising.
+ *
+ * version 1.04
+ *
+ * Copyright 2013, Jawed Ashraf - Deathray@cupidity.f9.co.uk
+ */
+
+#ifndef _AUTOTUNE_H_
+#define _AUTOTUNE_H_
+
+#include <string>
+#include "result.h"
+
+using namespace std;
+
+// Count of timed executions of each candidate, after an untimed execution
+#define AUTOTUNE_RUNS 3
+
+// Name of the file, in the program cache folder, holding tuned configurations
+#define AUTOTUNE_FILE "tuning.txt"
+
+// kernel_tuning
+// Configuration of the NLM kernels used by a device for a plane size
+struct kernel_tuning {
+	int algorithm	;	// method used to compute window distances, see nlm_algorithm
+	int half_tile	;	// tiles are held as halves in local memory
+};
+
+// Autotune
+// Chooses the fastest configuration of the NLM kernels for the device
+// and plane. Candidates are the implementations that produce the same
+// result as the requested algorithm, except for rounding, with tiles
+// held as floats or halves, or solely as requested when tune_half_tile
+// is 0.
+//
+// Each candidate filters the plane with a SingleFrame object. The
+// fastest is saved, keyed by device, driver, plane size and filter
+// parameters, so that later runs use it without benchmarking.
+//
+// tuned is set to the requested configuration if benchmarking fails.
+result Autotune(
+	const	int				&device_id,
+	const	int				&width,
+	const	int				&height,
+	const	int				&pitch,
+	const	unsigned char	*plane,			// plane used for benchmarking
+	const	float			&h,
+	const	int				&sample_expand,
+	const	int				&linear,
+	const	int				&correction,
+	const	int				&target_min,
+	const	int				&balanced,
+	const	kernel_tuning	&requested,
+	const	int				&tune_half_tile,	// candidates include both ways of holding tiles
+	const	int				&gaussian,		// buffer of gaussian weights on the device
+			kernel_tuning	*tuned);
+
+#endif // _AUTOTUNE_H_
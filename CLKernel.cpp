@@ -8,10 +8,23 @@
 #include "CLKernel.h"
 #include "CLutil.h"
 #include "device.h"
+#include "trace.h"
 
 
 CLKernel::CLKernel(const int &device_id, const string &kernel_name) {
 	kernel_				= g_devices[device_id].NewKernelInstance(kernel_name);
+	name_				= kernel_name;
+	arguments_valid_	= true;
+	argument_counter_	= 0;
+	work_dim_			= 0;			
+	local_work_size_	= NULL;	
+	scalar_global_size_	= NULL;
+	scalar_item_size_	= NULL;	
+}
+
+CLKernel::CLKernel(const int &device_id, const string &kernel_name, const string &variant) {
+	kernel_				= g_devices[device_id].NewKernelInstance(kernel_name, variant);
+	name_				= kernel_name;
 	arguments_valid_	= true;
 	argument_counter_	= 0;
 	work_dim_			= 0;			
@@ -114,6 +127,8 @@ result CLKernel::Execute(
 			return FILTER_ERROR;
 		}
 
+		CountEvent(event);
+		TraceCommand(name_, *event);
 		return FILTER_OK;
 	}
 	return FILTER_ERROR;
@@ -141,6 +156,8 @@ result CLKernel::ExecuteAsynch(
 			return FILTER_ERROR;
 		}
 
+		CountEvent(event);
+		TraceCommand(name_, *event);
 		return FILTER_OK;
 	}
 	return FILTER_ERROR;
@@ -168,6 +185,8 @@ result CLKernel::ExecuteWaitList(
 			return FILTER_ERROR;
 		}
 
+		CountEvent(event);
+		TraceCommand(name_, *event);
 		return FILTER_OK;
 	}
 	return FILTER_ERROR;
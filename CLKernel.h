@@ -24,6 +24,11 @@ public:
 	// Specify the device used to execute the named kernel.
 	CLKernel(const int &device_id, const string &kernel_name);
 
+	// Constructor
+	// Specify the device and the program variant, see VariantOptions,
+	// used to execute the named kernel.
+	CLKernel(const int &device_id, const string &kernel_name, const string &variant);
+
 	~CLKernel() {}
 
 	// SetArg
@@ -116,6 +121,7 @@ private:
 	void global_work_size();
 
 	cl_kernel	kernel_;				// Compiled OpenCL kernel, ready to execute
+	string		name_;					// Name of the kernel, for tracing
 	bool		arguments_valid_;		// Tracks occurrence of an error in arguments
 	int			argument_counter_;		// Count of arguments, when setting them sequentially
 	cl_uint		work_dim_;				// Count of dimensions in the execution domain
@@ -6,6 +6,10 @@
  */
 
 #include <direct.h>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <atomic>
 
 #include "util.h"
 #include "clutil.h"
@@ -14,8 +18,30 @@
 
 extern	int		g_device_count;
 
-cl_int			g_last_cl_error = CL_SUCCESS;
+__declspec(thread) cl_int	g_last_cl_error	= CL_SUCCESS;	// per thread, so that instances on separate threads report their own errors
 cl_context		g_context		= NULL;
+string			g_program_source;
+
+// References to events, changed by callbacks of the driver's threads too
+static atomic<int> g_live_events(0);
+
+void CountEvent(const cl_event *event) {
+	if (event != NULL && *event != NULL) ++g_live_events;
+}
+
+void RetainEvent(const cl_event &event) {
+	clRetainEvent(event);
+	++g_live_events;
+}
+
+void ReleaseEvent(const cl_event &event) {
+	clReleaseEvent(event);
+	--g_live_events;
+}
+
+int LiveEvents() {
+	return g_live_events;
+}
 
 char* GetCLErrorString(const cl_int &err) {
 	switch (err) {
@@ -184,6 +210,216 @@ result AssembleSources(const int* resources, const int& resource_count, string*
 	return FILTER_OK ;	
 }
 
+unsigned __int64 HashText(const string &text, const unsigned __int64 &seed) {
+	// 64-bit FNV-1a
+	unsigned __int64 hash = seed;
+	for (size_t i = 0; i < text.size(); ++i) {
+		hash ^= static_cast<unsigned char>(text[i]);
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+string DeviceInfo(const cl_device_id &device, const cl_device_info &parameter) {
+	size_t size = 0;
+	if (clGetDeviceInfo(device, parameter, 0, NULL, &size) != CL_SUCCESS || size == 0) 
+		return "";
+
+	vector<char> info(size);
+	clGetDeviceInfo(device, parameter, size, &info[0], NULL);
+	return string(&info[0]);
+}
+
+string ProgramCacheFolder() {
+	char folder[MAX_PATH];
+	DWORD length = GetEnvironmentVariableA("LOCALAPPDATA", folder, MAX_PATH);
+	if (length == 0 || length >= MAX_PATH) {
+		length = GetTempPathA(MAX_PATH, folder);
+		if (length == 0 || length >= MAX_PATH) return "";
+	}
+
+	string path(folder);
+	if (path[path.size() - 1] != '\\') path += '\\';
+	path += PROGRAM_CACHE_FOLDER;
+	_mkdir(path.c_str());
+	return path + '\\';
+}
+
+void ProgramCacheEntry(
+	const	cl_device_id	&device,
+	const	string			&options,
+	const	string			&source,
+			string			*file_name,
+			string			*key) {
+
+	ostringstream key_text;
+	key_text << PROGRAM_CACHE_VERSION << '|'
+			 << DeviceInfo(device, CL_DEVICE_NAME) << '|'
+			 << DeviceInfo(device, CL_DRIVER_VERSION) << '|'
+			 << options << '|'
+			 << hex << HashText(source, 14695981039346656037ULL);
+	*key = key_text.str();
+
+	ostringstream name;
+	name << "program_" << hex << HashText(*key, 14695981039346656037ULL) << ".bin";
+	*file_name = ProgramCacheFolder() + name.str();
+}
+
+bool LoadCachedProgram(
+	const	int				&device_count, 
+	const	cl_device_id	*devices,
+	const	string			&options,
+	const	string			&source,
+			cl_program		*program) {
+
+	vector<vector<unsigned char> > binaries(device_count);
+	vector<size_t> sizes(device_count);
+	vector<const unsigned char*> pointers(device_count);
+
+	for (int i = 0; i < device_count; ++i) {
+		string file_name, key;
+		ProgramCacheEntry(devices[i], options, source, &file_name, &key);
+
+		// The first line of the file is the key, guarding against
+		// collisions of the file name
+		ifstream file(file_name.c_str(), ios::binary);
+		string stored_key;
+		if (!file || !getline(file, stored_key) || stored_key != key) return false;
+
+		binaries[i].assign(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+		if (binaries[i].empty()) return false;
+
+		sizes[i] = binaries[i].size();
+		pointers[i] = &binaries[i][0];
+	}
+
+	cl_int cl_status = CL_SUCCESS;
+	*program = clCreateProgramWithBinary(g_context, 
+										 device_count, 
+										 devices, 
+										 &sizes[0], 
+										 &pointers[0], 
+										 NULL, 
+										 &cl_status);
+	if (cl_status != CL_SUCCESS) {
+		*program = NULL;
+		return false;
+	}
+
+	return true;
+}
+
+void SaveCachedProgram(
+	const	cl_program		&program,
+	const	int				&device_count, 
+	const	cl_device_id	*devices,
+	const	string			&options,
+	const	string			&source) {
+
+	vector<size_t> sizes(device_count);
+	if (clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, device_count * sizeof(size_t), &sizes[0], NULL) != CL_SUCCESS) 
+		return;
+
+	vector<vector<unsigned char> > binaries(device_count);
+	vector<unsigned char*> pointers(device_count);
+	for (int i = 0; i < device_count; ++i) {
+		if (sizes[i] == 0) return;
+		binaries[i].resize(sizes[i]);
+		pointers[i] = &binaries[i][0];
+	}
+	if (clGetProgramInfo(program, CL_PROGRAM_BINARIES, device_count * sizeof(unsigned char*), &pointers[0], NULL) != CL_SUCCESS) 
+		return;
+
+	for (int i = 0; i < device_count; ++i) {
+		string file_name, key;
+		ProgramCacheEntry(devices[i], options, source, &file_name, &key);
+
+		// Written under a temporary name then renamed, so that other 
+		// processes never load a partially written binary
+		ostringstream temporary_name;
+		temporary_name << file_name << '.' << GetCurrentProcessId();
+		{
+			ofstream file(temporary_name.str().c_str(), ios::binary | ios::trunc);
+			if (!file) continue;
+			file << key << '\n';
+			file.write(reinterpret_cast<const char*>(&binaries[i][0]), sizes[i]);
+			if (!file) {
+				file.close();
+				DeleteFileA(temporary_name.str().c_str());
+				continue;
+			}
+		}
+		if (!MoveFileExA(temporary_name.str().c_str(), file_name.c_str(), MOVEFILE_REPLACE_EXISTING))
+			DeleteFileA(temporary_name.str().c_str());
+	}
+}
+
+result BuildProgram(
+	const	int				&device_count, 
+	const	cl_device_id	*devices,
+	const	string			&options,
+	const	string			&source,
+			cl_program		*program) {
+
+	cl_int cl_status = CL_SUCCESS;
+
+	bool cached = LoadCachedProgram(device_count, devices, options, source, program);
+	if (cached) {
+		cl_status = clBuildProgram(*program, device_count, devices, options.c_str(), NULL, NULL);
+		if (cl_status == CL_SUCCESS) return FILTER_OK;
+
+		// The binary was rejected, e.g. after a driver update that kept
+		// its version string, so the program is built from source
+		clReleaseProgram(*program);
+	}
+
+	const char* source_c_str = source.c_str();
+	*program = clCreateProgramWithSource(g_context, 
+										 1, 
+										 &source_c_str,
+										 NULL,
+										 &cl_status);
+	if (cl_status != CL_SUCCESS) {  
+		g_last_cl_error = cl_status;
+		return FILTER_OPENCL_COMPILATION_FAILED;
+	}
+
+	cl_status = clBuildProgram(*program, device_count, devices, options.c_str(), NULL, NULL);
+	if (cl_status != CL_SUCCESS) {
+		g_last_cl_error = cl_status;
+		size_t build_log_size;
+		clGetProgramBuildInfo(*program, devices[0], CL_PROGRAM_BUILD_LOG, 0, NULL, &build_log_size);
+		char* build_log = static_cast<char*>(malloc(build_log_size * sizeof(char)));
+		clGetProgramBuildInfo(*program, devices[0], CL_PROGRAM_BUILD_LOG, build_log_size, build_log, NULL);
+		free(build_log);
+		return FILTER_OPENCL_KERNEL_DEVICE_BUILD_FAILED;
+	}
+
+	SaveCachedProgram(*program, device_count, devices, options, source);
+	return FILTER_OK;
+}
+
+string VariantOptions(
+	const int &sample_expand,
+	const int &linear,
+	const int &correction,
+	const int &target_min,
+	const int &balanced,
+	const int &half_tile,
+	const int &half_intermediate) {
+
+	ostringstream options;
+	options << BUILD_OPTIONS 
+			<< " -D VARIANT_SAMPLE_EXPAND=" << sample_expand
+			<< " -D VARIANT_LINEAR=" << linear
+			<< " -D VARIANT_CORRECTION=" << correction
+			<< " -D VARIANT_TARGET_MIN=" << target_min
+			<< " -D VARIANT_BALANCED=" << balanced;
+	if (half_tile) options << " -D HALF_TILE";
+	if (half_intermediate) options << " -D HALF_INTERMEDIATE";
+	return options.str();
+}
+
 result CompileAll(const int &device_count, const cl_device_id &devices) {
 	// The OpenCL source code is spread amongst a number of 
 	// .cl files encoded as resources. Each of these resources is 
@@ -191,11 +427,16 @@ result CompileAll(const int &device_count, const cl_device_id &devices) {
 	// and linked. Then each device in g_devices is given the program 
 	// and a list of kernels to create.
 	//
+	// The built program is cached on disk, so that later processes
+	// load it instead of compiling it, see BuildProgram.
+	//
+	// Variants of the program, with the filter's flags compiled in,
+	// are built by each device on first use, see device::Variant.
+	//
 	// IMPORTANT: After changing any .cl file, manually compile Deathray.rc,
 	// then link Deathray.
 
 	result	status		= FILTER_OK;
-	cl_int	cl_status	= CL_SUCCESS;
 
 	const int resource_count = 4;
 	const int resources[resource_count] = {RC_UTIL, // Always must be first
@@ -203,36 +444,28 @@ result CompileAll(const int &device_count, const cl_device_id &devices) {
 										   RC_NLM_SINGLE,
 										   RC_NLM_MULTI,
 										   };
-	string entire_program_source;
-
-	AssembleSources(&(resources[0]), resource_count, &entire_program_source);
-
-	const char* entire_program_c_str = entire_program_source.c_str();
-	cl_program program = clCreateProgramWithSource(g_context, 
-												   1, 
-												   &entire_program_c_str,
-												   NULL,
-												   &cl_status);
-	if (cl_status != CL_SUCCESS) {  
-		g_last_cl_error = cl_status;
-		return FILTER_OPENCL_COMPILATION_FAILED;
-	}
+	g_program_source.clear();
+	AssembleSources(&(resources[0]), resource_count, &g_program_source);
 
-	cl_status = clBuildProgram(program, device_count, &devices, "-cl-fast-relaxed-math", NULL, NULL);
-	if (cl_status != CL_SUCCESS) {
-		g_last_cl_error = cl_status;
-		size_t build_log_size;
-		clGetProgramBuildInfo(program, devices, CL_PROGRAM_BUILD_LOG, 0, NULL, &build_log_size);
-		char* build_log = static_cast<char*>(malloc(build_log_size * sizeof(char)));
-		clGetProgramBuildInfo(program, devices, CL_PROGRAM_BUILD_LOG, build_log_size, build_log, NULL);
-		free(build_log);
-		return FILTER_OPENCL_KERNEL_DEVICE_BUILD_FAILED;
-	}
+	cl_program program = NULL;
+	status = BuildProgram(device_count, &devices, BUILD_OPTIONS, g_program_source, &program);
+	if (status != FILTER_OK) return status;
 
-	const int kernel_count = 4;
+	const int kernel_count = 15;
 	const string kernels[kernel_count] = {"Initialise",
+										  "InitialiseHalf",
 										  "NLMSingleFrameFourPixel",
+										  "NLMSingleFrameIntegral",
+										  "NLMSingleFrameSeparable",
+										  "NLMSingleFramePairFourPixel",
+										  "NLMSingleFramePairIntegral",
+										  "NLMSingleFramePairSeparable",
 										  "NLMMultiFrameFourPixel",
+										  "NLMMultiFrameIntegral",
+										  "NLMMultiFrameSeparable",
+										  "NLMMultiFrameSymmetric",
+										  "NLMMultiFrameFusedFourPixel",
+										  "NLMMultiFrameFusedSeparable",
 										  "NLMFinalise"
 										  };
 	for (int i = 0; i < device_count; ++i) {
@@ -14,8 +14,29 @@ using namespace std;
 #include <CL/cl.h>
 #include "result.h"
 
-extern cl_int		g_last_cl_error;
+extern __declspec(thread) cl_int	g_last_cl_error;
 extern cl_context	g_context;
+extern string		g_program_source;
+
+// Options used to build every program
+#define BUILD_OPTIONS "-cl-fast-relaxed-math"
+
+// CountEvent
+// Counts the event, when not NULL, created by an enqueue or by
+// clCreateUserEvent. 
+//
+// RetainEvent and ReleaseEvent
+// clRetainEvent and clReleaseEvent, counting the reference added or
+// given up.
+//
+// LiveEvents
+// References to events counted and not yet released, by all threads.
+// An event leaked by filtering grows the count with every frame, see
+// DeathraySoak.
+void CountEvent(const cl_event *event);
+void RetainEvent(const cl_event &event);
+void ReleaseEvent(const cl_event &event);
+int LiveEvents();
 
 // GetCLErrorString
 // Returns error message in English
@@ -46,9 +67,82 @@ result AssembleSources(
 	const	int		&resource_count, 
 			string	*entire_program_source);
 
+// Sub-folder of the user's local application data holding built programs
+#define PROGRAM_CACHE_FOLDER "Deathray"
+
+// Changes whenever the layout of a cached program file changes
+#define PROGRAM_CACHE_VERSION 1
+
+// HashText
+// 64-bit FNV-1a hash of the text, continuing from seed
+unsigned __int64 HashText(const string &text, const unsigned __int64 &seed);
+
+// DeviceInfo
+// Returns a string property of the device, e.g. CL_DEVICE_NAME
+string DeviceInfo(const cl_device_id &device, const cl_device_info &parameter);
+
+// ProgramCacheFolder
+// Returns the folder holding cached programs, with a trailing 
+// backslash, creating it if necessary
+string ProgramCacheFolder();
+
+// ProgramCacheEntry
+// Cached programs are keyed by device name, driver version, build 
+// options and a hash of the source. Returns the key and the name of
+// the file holding the device's binary.
+void ProgramCacheEntry(
+	const	cl_device_id	&device,
+	const	string			&options,
+	const	string			&source,
+			string			*file_name,
+			string			*key);
+
+// LoadCachedProgram
+// Creates the program from the cached binary of each device. Returns
+// false if any device's binary is missing or does not match its key.
+bool LoadCachedProgram(
+	const	int				&device_count, 
+	const	cl_device_id	*devices,
+	const	string			&options,
+	const	string			&source,
+			cl_program		*program);
+
+// SaveCachedProgram
+// Writes the binary of the built program for each device to the cache
+void SaveCachedProgram(
+	const	cl_program		&program,
+	const	int				&device_count, 
+	const	cl_device_id	*devices,
+	const	string			&options,
+	const	string			&source);
+
+// BuildProgram
+// Builds the program from its cached binaries, or from source when 
+// they are missing or rejected by the driver. Binaries built from 
+// source are cached.
+result BuildProgram(
+	const	int				&device_count, 
+	const	cl_device_id	*devices,
+	const	string			&options,
+	const	string			&source,
+			cl_program		*program);
+
+// VariantOptions
+// Build options of the program variant that compiles in the filter's 
+// sample expansion and flags, see Util.cl
+string VariantOptions(
+	const int &sample_expand,
+	const int &linear,
+	const int &correction,
+	const int &target_min,
+	const int &balanced,
+	const int &half_tile,
+	const int &half_intermediate);
+
 // CompileAll
 // All kernels are compiled, for all available devices.
-// Requires g_context and g_devices.
+// Requires g_context and g_devices. The source is kept in
+// g_program_source, for variants that are built later.
 result CompileAll(
 	const int			&device_count, 
 	const cl_device_id	&devices);
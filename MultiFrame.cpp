@@ -5,26 +5,74 @@
  * Copyright 2013, Jawed Ashraf - Deathray@cupidity.f9.co.uk
  */
 
+#include <sstream>
 #include "device.h"
 #include "buffer.h"
 #include "buffer_map.h"
 #include "CLKernel.h"
+#include "CLutil.h"
 #include "MultiFrame.h"
+#include "nlm_algorithm.h"
+#include "trace.h"
 
 extern	int			g_device_count;
 extern	device		*g_devices;
 extern	cl_context	g_context;
-extern	int			g_gaussian;
 
 MultiFrame::MultiFrame() {
 	device_id_			= 0;
+	clip_				= NULL;
 	temporal_radius_	= 0;
 	frames_.clear();
-	dest_plane_			= 0;
+	pipelined_			= 0;
+	half_intermediate_	= 0;
+	slot_count_			= 1;
+	slot_				= 0;
+	executed_[0]		= NULL;
+	executed_[1]		= NULL;
 	width_				= 0;
 	height_				= 0;
 	src_pitch_			= 0;
 	dst_pitch_			= 0;
+	band_first_row_		= 0;
+	band_rows_			= 0;
+	cq_					= NULL;
+	symmetric_			= 0;
+	weight_map_limit_	= 0;
+	weight_map_bytes_	= 0;
+	fused_				= 0;
+	for (int slot = 0; slot < 2; ++slot) {
+		dest_plane_[slot]		= 0;
+		averages_[slot]			= 0;
+		weights_[slot]			= 0;
+		target_weights_[slot]	= 0;
+	}
+}
+
+MultiFrame::~MultiFrame() {
+	if (cq_ == NULL) return;
+
+	Finish();
+
+	buffer_map &buffers = g_devices[device_id_].buffers_;
+	for (int slot = 0; slot < 2; ++slot) {
+		buffers.Destroy(averages_[slot]);
+		buffers.Destroy(weights_[slot]);
+		buffers.Destroy(target_weights_[slot]);
+		buffers.Destroy(dest_plane_[slot]);
+	}
+	for (size_t i = 0; i < weight_maps_.size(); ++i) {
+		buffers.Destroy(weight_maps_[i].buffer);
+		if (weight_maps_[i].ready != NULL) ReleaseEvent(weight_maps_[i].ready);
+	}
+	for (size_t i = 0; i < frames_.size(); ++i) 
+		frames_[i].Release();
+	g_devices[device_id_].frames_.Forget(clip_);
+	for (int slot = 0; slot < 2; ++slot) {
+		if (executed_[slot] != NULL) ReleaseEvent(executed_[slot]);
+	}
+
+	clReleaseCommandQueue(cq_);
 }
 
 result MultiFrame::Init(
@@ -39,7 +87,14 @@ result MultiFrame::Init(
 	const	int				&linear,
 	const	int				&correction,
 	const	int				&target_min,
-	const	int				&balanced) {
+	const	int				&balanced,
+	const	int				&algorithm,
+	const	int				&half_tile,
+	const	int				&half_intermediate,
+	const	int				&pipelined,
+	const	int				&weight_cache,
+	const	int				&fused,
+	const	int				&gaussian) {
 
 	if (device_id >= g_device_count) return FILTER_ERROR;
 
@@ -51,21 +106,95 @@ result MultiFrame::Init(
 	height_				= height;	
 	src_pitch_			= src_pitch;
 	dst_pitch_			= dst_pitch;
+	band_first_row_		= 0;
+	band_rows_			= height;
 	h_					= h;
 	cq_					= g_devices[device_id_].cq();
 	target_min_			= target_min;
+	pipelined_			= pipelined;
+	half_intermediate_	= half_intermediate;
+	slot_count_			= pipelined ? 2 : 1;
+	symmetric_			= Symmetric(sample_expand, balanced, algorithm, weight_cache);
+	fused_				= Fused(temporal_radius, algorithm, symmetric_, fused);
 
 	if (width_ == 0 || height_ == 0 || src_pitch_ == 0 || dst_pitch_ == 0 || h == 0 ) return FILTER_INVALID_PARAMETER;
 
 	status = InitBuffers();
 	if (status != FILTER_OK) return status;
-	status = InitKernels(sample_expand, linear, correction, balanced);
+
+	// All maps that fit the budget are allocated now, so that filtering
+	// allocates nothing
+	weight_map_bytes_ = k_symmetric_offsets * intermediate_width_ * intermediate_height_ * sizeof(float) << 2;
+	weight_map_limit_ = symmetric_ ? (static_cast<size_t>(weight_cache) << 20) / weight_map_bytes_ : 0;
+	weight_maps_.clear();
+	if (weight_map_limit_ > 0 && weight_map_bytes_ > g_devices[device_id_].buffers_.max_alloc()) {
+		// No map can be allocated, so the budget is dropped instead of
+		// failing each allocation
+		ostringstream note;
+		note << "sym set to 0, as a weight map of " << (weight_map_bytes_ >> 20) << " MB exceeds the largest allocation of " 
+			 << (g_devices[device_id_].buffers_.max_alloc() >> 20) << " MB on device " << device_id_;
+		TraceNote(note.str());
+		weight_map_limit_ = 0;
+	}
+	AllocWeightMaps();
+
+	status = InitKernels(sample_expand, linear, correction, balanced, algorithm, half_tile, gaussian);
 	if (status != FILTER_OK) return status;
 	status = InitFrames();
 
 	return status;						
 }
 
+int MultiFrame::Symmetric(
+	const	int				&sample_expand,
+	const	int				&balanced,
+	const	int				&algorithm,
+	const	int				&weight_cache) {
+
+	return (weight_cache > 0 && sample_expand == 1 && balanced == 0 && algorithm == NLM_GAUSSIAN) ? 1 : 0;
+}
+
+int MultiFrame::Fused(
+	const	int				&temporal_radius,
+	const	int				&algorithm,
+	const	int				&symmetric,
+	const	int				&fused) {
+
+	return (fused && !symmetric && 2 * temporal_radius <= k_fused_samples && algorithm != NLM_INTEGRAL) ? 1 : 0;
+}
+
+size_t MultiFrame::Footprint(
+	const	int				&temporal_radius,
+	const	int				&width, 
+	const	int				&height,
+	const	int				&sample_expand,
+	const	int				&balanced,
+	const	int				&algorithm,
+	const	int				&half_intermediate,
+	const	int				&pipelined,
+	const	int				&weight_cache,
+	const	int				&fused) {
+
+	const int symmetric = Symmetric(sample_expand, balanced, algorithm, weight_cache);
+	const int slot_count = pipelined ? 2 : 1;
+	const int frame_count = 2 * temporal_radius + 1 + (pipelined ? 1 : 0);
+
+	// Frames, plus a destination plane and intermediates per slot, see
+	// InitBuffers and InitFrames
+	const size_t plane_bytes = buffer_map::PlaneBytes(width, height);
+	const size_t intermediate_bytes = (ByPowerOf2(width, 5) >> 2) * ByPowerOf2(height, 5) * (half_intermediate ? sizeof(cl_half) : sizeof(float)) << 2;
+	size_t bytes = (frame_count + slot_count) * plane_bytes;
+	if (!Fused(temporal_radius, algorithm, symmetric, fused)) bytes += 3 * slot_count * intermediate_bytes;
+
+	// Staging pools of the object's queue and the frame_cache's queue
+	bytes += 2 * buffer_map::StagingBytes(width, height);
+
+	// Weight maps fill the budget, see AllocWeightMaps
+	if (symmetric) bytes += static_cast<size_t>(weight_cache) << 20;
+
+	return bytes;
+}
+
 result MultiFrame::InitBuffers() {
 	result status = FILTER_OK;
 
@@ -73,15 +202,21 @@ result MultiFrame::InitBuffers() {
 	// horizontally and vertically because tile size is 32x32
 	intermediate_width_ = ByPowerOf2(width_, 5) >> 2;
 	intermediate_height_ = ByPowerOf2(height_, 5);
-	const size_t bytes = intermediate_width_ * intermediate_height_ * sizeof(float) << 2;
-	status = g_devices[device_id_].buffers_.AllocBuffer(cq_, bytes, &averages_);
-	if (status != FILTER_OK) return status;
-	status = g_devices[device_id_].buffers_.AllocBuffer(cq_, bytes, &weights_);
-	if (status != FILTER_OK) return status;
-	status = g_devices[device_id_].buffers_.AllocBuffer(cq_, bytes, &target_weights_);
-	if (status != FILTER_OK) return status;
+	const size_t bytes = intermediate_width_ * intermediate_height_ * (half_intermediate_ ? sizeof(cl_half) : sizeof(float)) << 2;
+	for (int slot = 0; slot < slot_count_; ++slot) {
+		// The fused kernel accumulates without intermediate buffers
+		if (!fused_) {
+			status = g_devices[device_id_].buffers_.AllocBuffer(cq_, bytes, &averages_[slot]);
+			if (status != FILTER_OK) return status;
+			status = g_devices[device_id_].buffers_.AllocBuffer(cq_, bytes, &weights_[slot]);
+			if (status != FILTER_OK) return status;
+			status = g_devices[device_id_].buffers_.AllocBuffer(cq_, bytes, &target_weights_[slot]);
+			if (status != FILTER_OK) return status;
+		}
 
-	status = g_devices[device_id_].buffers_.AllocPlane(cq_, width_, height_, &dest_plane_);
+		status = g_devices[device_id_].buffers_.AllocPlane(cq_, width_, height_, &dest_plane_[slot]);
+		if (status != FILTER_OK) return status;
+	}
 
 	return status;
 }
@@ -90,41 +225,100 @@ result MultiFrame::InitKernels(
 	const int &sample_expand,
 	const int &linear,
 	const int &correction,
-	const int &balanced) {
-	NLM_kernel_ = CLKernel(device_id_, "NLMMultiFrameFourPixel");
-	NLM_kernel_.SetNumberedArg(3, sizeof(int), &width_);
-	NLM_kernel_.SetNumberedArg(4, sizeof(int), &height_);
-	NLM_kernel_.SetNumberedArg(5, sizeof(float), &h_);
-	NLM_kernel_.SetNumberedArg(6, sizeof(int), &sample_expand);
-	NLM_kernel_.SetNumberedArg(7, sizeof(cl_mem), g_devices[device_id_].buffers_.ptr(g_gaussian));
-	NLM_kernel_.SetNumberedArg(8, sizeof(int), &intermediate_width_);
-	NLM_kernel_.SetNumberedArg(9, sizeof(int), &linear);
-	NLM_kernel_.SetNumberedArg(10, sizeof(int), &target_min_);
-	NLM_kernel_.SetNumberedArg(11, sizeof(int), &balanced);
-	NLM_kernel_.SetNumberedArg(12, sizeof(cl_mem), g_devices[device_id_].buffers_.ptr(averages_));
-	NLM_kernel_.SetNumberedArg(13, sizeof(cl_mem), g_devices[device_id_].buffers_.ptr(weights_));
-	NLM_kernel_.SetNumberedArg(14, sizeof(cl_mem), g_devices[device_id_].buffers_.ptr(target_weights_));
+	const int &balanced,
+	const int &algorithm,
+	const int &half_tile,
+	const int &gaussian) {
+	// Indexed by nlm_algorithm
+	const string kernel_names[] = {"NLMMultiFrameFourPixel", "NLMMultiFrameIntegral", "NLMMultiFrameSeparable"};
+
+	// Both kernels come from the variant of the program for these flags
+	const string variant = VariantOptions(sample_expand, linear, correction, target_min_, balanced, half_tile, half_intermediate_);
 
 	const size_t set_local_work_size[2]		= {8, 32};
 	const size_t set_scalar_global_size[2]	= {width_, height_};
 	const size_t set_scalar_item_size[2]	= {4, 1};
 
-	if (NLM_kernel_.arguments_valid()) {
-		NLM_kernel_.set_work_dim(2);
-		NLM_kernel_.set_local_work_size(set_local_work_size);
-		NLM_kernel_.set_scalar_global_size(set_scalar_global_size);
-		NLM_kernel_.set_scalar_item_size(set_scalar_item_size);
+	// Planes and sample count of the fused kernel are set per target frame
+	if (fused_) {
+		fused_kernel_ = CLKernel(device_id_, algorithm == NLM_SEPARABLE ? "NLMMultiFrameFusedSeparable" : "NLMMultiFrameFusedFourPixel", variant);
+		fused_kernel_.SetNumberedArg(10, sizeof(int), &width_);
+		fused_kernel_.SetNumberedArg(11, sizeof(int), &height_);
+		fused_kernel_.SetNumberedArg(12, sizeof(float), &h_);
+		fused_kernel_.SetNumberedArg(13, sizeof(int), &sample_expand);
+		fused_kernel_.SetNumberedArg(14, sizeof(cl_mem), g_devices[device_id_].buffers_.ptr(gaussian));
+		fused_kernel_.SetNumberedArg(15, sizeof(int), &linear);
+		fused_kernel_.SetNumberedArg(16, sizeof(int), &correction);
+		fused_kernel_.SetNumberedArg(17, sizeof(int), &target_min_);
+		fused_kernel_.SetNumberedArg(18, sizeof(int), &balanced);
+
+		if (fused_kernel_.arguments_valid()) {
+			fused_kernel_.set_work_dim(2);
+			fused_kernel_.set_local_work_size(set_local_work_size);
+			fused_kernel_.set_scalar_global_size(set_scalar_global_size);
+			fused_kernel_.set_scalar_item_size(set_scalar_item_size);
+			return FILTER_OK;
+		}
+		return FILTER_KERNEL_ARGUMENT_ERROR;
+	}
+
+	// The zeroing kernel is created once, as it runs for every target frame.
+	// Each work item initialises 4 pixels, whether held as floats or halves
+	const float initialise = 0.f;
+	zero_kernel_ = CLKernel(device_id_, half_intermediate_ ? "InitialiseHalf" : "Initialise");
+	zero_kernel_.SetNumberedArg(0, sizeof(cl_mem), g_devices[device_id_].buffers_.ptr(averages_[0]));
+	zero_kernel_.SetNumberedArg(1, sizeof(cl_float), &initialise);
+
+	if (zero_kernel_.arguments_valid()) {
+		const size_t set_zero_local_work_size[1]	= {256};
+		const size_t set_zero_global_size[1]		= {intermediate_width_ * intermediate_height_ << 2};
+		const size_t set_zero_item_size[1]			= {4};
+
+		zero_kernel_.set_work_dim(1);
+		zero_kernel_.set_local_work_size(set_zero_local_work_size);
+		zero_kernel_.set_scalar_global_size(set_zero_global_size);
+		zero_kernel_.set_scalar_item_size(set_zero_item_size);
 	} else {
 		return FILTER_KERNEL_ARGUMENT_ERROR;
 	}
 
-	finalise_kernel_ = CLKernel(device_id_, "NLMFinalise");
-	finalise_kernel_.SetNumberedArg(1, sizeof(cl_mem), g_devices[device_id_].buffers_.ptr(averages_));
-	finalise_kernel_.SetNumberedArg(2, sizeof(cl_mem), g_devices[device_id_].buffers_.ptr(weights_));
+	NLM_kernel_ = CLKernel(device_id_, kernel_names[algorithm], variant);
+	if (symmetric_) symmetric_kernel_ = CLKernel(device_id_, "NLMMultiFrameSymmetric", variant);
+
+	// The symmetric kernel shares the NLM kernel's arguments
+	CLKernel *NLM_kernels[2] = {&NLM_kernel_, &symmetric_kernel_};
+	for (int i = 0; i < 1 + symmetric_; ++i) {
+		CLKernel &kernel = *NLM_kernels[i];
+		kernel.SetNumberedArg(3, sizeof(int), &width_);
+		kernel.SetNumberedArg(4, sizeof(int), &height_);
+		kernel.SetNumberedArg(5, sizeof(float), &h_);
+		kernel.SetNumberedArg(6, sizeof(int), &sample_expand);
+		kernel.SetNumberedArg(7, sizeof(cl_mem), g_devices[device_id_].buffers_.ptr(gaussian));
+		kernel.SetNumberedArg(8, sizeof(int), &intermediate_width_);
+		kernel.SetNumberedArg(9, sizeof(int), &linear);
+		kernel.SetNumberedArg(10, sizeof(int), &target_min_);
+		kernel.SetNumberedArg(11, sizeof(int), &balanced);
+		kernel.SetNumberedArg(12, sizeof(cl_mem), g_devices[device_id_].buffers_.ptr(averages_[0]));
+		kernel.SetNumberedArg(13, sizeof(cl_mem), g_devices[device_id_].buffers_.ptr(weights_[0]));
+		kernel.SetNumberedArg(14, sizeof(cl_mem), g_devices[device_id_].buffers_.ptr(target_weights_[0]));
+
+		if (kernel.arguments_valid()) {
+			kernel.set_work_dim(2);
+			kernel.set_local_work_size(set_local_work_size);
+			kernel.set_scalar_global_size(set_scalar_global_size);
+			kernel.set_scalar_item_size(set_scalar_item_size);
+		} else {
+			return FILTER_KERNEL_ARGUMENT_ERROR;
+		}
+	}
+
+	finalise_kernel_ = CLKernel(device_id_, "NLMFinalise", variant);
+	finalise_kernel_.SetNumberedArg(1, sizeof(cl_mem), g_devices[device_id_].buffers_.ptr(averages_[0]));
+	finalise_kernel_.SetNumberedArg(2, sizeof(cl_mem), g_devices[device_id_].buffers_.ptr(weights_[0]));
 	finalise_kernel_.SetNumberedArg(3, sizeof(int), &intermediate_width_);
 	finalise_kernel_.SetNumberedArg(4, sizeof(int), &linear);
 	finalise_kernel_.SetNumberedArg(5, sizeof(int), &correction);
-	finalise_kernel_.SetNumberedArg(6, sizeof(cl_mem), g_devices[device_id_].buffers_.ptr(dest_plane_));
+	finalise_kernel_.SetNumberedArg(6, sizeof(cl_mem), g_devices[device_id_].buffers_.ptr(dest_plane_[0]));
 
 	if (finalise_kernel_.arguments_valid()) {
 		finalise_kernel_.set_work_dim(2);
@@ -139,13 +333,17 @@ result MultiFrame::InitKernels(
 }
 
 result MultiFrame::InitFrames() {	
-	const int frame_count = 2 * temporal_radius_ + 1;
+	// Frames are private until Share
+	const frame_key key = {NULL, 0, 0, width_, height_, 0};
+
+	const int frame_count = 2 * temporal_radius_ + 1 + (pipelined_ ? 1 : 0);
 	frames_.reserve(frame_count);
 	for (int i = 0; i < frame_count; ++i) {
 		Frame new_frame;
 		frames_.push_back(new_frame);
-		frames_[i].Init(device_id_, &cq_, NLM_kernel_, width_, height_, src_pitch_);
+		frames_[i].Init(device_id_, &cq_, NLM_kernel_, key, src_pitch_);
 	}
+	copy_wait_list_.resize(frame_count);
 
 	if (frames_.size() != frame_count)
 		return FILTER_MULTI_FRAME_INITIALISATION_FAILED;
@@ -156,31 +354,25 @@ result MultiFrame::InitFrames() {
 result MultiFrame::ZeroIntermediates() {
 	result status = FILTER_OK;
 
-	CLKernel Intermediates = CLKernel(device_id_, "Initialise");
-
 	float initialise = 0.f;
 
-	Intermediates.SetArg(sizeof(cl_mem), g_devices[device_id_].buffers_.ptr(averages_));
-	Intermediates.SetArg(sizeof(cl_float), &initialise);
-
-	if (Intermediates.arguments_valid()) {
-		const size_t set_local_work_size[1]		= {256};
-		const size_t set_scalar_global_size[1]	= {intermediate_width_ * intermediate_height_ << 2};
-		const size_t set_scalar_item_size[1]	= {4};
+	// Each buffer is zeroed in turn, so that the first pass need only
+	// follow the final zeroing
+	cl_event zeroed_averages;
+	cl_event zeroed_weights;
 
-		Intermediates.set_work_dim(1);
-		Intermediates.set_local_work_size(set_local_work_size);
-		Intermediates.set_scalar_global_size(set_scalar_global_size);
-		Intermediates.set_scalar_item_size(set_scalar_item_size);
-		status = Intermediates.Execute(cq_, NULL);
+	zero_kernel_.SetNumberedArg(0, sizeof(cl_mem), g_devices[device_id_].buffers_.ptr(averages_[slot_]));
+	zero_kernel_.SetNumberedArg(1, sizeof(cl_float), &initialise);
+	if (zero_kernel_.arguments_valid()) {
+		status = zero_kernel_.Execute(cq_, &zeroed_averages);
 		if (status != FILTER_OK) return status;
 	} else {
 		return FILTER_KERNEL_ARGUMENT_ERROR;
 	}
 
-	Intermediates.SetNumberedArg(0, sizeof(cl_mem), g_devices[device_id_].buffers_.ptr(weights_));
-	if (Intermediates.arguments_valid()) {
-		status = Intermediates.Execute(cq_, NULL);
+	zero_kernel_.SetNumberedArg(0, sizeof(cl_mem), g_devices[device_id_].buffers_.ptr(weights_[slot_]));
+	if (zero_kernel_.arguments_valid()) {
+		status = zero_kernel_.ExecuteAsynch(cq_, &zeroed_averages, &zeroed_weights);
 		if (status != FILTER_OK) return status;
 	} else {
 		return FILTER_KERNEL_ARGUMENT_ERROR;
@@ -188,30 +380,38 @@ result MultiFrame::ZeroIntermediates() {
 
 	if (target_min_) {
 		initialise = CL_MAXFLOAT;
-		Intermediates.SetNumberedArg(1, sizeof(cl_float), &initialise);
+		zero_kernel_.SetNumberedArg(1, sizeof(cl_float), &initialise);
 	}
 
-	Intermediates.SetNumberedArg(0, sizeof(cl_mem), g_devices[device_id_].buffers_.ptr(target_weights_));
-	if (Intermediates.arguments_valid()) {
-		status = Intermediates.Execute(cq_, NULL);
+	zero_kernel_.SetNumberedArg(0, sizeof(cl_mem), g_devices[device_id_].buffers_.ptr(target_weights_[slot_]));
+	if (zero_kernel_.arguments_valid()) {
+		status = zero_kernel_.ExecuteAsynch(cq_, &zeroed_weights, &zeroed_);
 		if (status != FILTER_OK) return status;
 	} else {
 		return FILTER_KERNEL_ARGUMENT_ERROR;
 	}
 
-	clFinish(cq_);
+	ReleaseEvent(zeroed_averages);
+	ReleaseEvent(zeroed_weights);
+
+	if (!pipelined_) clFinish(cq_);
 	return status;						
 }
 
+int MultiFrame::FrameID(const int &frame_number) {
+	return (frame_number + temporal_radius_) % frames_.size();
+}
+
 void MultiFrame::SupplyFrameNumbers(
 	const	int					&target_frame_number, 
 			MultiFrameRequest	*required) {
 
 	target_frame_number_ = target_frame_number;
+	slot_ = target_frame_number_ % slot_count_;
 
-	for (int i = -temporal_radius_, frame_id = 0; i <= temporal_radius_; ++i, ++frame_id) {
-		int frame_number = target_frame_number_ - ((target_frame_number_ - i + temporal_radius_) % frames_.size()) + temporal_radius_;
-		if (frames_[frame_id].IsCopyRequired(frame_number))
+	required->Reset(target_frame_number_ - temporal_radius_, 2 * temporal_radius_ + 1);
+	for (int frame_number = target_frame_number_ - temporal_radius_; frame_number <= target_frame_number_ + temporal_radius_; ++frame_number) {
+		if (frames_[FrameID(frame_number)].IsCopyRequired(frame_number))
 			required->Request(frame_number);	
 	}
 }
@@ -219,28 +419,25 @@ void MultiFrame::SupplyFrameNumbers(
 result MultiFrame::CopyTo(MultiFrameRequest *retrieved) {
 	result status = FILTER_OK;
 
-	status = ZeroIntermediates();
-	if (status != FILTER_OK) return status;
-
-	for (int i = -temporal_radius_, frame_id = 0; i <= temporal_radius_; ++i, ++frame_id) {
-		int frame_number = target_frame_number_ - ((target_frame_number_ - i + temporal_radius_) % frames_.size()) + temporal_radius_;
-		status = frames_[frame_id].CopyTo(frame_number, retrieved->Retrieve(frame_number));
+	if (!fused_) {
+		status = ZeroIntermediates();
 		if (status != FILTER_OK) return status;
 	}
-	clFinish(cq_);
-	return status;
-}
-
-result MultiFrame::ExecuteFrame(
-	const int &frame_id,
-	const bool &sample_equals_target,
-	cl_event &copying_target, 
-	cl_event *filter_events) {
 
-	cl_event executed;
+	// Copies are enqueued by the device's frame_cache, so when not
+	// pipelined their events are waited for
+	cl_uint copied_count = 0;
+	for (int frame_number = target_frame_number_ - temporal_radius_; frame_number <= target_frame_number_ + temporal_radius_; ++frame_number) {
+		Frame &frame = frames_[FrameID(frame_number)];
+		status = frame.CopyTo(frame_number, retrieved->Retrieve(frame_number));
+		if (status != FILTER_OK) return status;
 
-	result status = frames_[frame_id].Execute(sample_equals_target, &copying_target, &executed);
-	filter_events[frame_id] = executed;
+		int plane;
+		cl_event frame_copied;
+		frame.Plane(&plane, &frame_copied);
+		if (frame_copied != NULL) copy_wait_list_[copied_count++] = frame_copied;
+	}
+	if (!pipelined_ && copied_count > 0) clWaitForEvents(copied_count, &copy_wait_list_[0]);
 	return status;
 }
 
@@ -248,30 +445,55 @@ result MultiFrame::Execute() {
 	result status = FILTER_OK;
 
 	// Query the Frame object handling the target frame to get the plane for the other Frames to use
-	int target_frame_id = (target_frame_number_ + temporal_radius_) % frames_.size();
+	int target_frame_id = FrameID(target_frame_number_);
 
 	int target_frame_plane; 		
 	cl_event copying_target;
 	frames_[target_frame_id].Plane(&target_frame_plane, &copying_target);
 
+	if (fused_) return ExecuteFused(target_frame_plane, &copying_target);
+
 	NLM_kernel_.SetNumberedArg(0, sizeof(cl_mem), g_devices[device_id_].buffers_.ptr(target_frame_plane));
+	NLM_kernel_.SetNumberedArg(12, sizeof(cl_mem), g_devices[device_id_].buffers_.ptr(averages_[slot_]));
+	NLM_kernel_.SetNumberedArg(13, sizeof(cl_mem), g_devices[device_id_].buffers_.ptr(weights_[slot_]));
+	NLM_kernel_.SetNumberedArg(14, sizeof(cl_mem), g_devices[device_id_].buffers_.ptr(target_weights_[slot_]));
+
+	if (symmetric_) {
+		symmetric_kernel_.SetNumberedArg(0, sizeof(cl_mem), g_devices[device_id_].buffers_.ptr(target_frame_plane));
+		symmetric_kernel_.SetNumberedArg(12, sizeof(cl_mem), g_devices[device_id_].buffers_.ptr(averages_[slot_]));
+		symmetric_kernel_.SetNumberedArg(13, sizeof(cl_mem), g_devices[device_id_].buffers_.ptr(weights_[slot_]));
+		symmetric_kernel_.SetNumberedArg(14, sizeof(cl_mem), g_devices[device_id_].buffers_.ptr(target_weights_[slot_]));
+		EvictWeightMaps();
+	}
 
-	cl_event *filter_events = new cl_event[frames_.size()];
-	for (int i = 0; i < 2 * temporal_radius_ + 1; ++i) {
-		bool sample_equals_target = i == target_frame_id;
-		if (!sample_equals_target) { // exclude the target frame so that it is processed last
-			status = ExecuteFrame(i, sample_equals_target, copying_target, filter_events);
+	// Every pass updates the intermediates, so each pass follows its predecessor
+	cl_event prior_pass = zeroed_;
+	cl_event executed;
+	for (int frame_number = target_frame_number_ - temporal_radius_; frame_number <= target_frame_number_ + temporal_radius_; ++frame_number) {
+		if (frame_number != target_frame_number_) { // exclude the target frame so that it is processed last
+			if (symmetric_)
+				status = SymmetricPass(frame_number, &prior_pass, &copying_target, &executed);
+			else
+				status = frames_[FrameID(frame_number)].Execute(false, &prior_pass, &copying_target, &executed);
 			if (status != FILTER_OK) return status;
+			ReleaseEvent(prior_pass);
+			prior_pass = executed;
 		}
 	}
-	status = ExecuteFrame(target_frame_id, true, copying_target, filter_events);
+	status = frames_[target_frame_id].Execute(true, &prior_pass, &copying_target, &executed);
 	if (status != FILTER_OK) return status;
+	ReleaseEvent(prior_pass);
 
 	finalise_kernel_.SetNumberedArg(0, sizeof(cl_mem), g_devices[device_id_].buffers_.ptr(target_frame_plane));
-	status = finalise_kernel_.ExecuteWaitList(cq_, frames_.size(), filter_events, &executed_);
+	finalise_kernel_.SetNumberedArg(1, sizeof(cl_mem), g_devices[device_id_].buffers_.ptr(averages_[slot_]));
+	finalise_kernel_.SetNumberedArg(2, sizeof(cl_mem), g_devices[device_id_].buffers_.ptr(weights_[slot_]));
+	finalise_kernel_.SetNumberedArg(6, sizeof(cl_mem), g_devices[device_id_].buffers_.ptr(dest_plane_[slot_]));
+	if (executed_[slot_] != NULL) ReleaseEvent(executed_[slot_]);
+	status = finalise_kernel_.ExecuteAsynch(cq_, &executed, &executed_[slot_]);
 	if (status != FILTER_OK) return status;
+	ReleaseEvent(executed);
 
-	clFinish(cq_);
+	if (!pipelined_) clFinish(cq_);
 	return status;
 }
 
@@ -279,30 +501,174 @@ result MultiFrame::CopyFrom(
 	unsigned char	*dest,							  
 	cl_event		*returned) {
 
-	return g_devices[device_id_].buffers_.CopyFromPlaneAsynch(dest_plane_, 
+	return g_devices[device_id_].buffers_.CopyFromPlaneAsynch(dest_plane_[slot_], 
+															  band_first_row_,
 															  width_, 
-															  height_, 
+															  band_rows_, 
 															  dst_pitch_, 
-															  &executed_, 
+															  &executed_[slot_], 
 															  returned,
 															  dest);
 }
 
+result MultiFrame::ExecuteFused(
+	const	int			&target_frame_plane, 
+			cl_event	*target_copied) {
+
+	buffer_map &buffers = g_devices[device_id_].buffers_;
+
+	cl_event wait_list[k_fused_samples + 1];
+	int wait_list_length = 0;
+	if (*target_copied != NULL) wait_list[wait_list_length++] = *target_copied;
+
+	// Samples are in the order of the passes of Execute, with the target last
+	int sample_count = 0;
+	fused_kernel_.SetNumberedArg(0, sizeof(cl_mem), buffers.ptr(target_frame_plane));
+	for (int frame_number = target_frame_number_ - temporal_radius_; frame_number <= target_frame_number_ + temporal_radius_; ++frame_number) {
+		if (frame_number == target_frame_number_) continue;
+
+		int plane;
+		cl_event copied;
+		frames_[FrameID(frame_number)].Plane(&plane, &copied);
+		fused_kernel_.SetNumberedArg(1 + sample_count++, sizeof(cl_mem), buffers.ptr(plane));
+		if (copied != NULL) wait_list[wait_list_length++] = copied;
+	}
+
+	// Arguments for unused samples must still be planes
+	for (int i = sample_count; i < k_fused_samples; ++i)
+		fused_kernel_.SetNumberedArg(1 + i, sizeof(cl_mem), buffers.ptr(target_frame_plane));
+	fused_kernel_.SetNumberedArg(9, sizeof(int), &sample_count);
+	fused_kernel_.SetNumberedArg(19, sizeof(cl_mem), buffers.ptr(dest_plane_[slot_]));
+	if (!fused_kernel_.arguments_valid()) return FILTER_KERNEL_ARGUMENT_ERROR;
+
+	if (executed_[slot_] != NULL) ReleaseEvent(executed_[slot_]);
+	result status = fused_kernel_.ExecuteWaitList(cq_, wait_list_length, wait_list_length > 0 ? wait_list : NULL, &executed_[slot_]);
+	if (status != FILTER_OK) return status;
+
+	if (!pipelined_) clFinish(cq_);
+	return status;
+}
+
+void MultiFrame::EvictWeightMaps() {
+	for (size_t i = 0; i < weight_maps_.size(); ++i) {
+		weight_map &map = weight_maps_[i];
+		if (map.earlier >= target_frame_number_ || map.later < target_frame_number_)
+			map.used = false;
+	}
+}
+
+MultiFrame::weight_map* MultiFrame::FindWeightMap(const int &earlier, const int &later) {
+	for (size_t i = 0; i < weight_maps_.size(); ++i) {
+		weight_map &map = weight_maps_[i];
+		if (map.used && map.earlier == earlier && map.later == later) return &map;
+	}
+	return NULL;
+}
+
+void MultiFrame::AllocWeightMaps() {
+	while (weight_maps_.size() < weight_map_limit_) {
+		// Frames kept by the device's frame_cache make way for the map
+		g_devices[device_id_].frames_.Reclaim(weight_map_bytes_);
+
+		weight_map new_map = {0, false, 0, 0, NULL};
+		if (g_devices[device_id_].buffers_.AllocBuffer(cq_, weight_map_bytes_, &new_map.buffer) != FILTER_OK) {
+			// Video memory is exhausted, so the budget shrinks to the maps held
+			ostringstream note;
+			note << "sym holds " << weight_maps_.size() << " of " << weight_map_limit_ << " weight maps, as video memory is exhausted on device " << device_id_;
+			TraceNote(note.str());
+			weight_map_limit_ = weight_maps_.size();
+			return;
+		}
+		weight_maps_.push_back(new_map);
+	}
+}
+
+MultiFrame::weight_map* MultiFrame::AllocWeightMap(const int &earlier, const int &later) {
+	weight_map *map = FindWeightMap(earlier, later);
+	if (map != NULL) return map;
+
+	for (size_t i = 0; i < weight_maps_.size() && map == NULL; ++i) {
+		if (!weight_maps_[i].used) map = &weight_maps_[i];
+	}
+	if (map == NULL) return NULL;
+
+	map->used		= true;
+	map->earlier	= earlier;
+	map->later		= later;
+	return map;
+}
+
+result MultiFrame::SymmetricPass(
+	const	int			&frame_number, 
+			cl_event	*prior_pass, 
+			cl_event	*target_copied, 
+			cl_event	*executed) {
+
+	const bool reuse = frame_number < target_frame_number_;
+	weight_map *map = reuse ? FindWeightMap(frame_number, target_frame_number_)
+							: AllocWeightMap(target_frame_number_, frame_number);
+	if (map == NULL)
+		return frames_[FrameID(frame_number)].Execute(false, prior_pass, target_copied, executed);
+
+	int reuse_weights = reuse ? 1 : 0;
+	symmetric_kernel_.SetNumberedArg(15, sizeof(cl_mem), g_devices[device_id_].buffers_.ptr(map->buffer));
+	symmetric_kernel_.SetNumberedArg(16, sizeof(int), &reuse_weights);
+	if (!symmetric_kernel_.arguments_valid()) return FILTER_KERNEL_ARGUMENT_ERROR;
+
+	result status = frames_[FrameID(frame_number)].Execute(symmetric_kernel_, false, prior_pass, target_copied, &map->ready, executed);
+	if (status != FILTER_OK) return status;
+
+	// Whichever pass next uses the map, perhaps overwriting it, follows this one
+	if (map->ready != NULL) ReleaseEvent(map->ready);
+	map->ready = *executed;
+	RetainEvent(map->ready);
+
+	// The weights of a pair are reused once
+	if (reuse) map->used = false;
+	return status;
+}
+
+void MultiFrame::Band(const int &first_row, const int &rows) {
+	band_first_row_	= first_row;
+	band_rows_		= rows;
+}
+
+void MultiFrame::Finish() {
+	for (size_t i = 0; i < frames_.size(); ++i) {
+		int plane;
+		cl_event copied;
+		frames_[i].Plane(&plane, &copied);
+		if (copied != NULL) clWaitForEvents(1, &copied);
+	}
+	clFinish(cq_);
+}
+
+void MultiFrame::Share(
+	const	void			*clip,
+	const	int				&plane,
+	const	int				&first_row) {
+
+	clip_ = clip;
+
+	const frame_key key = {clip, plane, first_row, width_, height_, 0};
+	for (size_t i = 0; i < frames_.size(); ++i) 
+		frames_[i].Share(key);
+}
+
 // Frame
 MultiFrame::Frame::Frame() {
-	frame_number_			= 0;
+	const frame_key no_frame = {NULL, 0, 0, 0, 0, 0};
+	key_					= no_frame;
 	plane_					= 0;	
-	width_					= 0;
-	height_					= 0;
 	pitch_					= 0;
+	copied_					= NULL;
 }
 
 result MultiFrame::Frame::Init(
 	const	int					&device_id,
 			cl_command_queue	*cq, 
 	const	CLKernel			&NLM_kernel,
-	const	int					&width, 
-	const	int					&height, 
+	const	frame_key			&key,
 	const	int					&pitch) {
 
 	// Setting this frame's NLM_kernel_ to the client's kernel object means all frames share the 
@@ -312,33 +678,43 @@ result MultiFrame::Frame::Init(
 	device_id_	= device_id;
 	cq_			= *cq;
 	NLM_kernel_	= NLM_kernel;
-	width_		= width;
-	height_		= height;
+	key_		= key;
 	pitch_		= pitch;
-	frame_used_	= 0;
 
-	return g_devices[device_id_].buffers_.AllocPlane(cq_, width_, height_, &plane_);
+	// The plane is taken from the device's frame_cache when a frame is first held
+	return FILTER_OK;
 }
 
-bool MultiFrame::Frame::IsCopyRequired(int &frame_number) {
-	// BUG: erroneous frames will appear early in clip
-	// FIX: frame_used_ < 3 is a kludge.
-	if (frame_used_ < 3 || (frame_number != frame_number_)) 
-		return true;
-	else
-		return false;
+void MultiFrame::Frame::Share(const frame_key &key) {
+	key_ = key;
 }
 
-result MultiFrame::Frame::CopyTo(int &frame_number, const unsigned char* const source) {
-	result status = FILTER_OK;
+bool MultiFrame::Frame::IsCopyRequired(const int &frame_number) {
+	if (plane_ != 0 && frame_number == key_.frame_number) return false;
 
-	if (IsCopyRequired(frame_number)) {
-		frame_number_ = frame_number;
-		status = g_devices[device_id_].buffers_.CopyToPlaneAsynch(plane_, *source, width_, height_, pitch_, &copied_);
-	} else {
+	// The frame held is not sampled by the kernels of the prior target,
+	// as there is a Frame object for each frame they sample
+	Release();
+	key_.frame_number = frame_number;
+	return !g_devices[device_id_].frames_.Acquire(key_, &plane_, &copied_);
+}
+
+void MultiFrame::Frame::Release() {
+	if (plane_ != 0) g_devices[device_id_].frames_.Release(plane_);
+	plane_ = 0;
+	copied_ = NULL;
+}
+
+result MultiFrame::Frame::CopyTo(const int &frame_number, const unsigned char* const source) {
+	if (!IsCopyRequired(frame_number)) return FILTER_OK;
+
+	// The event of the copy is retained by the frame_cache, since a 
+	// pipelined target's kernels may be enqueued before the copy completes
+	result status = g_devices[device_id_].frames_.Insert(key_, *source, pitch_, &plane_, &copied_);
+	if (status != FILTER_OK) {
+		plane_ = 0;
 		copied_ = NULL;
 	}
-	++frame_used_;
 	return status;
 }
 
@@ -349,26 +725,35 @@ void MultiFrame::Frame::Plane(int *plane, cl_event *target_copied) {
 
 result MultiFrame::Frame::Execute(
 	const	bool		&is_sample_equal_to_target, 
-			cl_event	*antecedent, 
+			cl_event	*prior_pass, 
+			cl_event	*target_copied, 
+			cl_event	*executed) {
+
+	cl_event no_map = NULL;
+	return Execute(NLM_kernel_, is_sample_equal_to_target, prior_pass, target_copied, &no_map, executed);
+}
+
+result MultiFrame::Frame::Execute(
+			CLKernel	&kernel, 
+	const	bool		&is_sample_equal_to_target, 
+			cl_event	*prior_pass, 
+			cl_event	*target_copied, 
+			cl_event	*map_ready, 
 			cl_event	*executed) {
-	result status = FILTER_OK;
 
 	int sample_equals_target = is_sample_equal_to_target ? k_sample_equals_target : k_sample_is_not_target;
 
-	NLM_kernel_.SetNumberedArg(1, sizeof(cl_mem), g_devices[device_id_].buffers_.ptr(plane_));
-	NLM_kernel_.SetNumberedArg(2, sizeof(int), &sample_equals_target);
-
-	if (copied_ == NULL && *antecedent == NULL) { // target and sample frame are both on device from prior iteration
-		status = NLM_kernel_.Execute(cq_, executed);
-	} else if (*antecedent == NULL) { // target is on device, awaiting sample
-		status = NLM_kernel_.ExecuteAsynch(cq_, &copied_, executed);
-	} else if (copied_ == NULL) { // sample is on device, awaiting target
-		status = NLM_kernel_.ExecuteAsynch(cq_, antecedent, executed);
-	} else { // awaiting sample and target planes
-		wait_list_[0] = copied_;
-		wait_list_[1] = *antecedent;
-		status = NLM_kernel_.ExecuteWaitList(cq_, 2, wait_list_, executed);
-	}
+	kernel.SetNumberedArg(1, sizeof(cl_mem), g_devices[device_id_].buffers_.ptr(plane_));
+	kernel.SetNumberedArg(2, sizeof(int), &sample_equals_target);
 
-	return status;
+	int wait_list_length = 0;
+	wait_list_[wait_list_length++] = *prior_pass;
+	if (*target_copied != NULL)
+		wait_list_[wait_list_length++] = *target_copied;
+	if (copied_ != NULL && !is_sample_equal_to_target)
+		wait_list_[wait_list_length++] = copied_;
+	if (*map_ready != NULL)
+		wait_list_[wait_list_length++] = *map_ready;
+
+	return kernel.ExecuteWaitList(cq_, wait_list_length, wait_list_, executed);
 }
@@ -14,13 +14,15 @@
 #include "result.h"
 #include "CLKernel.h"
 #include "buffer_map.h"
+#include "frame_cache.h"
 #include "MultiFrameRequest.h"
 
 class MultiFrame {
 public:
 	MultiFrame();
 
-	~MultiFrame() {}
+	// Releases the buffers, planes and queues on the device
+	~MultiFrame();
 
 	// Init
 	// One-time configuration of this object to handle all multi-frame 
@@ -37,7 +39,29 @@ public:
 		const	int				&linear,
 		const	int				&correction,
 		const	int				&target_min,
-		const	int				&balanced);
+		const	int				&balanced,
+		const	int				&algorithm,
+		const	int				&half_tile,		// tiles are held as halves in local memory
+		const	int				&half_intermediate,	// intermediate buffers hold halves
+		const	int				&pipelined,
+		const	int				&weight_cache,	// megabytes of weight maps shared by pairs of frames, 0 for none
+		const	int				&fused,			// all passes are performed by a single kernel, when the radius allows
+		const	int				&gaussian);		// buffer of gaussian weights on the device
+
+	// Footprint
+	// Bytes of device memory that Init and the weight maps will
+	// allocate for these parameters, see Init.
+	static size_t Footprint(
+		const	int				&temporal_radius,
+		const	int				&width, 
+		const	int				&height,
+		const	int				&sample_expand,
+		const	int				&balanced,
+		const	int				&algorithm,
+		const	int				&half_intermediate,
+		const	int				&pipelined,
+		const	int				&weight_cache,
+		const	int				&fused);
 
 	// SupplyFrameNumbers
 	// Supplies a set of frame numbers, in object MultiFrameRequest
@@ -47,6 +71,24 @@ public:
 		const	int					&target_frame_number, 
 				MultiFrameRequest	*required);
 
+	// Band
+	// When the plane is a band of a larger plane, with an apron of 
+	// rows shared with its neighbours, restricts the copy to host to
+	// the band's own rows. By default all rows are copied.
+	void Band(
+		const	int				&first_row,		// first row of the plane belonging to the band
+		const	int				&rows);			// count of rows belonging to the band
+
+	// Share
+	// Identifies the plane of the clip being filtered, so that frames
+	// are shared through the device's frame_cache with other instances
+	// filtering the same plane. By default frames are private. Called
+	// after Init, before the first frame.
+	void Share(
+		const	void			*clip,			// source clip
+		const	int				&plane,			// 0 for Y, 1 for U, 2 for V
+		const	int				&first_row);	// first row of the host plane copied to the device
+
 	// CopyTo
 	// Before processing each of the planes, all frames are
 	// copied to the device. Usually most frames will already
@@ -56,23 +98,52 @@ public:
 	//
 	// Also zeroes the intermediate buffers.
 	//
-	// Called once per filtered frame
+	// Called once per filtered frame. When pipelined the copies
+	// are not complete on return, so the host planes must remain
+	// valid until CopyFrom's event for this frame has completed.
 	result CopyTo(MultiFrameRequest *retrieved) ;
 	
 	// Execute
 	// Runs all iterations of the temporal filter and the 
-	// finalise kernel.
+	// finalise kernel. When pipelined, returns without waiting
+	// for the kernels to complete.
 	result Execute();
 	
 	// CopyFrom
 	// Copy filtered pixels to host, returning an event that
 	// can be used to track completion of the copy.
+	//
+	// When pipelined, Execute for the next frame may be called
+	// before this copy completes.
 	result CopyFrom(
 		unsigned char	*dest,							  
 		cl_event		*returned_);
 
+	// Finish
+	// Waits for all copies and kernels to complete, e.g. before
+	// abandoning a frame that was filtered speculatively.
+	void Finish();
+
 private:
 
+	// Symmetric
+	// Weights are the same for both frames of a pair solely when windows
+	// are gaussian-weighted, unbalanced and unaffected by the tile's edges
+	static int Symmetric(
+		const	int				&sample_expand,
+		const	int				&balanced,
+		const	int				&algorithm,
+		const	int				&weight_cache);
+
+	// Fused
+	// The fused kernel takes a fixed count of sample planes as arguments,
+	// and holds a single tile, so cannot build an integral image
+	static int Fused(
+		const	int				&temporal_radius,
+		const	int				&algorithm,
+		const	int				&symmetric,
+		const	int				&fused);
+
 	// InitBuffers
 	// Create the intermediate averages, weights and maximum
 	// weights buffers and create the destination buffer.
@@ -85,7 +156,10 @@ private:
 		const int &sample_expand,
 		const int &linear,
 		const int &correction,
-		const int &balanced);
+		const int &balanced,
+		const int &algorithm,
+		const int &half_tile,
+		const int &gaussian);
 
 	// InitFrames
 	// Create the Frame objects, one per step of the temporal filter.
@@ -93,21 +167,73 @@ private:
 
 	// ZeroIntermediates
 	// Before every new frame is processed the intermediate buffers must be zeroed.
+	// Uses the kernel created by InitKernels, so that no kernel is created per frame.
 	result ZeroIntermediates();
 
-	// ExecuteFrame
-	// Process a single frame in the circular buffer of frames.
-	result ExecuteFrame(
-		const		int		&frame_id,
-		const		bool	&sample_equals_target,
-		cl_event			&copying_target, 
-		cl_event			*filter_events);
+	// FrameID
+	// Index of the Frame object that holds the frame number.
+	int FrameID(const int &frame_number);
+
+	// weight_map
+	// Weights of every sample window for every pixel, computed when
+	// the earlier frame of a pair is the target, for use when the 
+	// later frame is the target.
+	struct weight_map {
+		int buffer			;	// buffer holding the weights
+		bool used			;	// weights are awaiting reuse
+		int earlier			;	// frame number of the target when the weights were computed
+		int later			;	// frame number of the sample when the weights were computed
+		cl_event ready		;	// latest pass to write or read the buffer
+	};
+
+	// EvictWeightMaps
+	// Releases the maps that the target frame cannot use, i.e. all but
+	// those computed for an earlier target that sampled this target or
+	// a later frame.
+	void EvictWeightMaps();
+
+	// FindWeightMap
+	// Returns the map holding the weights of the pair of frames, or 
+	// NULL if there is none.
+	weight_map* FindWeightMap(const int &earlier, const int &later);
+
+	// AllocWeightMaps
+	// Allocates as many maps as fit the budget, during Init.
+	void AllocWeightMaps();
+
+	// AllocWeightMap
+	// Returns a map for the weights of the pair of frames, or NULL if
+	// every map is in use.
+	weight_map* AllocWeightMap(const int &earlier, const int &later);
+
+	// ExecuteFused
+	// Runs the fused kernel, which performs all passes of the temporal
+	// filter and the finalise kernel, once all frames are copied.
+	result ExecuteFused(
+		const	int			&target_frame_plane, 
+				cl_event	*target_copied);
+
+	// SymmetricPass
+	// Performs the NLM pass for a sample frame, storing the weights
+	// when the sample is later than the target and reusing them when
+	// the target is later than the sample. Falls back to a normal
+	// pass if there is no map for the pair.
+	result SymmetricPass(
+		const	int			&frame_number, 
+				cl_event	*prior_pass, 
+				cl_event	*target_copied, 
+				cl_event	*executed);
 
 
 	// Frame
 	// An object for each of the 2 * temporal_radius + 1 frames, all of which are processed separately.
+	// When pipelined there is one extra object, so that the newest frame does not release
+	// the oldest frame while it is still being sampled by the kernels of the prior target.
 	//
 	// This allows a frame to stay in device memory without being repeatedly copied from host. 
+	// The plane holding the frame is taken from the device's frame_cache, so it is copied 
+	// once for all instances that share it. Frames given up by the ring are kept by the cache 
+	// while memory allows, so a seek back to them does not copy them again.
 	//
 	// The usage of multiple Frame objects mimics a circular buffer. As frame number, n, progresses over
 	// the lifetime of filtering a clip, each of the static set  of frame objects will take it in turns 
@@ -120,25 +246,35 @@ private:
 		~Frame() {}
 
 		// Init
-		// Tell the frame object to initialise its buffer
+		// Tell the frame object which plane it holds frames of. Kernels 
+		// use cq.
 		result Init(
 			const	int					&device_id,
 			cl_command_queue			*cq, 
 			const	CLKernel			&NLM_kernel,
-			const	int					&width, 
-			const	int					&height, 
+			const	frame_key			&key,
 			const	int					&pitch);
 
+		// Share
+		// Replaces the key of the frames held, before any is held
+		void Share(const frame_key &key);
+
 		// IsCopyRequired
 		// Queries the Frame to discover if it needs data from the host
-		// for the frame specified.
-		bool IsCopyRequired(int &frame_number);
+		// for the frame specified. The frame is taken from the device's
+		// frame_cache, without a copy, if another instance holds it.
+		bool IsCopyRequired(const int &frame_number);
+
+		// Release
+		// Gives up the plane holding the frame, once no kernel that 
+		// reads it is pending.
+		void Release();
 
 		// CopyTo
 		// All frame objects are given the chance to copy host data to the device, if needed.
 		//
 		// This handles the once-per-cycle copying of host data to the device.
-		result CopyTo(int &frame_number, const unsigned char* const source);
+		result CopyTo(const int &frame_number, const unsigned char* const source);
 
 		// Plane
 		// Allows the parent to query the frame known to be handling the target 
@@ -149,14 +285,27 @@ private:
 		void Plane(int *plane, cl_event *target_copied);
 
 		// Execute
-		// Performs the NLM pass.
+		// Performs the NLM pass, once the prior pass and the copies of the
+		// target and sample planes have completed.
 		//
 		// During each cycle the client instructs a single frame object that it is 
 		// handling the target frame. The id of the frame object handling the target frame
 		// progresses circularly around the "ring" of Frame objects, as the clip is processed.
 		result Execute(
 			const	bool		&is_sample_equal_to_target, 
-					cl_event	*antecedent, 
+					cl_event	*prior_pass, 
+					cl_event	*target_copied, 
+					cl_event	*executed);
+
+		// Execute
+		// Performs the pass with a kernel other than the shared NLM kernel,
+		// once the weight map the kernel uses is also ready.
+		result Execute(
+					CLKernel	&kernel, 
+			const	bool		&is_sample_equal_to_target, 
+					cl_event	*prior_pass, 
+					cl_event	*target_copied, 
+					cl_event	*map_ready, 
 					cl_event	*executed);
 
 	private:
@@ -164,29 +313,33 @@ private:
 		int device_id_			;	// device executing the kernels
 		cl_command_queue cq_	;	// command queue shared by all Frame objects and client object
 		CLKernel NLM_kernel_	;	// each frame sets arguments for a kernel shared by all
-		int frame_number_		;	// frame being processed
-		int plane_				;	// buffer for the frame being processed
-		int width_				;	// width of plane's content
-		int height_				;	// height of plane's content
+		frame_key key_			;	// plane of the clip held, and frame being processed
+		int plane_				;	// buffer for the frame being processed, 0 when no frame is held
 		int pitch_				;	// host plane format allows each row to be potentially longer than width_
-		cl_event copied_		;	// tracks completion of the copy from host to device of the Frame's sample plane
-		cl_event wait_list_[2]	;	// used during execution to track completion of copying of target and sample planes
-		int frame_used_			;	// tracks count of times plane data has been copied to device - enables kludge
+		cl_event copied_		;	// tracks completion of the copy from host to device of the Frame's sample plane, owned by the frame_cache
+		cl_event wait_list_[4]	;	// used during execution to track completion of the prior pass, copying of target and sample planes and the weight map
 	};
 
 
 	int device_id_				;	// device used to execute the filter kernels
+	const void *clip_			;	// source clip whose frames are shared, or NULL when frames are private
 	int	temporal_radius_		;	// count of frames either side of target frame that will be included in multi-frame filtering
 	vector<Frame> frames_		;	// set of frame planes including target
 	int target_frame_number_	;	// frame to be filtered
-	int dest_plane_				;	// dedicated buffer for destination plane
-	int averages_				;	// intermediate averages buffer
-	int weights_				;	// intermediate weights buffer
-	int target_weights_			;	// intermediate target weights buffer
+	int pipelined_				;	// next target may be copied and filtered before the result for this target is copied to host
+	int half_intermediate_		;	// intermediate buffers hold halves instead of floats
+	int slot_count_				;	// sets of intermediate and destination buffers, 2 when pipelined so that consecutive targets alternate
+	int slot_					;	// set of buffers used by the target frame
+	int dest_plane_[2]			;	// dedicated buffer for destination plane
+	int averages_[2]			;	// intermediate averages buffer
+	int weights_[2]				;	// intermediate weights buffer
+	int target_weights_[2]		;	// intermediate target weights buffer
 	int width_					;	// width of plane's content
 	int height_					;	// height of plane's content
 	int src_pitch_				;	// host plane format allows each row to be potentially longer than width_
 	int dst_pitch_				;	// host plane format allows each row to be potentially longer than width_
+	int band_first_row_			;	// first row copied to host
+	int band_rows_				;	// count of rows copied to host
 	float h_					;	// strength of noise reduction
 	cl_command_queue cq_		;	// device object for queue management and synchronisation
 	int target_min_				;	// target pixel is weighted using minimum weight of samples, not maximum
@@ -194,12 +347,27 @@ private:
 	size_t intermediate_height_	;	// height of intermediate buffers, rounded-up to 32 rows
 	CLKernel NLM_kernel_		;	// kernel that performs NLM computations, once per sample plane
 	CLKernel finalise_kernel_	;	// single invocation of this kernel to average all samples
-	cl_event copied_			;	// used to track the final copy to the device - at least one frame is copied to the device
-	cl_event executed_			;	// finalise kernel is executed synchronously, but event is used for asynchronous copy back to host
+	int symmetric_				;	// weights of each pair of frames are computed once, when the earlier frame is the target
+	CLKernel symmetric_kernel_	;	// kernel that stores or reuses the weights of a pair of frames
+	vector<weight_map> weight_maps_;	// maps of weights of pairs of frames
+	size_t weight_map_limit_	;	// count of maps that fit in the budget
+	size_t weight_map_bytes_	;	// size of each map
+	int fused_					;	// a single kernel performs all passes and finalisation, without intermediate buffers
+	CLKernel fused_kernel_		;	// kernel that samples all frames and finalises
+	CLKernel zero_kernel_		;	// kernel that zeroes the intermediate buffers before each target frame
+	vector<cl_event> copy_wait_list_;	// copies of frames to the device waited for by CopyTo, sized once by InitFrames
+	cl_event zeroed_			;	// intermediate buffers of the slot have been zeroed, the first pass follows this
+	cl_event executed_[2]		;	// finalise kernel of each slot, used for asynchronous copy back to host
 
 	// Kernel needs to know whether the plane it is sampling from is the target plane
 	static const int k_sample_equals_target = 1;
 	static const int k_sample_is_not_target = 0;
+
+	// Weight maps hold the weights of the 7x7 sample windows of each pixel
+	static const int k_symmetric_offsets = 49;
+
+	// Sample planes, other than the target, taken by the fused kernel
+	static const int k_fused_samples = 8;
 };
 
 #endif // MULTI_FRAME_H_
\ No newline at end of file
@@ -0,0 +1,178 @@
+/* Deathray - An Avisynth plug-in filter for spatial/temporal non-local means de-noising.
+ *
+ * version 1.04
+ *
+ * Copyright 2013, Jawed Ashraf - Deathray@cupidity.f9.co.uk
+ */
+
+#include <float.h>
+#include <string.h>
+#include <algorithm>
+#include "MultiFrameCPU.h"
+#include "NLMHost.h"
+#include "ThreadPool.h"
+
+extern	ThreadPool	g_thread_pool;
+
+MultiFrameCPU::MultiFrameCPU() {
+	temporal_radius_		= 0;
+	target_frame_number_	= 0;
+	width_					= 0;
+	height_					= 0;
+	src_pitch_				= 0;
+	dst_pitch_				= 0;
+	tiles_across_			= 0;
+	tiles_down_				= 0;
+	filter_					= NULL;
+	strip_width_			= 0;
+}
+
+result MultiFrameCPU::Init(
+	const	int				&temporal_radius,
+	const	int				&width,
+	const	int				&height,
+	const	int				&src_pitch,
+	const	int				&dst_pitch,
+	const	float			&h,
+	const	int				&sample_expand,
+	const	int				&linear,
+	const	int				&correction,
+	const	int				&target_min,
+	const	int				&balanced,
+	const	int				&algorithm,
+	const	float			*gaussian) {
+
+	temporal_radius_	= temporal_radius;
+	width_				= width;
+	height_				= height;
+	src_pitch_			= src_pitch;
+	dst_pitch_			= dst_pitch;
+	h_					= h;
+	sample_expand_		= sample_expand;
+	linear_				= linear;
+	correction_			= correction;
+	target_min_			= target_min;
+	balanced_			= balanced;
+	algorithm_			= algorithm;
+
+	if (width_ == 0 || height_ == 0 || src_pitch_ == 0 || dst_pitch_ == 0 || h == 0 ) return FILTER_INVALID_PARAMETER;
+
+	memcpy(gaussian_, gaussian, 56 * sizeof(float));
+
+	tiles_across_	= (width_ + k_host_tile_size - 1) / k_host_tile_size;
+	tiles_down_		= (height_ + k_host_tile_size - 1) / k_host_tile_size;
+
+	filter_ = SelectFilterStrip(DetectHostSIMD(), &strip_width_);
+
+	const int frame_count = 2 * temporal_radius_ + 1;
+	planes_.resize(frame_count);
+	for (int i = 0; i < frame_count; ++i)
+		planes_[i].resize(width_ * height_);
+	frame_numbers_.assign(frame_count, 0);
+	converted_.assign(frame_count, false);
+
+	dest_.resize(width_ * height_);
+
+	if (planes_.size() != frame_count)
+		return FILTER_MULTI_FRAME_INITIALISATION_FAILED;
+
+	return FILTER_OK;
+}
+
+int MultiFrameCPU::Slot(const int &frame_number) {
+	// Frame numbers start at -temporal_radius_ for the first frame of the clip
+	return (frame_number + temporal_radius_) % planes_.size();
+}
+
+void MultiFrameCPU::SupplyFrameNumbers(
+	const	int					&target_frame_number,
+			MultiFrameRequest	*required) {
+
+	target_frame_number_ = target_frame_number;
+
+	required->Reset(target_frame_number_ - temporal_radius_, 2 * temporal_radius_ + 1);
+	for (int i = -temporal_radius_; i <= temporal_radius_; ++i) {
+		int frame_number = target_frame_number_ + i;
+		int slot = Slot(frame_number);
+		if (!converted_[slot] || frame_numbers_[slot] != frame_number)
+			required->Request(frame_number);
+	}
+}
+
+result MultiFrameCPU::CopyTo(MultiFrameRequest *retrieved) {
+	for (int i = -temporal_radius_; i <= temporal_radius_; ++i) {
+		int frame_number = target_frame_number_ + i;
+		int slot = Slot(frame_number);
+		if (!converted_[slot] || frame_numbers_[slot] != frame_number) {
+			const unsigned char *source = retrieved->Retrieve(frame_number);
+			if (source == NULL) return FILTER_INVALID_PARAMETER;
+
+			ReadPlaneHost(source, width_, height_, src_pitch_, linear_, &planes_[slot][0]);
+			frame_numbers_[slot]	= frame_number;
+			converted_[slot]		= true;
+		}
+	}
+	return FILTER_OK;
+}
+
+result MultiFrameCPU::Execute() {
+	g_thread_pool.Execute(tiles_across_ * tiles_down_, &MultiFrameCPU::FilterTile, this);
+	return FILTER_OK;
+}
+
+result MultiFrameCPU::CopyFrom(unsigned char *dest) {
+	for (int y = 0; y < height_; ++y)
+		memcpy(dest + y * dst_pitch_, &dest_[y * width_], width_);
+	return FILTER_OK;
+}
+
+void MultiFrameCPU::FilterTile(void *context, const int &tile) {
+	// Each task produces up to 1024 filtered pixels, organised as a tile
+	// of 32x32. The accumulators for the tile stay on the stack while
+	// every sample plane is visited, the target plane last, as
+	// MultiFrame::Execute does across its passes.
+
+	MultiFrameCPU *filter = static_cast<MultiFrameCPU*>(context);
+
+	const int tile_left = (tile % filter->tiles_across_) * k_host_tile_size;
+	const int tile_top	= (tile / filter->tiles_across_) * k_host_tile_size;
+	const int columns	= min(k_host_tile_size, filter->width_ - tile_left);
+	const int rows		= min(k_host_tile_size, filter->height_ - tile_top);
+
+	float target_storage[k_host_tile_storage] = {0.f};
+	float sample_storage[k_host_tile_storage] = {0.f};
+	float *target_tile = target_storage + k_host_tile_padding;
+	float *sample_tile = sample_storage + k_host_tile_padding;
+
+	float average[k_host_tile_size * k_host_tile_size];
+	float weight[k_host_tile_size * k_host_tile_size];
+	float target_weight[k_host_tile_size * k_host_tile_size];
+	for (int i = 0; i < k_host_tile_size * k_host_tile_size; ++i) {
+		average[i]			= 0.f;
+		weight[i]			= 0.f;
+		target_weight[i]	= filter->target_min_ ? FLT_MAX : 0.f;
+	}
+
+	const float *target_plane = &filter->planes_[filter->Slot(filter->target_frame_number_)][0];
+	FetchAndMirror48x48Host(target_plane, filter->width_, filter->height_, tile_left, tile_top, target_tile);
+
+	for (int i = -filter->temporal_radius_; i <= filter->temporal_radius_; ++i) {
+		const bool sample_equals_target = (i == 0);
+		if (sample_equals_target) continue; // target frame is processed last
+
+		const float *sample_plane = &filter->planes_[filter->Slot(filter->target_frame_number_ + i)][0];
+		FetchAndMirror48x48Host(sample_plane, filter->width_, filter->height_, tile_left, tile_top, sample_tile);
+
+		FilterTileHost(filter->algorithm_, filter->filter_, filter->strip_width_, rows, columns, filter->h_, filter->sample_expand_, 
+					   target_tile, sample_tile, filter->gaussian_, 0, filter->target_min_, filter->balanced_, average, weight, target_weight);
+	}
+
+	FilterTileHost(filter->algorithm_, filter->filter_, filter->strip_width_, rows, columns, filter->h_, filter->sample_expand_, 
+				   target_tile, target_tile, filter->gaussian_, 1, filter->target_min_, filter->balanced_, average, weight, target_weight);
+
+	for (int y = 0; y < rows; ++y) {
+		const int plane_offset = (tile_top + y) * filter->width_ + tile_left;
+		FinaliseHost(average + y * k_host_tile_size, weight + y * k_host_tile_size, target_plane + plane_offset, columns,
+					 filter->linear_, filter->correction_, &filter->dest_[plane_offset]);
+	}
+}
@@ -0,0 +1,107 @@
+/* Deathray - An Avisynth plug-in filter for spatial/temporal non-local means de-noising.
+ *
+ * version 1.04
+ *
+ * Copyright 2013, Jawed Ashraf - Deathray@cupidity.f9.co.uk
+ */
+
+#ifndef MULTI_FRAME_CPU_H_
+#define MULTI_FRAME_CPU_H_
+
+#include <vector>
+#include "result.h"
+#include "MultiFrameRequest.h"
+#include "NLMHost.h"
+
+using namespace std;
+
+// MultiFrameCPU
+// Host equivalent of MultiFrame, used when no OpenCL device is available.
+//
+// The 2 * temporal_radius + 1 planes are held in a circular buffer, in the
+// same way as MultiFrame's Frame objects, so that each plane is converted
+// once per cycle. 32x32 tiles are filtered in parallel by g_thread_pool,
+// with each tile processing all sample planes before finalising, so no
+// intermediate buffers are required.
+class MultiFrameCPU {
+public:
+	MultiFrameCPU();
+
+	~MultiFrameCPU() {}
+
+	// Init
+	// One-time configuration of this object to handle all multi-frame
+	// processing for the duration of the clip.
+	result Init(
+		const	int				&temporal_radius,
+		const	int				&width,
+		const	int				&height,
+		const	int				&src_pitch,
+		const	int				&dst_pitch,
+		const	float			&h,
+		const	int				&sample_expand,
+		const	int				&linear,
+		const	int				&correction,
+		const	int				&target_min,
+		const	int				&balanced,
+		const	int				&algorithm,
+		const	float			*gaussian);
+
+	// SupplyFrameNumbers
+	// Supplies a set of frame numbers, in object MultiFrameRequest
+	// when Deathray object requests which frames should be converted.
+	void SupplyFrameNumbers(
+		const	int					&target_frame_number,
+				MultiFrameRequest	*required);
+
+	// CopyTo
+	// Converts the planes that are not already held in the
+	// circular buffer.
+	//
+	// Called once per filtered frame
+	result CopyTo(MultiFrameRequest *retrieved);
+
+	// Execute
+	// Filters all tiles over the entire temporal range. Returns
+	// once all tiles are filtered.
+	result Execute();
+
+	// CopyFrom
+	// Copy filtered pixels to host.
+	result CopyFrom(unsigned char *dest);
+
+private:
+
+	// Slot
+	// Position in the circular buffer of the plane for the frame number
+	int Slot(const int &frame_number);
+
+	// FilterTile
+	// Task executed by the thread pool, filtering a single 32x32 tile.
+	static void FilterTile(void *context, const int &tile);
+
+	int	temporal_radius_			;	// count of frames either side of target frame that will be included in multi-frame filtering
+	int target_frame_number_		;	// frame to be filtered
+	int width_						;	// width of plane's content
+	int height_						;	// height of plane's content
+	int src_pitch_					;	// host plane format allows each row to be potentially longer than width_
+	int dst_pitch_					;	// host plane format allows each row to be potentially longer than width_
+	float h_						;	// strength of noise reduction
+	int sample_expand_				;	// factor by which the sample radius is expanded
+	int linear_						;	// process plane in linear space instead of gamma space
+	int correction_					;	// apply a post-filtering correction
+	int target_min_					;	// target pixel is weighted using minimum weight of samples, not maximum
+	int balanced_					;	// balanced tonal range de-noising
+	int algorithm_					;	// method used to compute window distances
+	float gaussian_[56]				;	// weights of gaussian kernel and its 1-dimensional equivalent
+	int tiles_across_				;	// count of 32x32 tiles horizontally
+	int tiles_down_					;	// count of 32x32 tiles vertically
+	filter_strip filter_			;	// Filter4Host or a SIMD equivalent, chosen for the host's CPU
+	int strip_width_				;	// count of pixels filtered by each call to filter_
+	vector<vector<float> > planes_	;	// circular buffer of planes as normalised floats
+	vector<int> frame_numbers_		;	// frame held by each plane in the circular buffer
+	vector<bool> converted_			;	// plane in the circular buffer contains valid data
+	vector<unsigned char> dest_		;	// filtered plane
+};
+
+#endif // MULTI_FRAME_CPU_H_
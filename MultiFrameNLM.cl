@@ -19,9 +19,9 @@ __kernel void NLMMultiFrameFourPixel(
 	const		int			linear,					// process plane in linear space instead of gamma space
 	const		int			target_min,				// target pixel is weighted using minimum weight of samples, not maximum
 	const		int			balanced,				// balanced tonal range de-noising
-	global 		float4		*intermediate_average,	// intermediate average for 4 pixels
-	global 		float4		*intermediate_weight,	// intermediate weight for 4 pixels
-	global		float4		*intermediate_target) {	// intermediate target weights for 4 pixels
+	global 		INTERMEDIATE	*intermediate_average,	// intermediate average for 4 pixels
+	global 		INTERMEDIATE	*intermediate_weight,	// intermediate weight for 4 pixels
+	global		INTERMEDIATE	*intermediate_target) {	// intermediate target weights for 4 pixels
 
 	// Each work group produces 1024 filtered pixels, organised as a tile
 	// of 32x32, for a single iteration of multi-pass filtering. Each 
@@ -45,7 +45,7 @@ __kernel void NLMMultiFrameFourPixel(
 	// (weighted running sum), weight (running sum of weights) and
 	// target weight (weight that will be used at end for target pixel).
 
-	__local float tile[TILE_SIDE * TILE_SIDE];
+	__local TILE_PIXEL tile[TILE_SIDE * TILE_SIDE];
 
 	int2 local_id;
 	int2 source;
@@ -55,7 +55,7 @@ __kernel void NLMMultiFrameFourPixel(
 	int2 target = (int2)((local_id.x << 2) + 8, local_id.y + 8);
 
 	// The tile is 48x48 pixels which is entirely filled from the source
-	FetchAndMirror48x48(target_plane, width, height, local_id, source, linear, tile) ;
+	FetchAndMirror48x48(target_plane, width, height, local_id, source, LINEAR(linear), tile) ;
 
 	// Populate the 10x7 target window from the tile
 	int kernel_radius = 3;
@@ -69,27 +69,371 @@ __kernel void NLMMultiFrameFourPixel(
 	// Most planes are planes other than the target plane, which need
 	// to be fetched into the tile for sampling
 	if (!sample_equals_target)
-		FetchAndMirror48x48(sample_plane, width, height, local_id, source, linear, tile);
+		FetchAndMirror48x48(sample_plane, width, height, local_id, source, LINEAR(linear), tile);
 
 	int linear_address = source.y * intermediate_width + source.x;
-	float4 average = intermediate_average[linear_address];
-	float4 weight = intermediate_weight[linear_address];
-	float4 target_weight = intermediate_target[linear_address];
+	float4 average = ReadIntermediate(intermediate_average, linear_address);
+	float4 weight = ReadIntermediate(intermediate_weight, linear_address);
+	float4 target_weight = ReadIntermediate(intermediate_target, linear_address);
 
-	Filter4(target, h, sample_expand, target_window, tile, g_gaussian, sample_equals_target, target_min, balanced, &average, &weight, &target_weight);
+	Filter4(target, h, SAMPLE_EXPAND(sample_expand), target_window, tile, g_gaussian, sample_equals_target, TARGET_MIN(target_min), BALANCED(balanced), &average, &weight, &target_weight);
 
 	if (target.y < height) {
-		intermediate_average[linear_address] = average;
-		intermediate_weight[linear_address] = weight;
-		intermediate_target[linear_address] = target_weight;
+		WriteIntermediate(average, intermediate_average, linear_address);
+		WriteIntermediate(weight, intermediate_weight, linear_address);
+		WriteIntermediate(target_weight, intermediate_target, linear_address);
 	}
 }
 
+__attribute__((reqd_work_group_size(8, 32, 1)))
+__kernel void NLMMultiFrameIntegral(
+	read_only 	image2d_t 	target_plane,			// plane being filtered
+	read_only 	image2d_t 	sample_plane,			// any other plane
+	const		int			sample_equals_target,	// 1 when sample plane is target plane, 0 otherwise
+	const		int			width,					// width in pixels
+	const		int			height,					// height in pixels
+	const		float		h,						// strength of denoising
+	const		int			sample_expand,			// factor to expand sample radius
+	constant	float		*g_gaussian,			// 49 weights of guassian kernel, unused
+	const		int			intermediate_width,		// width, in float4s, of intermediate buffers
+	const		int			linear,					// process plane in linear space instead of gamma space
+	const		int			target_min,				// target pixel is weighted using minimum weight of samples, not maximum
+	const		int			balanced,				// balanced tonal range de-noising
+	global 		INTERMEDIATE	*intermediate_average,	// intermediate average for 4 pixels
+	global 		INTERMEDIATE	*intermediate_weight,	// intermediate weight for 4 pixels
+	global		INTERMEDIATE	*intermediate_target) {	// intermediate target weights for 4 pixels
+
+	// Same as NLMMultiFrameFourPixel, except that windows are box-weighted
+	// and their distances are taken from an integral image, see FilterIntegral.
+	//
+	// Arguments match NLMMultiFrameFourPixel so that the host can use either.
+
+	__local TILE_PIXEL tile[TILE_SIDE * TILE_SIDE];
+	__local float integral[INTEGRAL_SIDE * INTEGRAL_SIDE];
+
+	int2 local_id;
+	int2 source;
+	Coordinates32x32(&local_id, &source);
+
+	// Inside local memory the top-left corner of the tile is at (8,8)
+	int2 target = (int2)((local_id.x << 2) + 8, local_id.y + 8);
+
+	// The tile is 48x48 pixels which is entirely filled from the source
+	FetchAndMirror48x48(target_plane, width, height, local_id, source, LINEAR(linear), tile) ;
+
+	// Each work item holds the target pixels it needs, so the tile
+	// can be re-used for the sample plane
+	float target_pixels[INTEGRAL_ENTRIES];
+	IntegralTargetPixels(local_id, tile, target_pixels);
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if (!sample_equals_target)
+		FetchAndMirror48x48(sample_plane, width, height, local_id, source, LINEAR(linear), tile);
+
+	int linear_address = source.y * intermediate_width + source.x;
+	float4 average = ReadIntermediate(intermediate_average, linear_address);
+	float4 weight = ReadIntermediate(intermediate_weight, linear_address);
+	float4 target_weight = ReadIntermediate(intermediate_target, linear_address);
+
+	FilterIntegral(local_id, target, h, SAMPLE_EXPAND(sample_expand), target_pixels, tile, integral, sample_equals_target, TARGET_MIN(target_min), BALANCED(balanced), &average, &weight, &target_weight);
+
+	if (target.y < height) {
+		WriteIntermediate(average, intermediate_average, linear_address);
+		WriteIntermediate(weight, intermediate_weight, linear_address);
+		WriteIntermediate(target_weight, intermediate_target, linear_address);
+	}
+}
+
+__attribute__((reqd_work_group_size(8, 32, 1)))
+__kernel void NLMMultiFrameSeparable(
+	read_only 	image2d_t 	target_plane,			// plane being filtered
+	read_only 	image2d_t 	sample_plane,			// any other plane
+	const		int			sample_equals_target,	// 1 when sample plane is target plane, 0 otherwise
+	const		int			width,					// width in pixels
+	const		int			height,					// height in pixels
+	const		float		h,						// strength of denoising
+	const		int			sample_expand,			// factor to expand sample radius
+	constant	float		*g_gaussian,			// 49 weights of guassian kernel followed by 7 weights of its 1-dimensional equivalent
+	const		int			intermediate_width,		// width, in float4s, of intermediate buffers
+	const		int			linear,					// process plane in linear space instead of gamma space
+	const		int			target_min,				// target pixel is weighted using minimum weight of samples, not maximum
+	const		int			balanced,				// balanced tonal range de-noising
+	global 		INTERMEDIATE	*intermediate_average,	// intermediate average for 4 pixels
+	global 		INTERMEDIATE	*intermediate_weight,	// intermediate weight for 4 pixels
+	global		INTERMEDIATE	*intermediate_target) {	// intermediate target weights for 4 pixels
+
+	// Same as NLMMultiFrameFourPixel, except that the gaussian weighting
+	// of windows is performed separably, see FilterSeparable.
+	//
+	// Arguments match NLMMultiFrameFourPixel so that the host can use either.
+
+	__local TILE_PIXEL tile[TILE_SIDE * TILE_SIDE];
+	__local float column_distance[32 * SEPARABLE_COLUMNS];
+
+	int2 local_id;
+	int2 source;
+	Coordinates32x32(&local_id, &source);
+
+	// Inside local memory the top-left corner of the tile is at (8,8)
+	int2 target = (int2)((local_id.x << 2) + 8, local_id.y + 8);
+
+	// The tile is 48x48 pixels which is entirely filled from the source
+	FetchAndMirror48x48(target_plane, width, height, local_id, source, LINEAR(linear), tile) ;
+
+	// Populate the 10x7 target window from the tile
+	int kernel_radius = 3;
+	float16 target_window[7];
+	for (int y = 0; y < 2 * kernel_radius + 1; ++y) {
+		target_window[y] = ReadTile16(target.x - kernel_radius,
+									  target.y + y - kernel_radius, 
+									  tile);
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if (!sample_equals_target)
+		FetchAndMirror48x48(sample_plane, width, height, local_id, source, LINEAR(linear), tile);
+
+	int linear_address = source.y * intermediate_width + source.x;
+	float4 average = ReadIntermediate(intermediate_average, linear_address);
+	float4 weight = ReadIntermediate(intermediate_weight, linear_address);
+	float4 target_weight = ReadIntermediate(intermediate_target, linear_address);
+
+	FilterSeparable(local_id, target, h, SAMPLE_EXPAND(sample_expand), target_window, tile, g_gaussian, column_distance, sample_equals_target, TARGET_MIN(target_min), BALANCED(balanced), &average, &weight, &target_weight);
+
+	if (target.y < height) {
+		WriteIntermediate(average, intermediate_average, linear_address);
+		WriteIntermediate(weight, intermediate_weight, linear_address);
+		WriteIntermediate(target_weight, intermediate_target, linear_address);
+	}
+}
+
+__attribute__((reqd_work_group_size(8, 32, 1)))
+__kernel void NLMMultiFrameSymmetric(
+	read_only 	image2d_t 	target_plane,			// plane being filtered
+	read_only 	image2d_t 	sample_plane,			// any other plane
+	const		int			sample_equals_target,	// unused, the sample plane is never the target plane
+	const		int			width,					// width in pixels
+	const		int			height,					// height in pixels
+	const		float		h,						// strength of denoising
+	const		int			sample_expand,			// unused, sample radius is not expanded
+	constant	float		*g_gaussian,			// 49 weights of guassian kernel
+	const		int			intermediate_width,		// width, in float4s, of intermediate buffers
+	const		int			linear,					// process plane in linear space instead of gamma space
+	const		int			target_min,				// target pixel is weighted using minimum weight of samples, not maximum
+	const		int			balanced,				// unused, weighting is not balanced
+	global 		INTERMEDIATE	*intermediate_average,	// intermediate average for 4 pixels
+	global 		INTERMEDIATE	*intermediate_weight,	// intermediate weight for 4 pixels
+	global		INTERMEDIATE	*intermediate_target,	// intermediate target weights for 4 pixels
+	global		float		*weight_map,			// weights of the pair of target and sample frames
+	const		int			reuse) {				// 1 when weight_map is read, 0 when it is written
+
+	// Same as NLMMultiFrameFourPixel, except that the weights of each
+	// pair of frames are computed once, see FilterSymmetric.
+	//
+	// Arguments 0 to 14 match NLMMultiFrameFourPixel so that the host can
+	// set them in the same way.
+
+	__local TILE_PIXEL tile[TILE_SIDE * TILE_SIDE];
+
+	int2 local_id;
+	int2 source;
+	Coordinates32x32(&local_id, &source);
+
+	// Inside local memory the top-left corner of the tile is at (8,8)
+	int2 target = (int2)((local_id.x << 2) + 8, local_id.y + 8);
+
+	// The tile is 48x48 pixels which is entirely filled from the source
+	FetchAndMirror48x48(target_plane, width, height, local_id, source, LINEAR(linear), tile) ;
+
+	// Populate the 10x7 target window from the tile
+	int kernel_radius = 3;
+	float16 target_window[7];
+	for (int y = 0; y < 2 * kernel_radius + 1; ++y) {
+		target_window[y] = ReadTile16(target.x - kernel_radius,
+									  target.y + y - kernel_radius, 
+									  tile);
+	}
+
+	FetchAndMirror48x48(sample_plane, width, height, local_id, source, LINEAR(linear), tile);
+
+	int linear_address = source.y * intermediate_width + source.x;
+	float4 average = ReadIntermediate(intermediate_average, linear_address);
+	float4 weight = ReadIntermediate(intermediate_weight, linear_address);
+	float4 target_weight = ReadIntermediate(intermediate_target, linear_address);
+
+	int2 pixel = (int2)(source.x << 2, source.y);
+	FilterSymmetric(target, pixel, width, height, h, target_window, tile, g_gaussian, TARGET_MIN(target_min), reuse, weight_map, intermediate_width << 2, get_global_size(1), &average, &weight, &target_weight);
+
+	if (target.y < height) {
+		WriteIntermediate(average, intermediate_average, linear_address);
+		WriteIntermediate(weight, intermediate_weight, linear_address);
+		WriteIntermediate(target_weight, intermediate_target, linear_address);
+	}
+}
+
+#define FUSED_SAMPLES 8		// sample planes, other than the target plane, filtered by a fused kernel
+
+void FusedTemporal(
+	read_only 	image2d_t 	target_plane,			// plane being filtered
+	read_only 	image2d_t 	sample_0,				// planes other than the target plane, sample_count of them
+	read_only 	image2d_t 	sample_1,
+	read_only 	image2d_t 	sample_2,
+	read_only 	image2d_t 	sample_3,
+	read_only 	image2d_t 	sample_4,
+	read_only 	image2d_t 	sample_5,
+	read_only 	image2d_t 	sample_6,
+	read_only 	image2d_t 	sample_7,
+	const		int			sample_count,			// count of sample planes, up to FUSED_SAMPLES
+	const		int			width,					// width in pixels
+	const		int			height,					// height in pixels
+	const		float		h,						// strength of denoising
+	const		int			sample_expand,			// factor to expand sample radius
+	constant	float		*g_gaussian,			// 49 weights of guassian kernel followed by 7 weights of its 1-dimensional equivalent
+	const		int			linear,					// process plane in linear space instead of gamma space
+	const		int			correction,				// apply a post-filtering correction
+	const		int			target_min,				// target pixel is weighted using minimum weight of samples, not maximum
+	const		int			balanced,				// balanced tonal range de-noising
+	write_only 	image2d_t 	destination_plane,		// filtered result
+	const		int			separable,				// gaussian weighting of windows is performed separably
+	local	TILE_PIXEL		*tile,					// tile of the target plane or of a sample plane
+	local		float		*column_distance) {		// used when separable, see FilterSeparable
+
+	// Performs all passes of multi-frame filtering and the finalise
+	// kernel in one, so that the running sums stay in registers instead
+	// of intermediate buffers and the target window is read once.
+	//
+	// Sample planes are passed in the same order as the passes of
+	// MultiFrame::Execute, with the target plane sampled last, so the 
+	// result is the same.
+
+	int2 local_id;
+	int2 source;
+	Coordinates32x32(&local_id, &source);
+
+	float4 average = 0.f;
+	float4 weight = 0.f;
+	float4 target_weight = TARGET_MIN(target_min) ? MAXFLOAT : 0.f;
+
+	// Inside local memory the top-left corner of the tile is at (8,8)
+	int2 target = (int2)((local_id.x << 2) + 8, local_id.y + 8);
+
+	// The tile is 48x48 pixels which is entirely filled from the source
+	FetchAndMirror48x48(target_plane, width, height, local_id, source, LINEAR(linear), tile) ;
+
+	// Populate the 10x7 target window from the tile
+	int kernel_radius = 3;
+	float16 target_window[7];
+	for (int y = 0; y < 2 * kernel_radius + 1; ++y) {
+		target_window[y] = ReadTile16(target.x - kernel_radius,
+									  target.y + y - kernel_radius, 
+									  tile);
+	}
+
+	for (int i = 0; i <= sample_count; ++i) {
+		// The tile is overwritten once all work items have finished with it
+		barrier(CLK_LOCAL_MEM_FENCE);
+		switch (i == sample_count ? -1 : i) {
+			case 0: FetchAndMirror48x48(sample_0, width, height, local_id, source, LINEAR(linear), tile); break;
+			case 1: FetchAndMirror48x48(sample_1, width, height, local_id, source, LINEAR(linear), tile); break;
+			case 2: FetchAndMirror48x48(sample_2, width, height, local_id, source, LINEAR(linear), tile); break;
+			case 3: FetchAndMirror48x48(sample_3, width, height, local_id, source, LINEAR(linear), tile); break;
+			case 4: FetchAndMirror48x48(sample_4, width, height, local_id, source, LINEAR(linear), tile); break;
+			case 5: FetchAndMirror48x48(sample_5, width, height, local_id, source, LINEAR(linear), tile); break;
+			case 6: FetchAndMirror48x48(sample_6, width, height, local_id, source, LINEAR(linear), tile); break;
+			case 7: FetchAndMirror48x48(sample_7, width, height, local_id, source, LINEAR(linear), tile); break;
+			default: FetchAndMirror48x48(target_plane, width, height, local_id, source, LINEAR(linear), tile); break;
+		}
+
+		// The target plane, last, reweights the target pixel
+		const int sample_equals_target = (i == sample_count) ? 1 : 0;
+		if (separable)
+			FilterSeparable(local_id, target, h, SAMPLE_EXPAND(sample_expand), target_window, tile, g_gaussian, column_distance, sample_equals_target, TARGET_MIN(target_min), BALANCED(balanced), &average, &weight, &target_weight);
+		else
+			Filter4(target, h, SAMPLE_EXPAND(sample_expand), target_window, tile, g_gaussian, sample_equals_target, TARGET_MIN(target_min), BALANCED(balanced), &average, &weight, &target_weight);
+	}
+
+	float4 filtered_pixels = average / weight;
+
+	if (CORRECTION(correction)) {
+		float4 original = ReadPixel4(target_plane, source, LINEAR(linear));
+
+		float4 difference = filtered_pixels - original;
+		float4 correction = (difference * original * original) - 
+							((difference * original) * (difference * original));
+
+		filtered_pixels = filtered_pixels - correction;
+	}
+	WritePixel4(filtered_pixels, source, LINEAR(linear), destination_plane);
+}
+
+__attribute__((reqd_work_group_size(8, 32, 1)))
+__kernel void NLMMultiFrameFusedFourPixel(
+	read_only 	image2d_t 	target_plane,			// plane being filtered
+	read_only 	image2d_t 	sample_0,				// planes other than the target plane, sample_count of them
+	read_only 	image2d_t 	sample_1,
+	read_only 	image2d_t 	sample_2,
+	read_only 	image2d_t 	sample_3,
+	read_only 	image2d_t 	sample_4,
+	read_only 	image2d_t 	sample_5,
+	read_only 	image2d_t 	sample_6,
+	read_only 	image2d_t 	sample_7,
+	const		int			sample_count,			// count of sample planes, up to FUSED_SAMPLES
+	const		int			width,					// width in pixels
+	const		int			height,					// height in pixels
+	const		float		h,						// strength of denoising
+	const		int			sample_expand,			// factor to expand sample radius
+	constant	float		*g_gaussian,			// 49 weights of guassian kernel followed by 7 weights of its 1-dimensional equivalent
+	const		int			linear,					// process plane in linear space instead of gamma space
+	const		int			correction,				// apply a post-filtering correction
+	const		int			target_min,				// target pixel is weighted using minimum weight of samples, not maximum
+	const		int			balanced,				// balanced tonal range de-noising
+	write_only 	image2d_t 	destination_plane) {	// filtered result
+
+	// Performs all passes of NLMMultiFrameFourPixel and NLMFinalise for
+	// the target plane, see FusedTemporal.
+
+	__local TILE_PIXEL tile[TILE_SIDE * TILE_SIDE];
+
+	FusedTemporal(target_plane, sample_0, sample_1, sample_2, sample_3, sample_4, sample_5, sample_6, sample_7, sample_count, width, height, h, sample_expand, g_gaussian, linear, correction, target_min, balanced, destination_plane, 0, tile, 0);
+}
+
+__attribute__((reqd_work_group_size(8, 32, 1)))
+__kernel void NLMMultiFrameFusedSeparable(
+	read_only 	image2d_t 	target_plane,			// plane being filtered
+	read_only 	image2d_t 	sample_0,				// planes other than the target plane, sample_count of them
+	read_only 	image2d_t 	sample_1,
+	read_only 	image2d_t 	sample_2,
+	read_only 	image2d_t 	sample_3,
+	read_only 	image2d_t 	sample_4,
+	read_only 	image2d_t 	sample_5,
+	read_only 	image2d_t 	sample_6,
+	read_only 	image2d_t 	sample_7,
+	const		int			sample_count,			// count of sample planes, up to FUSED_SAMPLES
+	const		int			width,					// width in pixels
+	const		int			height,					// height in pixels
+	const		float		h,						// strength of denoising
+	const		int			sample_expand,			// factor to expand sample radius
+	constant	float		*g_gaussian,			// 49 weights of guassian kernel followed by 7 weights of its 1-dimensional equivalent
+	const		int			linear,					// process plane in linear space instead of gamma space
+	const		int			correction,				// apply a post-filtering correction
+	const		int			target_min,				// target pixel is weighted using minimum weight of samples, not maximum
+	const		int			balanced,				// balanced tonal range de-noising
+	write_only 	image2d_t 	destination_plane) {	// filtered result
+
+	// Performs all passes of NLMMultiFrameSeparable and NLMFinalise for
+	// the target plane, see FusedTemporal.
+
+	__local TILE_PIXEL tile[TILE_SIDE * TILE_SIDE];
+	__local float column_distance[32 * SEPARABLE_COLUMNS];
+
+	FusedTemporal(target_plane, sample_0, sample_1, sample_2, sample_3, sample_4, sample_5, sample_6, sample_7, sample_count, width, height, h, sample_expand, g_gaussian, linear, correction, target_min, balanced, destination_plane, 1, tile, column_distance);
+}
+
 __attribute__((reqd_work_group_size(8, 32, 1)))
 __kernel void NLMFinalise(
 	read_only 				image2d_t 	target_plane,			// plane being filtered
-	const		global 		float4		*intermediate_average,	// final average for 4 pixels
-	const		global 		float4		*intermediate_weight,	// final weight for 4 pixels
+	const		global 		INTERMEDIATE	*intermediate_average,	// final average for 4 pixels
+	const		global 		INTERMEDIATE	*intermediate_weight,	// final weight for 4 pixels
 	const					int			intermediate_width,		// width, in float4s, of intermediate buffers
 	const					int			linear,					// process plane in linear space instead of gamma space
 	const					int			correction,				// apply a post-filtering correction
@@ -109,13 +453,13 @@ __kernel void NLMFinalise(
 
 	int linear_address = destination.y * intermediate_width + destination.x;
 
-	float4 average = intermediate_average[linear_address];
-	float4 weight = intermediate_weight[linear_address];
+	float4 average = ReadIntermediate(intermediate_average, linear_address);
+	float4 weight = ReadIntermediate(intermediate_weight, linear_address);
 
 	float4 filtered_pixels = average / weight;
 
-	if (correction) {
-		float4 original = ReadPixel4(target_plane, destination, linear);
+	if (CORRECTION(correction)) {
+		float4 original = ReadPixel4(target_plane, destination, LINEAR(linear));
 
 		float4 difference = filtered_pixels - original;
 		float4 correction = (difference * original * original) - 
@@ -123,7 +467,7 @@ __kernel void NLMFinalise(
 
 		filtered_pixels = filtered_pixels - correction;
 	}
-	WritePixel4(filtered_pixels, destination, linear, destination_plane);
+	WritePixel4(filtered_pixels, destination, LINEAR(linear), destination_plane);
 }
 
 
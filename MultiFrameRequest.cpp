@@ -7,15 +7,23 @@
 
 #include "MultiFrameRequest.h"
 
+void MultiFrameRequest::Reset(const int &first_frame_number, const int &frame_count) {
+	first_frame_number_ = first_frame_number;
+	requested_.assign(frame_count, 0);
+	frames_.assign(frame_count, static_cast<const unsigned char*>(NULL));
+}
+int MultiFrameRequest::Index(const int &frame_number) {
+	int index = frame_number - first_frame_number_;
+	return (index >= 0 && index < static_cast<int>(frames_.size())) ? index : -1;
+}
 void MultiFrameRequest::Request(int frame_number) {
-	frames_.insert(pair<int, const unsigned char*>(frame_number, static_cast<const unsigned char*>(NULL)));
+	int index = Index(frame_number);
+	if (index >= 0) requested_[index] = 1;
 }
 bool MultiFrameRequest::GetFrameNumber(int *frame_number) {
-	map<int, const unsigned char*>::iterator find_frame;
-	
-	for (find_frame = frames_.begin(); find_frame != frames_.end(); ++find_frame) {
-		if (find_frame->second == NULL) {
-			*frame_number = find_frame->first;
+	for (size_t i = 0; i < frames_.size(); ++i) {
+		if (requested_[i] && frames_[i] == NULL) {
+			*frame_number = first_frame_number_ + static_cast<int>(i);
 			return true;
 		}
 	}
@@ -23,8 +31,10 @@ bool MultiFrameRequest::GetFrameNumber(int *frame_number) {
 	return false;
 }
 void MultiFrameRequest::Supply(int frame_number, const unsigned char* host_pointer) {
-	frames_[frame_number] = host_pointer;
+	int index = Index(frame_number);
+	if (index >= 0) frames_[index] = host_pointer;
 }
 const unsigned char* MultiFrameRequest::Retrieve(int frame_number) {
-	return frames_[frame_number];
+	int index = Index(frame_number);
+	return (index >= 0) ? frames_[index] : NULL;
 }
@@ -8,20 +8,31 @@
 #ifndef MULTI_FRAME_REQUEST_H_
 #define MULTI_FRAME_REQUEST_H_
 
-#include <map>
+#include <vector>
 using namespace std;
 
 // MultiFrameRequest
 // Holds requests for the frames that are required in multi-frame processing.
 // Luma and chroma processing can each independently request a set of frames
 // that Avisynth should provide.
+//
+// A request object is reused for every target frame, keeping its storage,
+// so that the requests of each target do not allocate.
 class MultiFrameRequest
 {
 public:
 
-	MultiFrameRequest() {}
+	MultiFrameRequest() : first_frame_number_(0) {}
 	~MultiFrameRequest() {}
 
+	// Reset
+	// Clear all requests and pointers before the requests for a target
+	// frame are made. Only frame numbers from first_frame_number, for
+	// frame_count frames, can be requested.
+	void Reset(
+		const int				&first_frame_number,
+		const int				&frame_count);
+
 	// Request
 	// Add a request for the specified frame number.
 	void Request(int frame_number);
@@ -46,7 +57,13 @@ public:
 
 private:
 
-	map<int, const unsigned char*>	frames_;
+	// Index
+	// Position of the frame number in the arrays, or -1 if outside them.
+	int Index(const int &frame_number);
+
+	int first_frame_number_					;	// frame number held by the first element of the arrays
+	vector<int> requested_					;	// 1 for each frame that is requested, otherwise 0
+	vector<const unsigned char*> frames_	;	// pointer supplied for each frame, NULL until supplied
 };
 
 #endif // MULTI_FRAME_REQUEST_H_
\ No newline at end of file
@@ -0,0 +1,462 @@
+/* Deathray - An Avisynth plug-in filter for spatial/temporal non-local means de-noising.
+ *
+ * version 1.04
+ *
+ * Copyright 2013, Jawed Ashraf - Deathray@cupidity.f9.co.uk
+ */
+
+#include <math.h>
+#include <algorithm>
+#include "NLMHost.h"
+#include "nlm_algorithm.h"
+
+using namespace std;
+
+#define USE_SRGB_GAMMA_CURVE 1
+
+float GammaDecode(const float &x) {
+#if USE_SRGB_GAMMA_CURVE
+	if (x <= 0.081f) return x/4.5f;
+	return powf(((x + 0.099f)/1.099f), 2.22222222f);
+#else
+	return powf(x, 2.22222222f);
+#endif
+}
+
+float GammaEncode(const float &x) {
+#if USE_SRGB_GAMMA_CURVE
+	if (x <= 0.018f) return 4.5f * x;
+	return 1.099f * powf(x, 0.45f) - 0.099f;
+#else
+	return powf(x, 0.45f);
+#endif
+}
+
+void ReadPlaneHost(
+	const	unsigned char	*source,
+	const	int				&width,
+	const	int				&height,
+	const	int				&pitch,
+	const	int				&linear,
+			float			*plane) {
+
+	// Every 8-bit value maps to a single float, so the conversion
+	// is a table lookup
+	float normalised[256];
+	for (int i = 0; i < 256; ++i) {
+		normalised[i] = static_cast<float>(i) / 255.f;
+		if (linear) normalised[i] = GammaDecode(normalised[i]);
+	}
+
+	for (int y = 0; y < height; ++y) {
+		const unsigned char *row = source + y * pitch;
+		float *plane_row = plane + y * width;
+		for (int x = 0; x < width; ++x)
+			plane_row[x] = normalised[row[x]];
+	}
+}
+
+unsigned char WritePixelHost(
+	const	float	&pixel,
+	const	int		&linear) {
+
+	float write_pixel = linear ? GammaEncode(pixel) : pixel;
+	float scaled = write_pixel * 255.f;
+
+	if (!(scaled > 0.f)) return 0;
+	if (scaled >= 255.f) return 255;
+	return static_cast<unsigned char>(scaled + 0.5f);
+}
+
+// Mirror
+// Reflects a coordinate that lies outside the plane about the
+// first or last pixel, as the device does when filling the apron.
+static int Mirror(int x, const int &extent) {
+	if (x < 0) x = -x;
+	if (x > extent - 1) x = 2 * (extent - 1) - x;
+	return min(max(x, 0), extent - 1);
+}
+
+void FetchAndMirror48x48Host(
+	const	float	*plane,
+	const	int		&width,
+	const	int		&height,
+	const	int		&tile_left,
+	const	int		&tile_top,
+			float	*tile) {
+
+	int columns[k_host_tile_side];
+	for (int x = 0; x < k_host_tile_side; ++x)
+		columns[x] = Mirror(tile_left - k_host_apron + x, width);
+
+	for (int y = 0; y < k_host_tile_side; ++y) {
+		const float *plane_row = plane + Mirror(tile_top - k_host_apron + y, height) * width;
+		float *tile_row = tile + y * k_host_tile_side;
+		for (int x = 0; x < k_host_tile_side; ++x)
+			tile_row[x] = plane_row[columns[x]];
+	}
+}
+
+void Filter4Host(
+	const	int		&target_x,
+	const	int		&target_y,
+	const	float	&h,
+	const	int		&sample_expand,
+	const	float	*target_tile,
+	const	float	*sample_tile,
+	const	float	*gaussian,
+	const	int		&reweight_target_pixel,
+	const	int		&target_min,
+	const	int		&balanced,
+			float	*all_samples_average,
+			float	*all_samples_weight,
+			float	*target_weight) {
+
+	// Sample windows are bounded by the tile, as on the device, so a
+	// sample_expand of 2 or more is limited by the apron.
+
+	const int kernel_radius = 3;
+	const int sample_radius = kernel_radius * sample_expand;
+
+	const int sample_start_x = max(target_x - sample_radius, 3);
+	const int sample_start_y = max(target_y - sample_radius, 3);
+	const int sample_end_x	 = min(target_x + sample_radius, 41);
+	const int sample_end_y	 = min(target_y + sample_radius, 44);
+
+	const float invert = 1.f;					// bias difference with an inversion...
+	const float factor = balanced ? 0.5f: 0.f;	// ... and range limiter, towards highlights and away from shadows
+
+	// A window of 10x7 pixels, centred upon the 4 pixels being filtered
+	float target_window[7][10];
+	for (int y = 0; y < 2 * kernel_radius + 1; ++y) {
+		const float *tile_row = target_tile + (target_y + y - kernel_radius) * k_host_tile_side + target_x - kernel_radius;
+		for (int x = 0; x < 10; ++x)
+			target_window[y][x] = tile_row[x];
+	}
+
+	// Filter4 accumulates the window's columns in pairs that share a
+	// gaussian weight: 0 and 6, 1 and 5, 2 and 4, then 3.
+	static const int column[7]	 = {0, 6, 1, 5, 2, 4, 3};
+	static const int position[7] = {0, 0, 1, 1, 2, 2, 3};
+
+	for (int sample_y = sample_start_y; sample_y <= sample_end_y; ++sample_y) {
+		for (int sample_x = sample_start_x; sample_x <= sample_end_x; ++sample_x) {
+			int gaussian_position = 0;
+			float euclidean_distance[4] = {0.f, 0.f, 0.f, 0.f};
+			for (int y = 0; y < 2 * kernel_radius + 1; ++y) {
+				const float *sample_window_row = sample_tile + (sample_y + y - kernel_radius) * k_host_tile_side + sample_x - kernel_radius;
+				for (int c = 0; c < 7; ++c) {
+					const float weight = gaussian[gaussian_position + position[c]];
+					for (int i = 0; i < 4; ++i) {
+						const float target_pixel = target_window[y][column[c] + i];
+						const float diff = (invert - factor * target_pixel) * (target_pixel - sample_window_row[column[c] + i]);
+						euclidean_distance[i] += weight * (diff * diff);
+					}
+				}
+				gaussian_position += 7;
+			}
+
+			const float *sample_centre_pixel = sample_tile + sample_y * k_host_tile_side + sample_x;
+			const bool is_target = sample_x == target_x && sample_y == target_y && reweight_target_pixel;
+			for (int i = 0; i < 4; ++i) {
+				float sample_weight = expf(-euclidean_distance[i] / h);
+
+				target_weight[i] = target_min
+								 ? min(target_weight[i], sample_weight)
+								 : max(target_weight[i], sample_weight);
+
+				sample_weight = is_target ? 0.f : sample_weight;
+
+				all_samples_weight[i] += sample_weight;
+				all_samples_average[i] += sample_weight * sample_centre_pixel[i];
+			}
+		}
+	}
+
+	const float *target_centre_pixel = sample_tile + target_y * k_host_tile_side + target_x;
+	for (int i = 0; i < 4; ++i) {
+		target_weight[i] = max(target_weight[i], 0.004f);
+		all_samples_weight[i] += reweight_target_pixel ? target_weight[i] : 0.f;
+		all_samples_average[i] += reweight_target_pixel ? target_weight[i] * target_centre_pixel[i] : 0.f;
+	}
+}
+
+void FilterTileIntegralHost(
+	const	float	&h,
+	const	int		&sample_expand,
+	const	float	*target_tile,
+	const	float	*sample_tile,
+	const	int		&reweight_target_pixel,
+	const	int		&target_min,
+	const	int		&balanced,
+			float	*all_samples_average,
+			float	*all_samples_weight,
+			float	*target_weight) {
+
+	// Port of FilterIntegral in nlm.cl. The region of the tile covered by
+	// the windows of the 32x32 target pixels is 38x38, starting at (5,5).
+
+	const int kernel_radius = 3;
+	const int sample_radius = kernel_radius * sample_expand;
+	const int region		= 38;
+	const int origin		= 5;
+	const int side			= region + 1;
+
+	const int offset_start_x = max(-sample_radius, 3 - 36);
+	const int offset_start_y = max(-sample_radius, 3 - 39);
+	const int offset_end_x	 = min(sample_radius, 41 - 8);
+	const int offset_end_y	 = min(sample_radius, 44 - 8);
+
+	const float invert = 1.f;					// bias difference with an inversion...
+	const float factor = balanced ? 0.5f: 0.f;	// ... and range limiter, towards highlights and away from shadows
+
+	float inversion[region * region];
+	for (int y = 0; y < region; ++y) {
+		for (int x = 0; x < region; ++x) {
+			const float target_pixel = target_tile[(y + origin) * k_host_tile_side + x + origin];
+			inversion[y * region + x] = invert - factor * target_pixel;
+		}
+	}
+
+	float integral[side * side];
+	for (int i = 0; i < side; ++i) {
+		integral[i] = 0.f;
+		integral[i * side] = 0.f;
+	}
+
+	for (int offset_y = offset_start_y; offset_y <= offset_end_y; ++offset_y) {
+		for (int offset_x = offset_start_x; offset_x <= offset_end_x; ++offset_x) {
+			for (int y = 0; y < region; ++y) {
+				const int sample_y = min(max(y + origin + offset_y, 0), k_host_tile_side - 1);
+				const float *target_row = target_tile + (y + origin) * k_host_tile_side + origin;
+				const float *sample_row = sample_tile + sample_y * k_host_tile_side;
+				float *integral_row = integral + (y + 1) * side + 1;
+				for (int x = 0; x < region; ++x) {
+					const int sample_x = min(max(x + origin + offset_x, 0), k_host_tile_side - 1);
+					const float diff = inversion[y * region + x] * (target_row[x] - sample_row[sample_x]);
+					integral_row[x] = diff * diff;
+				}
+			}
+
+			for (int y = 1; y < side; ++y) {
+				float sum = 0.f;
+				for (int x = 1; x < side; ++x) {
+					sum += integral[y * side + x];
+					integral[y * side + x] = sum;
+				}
+			}
+			for (int x = 1; x < side; ++x) {
+				float sum = 0.f;
+				for (int y = 1; y < side; ++y) {
+					sum += integral[y * side + x];
+					integral[y * side + x] = sum;
+				}
+			}
+
+			for (int y = 0; y < k_host_tile_size; ++y) {
+				const int target_y = y + k_host_apron;
+				const int sample_y = target_y + offset_y;
+				if (sample_y < max(target_y - sample_radius, 3) || sample_y > min(target_y + sample_radius, 44)) continue;
+
+				const int window_top	= (target_y - kernel_radius - origin) * side;
+				const int window_bottom = window_top + (2 * kernel_radius + 1) * side;
+
+				for (int x = 0; x < k_host_tile_size; ++x) {
+					// Bounds are those of the strip of 4 pixels that this pixel belongs to
+					const int strip_x	= (x & ~3) + k_host_apron;
+					const int target_x	= x + k_host_apron;
+					if (strip_x + offset_x < max(strip_x - sample_radius, 3) || strip_x + offset_x > min(strip_x + sample_radius, 41)) continue;
+
+					const int window_left	= target_x - kernel_radius - origin;
+					const int window_right	= window_left + 2 * kernel_radius + 1;
+					const float euclidean_distance = integral[window_bottom + window_right]
+												   - integral[window_top + window_right]
+												   - integral[window_bottom + window_left]
+												   + integral[window_top + window_left];
+
+					float sample_weight = expf(-euclidean_distance / (49.f * h));
+
+					const int pixel = y * k_host_tile_size + x;
+					target_weight[pixel] = target_min
+										 ? min(target_weight[pixel], sample_weight)
+										 : max(target_weight[pixel], sample_weight);
+
+					sample_weight = (offset_x == 0 && offset_y == 0 && reweight_target_pixel) ? 0.f : sample_weight;
+
+					all_samples_weight[pixel] += sample_weight;
+					all_samples_average[pixel] += sample_weight * sample_tile[sample_y * k_host_tile_side + target_x + offset_x];
+				}
+			}
+		}
+	}
+
+	for (int y = 0; y < k_host_tile_size; ++y) {
+		for (int x = 0; x < k_host_tile_size; ++x) {
+			const int pixel = y * k_host_tile_size + x;
+			target_weight[pixel] = max(target_weight[pixel], 0.004f);
+			all_samples_weight[pixel] += reweight_target_pixel ? target_weight[pixel] : 0.f;
+			all_samples_average[pixel] += reweight_target_pixel 
+										? target_weight[pixel] * sample_tile[(y + k_host_apron) * k_host_tile_side + x + k_host_apron] 
+										: 0.f;
+		}
+	}
+}
+
+void FilterTileSeparableHost(
+	const	float	&h,
+	const	int		&sample_expand,
+	const	float	*target_tile,
+	const	float	*sample_tile,
+	const	float	*gaussian,
+	const	int		&reweight_target_pixel,
+	const	int		&target_min,
+	const	int		&balanced,
+			float	*all_samples_average,
+			float	*all_samples_weight,
+			float	*target_weight) {
+
+	// Port of FilterSeparable in nlm.cl. The columns of the tile covered by
+	// the windows of the 32x32 target pixels are 5 to 42.
+
+	const int kernel_radius = 3;
+	const int sample_radius = kernel_radius * sample_expand;
+	const int columns		= 38;
+	const int origin		= 5;
+
+	const int offset_start_x = max(-sample_radius, 3 - 36);
+	const int offset_start_y = max(-sample_radius, 3 - 39);
+	const int offset_end_x	 = min(sample_radius, 41 - 8);
+	const int offset_end_y	 = min(sample_radius, 44 - 8);
+
+	const float *weight = gaussian + 49;
+
+	const float invert = 1.f;					// bias difference with an inversion...
+	const float factor = balanced ? 0.5f: 0.f;	// ... and range limiter, towards highlights and away from shadows
+
+	float column_distance[k_host_tile_size * columns];
+
+	for (int offset_y = offset_start_y; offset_y <= offset_end_y; ++offset_y) {
+		for (int offset_x = offset_start_x; offset_x <= offset_end_x; ++offset_x) {
+			for (int y = 0; y < k_host_tile_size; ++y) {
+				const int target_y = y + k_host_apron;
+				const int sample_y = target_y + offset_y;
+				if (sample_y < max(target_y - sample_radius, 3) || sample_y > min(target_y + sample_radius, 44)) continue;
+
+				float *distance_row = column_distance + y * columns;
+				for (int x = 0; x < columns; ++x)
+					distance_row[x] = 0.f;
+
+				for (int row = 0; row < 2 * kernel_radius + 1; ++row) {
+					const float *target_row = target_tile + (target_y - kernel_radius + row) * k_host_tile_side + origin;
+					const float *sample_row = sample_tile + (sample_y - kernel_radius + row) * k_host_tile_side;
+					for (int x = 0; x < columns; ++x) {
+						const int sample_x = min(max(x + origin + offset_x, 0), k_host_tile_side - 1);
+						const float diff = (invert - factor * target_row[x]) * (target_row[x] - sample_row[sample_x]);
+						distance_row[x] += weight[row] * (diff * diff);
+					}
+				}
+			}
+
+			for (int y = 0; y < k_host_tile_size; ++y) {
+				const int target_y = y + k_host_apron;
+				const int sample_y = target_y + offset_y;
+				if (sample_y < max(target_y - sample_radius, 3) || sample_y > min(target_y + sample_radius, 44)) continue;
+
+				for (int x = 0; x < k_host_tile_size; ++x) {
+					// Bounds are those of the strip of 4 pixels that this pixel belongs to
+					const int strip_x	= (x & ~3) + k_host_apron;
+					const int target_x	= x + k_host_apron;
+					if (strip_x + offset_x < max(strip_x - sample_radius, 3) || strip_x + offset_x > min(strip_x + sample_radius, 41)) continue;
+
+					const float *window = column_distance + y * columns + target_x - kernel_radius - origin;
+					float euclidean_distance = 0.f;
+					for (int i = 0; i < 2 * kernel_radius + 1; ++i)
+						euclidean_distance += weight[i] * window[i];
+
+					float sample_weight = expf(-euclidean_distance / h);
+
+					const int pixel = y * k_host_tile_size + x;
+					target_weight[pixel] = target_min
+										 ? min(target_weight[pixel], sample_weight)
+										 : max(target_weight[pixel], sample_weight);
+
+					sample_weight = (offset_x == 0 && offset_y == 0 && reweight_target_pixel) ? 0.f : sample_weight;
+
+					all_samples_weight[pixel] += sample_weight;
+					all_samples_average[pixel] += sample_weight * sample_tile[sample_y * k_host_tile_side + target_x + offset_x];
+				}
+			}
+		}
+	}
+
+	for (int y = 0; y < k_host_tile_size; ++y) {
+		for (int x = 0; x < k_host_tile_size; ++x) {
+			const int pixel = y * k_host_tile_size + x;
+			target_weight[pixel] = max(target_weight[pixel], 0.004f);
+			all_samples_weight[pixel] += reweight_target_pixel ? target_weight[pixel] : 0.f;
+			all_samples_average[pixel] += reweight_target_pixel 
+										? target_weight[pixel] * sample_tile[(y + k_host_apron) * k_host_tile_side + x + k_host_apron] 
+										: 0.f;
+		}
+	}
+}
+
+void FilterTileHost(
+	const	int				&algorithm,
+	const	filter_strip	&filter,
+	const	int				&strip_width,
+	const	int				&rows,
+	const	int				&columns,
+	const	float			&h,
+	const	int				&sample_expand,
+	const	float			*target_tile,
+	const	float			*sample_tile,
+	const	float			*gaussian,
+	const	int				&reweight_target_pixel,
+	const	int				&target_min,
+	const	int				&balanced,
+			float			*all_samples_average,
+			float			*all_samples_weight,
+			float			*target_weight) {
+
+	if (algorithm == NLM_INTEGRAL) {
+		FilterTileIntegralHost(h, sample_expand, target_tile, sample_tile, reweight_target_pixel, target_min, balanced, 
+							   all_samples_average, all_samples_weight, target_weight);
+		return;
+	}
+	if (algorithm == NLM_SEPARABLE) {
+		FilterTileSeparableHost(h, sample_expand, target_tile, sample_tile, gaussian, reweight_target_pixel, target_min, balanced, 
+								all_samples_average, all_samples_weight, target_weight);
+		return;
+	}
+
+	// Inside the tile the top-left corner of the filtered region is at (8,8)
+	for (int y = 0; y < rows; ++y) {
+		for (int x = 0; x < columns; x += strip_width) {
+			const int strip = y * k_host_tile_size + x;
+			filter(x + k_host_apron, y + k_host_apron, h, sample_expand, target_tile, sample_tile, gaussian, reweight_target_pixel, 
+				   target_min, balanced, all_samples_average + strip, all_samples_weight + strip, target_weight + strip);
+		}
+	}
+}
+
+void FinaliseHost(
+	const	float			*average,
+	const	float			*weight,
+	const	float			*original,
+	const	int				&count,
+	const	int				&linear,
+	const	int				&correction,
+			unsigned char	*destination) {
+
+	for (int i = 0; i < count; ++i) {
+		float filtered_pixel = average[i] / weight[i];
+
+		if (correction) {
+			const float difference = filtered_pixel - original[i];
+			filtered_pixel -= (difference * original[i] * original[i]) -
+							  ((difference * original[i]) * (difference * original[i]));
+		}
+		destination[i] = WritePixelHost(filtered_pixel, linear);
+	}
+}
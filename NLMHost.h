@@ -0,0 +1,207 @@
+/* Deathray - An Avisynth plug-in filter for spatial/temporal non-local means de-noising.
+ *
+ * version 1.04
+ *
+ * Copyright 2013, Jawed Ashraf - Deathray@cupidity.f9.co.uk
+ */
+
+#ifndef _NLM_HOST_H_
+#define _NLM_HOST_H_
+
+// Host implementation of the NLM kernels in Util.cl and nlm.cl, used by the
+// CPU engine when no OpenCL device is available.
+//
+// Planes are held as normalised floats, 0.f to 1.f, the same as the device
+// sees when reading a UNORM8 image. Tiles are 32x32 pixels with an apron
+// of 8 pixels, i.e. 48x48, exactly as on the device.
+
+static const int k_host_tile_size	= 32;	// pixels filtered per tile, horizontally and vertically
+static const int k_host_apron		= 8;	// pixels bordering the tile on all four sides
+static const int k_host_tile_side	= 48;	// side of tile including apron
+static const int k_host_max_strip	= 16;	// widest horizontal strip of target pixels filtered at once
+static const int k_host_tile_padding= 16;	// floats either side of a tile, read by the masked lanes of SIMD strips
+static const int k_host_tile_storage= k_host_tile_side * k_host_tile_side + 2 * k_host_tile_padding;
+
+// host_simd
+// Instruction set extensions used by the host implementation of Filter4.
+enum host_simd {
+	HOST_SIMD_NONE,		// scalar, Filter4Host
+	HOST_SIMD_SSE41,	// 4 pixels per instruction
+	HOST_SIMD_AVX2,		// 8 pixels per instruction
+	HOST_SIMD_AVX512	// 16 pixels per instruction
+};
+
+// filter_strip
+// Signature shared by Filter4Host and its SIMD equivalents, each of
+// which filters a horizontal strip of target pixels.
+typedef void (*filter_strip)(
+	const	int		&target_x,
+	const	int		&target_y,
+	const	float	&h,
+	const	int		&sample_expand,
+	const	float	*target_tile,
+	const	float	*sample_tile,
+	const	float	*gaussian,
+	const	int		&reweight_target_pixel,
+	const	int		&target_min,
+	const	int		&balanced,
+			float	*all_samples_average,
+			float	*all_samples_weight,
+			float	*target_weight);
+
+// GammaDecode
+// Converts input from gamma space into linear space.
+float GammaDecode(const float &x);
+
+// GammaEncode
+// Converts input from linear space into gamma space.
+float GammaEncode(const float &x);
+
+// ReadPlaneHost
+// Converts a plane of 8-bit pixels into normalised floats, optionally
+// into linear space. The float plane has a pitch equal to width.
+void ReadPlaneHost(
+	const	unsigned char	*source,	// host plane
+	const	int				&width,		// width in pixels
+	const	int				&height,	// height in pixels
+	const	int				&pitch,		// size in bytes of each row of source
+	const	int				&linear,	// convert into linear space
+			float			*plane);	// width x height floats
+
+// WritePixelHost
+// Converts a normalised float, optionally in linear space, into an 8-bit
+// pixel, saturating and rounding as the device does for a UNORM8 image.
+unsigned char WritePixelHost(
+	const	float	&pixel,
+	const	int		&linear);
+
+// FetchAndMirror48x48Host
+// Populates a 48x48 tile from the plane. The tile is the 32x32 region
+// to be filtered plus an apron of 8 pixels on all four sides. At the
+// frame edges the apron is mirrored from just inside the frame.
+void FetchAndMirror48x48Host(
+	const	float	*plane,			// normalised plane, pitch equal to width
+	const	int		&width,			// width in pixels
+	const	int		&height,		// height in pixels
+	const	int		&tile_left,		// plane coordinates of the top-left pixel ...
+	const	int		&tile_top,		// ... of the 32x32 region to be filtered
+			float	*tile);			// 48x48 floats
+
+// Filter4Host
+// Computes the gaussian-weighted average of a horizontal strip of 4 target
+// pixels' windows against all sample windows from the sample tile.
+//
+// This is a port of Filter4 in nlm.cl, with float4 arithmetic performed
+// per element in the same order.
+void Filter4Host(
+	const	int		&target_x,				// tile coordinates of left-hand pixel ...
+	const	int		&target_y,				// ... of 4 pixels in a horizontal strip
+	const	float	&h,						// strength of denoising
+	const	int		&sample_expand,			// factor to expand sample radius
+	const	float	*target_tile,			// 48x48 tile containing the target pixels' windows
+	const	float	*sample_tile,			// 48x48 tile from which samples are taken
+	const	float	*gaussian,				// 49 weights of gaussian kernel
+	const	int		&reweight_target_pixel,	// when target plane is the sampling plane, the target pixel is reweighted
+	const	int		&target_min,			// target pixel is weighted using minimum weight of samples, not maximum
+	const	int		&balanced,				// balanced tonal range de-noising
+			float	*all_samples_average,	// running sum of weighted pixel values, 4 floats
+			float	*all_samples_weight,	// running sum of weights, 4 floats
+			float	*target_weight);		// weight chosen from across all sample planes, 4 floats
+
+// FilterTileIntegralHost
+// Computes the box-weighted average of all 32x32 target pixels' windows
+// against all sample windows from the sample tile, reading window
+// distances from an integral image of squared differences built for each
+// sample offset.
+//
+// This is a port of FilterIntegral in nlm.cl.
+void FilterTileIntegralHost(
+	const	float	&h,						// strength of denoising
+	const	int		&sample_expand,			// factor to expand sample radius
+	const	float	*target_tile,			// 48x48 tile containing the target pixels' windows
+	const	float	*sample_tile,			// 48x48 tile from which samples are taken
+	const	int		&reweight_target_pixel,	// when target plane is the sampling plane, the target pixel is reweighted
+	const	int		&target_min,			// target pixel is weighted using minimum weight of samples, not maximum
+	const	int		&balanced,				// balanced tonal range de-noising
+			float	*all_samples_average,	// running sum of weighted pixel values, 32x32 floats
+			float	*all_samples_weight,	// running sum of weights, 32x32 floats
+			float	*target_weight);		// weight chosen from across all sample planes, 32x32 floats
+
+// FilterTileSeparableHost
+// Computes the gaussian-weighted average of all 32x32 target pixels' windows
+// against all sample windows from the sample tile. For each sample offset
+// the distance of each column of 7 pixels is weighted vertically, then each
+// window's distance is the horizontally weighted sum of 7 column distances.
+//
+// This is a port of FilterSeparable in nlm.cl.
+void FilterTileSeparableHost(
+	const	float	&h,						// strength of denoising
+	const	int		&sample_expand,			// factor to expand sample radius
+	const	float	*target_tile,			// 48x48 tile containing the target pixels' windows
+	const	float	*sample_tile,			// 48x48 tile from which samples are taken
+	const	float	*gaussian,				// 49 weights of gaussian kernel, then 7 weights of its 1-dimensional equivalent
+	const	int		&reweight_target_pixel,	// when target plane is the sampling plane, the target pixel is reweighted
+	const	int		&target_min,			// target pixel is weighted using minimum weight of samples, not maximum
+	const	int		&balanced,				// balanced tonal range de-noising
+			float	*all_samples_average,	// running sum of weighted pixel values, 32x32 floats
+			float	*all_samples_weight,	// running sum of weights, 32x32 floats
+			float	*target_weight);		// weight chosen from across all sample planes, 32x32 floats
+
+// FilterTileHost
+// Accumulates samples from the sample tile for the rows x columns target
+// pixels at the top-left of the 32x32 tile, using filter on strips of
+// strip_width pixels or, for NLM_INTEGRAL and NLM_SEPARABLE, 
+// FilterTileIntegralHost and FilterTileSeparableHost.
+void FilterTileHost(
+	const	int				&algorithm,				// nlm_algorithm
+	const	filter_strip	&filter,				// Filter4Host or a SIMD equivalent
+	const	int				&strip_width,			// count of pixels filtered by each call to filter
+	const	int				&rows,					// count of rows of target pixels in the tile
+	const	int				&columns,				// count of columns of target pixels in the tile
+	const	float			&h,						// strength of denoising
+	const	int				&sample_expand,			// factor to expand sample radius
+	const	float			*target_tile,			// 48x48 tile containing the target pixels' windows
+	const	float			*sample_tile,			// 48x48 tile from which samples are taken
+	const	float			*gaussian,				// 49 weights of gaussian kernel, then 7 weights of its 1-dimensional equivalent
+	const	int				&reweight_target_pixel,	// when target plane is the sampling plane, the target pixel is reweighted
+	const	int				&target_min,			// target pixel is weighted using minimum weight of samples, not maximum
+	const	int				&balanced,				// balanced tonal range de-noising
+			float			*all_samples_average,	// running sum of weighted pixel values, 32x32 floats
+			float			*all_samples_weight,	// running sum of weights, 32x32 floats
+			float			*target_weight);		// weight chosen from across all sample planes, 32x32 floats
+
+// DetectHostSIMD
+// Queries the CPU and operating system for the widest instruction set
+// extension that can be used.
+host_simd DetectHostSIMD();
+
+// SelectFilterStrip
+// Returns the strip filter for the instruction set extension and the
+// count of pixels in each strip that it filters.
+//
+// Each SIMD strip filter computes exactly the same result as calling
+// Filter4Host on each group of 4 pixels in its strip: per-pixel arithmetic
+// is performed in the same order, without fused multiply-add, and exp()
+// is computed per pixel with the C library. Filter4Host is therefore the
+// reference for bit-exactness.
+//
+// The SIMD strip filters read up to 12 floats beyond either end of the
+// tiles, so tiles must be allocated with k_host_tile_padding finite floats
+// before and after them.
+filter_strip SelectFilterStrip(
+	const	host_simd	&simd,
+			int			*strip_width);
+
+// FinaliseHost
+// Computes filtered pixels from average and weight, applies the optional
+// correction and writes the pixels as 8-bit.
+void FinaliseHost(
+	const	float			*average,		// weighted sum per pixel
+	const	float			*weight,		// sum of weights per pixel
+	const	float			*original,		// unfiltered pixels, normalised
+	const	int				&count,			// count of pixels
+	const	int				&linear,		// pixels are in linear space
+	const	int				&correction,	// apply a post-filtering correction
+			unsigned char	*destination);	// 8-bit pixels
+
+#endif // _NLM_HOST_H_
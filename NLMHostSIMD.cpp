@@ -0,0 +1,256 @@
+/* Deathray - An Avisynth plug-in filter for spatial/temporal non-local means de-noising.
+ *
+ * version 1.04
+ *
+ * Copyright 2013, Jawed Ashraf - Deathray@cupidity.f9.co.uk
+ */
+
+#include <math.h>
+#include <intrin.h>
+#include <immintrin.h>
+#include <algorithm>
+#include "NLMHost.h"
+
+using namespace std;
+
+// AVX-512 intrinsics are only available from Visual Studio 2017
+#if defined(_MSC_VER) && _MSC_VER >= 1911
+#define NLM_HOST_AVX512 1
+#else
+#define NLM_HOST_AVX512 0
+#endif
+
+// Each of the following describes a SIMD register of floats, as used by
+// FilterStrip. mask is the result of a comparison per lane.
+
+struct sse41 {
+	typedef __m128 vec;
+	typedef __m128 mask;
+	static const int width = 4;
+
+	static inline vec zero()										{ return _mm_setzero_ps(); }
+	static inline vec set1(const float &x)							{ return _mm_set1_ps(x); }
+	static inline vec load(const float *p)							{ return _mm_loadu_ps(p); }
+	static inline void store(float *p, const vec &a)				{ _mm_storeu_ps(p, a); }
+	static inline vec add(const vec &a, const vec &b)				{ return _mm_add_ps(a, b); }
+	static inline vec sub(const vec &a, const vec &b)				{ return _mm_sub_ps(a, b); }
+	static inline vec mul(const vec &a, const vec &b)				{ return _mm_mul_ps(a, b); }
+	static inline vec minimum(const vec &a, const vec &b)			{ return _mm_min_ps(a, b); }
+	static inline vec maximum(const vec &a, const vec &b)			{ return _mm_max_ps(a, b); }
+	static inline mask in_range(const vec &x, const vec &lo, const vec &hi) {
+		return _mm_and_ps(_mm_cmpge_ps(x, lo), _mm_cmple_ps(x, hi));
+	}
+	static inline vec select(const vec &a, const vec &b, const mask &m)	{ return _mm_blendv_ps(a, b, m); }
+	static inline vec zero_unless(const vec &a, const mask &m)		{ return _mm_and_ps(a, m); }
+	static inline void finish() {}
+};
+
+struct avx2 {
+	typedef __m256 vec;
+	typedef __m256 mask;
+	static const int width = 8;
+
+	static inline vec zero()										{ return _mm256_setzero_ps(); }
+	static inline vec set1(const float &x)							{ return _mm256_set1_ps(x); }
+	static inline vec load(const float *p)							{ return _mm256_loadu_ps(p); }
+	static inline void store(float *p, const vec &a)				{ _mm256_storeu_ps(p, a); }
+	static inline vec add(const vec &a, const vec &b)				{ return _mm256_add_ps(a, b); }
+	static inline vec sub(const vec &a, const vec &b)				{ return _mm256_sub_ps(a, b); }
+	static inline vec mul(const vec &a, const vec &b)				{ return _mm256_mul_ps(a, b); }
+	static inline vec minimum(const vec &a, const vec &b)			{ return _mm256_min_ps(a, b); }
+	static inline vec maximum(const vec &a, const vec &b)			{ return _mm256_max_ps(a, b); }
+	static inline mask in_range(const vec &x, const vec &lo, const vec &hi) {
+		return _mm256_and_ps(_mm256_cmp_ps(x, lo, _CMP_GE_OQ), _mm256_cmp_ps(x, hi, _CMP_LE_OQ));
+	}
+	static inline vec select(const vec &a, const vec &b, const mask &m)	{ return _mm256_blendv_ps(a, b, m); }
+	static inline vec zero_unless(const vec &a, const mask &m)		{ return _mm256_and_ps(a, m); }
+	static inline void finish()										{ _mm256_zeroupper(); }
+};
+
+#if NLM_HOST_AVX512
+struct avx512 {
+	typedef __m512 vec;
+	typedef __mmask16 mask;
+	static const int width = 16;
+
+	static inline vec zero()										{ return _mm512_setzero_ps(); }
+	static inline vec set1(const float &x)							{ return _mm512_set1_ps(x); }
+	static inline vec load(const float *p)							{ return _mm512_loadu_ps(p); }
+	static inline void store(float *p, const vec &a)				{ _mm512_storeu_ps(p, a); }
+	static inline vec add(const vec &a, const vec &b)				{ return _mm512_add_ps(a, b); }
+	static inline vec sub(const vec &a, const vec &b)				{ return _mm512_sub_ps(a, b); }
+	static inline vec mul(const vec &a, const vec &b)				{ return _mm512_mul_ps(a, b); }
+	static inline vec minimum(const vec &a, const vec &b)			{ return _mm512_min_ps(a, b); }
+	static inline vec maximum(const vec &a, const vec &b)			{ return _mm512_max_ps(a, b); }
+	static inline mask in_range(const vec &x, const vec &lo, const vec &hi) {
+		return _mm512_cmp_ps_mask(x, lo, _CMP_GE_OQ) & _mm512_cmp_ps_mask(x, hi, _CMP_LE_OQ);
+	}
+	static inline vec select(const vec &a, const vec &b, const mask &m)	{ return _mm512_mask_blend_ps(m, a, b); }
+	static inline vec zero_unless(const vec &a, const mask &m)		{ return _mm512_maskz_mov_ps(m, a); }
+	static inline void finish()										{ _mm256_zeroupper(); }
+};
+#endif
+
+// FilterStrip
+// Filter4Host for a strip of simd::width pixels, i.e. simd::width / 4
+// groups of 4 pixels.
+//
+// Each group has the sample bounds that Filter4 computes for its left-hand
+// pixel, so the strip iterates over the union of the groups' sample offsets
+// and each lane is masked to its group's bounds. Masked lanes read pixels
+// from neighbouring rows or the tile's padding, which are then discarded.
+template <typename simd>
+void FilterStrip(
+	const	int		&target_x,
+	const	int		&target_y,
+	const	float	&h,
+	const	int		&sample_expand,
+	const	float	*target_tile,
+	const	float	*sample_tile,
+	const	float	*gaussian,
+	const	int		&reweight_target_pixel,
+	const	int		&target_min,
+	const	int		&balanced,
+			float	*all_samples_average,
+			float	*all_samples_weight,
+			float	*target_weight) {
+
+	typedef typename simd::vec vec;
+	typedef typename simd::mask mask;
+
+	const int kernel_radius = 3;
+	const int sample_radius = kernel_radius * sample_expand;
+
+	float lane_start[k_host_max_strip];
+	float lane_end[k_host_max_strip];
+	for (int i = 0; i < simd::width; ++i) {
+		const int group_x = target_x + (i & ~3);
+		lane_start[i]	= static_cast<float>(max(group_x - sample_radius, 3) - group_x);
+		lane_end[i]		= static_cast<float>(min(group_x + sample_radius, 41) - group_x);
+	}
+	const vec offset_start	= simd::load(lane_start);
+	const vec offset_end	= simd::load(lane_end);
+
+	const int offset_start_x = max(-sample_radius, 3 - (target_x + simd::width - 4));
+	const int offset_end_x	 = min(sample_radius, 41 - target_x);
+	const int sample_start_y = max(target_y - sample_radius, 3);
+	const int sample_end_y	 = min(target_y + sample_radius, 44);
+
+	const float invert = 1.f;					// bias difference with an inversion...
+	const float factor = balanced ? 0.5f: 0.f;	// ... and range limiter, towards highlights and away from shadows
+
+	static const int column[7]	 = {0, 6, 1, 5, 2, 4, 3};
+	static const int position[7] = {0, 0, 1, 1, 2, 2, 3};
+
+	// The target pixels' windows, their inversions and the gaussian weights
+	// are the same for every sample
+	vec target_pixel[49];
+	vec inversion[49];
+	vec weight[49];
+	int window_offset[49];
+	for (int y = 0, k = 0; y < 2 * kernel_radius + 1; ++y) {
+		for (int c = 0; c < 7; ++c, ++k) {
+			window_offset[k]	= (y - kernel_radius) * k_host_tile_side - kernel_radius + column[c];
+			target_pixel[k]		= simd::load(target_tile + target_y * k_host_tile_side + target_x + window_offset[k]);
+			inversion[k]		= simd::sub(simd::set1(invert), simd::mul(simd::set1(factor), target_pixel[k]));
+			weight[k]			= simd::set1(gaussian[7 * y + position[c]]);
+		}
+	}
+
+	vec average			= simd::load(all_samples_average);
+	vec total_weight	= simd::load(all_samples_weight);
+	vec chosen_weight	= simd::load(target_weight);
+
+	float distance[k_host_max_strip];
+	float sample_weight[k_host_max_strip];
+
+	for (int sample_y = sample_start_y; sample_y <= sample_end_y; ++sample_y) {
+		for (int offset_x = offset_start_x; offset_x <= offset_end_x; ++offset_x) {
+			const float *sample_centre_pixel = sample_tile + sample_y * k_host_tile_side + target_x + offset_x;
+
+			vec euclidean_distance = simd::zero();
+			for (int k = 0; k < 49; ++k) {
+				const vec diff = simd::mul(inversion[k], simd::sub(target_pixel[k], simd::load(sample_centre_pixel + window_offset[k])));
+				euclidean_distance = simd::add(euclidean_distance, simd::mul(weight[k], simd::mul(diff, diff)));
+			}
+
+			simd::store(distance, euclidean_distance);
+			for (int i = 0; i < simd::width; ++i)
+				sample_weight[i] = expf(-distance[i] / h);
+
+			const mask in_bounds = simd::in_range(simd::set1(static_cast<float>(offset_x)), offset_start, offset_end);
+			const vec weights = simd::load(sample_weight);
+
+			chosen_weight = simd::select(chosen_weight, target_min
+														? simd::minimum(chosen_weight, weights)
+														: simd::maximum(chosen_weight, weights), in_bounds);
+
+			const bool is_target = offset_x == 0 && sample_y == target_y && reweight_target_pixel;
+			if (is_target) continue;
+
+			const vec bounded_weights = simd::zero_unless(weights, in_bounds);
+			total_weight	= simd::add(total_weight, bounded_weights);
+			average			= simd::add(average, simd::mul(bounded_weights, simd::load(sample_centre_pixel)));
+		}
+	}
+
+	chosen_weight = simd::maximum(chosen_weight, simd::set1(0.004f));
+	if (reweight_target_pixel) {
+		total_weight	= simd::add(total_weight, chosen_weight);
+		average			= simd::add(average, simd::mul(chosen_weight, simd::load(sample_tile + target_y * k_host_tile_side + target_x)));
+	}
+
+	simd::store(all_samples_average, average);
+	simd::store(all_samples_weight, total_weight);
+	simd::store(target_weight, chosen_weight);
+	simd::finish();
+}
+
+host_simd DetectHostSIMD() {
+	int info[4];
+
+	__cpuid(info, 0);
+	const int highest_function = info[0];
+
+	__cpuid(info, 1);
+	const bool has_sse41	= (info[2] & (1 << 19)) != 0;
+	const bool has_osxsave	= (info[2] & (1 << 27)) != 0;
+	const bool has_avx		= (info[2] & (1 << 28)) != 0;
+
+	if (!has_sse41) return HOST_SIMD_NONE;
+	if (!has_osxsave || !has_avx || highest_function < 7) return HOST_SIMD_SSE41;
+
+	// The operating system must preserve the YMM (and ZMM) registers
+	const unsigned __int64 enabled_state = _xgetbv(0);
+	if ((enabled_state & 0x06) != 0x06) return HOST_SIMD_SSE41;
+
+	__cpuidex(info, 7, 0);
+	const bool has_avx2		= (info[1] & (1 << 5)) != 0;
+	const bool has_avx512f	= (info[1] & (1 << 16)) != 0;
+
+	if (NLM_HOST_AVX512 && has_avx512f && (enabled_state & 0xe6) == 0xe6) return HOST_SIMD_AVX512;
+	if (has_avx2) return HOST_SIMD_AVX2;
+	return HOST_SIMD_SSE41;
+}
+
+filter_strip SelectFilterStrip(
+	const	host_simd	&simd,
+			int			*strip_width) {
+
+	switch (simd) {
+#if NLM_HOST_AVX512
+		case HOST_SIMD_AVX512:
+			*strip_width = avx512::width;
+			return &FilterStrip<avx512>;
+#endif
+		case HOST_SIMD_AVX2:
+			*strip_width = avx2::width;
+			return &FilterStrip<avx2>;
+		case HOST_SIMD_SSE41:
+			*strip_width = sse41::width;
+			return &FilterStrip<sse41>;
+		default:
+			*strip_width = 4;
+			return &Filter4Host;
+	}
+}
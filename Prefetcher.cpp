@@ -0,0 +1,125 @@
+/* Deathray - An Avisynth plug-in filter for spatial/temporal non-local means de-noising.
+ *
+ * version 1.04
+ *
+ * Copyright 2013, Jawed Ashraf - Deathray@cupidity.f9.co.uk
+ */
+
+#include <algorithm>
+#include "Prefetcher.h"
+
+Prefetcher::Prefetcher() {
+	depth_			= 0;
+	frame_count_	= 0;
+	prior_target_	= -2;
+	next_queued_	= 0;
+}
+
+void Prefetcher::Init(
+	const	PClip				&child,
+	const	int					&depth,
+	const	int					&frame_count) {
+
+	lock_guard<mutex> serialise(mutex_);
+
+	if (depth_ > 0) return;
+
+	child_			= child;
+	depth_			= depth;
+	frame_count_	= frame_count;
+}
+
+void Prefetcher::Target(
+	const	int		&target,
+	const	int		&first,
+	const	int		&last) {
+
+	lock_guard<mutex> serialise(mutex_);
+
+	const bool sequential = target == prior_target_ + 1;
+	prior_target_ = target;
+
+	map<int, PVideoFrame>::iterator frame = frames_.begin();
+	while (frame != frames_.end()) {
+		if (frame->first < first || (!sequential && frame->first > last))
+			frames_.erase(frame++);
+		else
+			++frame;
+	}
+
+	if (!sequential) {
+		queue_.clear();
+		next_queued_ = last + 1;
+		return;
+	}
+
+	// Frames queued outside the window, e.g. before a seek back, would
+	// use up the depth
+	const int end = min(last + depth_, frame_count_ - 1);
+	deque<int>::iterator queued = queue_.begin();
+	while (queued != queue_.end()) {
+		if (*queued < first || *queued > end)
+			queued = queue_.erase(queued);
+		else
+			++queued;
+	}
+
+	for (int n = max(next_queued_, last + 1); n <= end; ++n)
+		queue_.push_back(n);
+	next_queued_ = max(next_queued_, end + 1);
+}
+
+PVideoFrame Prefetcher::GetFrame(
+	const	int					&n,
+			IScriptEnvironment	*env) {
+
+	unique_lock<mutex> lock(mutex_);
+
+	for (;;) {
+		map<int, PVideoFrame>::iterator frame = frames_.find(n);
+		if (frame != frames_.end()) return frame->second;
+
+		if (fetching_.count(n) == 0) break;
+		fetched_.wait(lock);
+	}
+
+	// Fetch does not fetch the frame once it is needed now
+	deque<int>::iterator queued = find(queue_.begin(), queue_.end(), n);
+	if (queued != queue_.end()) queue_.erase(queued);
+	lock.unlock();
+
+	PVideoFrame fetched = child_->GetFrame(n, env);
+
+	// Held so that planes of the same frame, requested separately, are fetched once
+	lock.lock();
+	frames_[n] = fetched;
+	return fetched;
+}
+
+void Prefetcher::Fetch(IScriptEnvironment *env) {
+	for (;;) {
+		int n;
+		{
+			lock_guard<mutex> serialise(mutex_);
+			if (queue_.empty()) return;
+			n = queue_.front();
+			queue_.pop_front();
+			fetching_.insert(n);
+		}
+
+		PVideoFrame fetched;
+		bool succeeded = true;
+		try {
+			fetched = child_->GetFrame(n, env);
+		} catch (...) {
+			succeeded = false;
+		}
+
+		{
+			lock_guard<mutex> serialise(mutex_);
+			if (succeeded) frames_[n] = fetched;
+			fetching_.erase(n);
+		}
+		fetched_.notify_all();
+	}
+}
@@ -0,0 +1,82 @@
+/* Deathray - An Avisynth plug-in filter for spatial/temporal non-local means de-noising.
+ *
+ * version 1.04
+ *
+ * Copyright 2013, Jawed Ashraf - Deathray@cupidity.f9.co.uk
+ */
+
+#ifndef _PREFETCHER_H_
+#define _PREFETCHER_H_
+
+#include <windows.h>
+#include <map>
+#include <set>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include "avisynth.h"
+
+using namespace std;
+
+// Prefetcher
+// Fetches frames from the child clip ahead of their use, so that
+// decoding upstream overlaps filtering on the device.
+//
+// Avisynth's filters may only be called on the threads that Avisynth
+// calls Deathray on, so frames are fetched by those threads: GetFrame
+// fetches the frames queued ahead by Target, see Fetch, after the
+// device has been given the current frame and before waiting for it.
+//
+// Prefetching starts once targets are requested in sequence.
+class Prefetcher {
+public:
+	Prefetcher();
+
+	// Init
+	// Records the clip, and the count of frames fetched beyond those 
+	// needed by the current target. Subsequent calls are ignored.
+	void Init(
+		const	PClip				&child,			// clip supplying frames
+		const	int					&depth,			// count of frames to fetch ahead
+		const	int					&frame_count);	// count of frames in the clip
+
+	// Target
+	// Informs the prefetcher that frames first to last are required
+	// to filter the target frame. Frames before first are released.
+	//
+	// When target follows the prior target, frames after last are 
+	// queued for Fetch, and queued frames outside the window of first
+	// to last plus depth are removed. Otherwise frames that are queued
+	// or held outside first to last are discarded.
+	void Target(
+		const	int		&target,
+		const	int		&first,
+		const	int		&last);
+
+	// GetFrame
+	// Returns the frame, waiting if another thread is fetching it,
+	// otherwise fetching it now with env.
+	PVideoFrame GetFrame(
+		const	int					&n,
+				IScriptEnvironment	*env);
+
+	// Fetch
+	// Fetches the queued frames with env, on the calling thread. An
+	// error is left for GetFrame to report, when the frame is needed.
+	void Fetch(IScriptEnvironment *env);
+
+private:
+
+	PClip					child_				;	// clip supplying frames
+	int						depth_				;	// count of frames to fetch beyond the last frame of the target
+	int						frame_count_		;	// count of frames in the clip
+	mutex					mutex_				;	// guards the fields below
+	condition_variable		fetched_			;	// signalled when a thread finishes fetching a frame
+	map<int, PVideoFrame>	frames_				;	// fetched frames, by frame number
+	deque<int>				queue_				;	// frames yet to be fetched by Fetch
+	set<int>				fetching_			;	// frames being fetched, by any thread
+	int						prior_target_		;	// target of the prior call to Target
+	int						next_queued_		;	// first frame not yet queued
+};
+
+#endif // _PREFETCHER_H_
@@ -8,20 +8,49 @@
 #include "SingleFrame.h"
 #include "device.h"
 #include "buffer_map.h"
+#include "CLutil.h"
 
 extern	int		g_device_count;
 extern	device	*g_devices;
 
-extern	int		g_gaussian;
-
 SingleFrame::SingleFrame() {
 	device_id_		= 0;
 	width_			= 0;
 	height_			= 0;
 	src_pitch_		= 0;
 	dst_pitch_		= 0;
-	source_plane_	= 0;
-	dest_plane_		= 0;
+	band_first_row_	= 0;
+	band_rows_		= 0;
+	plane_count_	= 1;
+	cq_				= NULL;
+	executed_		= NULL;
+	const frame_key no_frame = {NULL, 0, 0, 0, 0, 0};
+	for (int plane = 0; plane < 2; ++plane) {
+		key_[plane]				= no_frame;
+		source_plane_[plane]	= 0;
+		dest_plane_[plane]		= 0;
+	}
+}
+
+SingleFrame::~SingleFrame() {
+	if (cq_ == NULL) return;
+
+	clFinish(cq_);
+	for (int plane = 0; plane < plane_count_; ++plane) {
+		if (source_plane_[plane] != 0) g_devices[device_id_].frames_.Release(source_plane_[plane]);
+		g_devices[device_id_].buffers_.Destroy(dest_plane_[plane]);
+	}
+	g_devices[device_id_].frames_.Forget(key_[0].clip);
+	if (executed_ != NULL) ReleaseEvent(executed_);
+	clReleaseCommandQueue(cq_);
+}
+
+size_t SingleFrame::Footprint(
+	const	int		&width, 
+	const	int		&height,
+	const	int		&plane_count) {
+
+	return 2 * plane_count * buffer_map::PlaneBytes(width, height) + buffer_map::StagingBytes(width, height);
 }
 
 result SingleFrame::Init(
@@ -30,12 +59,16 @@ result SingleFrame::Init(
 	const	int		&height,
 	const	int		&src_pitch,
 	const	int		&dst_pitch,
+	const	int		&plane_count,
 	const	float	&h,
 	const	int		&sample_expand,
 	const	int		&linear,
 	const	int		&correction,
 	const	int		&target_min,
-	const	int		&balanced) {
+	const	int		&balanced,
+	const	int		&algorithm,
+	const	int		&half_tile,
+	const	int		&gaussian) {
 
 	if (device_id >= g_device_count) return FILTER_ERROR;
 
@@ -46,34 +79,51 @@ result SingleFrame::Init(
 	height_			= height;
 	src_pitch_		= src_pitch;
 	dst_pitch_		= dst_pitch;
+	band_first_row_	= 0;
+	band_rows_		= height;
+	plane_count_	= plane_count;
 	cq_				= g_devices[device_id_].cq();
 
 	if (width_ == 0 || height_ == 0 || src_pitch_ == 0 || dst_pitch_ == 0 || h == 0 ) return FILTER_INVALID_PARAMETER;
+	if (plane_count_ < 1 || plane_count_ > 2) return FILTER_INVALID_PARAMETER;
+
+	// Source planes are private until Share, and are taken from the
+	// device's frame_cache by CopyTo
+	for (int plane = 0; plane < plane_count_; ++plane) {
+		const frame_key key = {NULL, plane, 0, width_, height_, 0};
+		key_[plane] = key;
+		status = g_devices[device_id_].buffers_.AllocPlane(cq_, width_, height_, &dest_plane_[plane]);
+		if (status != FILTER_OK) return status;
+	}
 
-	status = g_devices[device_id_].buffers_.AllocPlane(cq_, width_, height_, &source_plane_);
-	if (status != FILTER_OK) return status;
-	status = g_devices[device_id_].buffers_.AllocPlane(cq_, width_, height_, &dest_plane_);
-	if (status != FILTER_OK) return status;
-
-	kernel_ = CLKernel(device_id_, "NLMSingleFrameFourPixel");
-
-	kernel_.SetArg(sizeof(cl_mem), g_devices[device_id_].buffers_.ptr(source_plane_));
-	kernel_.SetArg(sizeof(int), &width_);
-	kernel_.SetArg(sizeof(int), &height_);
-	kernel_.SetArg(sizeof(float), &h);
-	kernel_.SetArg(sizeof(int), &sample_expand);
-	kernel_.SetArg(sizeof(cl_mem), g_devices[device_id_].buffers_.ptr(g_gaussian));
-	kernel_.SetArg(sizeof(int), &linear);
-	kernel_.SetArg(sizeof(int), &correction);
-	kernel_.SetArg(sizeof(int), &target_min);
-	kernel_.SetArg(sizeof(int), &balanced);
-	kernel_.SetArg(sizeof(cl_mem), g_devices[device_id_].buffers_.ptr(dest_plane_));
+	// Indexed by nlm_algorithm
+	const string kernel_names[] = {"NLMSingleFrameFourPixel", "NLMSingleFrameIntegral", "NLMSingleFrameSeparable"};
+	const string pair_kernel_names[] = {"NLMSingleFramePairFourPixel", "NLMSingleFramePairIntegral", "NLMSingleFramePairSeparable"};
+
+	kernel_ = CLKernel(device_id_, 
+					   plane_count_ == 2 ? pair_kernel_names[algorithm] : kernel_names[algorithm], 
+					   VariantOptions(sample_expand, linear, correction, target_min, balanced, half_tile, 0));
+
+	// Arguments follow the source planes, which are set per frame
+	int argument = plane_count_;
+	kernel_.SetNumberedArg(argument++, sizeof(int), &width_);
+	kernel_.SetNumberedArg(argument++, sizeof(int), &height_);
+	kernel_.SetNumberedArg(argument++, sizeof(float), &h);
+	kernel_.SetNumberedArg(argument++, sizeof(int), &sample_expand);
+	kernel_.SetNumberedArg(argument++, sizeof(cl_mem), g_devices[device_id_].buffers_.ptr(gaussian));
+	kernel_.SetNumberedArg(argument++, sizeof(int), &linear);
+	kernel_.SetNumberedArg(argument++, sizeof(int), &correction);
+	kernel_.SetNumberedArg(argument++, sizeof(int), &target_min);
+	kernel_.SetNumberedArg(argument++, sizeof(int), &balanced);
+	for (int plane = 0; plane < plane_count_; ++plane) 
+		kernel_.SetNumberedArg(argument++, sizeof(cl_mem), g_devices[device_id_].buffers_.ptr(dest_plane_[plane]));
 
 	if (kernel_.arguments_valid()) {
-		kernel_.set_work_dim(2);
-		const size_t set_local_work_size[2]		= {8, 32};
-		const size_t set_scalar_global_size[2]	= {width_, height_};
-		const size_t set_scalar_item_size[2]	= {4, 1};
+		// The third dimension selects the plane of a pair
+		kernel_.set_work_dim(3);
+		const size_t set_local_work_size[3]		= {8, 32, 1};
+		const size_t set_scalar_global_size[3]	= {width_, height_, plane_count_};
+		const size_t set_scalar_item_size[3]	= {4, 1, 1};
 
 		kernel_.set_local_work_size(set_local_work_size);
 		kernel_.set_scalar_global_size(set_scalar_global_size);
@@ -85,29 +135,72 @@ result SingleFrame::Init(
 	return FILTER_KERNEL_ARGUMENT_ERROR;
 }
 
-result SingleFrame::CopyTo(const unsigned char *source) {
-	return g_devices[device_id_].buffers_.CopyToPlaneAsynch(source_plane_,
-															*source, 
-															width_, 
-															height_, 
-															src_pitch_, 
-															&copied_to_);
+void SingleFrame::Band(const int &first_row, const int &rows) {
+	band_first_row_	= first_row;
+	band_rows_		= rows;
+}
 
+void SingleFrame::Share(
+	const	void	*clip,
+	const	int		&plane,
+	const	int		&first_row) {
+
+	for (int i = 0; i < plane_count_; ++i) {
+		key_[i].clip		= clip;
+		key_[i].plane		= plane + i;
+		key_[i].first_row	= first_row;
+	}
+}
+
+result SingleFrame::CopyTo(
+	const	int				&frame_number,
+	const	unsigned char	*source,
+	const	unsigned char	*second_source) {
+
+	frame_cache &frames = g_devices[device_id_].frames_;
+
+	const unsigned char *sources[2] = {source, second_source};
+	for (int plane = 0; plane < plane_count_; ++plane) {
+		if (source_plane_[plane] != 0) frames.Release(source_plane_[plane]);
+		source_plane_[plane] = 0;
+
+		key_[plane].frame_number = frame_number;
+		if (!frames.Acquire(key_[plane], &source_plane_[plane], &copied_to_[plane])) {
+			result status = frames.Insert(key_[plane], *sources[plane], src_pitch_, &source_plane_[plane], &copied_to_[plane]);
+			if (status != FILTER_OK) {
+				source_plane_[plane] = 0;
+				return status;
+			}
+		}
+		kernel_.SetNumberedArg(plane, sizeof(cl_mem), g_devices[device_id_].buffers_.ptr(source_plane_[plane]));
+	}
+	return FILTER_OK;
 }
 
 result SingleFrame::Execute() {
-	return kernel_.ExecuteAsynch(cq_, &copied_to_, &executed_);
+	// The prior frame's copies to host were enqueued after its execution
+	if (executed_ != NULL) ReleaseEvent(executed_);
+	return kernel_.ExecuteWaitList(cq_, plane_count_, copied_to_, &executed_);
 }
 
 result SingleFrame::CopyFrom(
 	unsigned char	*dest,							  
-	cl_event		*returned) {
-
-	return g_devices[device_id_].buffers_.CopyFromPlaneAsynch(dest_plane_,
-															  width_,
-															  height_, 
-															  dst_pitch_, 
-															  &executed_, 
-															  returned,
-															  dest);
+	cl_event		*returned,
+	unsigned char	*second_dest,
+	cl_event		*second_returned) {
+
+	unsigned char *dests[2] = {dest, second_dest};
+	cl_event *returns[2] = {returned, second_returned};
+	for (int plane = 0; plane < plane_count_; ++plane) {
+		result status = g_devices[device_id_].buffers_.CopyFromPlaneAsynch(dest_plane_[plane],
+																		   band_first_row_,
+																		   width_,
+																		   band_rows_, 
+																		   dst_pitch_, 
+																		   &executed_, 
+																		   returns[plane],
+																		   dests[plane]);
+		if (status != FILTER_OK) return status;
+	}
+	return FILTER_OK;
 }
@@ -13,13 +13,16 @@
 #include "avisynth.h"
 #include "CLKernel.h"
 #include "result.h"
+#include "nlm_algorithm.h"
+#include "frame_cache.h"
 
 class SingleFrame
 {
 public:
 	SingleFrame();
 
-	~SingleFrame() {}
+	// Releases the planes and queue on the device
+	~SingleFrame();
 
 	// Init
 	// Setup the static source and destination buffers on the device
@@ -31,27 +34,66 @@ public:
 		const	int		&height,
 		const	int		&src_pitch,
 		const	int		&dst_pitch,
+		const	int		&plane_count,	// 1, or 2 for a pair of planes of the same size filtered by one kernel
 		const	float	&h,
 		const	int		&sample_expand,
 		const	int		&linear,
 		const	int		&correction,
 		const	int		&target_min,
-		const	int		&balanced);
+		const	int		&balanced,
+		const	int		&algorithm,
+		const	int		&half_tile,		// tiles are held as halves in local memory
+		const	int		&gaussian);		// buffer of gaussian weights on the device
+
+	// Footprint
+	// Bytes of device memory that Init will allocate, a source and
+	// a destination plane per plane, plus the staging pool of its 
+	// queue.
+	static size_t Footprint(
+		const	int		&width, 
+		const	int		&height,
+		const	int		&plane_count);
+
+	// Band
+	// When the plane is a band of a larger plane, with an apron of 
+	// rows shared with its neighbours, restricts the copy to host to
+	// the band's own rows. By default all rows are copied.
+	void Band(
+		const	int		&first_row,		// first row of the plane belonging to the band
+		const	int		&rows);			// count of rows belonging to the band
+
+	// Share
+	// Identifies the plane, or the first of the pair of planes, of the
+	// clip being filtered, so that source planes are shared through the
+	// device's frame_cache with other instances filtering the same
+	// planes. By default source planes are private.
+	void Share(
+		const	void	*clip,			// source clip
+		const	int		&plane,			// 0 for Y, 1 for U and V
+		const	int		&first_row);	// first row of the host plane copied to the device
 
 	// CopyTo
-	// Copy the plane from host to device.
-	result CopyTo(const unsigned char *source);
+	// Copy the plane, or the pair of planes, from host to device,
+	// unless another instance holds them. The planes of the prior 
+	// frame are released, so its kernel must be complete.
+	result CopyTo(
+		const	int				&frame_number,
+		const	unsigned char	*source,
+		const	unsigned char	*second_source = NULL);
 
 	// Execute
-	// Perform NLM computation.
+	// Perform NLM computation, for both planes of a pair with a single
+	// launch of the kernel.
 	result Execute();
 
 	// CopyFrom
-	// Copy the plane of filtered pixels from the device
-	// to the destination buffer on the host.
+	// Copy the plane, or the pair of planes, of filtered pixels from 
+	// the device to the destination buffers on the host.
 	result CopyFrom(
 		unsigned char	*dest,
-		cl_event		*returned);
+		cl_event		*returned,
+		unsigned char	*second_dest = NULL,
+		cl_event		*second_returned = NULL);
 
 private:
 	int device_id_		;	// device used to execute the filter kernels
@@ -59,11 +101,15 @@ private:
 	int height_			;	// height of plane's content
 	int src_pitch_		;	// host plane format allows each row to be potentially longer than width_
 	int dst_pitch_		;	// host plane format allows each row to be potentially longer than width_
-	int source_plane_	;	// dedicated buffer for source plane
-	int dest_plane_		;	// dedicated buffer for destination plane
+	int band_first_row_	;	// first row copied to host
+	int band_rows_		;	// count of rows copied to host
+	int plane_count_	;	// planes filtered by each launch of the kernel
+	frame_key key_[2]	;	// planes of the clip, and frame held
+	int source_plane_[2];	// buffer for source plane, from the device's frame_cache, 0 when no frame is held
+	int dest_plane_[2]	;	// dedicated buffer for destination plane
 	cl_command_queue cq_;	// device is used asynchronously so it is more a pool of commands rather than a queue
 	CLKernel kernel_	;	// non local means kernel executed on device
-	cl_event copied_to_ ;	// source buffer is copied to device asynchronously
+	cl_event copied_to_[2];	// source buffer is copied to device asynchronously, event owned by the frame_cache
 	cl_event executed_	;	// kernel is executed asynchronously
 };
 
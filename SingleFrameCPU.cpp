@@ -0,0 +1,118 @@
+/* Deathray - An Avisynth plug-in filter for spatial/temporal non-local means de-noising.
+ *
+ * version 1.04
+ *
+ * Copyright 2013, Jawed Ashraf - Deathray@cupidity.f9.co.uk
+ */
+
+#include <float.h>
+#include <string.h>
+#include <algorithm>
+#include "SingleFrameCPU.h"
+#include "NLMHost.h"
+#include "ThreadPool.h"
+
+extern	ThreadPool	g_thread_pool;
+
+SingleFrameCPU::SingleFrameCPU() {
+	width_			= 0;
+	height_			= 0;
+	src_pitch_		= 0;
+	dst_pitch_		= 0;
+	tiles_across_	= 0;
+	tiles_down_		= 0;
+	filter_			= NULL;
+	strip_width_	= 0;
+}
+
+result SingleFrameCPU::Init(
+	const	int		&width,
+	const	int		&height,
+	const	int		&src_pitch,
+	const	int		&dst_pitch,
+	const	float	&h,
+	const	int		&sample_expand,
+	const	int		&linear,
+	const	int		&correction,
+	const	int		&target_min,
+	const	int		&balanced,
+	const	int		&algorithm,
+	const	float	*gaussian) {
+
+	width_			= width;
+	height_			= height;
+	src_pitch_		= src_pitch;
+	dst_pitch_		= dst_pitch;
+	h_				= h;
+	sample_expand_	= sample_expand;
+	linear_			= linear;
+	correction_		= correction;
+	target_min_		= target_min;
+	balanced_		= balanced;
+	algorithm_		= algorithm;
+
+	if (width_ == 0 || height_ == 0 || src_pitch_ == 0 || dst_pitch_ == 0 || h == 0 ) return FILTER_INVALID_PARAMETER;
+
+	memcpy(gaussian_, gaussian, 56 * sizeof(float));
+
+	tiles_across_	= (width_ + k_host_tile_size - 1) / k_host_tile_size;
+	tiles_down_		= (height_ + k_host_tile_size - 1) / k_host_tile_size;
+
+	filter_ = SelectFilterStrip(DetectHostSIMD(), &strip_width_);
+
+	source_.resize(width_ * height_);
+	dest_.resize(width_ * height_);
+
+	return FILTER_OK;
+}
+
+result SingleFrameCPU::CopyTo(const unsigned char *source) {
+	ReadPlaneHost(source, width_, height_, src_pitch_, linear_, &source_[0]);
+	return FILTER_OK;
+}
+
+result SingleFrameCPU::Execute() {
+	g_thread_pool.Execute(tiles_across_ * tiles_down_, &SingleFrameCPU::FilterTile, this);
+	return FILTER_OK;
+}
+
+result SingleFrameCPU::CopyFrom(unsigned char *dest) {
+	for (int y = 0; y < height_; ++y)
+		memcpy(dest + y * dst_pitch_, &dest_[y * width_], width_);
+	return FILTER_OK;
+}
+
+void SingleFrameCPU::FilterTile(void *context, const int &tile) {
+	// Each task produces up to 1024 filtered pixels, organised as a tile
+	// of 32x32, processed as horizontal strips of 4 or more pixels in the
+	// same way as the work items of NLMSingleFrameFourPixel.
+
+	SingleFrameCPU *filter = static_cast<SingleFrameCPU*>(context);
+
+	const int tile_left = (tile % filter->tiles_across_) * k_host_tile_size;
+	const int tile_top	= (tile / filter->tiles_across_) * k_host_tile_size;
+	const int columns	= min(k_host_tile_size, filter->width_ - tile_left);
+	const int rows		= min(k_host_tile_size, filter->height_ - tile_top);
+
+	float target_storage[k_host_tile_storage] = {0.f};
+	float *target_tile = target_storage + k_host_tile_padding;
+	FetchAndMirror48x48Host(&filter->source_[0], filter->width_, filter->height_, tile_left, tile_top, target_tile);
+
+	float average[k_host_tile_size * k_host_tile_size];
+	float weight[k_host_tile_size * k_host_tile_size];
+	float target_weight[k_host_tile_size * k_host_tile_size];
+	for (int i = 0; i < k_host_tile_size * k_host_tile_size; ++i) {
+		average[i]			= 0.f;
+		weight[i]			= 0.f;
+		target_weight[i]	= filter->target_min_ ? FLT_MAX : 0.f;
+	}
+
+	FilterTileHost(filter->algorithm_, filter->filter_, filter->strip_width_, rows, columns, filter->h_, filter->sample_expand_, 
+				   target_tile, target_tile, filter->gaussian_, 1, filter->target_min_, filter->balanced_, average, weight, target_weight);
+
+	for (int y = 0; y < rows; ++y) {
+		const int plane_offset = (tile_top + y) * filter->width_ + tile_left;
+		FinaliseHost(average + y * k_host_tile_size, weight + y * k_host_tile_size, &filter->source_[plane_offset], columns,
+					 filter->linear_, filter->correction_, &filter->dest_[plane_offset]);
+	}
+}
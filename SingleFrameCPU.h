@@ -0,0 +1,86 @@
+/* Deathray - An Avisynth plug-in filter for spatial/temporal non-local means de-noising.
+ *
+ * version 1.04
+ *
+ * Copyright 2013, Jawed Ashraf - Deathray@cupidity.f9.co.uk
+ */
+
+#ifndef _SINGLE_FRAME_CPU_
+#define _SINGLE_FRAME_CPU_
+
+#include <vector>
+#include "result.h"
+#include "NLMHost.h"
+
+using namespace std;
+
+// SingleFrameCPU
+// Host equivalent of SingleFrame, used when no OpenCL device is available.
+// 32x32 tiles of the plane are filtered in parallel by g_thread_pool,
+// with each thread filtering strips of 4, 8 or 16 pixels depending upon
+// the CPU's SIMD width.
+class SingleFrameCPU
+{
+public:
+	SingleFrameCPU();
+
+	~SingleFrameCPU() {}
+
+	// Init
+	// Setup the source and destination planes on the host
+	// and record the filter parameters, which do not
+	// change over the duration of clip processing.
+	result Init(
+		const	int		&width,
+		const	int		&height,
+		const	int		&src_pitch,
+		const	int		&dst_pitch,
+		const	float	&h,
+		const	int		&sample_expand,
+		const	int		&linear,
+		const	int		&correction,
+		const	int		&target_min,
+		const	int		&balanced,
+		const	int		&algorithm,
+		const	float	*gaussian);
+
+	// CopyTo
+	// Convert the plane into normalised floats.
+	result CopyTo(const unsigned char *source);
+
+	// Execute
+	// Perform NLM computation. Returns once all tiles are filtered.
+	result Execute();
+
+	// CopyFrom
+	// Copy the plane of filtered pixels to the destination
+	// buffer on the host.
+	result CopyFrom(unsigned char *dest);
+
+private:
+
+	// FilterTile
+	// Task executed by the thread pool, filtering a single 32x32 tile.
+	static void FilterTile(void *context, const int &tile);
+
+	int width_				;	// width of plane's content
+	int height_				;	// height of plane's content
+	int src_pitch_			;	// host plane format allows each row to be potentially longer than width_
+	int dst_pitch_			;	// host plane format allows each row to be potentially longer than width_
+	float h_				;	// strength of noise reduction
+	int sample_expand_		;	// factor by which the sample radius is expanded
+	int linear_				;	// process plane in linear space instead of gamma space
+	int correction_			;	// apply a post-filtering correction
+	int target_min_			;	// target pixel is weighted using minimum weight of samples, not maximum
+	int balanced_			;	// balanced tonal range de-noising
+	int algorithm_			;	// method used to compute window distances
+	float gaussian_[56]		;	// weights of gaussian kernel and its 1-dimensional equivalent
+	int tiles_across_		;	// count of 32x32 tiles horizontally
+	int tiles_down_			;	// count of 32x32 tiles vertically
+	filter_strip filter_	;	// Filter4Host or a SIMD equivalent, chosen for the host's CPU
+	int strip_width_		;	// count of pixels filtered by each call to filter_
+	vector<float> source_	;	// source plane as normalised floats
+	vector<unsigned char> dest_;// filtered plane
+};
+
+#endif // _SINGLE_FRAME_CPU_
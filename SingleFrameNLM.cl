@@ -5,6 +5,59 @@
  * Copyright 2013, Jawed Ashraf - Deathray@cupidity.f9.co.uk
  */
 
+void SingleFrameFourPixel(
+	read_only 	image2d_t 	target_plane,			// input plane
+	const		int			width,					// width in pixels
+	const		int			height,					// height in pixels
+	const		float		h,						// strength of denoising
+	const		int			sample_expand,			// factor to expand sample radius
+	constant	float		*g_gaussian,			// 49 weights of guassian kernel
+	const		int			linear,					// process plane in linear space instead of gamma space
+	const		int			correction,				// apply a post-filtering correction
+	const		int			target_min,				// target pixel is weighted using minimum weight of samples, not maximum
+	const		int			balanced,				// balanced tonal range de-noising
+	write_only 	image2d_t 	destination_plane,		// filtered result
+	local		TILE_PIXEL	*target_tile) {		// tile of the plane being filtered
+	// Body of NLMSingleFrameFourPixel, shared with NLMSingleFramePairFourPixel
+	// so that a pair of planes can be filtered by a single kernel.
+
+	int2 local_id;
+	int2 source;
+	Coordinates32x32(&local_id, &source);
+
+	float4 average = 0.f;
+	float4 weight = 0.f;
+	float4 target_weight = TARGET_MIN(target_min) ? MAXFLOAT : 0.f;
+	float4 filtered_pixels;
+
+	// Inside local memory the top-left corner of the tile is at (8,8)
+	int2 target = (int2)((local_id.x << 2) + 8, local_id.y + 8);
+
+	// The tile is 48x48 pixels which is entirely filled from the source
+	FetchAndMirror48x48(target_plane, width, height, local_id, source, LINEAR(linear), target_tile) ;
+
+	int kernel_radius = 3;
+	float16 target_window[7];
+	for (int y = 0; y < 2 * kernel_radius + 1; ++y) {
+		target_window[y] = ReadTile16(target.x - kernel_radius,
+									  target.y + y - kernel_radius, 
+									  target_tile);
+	}
+
+	Filter4(target,	h, SAMPLE_EXPAND(sample_expand), target_window, target_tile, g_gaussian, 1, TARGET_MIN(target_min), BALANCED(balanced), &average, &weight, &target_weight);
+	filtered_pixels = average / weight;
+	if (CORRECTION(correction)) {
+		float4 original = ReadPixel4(target_plane, source, LINEAR(linear));
+
+		float4 difference = filtered_pixels - original;
+		float4 correction = (difference * original * original) - 
+							((difference * original) * (difference * original));
+
+		filtered_pixels = filtered_pixels - correction;
+	}
+	WritePixel4(filtered_pixels, source, LINEAR(linear), destination_plane);
+}
+
 __attribute__((reqd_work_group_size(8, 32, 1)))
 __kernel void NLMSingleFrameFourPixel(
 	read_only 	image2d_t 	target_plane,			// input plane
@@ -34,7 +87,100 @@ __kernel void NLMSingleFrameFourPixel(
 	// Destination plane is formatted as UNORM8 uchar. The device 
 	// automatically converts a pixel in range 0.f to 1.f into 0 to 255.
 
-	__local float target_tile[TILE_SIDE * TILE_SIDE];
+	__local TILE_PIXEL target_tile[TILE_SIDE * TILE_SIDE];
+
+	SingleFrameFourPixel(target_plane, width, height, h, sample_expand, g_gaussian, linear, correction, target_min, balanced, destination_plane, target_tile);
+}
+
+void SingleFrameIntegral(
+	read_only 	image2d_t 	target_plane,			// input plane
+	const		int			width,					// width in pixels
+	const		int			height,					// height in pixels
+	const		float		h,						// strength of denoising
+	const		int			sample_expand,			// factor to expand sample radius
+	constant	float		*g_gaussian,			// 49 weights of guassian kernel, unused
+	const		int			linear,					// process plane in linear space instead of gamma space
+	const		int			correction,				// apply a post-filtering correction
+	const		int			target_min,				// target pixel is weighted using minimum weight of samples, not maximum
+	const		int			balanced,				// balanced tonal range de-noising
+	write_only 	image2d_t 	destination_plane,		// filtered result
+	local		TILE_PIXEL	*target_tile,		// tile of the plane being filtered
+	local		float		*integral) {			// integral image of squared differences
+	// Body of NLMSingleFrameIntegral, shared with NLMSingleFramePairIntegral
+	// so that a pair of planes can be filtered by a single kernel.
+
+	int2 local_id;
+	int2 source;
+	Coordinates32x32(&local_id, &source);
+
+	float4 average = 0.f;
+	float4 weight = 0.f;
+	float4 target_weight = TARGET_MIN(target_min) ? MAXFLOAT : 0.f;
+	float4 filtered_pixels;
+
+	// Inside local memory the top-left corner of the tile is at (8,8)
+	int2 target = (int2)((local_id.x << 2) + 8, local_id.y + 8);
+
+	// The tile is 48x48 pixels which is entirely filled from the source
+	FetchAndMirror48x48(target_plane, width, height, local_id, source, LINEAR(linear), target_tile) ;
+
+	float target_pixels[INTEGRAL_ENTRIES];
+	IntegralTargetPixels(local_id, target_tile, target_pixels);
+
+	FilterIntegral(local_id, target, h, SAMPLE_EXPAND(sample_expand), target_pixels, target_tile, integral, 1, TARGET_MIN(target_min), BALANCED(balanced), &average, &weight, &target_weight);
+	filtered_pixels = average / weight;
+	if (CORRECTION(correction)) {
+		float4 original = ReadPixel4(target_plane, source, LINEAR(linear));
+
+		float4 difference = filtered_pixels - original;
+		float4 correction = (difference * original * original) - 
+							((difference * original) * (difference * original));
+
+		filtered_pixels = filtered_pixels - correction;
+	}
+	WritePixel4(filtered_pixels, source, LINEAR(linear), destination_plane);
+}
+
+__attribute__((reqd_work_group_size(8, 32, 1)))
+__kernel void NLMSingleFrameIntegral(
+	read_only 	image2d_t 	target_plane,			// input plane
+	const		int			width,					// width in pixels
+	const		int			height,					// height in pixels
+	const		float		h,						// strength of denoising
+	const		int			sample_expand,			// factor to expand sample radius
+	constant	float		*g_gaussian,			// 49 weights of guassian kernel, unused
+	const		int			linear,					// process plane in linear space instead of gamma space
+	const		int			correction,				// apply a post-filtering correction
+	const		int			target_min,				// target pixel is weighted using minimum weight of samples, not maximum
+	const		int			balanced,				// balanced tonal range de-noising
+	write_only 	image2d_t 	destination_plane) {	// filtered result
+	// Same as NLMSingleFrameFourPixel, except that windows are box-weighted
+	// and their distances are taken from an integral image, see FilterIntegral.
+	//
+	// Arguments match NLMSingleFrameFourPixel so that the host can use either.
+
+	__local TILE_PIXEL target_tile[TILE_SIDE * TILE_SIDE];
+	__local float integral[INTEGRAL_SIDE * INTEGRAL_SIDE];
+
+	SingleFrameIntegral(target_plane, width, height, h, sample_expand, g_gaussian, linear, correction, target_min, balanced, destination_plane, target_tile, integral);
+}
+
+void SingleFrameSeparable(
+	read_only 	image2d_t 	target_plane,			// input plane
+	const		int			width,					// width in pixels
+	const		int			height,					// height in pixels
+	const		float		h,						// strength of denoising
+	const		int			sample_expand,			// factor to expand sample radius
+	constant	float		*g_gaussian,			// 49 weights of guassian kernel followed by 7 weights of its 1-dimensional equivalent
+	const		int			linear,					// process plane in linear space instead of gamma space
+	const		int			correction,				// apply a post-filtering correction
+	const		int			target_min,				// target pixel is weighted using minimum weight of samples, not maximum
+	const		int			balanced,				// balanced tonal range de-noising
+	write_only 	image2d_t 	destination_plane,		// filtered result
+	local		TILE_PIXEL	*target_tile,		// tile of the plane being filtered
+	local		float		*column_distance) {	// distances of the columns of sample windows
+	// Body of NLMSingleFrameSeparable, shared with NLMSingleFramePairSeparable
+	// so that a pair of planes can be filtered by a single kernel.
 
 	int2 local_id;
 	int2 source;
@@ -42,14 +188,14 @@ __kernel void NLMSingleFrameFourPixel(
 
 	float4 average = 0.f;
 	float4 weight = 0.f;
-	float4 target_weight = target_min ? MAXFLOAT : 0.f;
+	float4 target_weight = TARGET_MIN(target_min) ? MAXFLOAT : 0.f;
 	float4 filtered_pixels;
 
 	// Inside local memory the top-left corner of the tile is at (8,8)
 	int2 target = (int2)((local_id.x << 2) + 8, local_id.y + 8);
 
 	// The tile is 48x48 pixels which is entirely filled from the source
-	FetchAndMirror48x48(target_plane, width, height, local_id, source, linear, target_tile) ;
+	FetchAndMirror48x48(target_plane, width, height, local_id, source, LINEAR(linear), target_tile) ;
 
 	int kernel_radius = 3;
 	float16 target_window[7];
@@ -59,10 +205,10 @@ __kernel void NLMSingleFrameFourPixel(
 									  target_tile);
 	}
 
-	Filter4(target,	h, sample_expand, target_window, target_tile, g_gaussian, 1, target_min, balanced, &average, &weight, &target_weight);
+	FilterSeparable(local_id, target, h, SAMPLE_EXPAND(sample_expand), target_window, target_tile, g_gaussian, column_distance, 1, TARGET_MIN(target_min), BALANCED(balanced), &average, &weight, &target_weight);
 	filtered_pixels = average / weight;
-	if (correction) {
-		float4 original = ReadPixel4(target_plane, source, linear);
+	if (CORRECTION(correction)) {
+		float4 original = ReadPixel4(target_plane, source, LINEAR(linear));
 
 		float4 difference = filtered_pixels - original;
 		float4 correction = (difference * original * original) - 
@@ -70,5 +216,112 @@ __kernel void NLMSingleFrameFourPixel(
 
 		filtered_pixels = filtered_pixels - correction;
 	}
-	WritePixel4(filtered_pixels, source, linear, destination_plane);
+	WritePixel4(filtered_pixels, source, LINEAR(linear), destination_plane);
+}
+
+__attribute__((reqd_work_group_size(8, 32, 1)))
+__kernel void NLMSingleFrameSeparable(
+	read_only 	image2d_t 	target_plane,			// input plane
+	const		int			width,					// width in pixels
+	const		int			height,					// height in pixels
+	const		float		h,						// strength of denoising
+	const		int			sample_expand,			// factor to expand sample radius
+	constant	float		*g_gaussian,			// 49 weights of guassian kernel followed by 7 weights of its 1-dimensional equivalent
+	const		int			linear,					// process plane in linear space instead of gamma space
+	const		int			correction,				// apply a post-filtering correction
+	const		int			target_min,				// target pixel is weighted using minimum weight of samples, not maximum
+	const		int			balanced,				// balanced tonal range de-noising
+	write_only 	image2d_t 	destination_plane) {	// filtered result
+	// Same as NLMSingleFrameFourPixel, except that the gaussian weighting
+	// of windows is performed separably, see FilterSeparable.
+	//
+	// Arguments match NLMSingleFrameFourPixel so that the host can use either.
+
+	__local TILE_PIXEL target_tile[TILE_SIDE * TILE_SIDE];
+	__local float column_distance[32 * SEPARABLE_COLUMNS];
+
+	SingleFrameSeparable(target_plane, width, height, h, sample_expand, g_gaussian, linear, correction, target_min, balanced, destination_plane, target_tile, column_distance);
+}
+
+__attribute__((reqd_work_group_size(8, 32, 1)))
+__kernel void NLMSingleFramePairFourPixel(
+	read_only 	image2d_t 	first_plane,			// input plane filtered by the first half of the work groups
+	read_only 	image2d_t 	second_plane,			// input plane, the same size, filtered by the second half
+	const		int			width,					// width in pixels
+	const		int			height,					// height in pixels
+	const		float		h,						// strength of denoising
+	const		int			sample_expand,			// factor to expand sample radius
+	constant	float		*g_gaussian,			// 49 weights of guassian kernel
+	const		int			linear,					// process plane in linear space instead of gamma space
+	const		int			correction,				// apply a post-filtering correction
+	const		int			target_min,				// target pixel is weighted using minimum weight of samples, not maximum
+	const		int			balanced,				// balanced tonal range de-noising
+	write_only 	image2d_t 	first_destination,		// filtered result of first_plane
+	write_only 	image2d_t 	second_destination) {	// filtered result of second_plane
+	// Same as NLMSingleFrameFourPixel, for a pair of planes that share all
+	// parameters, e.g. the chroma planes. The third dimension of the
+	// NDRange selects the plane, so both are filtered by one launch.
+
+	__local TILE_PIXEL target_tile[TILE_SIDE * TILE_SIDE];
+
+	if (get_group_id(2) == 0)
+		SingleFrameFourPixel(first_plane, width, height, h, sample_expand, g_gaussian, linear, correction, target_min, balanced, first_destination, target_tile);
+	else
+		SingleFrameFourPixel(second_plane, width, height, h, sample_expand, g_gaussian, linear, correction, target_min, balanced, second_destination, target_tile);
+}
+
+__attribute__((reqd_work_group_size(8, 32, 1)))
+__kernel void NLMSingleFramePairIntegral(
+	read_only 	image2d_t 	first_plane,			// input plane filtered by the first half of the work groups
+	read_only 	image2d_t 	second_plane,			// input plane, the same size, filtered by the second half
+	const		int			width,					// width in pixels
+	const		int			height,					// height in pixels
+	const		float		h,						// strength of denoising
+	const		int			sample_expand,			// factor to expand sample radius
+	constant	float		*g_gaussian,			// 49 weights of guassian kernel, unused
+	const		int			linear,					// process plane in linear space instead of gamma space
+	const		int			correction,				// apply a post-filtering correction
+	const		int			target_min,				// target pixel is weighted using minimum weight of samples, not maximum
+	const		int			balanced,				// balanced tonal range de-noising
+	write_only 	image2d_t 	first_destination,		// filtered result of first_plane
+	write_only 	image2d_t 	second_destination) {	// filtered result of second_plane
+	// Same as NLMSingleFrameIntegral, for a pair of planes that share all
+	// parameters, e.g. the chroma planes. The third dimension of the
+	// NDRange selects the plane, so both are filtered by one launch.
+
+	__local TILE_PIXEL target_tile[TILE_SIDE * TILE_SIDE];
+	__local float integral[INTEGRAL_SIDE * INTEGRAL_SIDE];
+
+	if (get_group_id(2) == 0)
+		SingleFrameIntegral(first_plane, width, height, h, sample_expand, g_gaussian, linear, correction, target_min, balanced, first_destination, target_tile, integral);
+	else
+		SingleFrameIntegral(second_plane, width, height, h, sample_expand, g_gaussian, linear, correction, target_min, balanced, second_destination, target_tile, integral);
+}
+
+__attribute__((reqd_work_group_size(8, 32, 1)))
+__kernel void NLMSingleFramePairSeparable(
+	read_only 	image2d_t 	first_plane,			// input plane filtered by the first half of the work groups
+	read_only 	image2d_t 	second_plane,			// input plane, the same size, filtered by the second half
+	const		int			width,					// width in pixels
+	const		int			height,					// height in pixels
+	const		float		h,						// strength of denoising
+	const		int			sample_expand,			// factor to expand sample radius
+	constant	float		*g_gaussian,			// 49 weights of guassian kernel followed by 7 weights of its 1-dimensional equivalent
+	const		int			linear,					// process plane in linear space instead of gamma space
+	const		int			correction,				// apply a post-filtering correction
+	const		int			target_min,				// target pixel is weighted using minimum weight of samples, not maximum
+	const		int			balanced,				// balanced tonal range de-noising
+	write_only 	image2d_t 	first_destination,		// filtered result of first_plane
+	write_only 	image2d_t 	second_destination) {	// filtered result of second_plane
+	// Same as NLMSingleFrameSeparable, for a pair of planes that share all
+	// parameters, e.g. the chroma planes. The third dimension of the
+	// NDRange selects the plane, so both are filtered by one launch.
+
+	__local TILE_PIXEL target_tile[TILE_SIDE * TILE_SIDE];
+	__local float column_distance[32 * SEPARABLE_COLUMNS];
+
+	if (get_group_id(2) == 0)
+		SingleFrameSeparable(first_plane, width, height, h, sample_expand, g_gaussian, linear, correction, target_min, balanced, first_destination, target_tile, column_distance);
+	else
+		SingleFrameSeparable(second_plane, width, height, h, sample_expand, g_gaussian, linear, correction, target_min, balanced, second_destination, target_tile, column_distance);
 }
@@ -0,0 +1,118 @@
+/* Deathray - An Avisynth plug-in filter for spatial/temporal non-local means de-noising.
+ *
+ * version 1.04
+ *
+ * Copyright 2013, Jawed Ashraf - Deathray@cupidity.f9.co.uk
+ */
+
+#include <algorithm>
+#include "ThreadPool.h"
+
+ThreadPool::ThreadPool() {
+	stop_ = false;
+}
+
+ThreadPool::~ThreadPool() {
+	{
+		unique_lock<mutex> lock(mutex_);
+		stop_ = true;
+	}
+	start_.notify_all();
+
+	for (size_t i = 0; i < threads_.size(); ++i)
+		threads_[i].detach();
+}
+
+void ThreadPool::Start() {
+	lock_guard<mutex> serialise(start_mutex_);
+
+	if (threads_.size() > 0) return;
+
+	const int count = static_cast<int>(thread::hardware_concurrency());
+	for (int i = 1; i < count; ++i)
+		threads_.push_back(thread(&ThreadPool::Worker, this));
+}
+
+void ThreadPool::Stop() {
+	lock_guard<mutex> serialise(start_mutex_);
+
+	{
+		unique_lock<mutex> lock(mutex_);
+		stop_ = true;
+	}
+	start_.notify_all();
+
+	for (size_t i = 0; i < threads_.size(); ++i)
+		threads_[i].join();
+	threads_.clear();
+
+	unique_lock<mutex> lock(mutex_);
+	stop_ = false;
+}
+
+void ThreadPool::Execute(
+	const	int		&task_count,
+			void	(*task)(void *context, const int &task_id),
+			void	*context) {
+
+	Start();
+
+	batch tasks;
+	tasks.task			= task;
+	tasks.context		= context;
+	tasks.task_count	= task_count;
+	tasks.next_task		= 0;
+	tasks.busy_workers	= 0;
+	{
+		unique_lock<mutex> lock(mutex_);
+		batches_.push_back(&tasks);
+	}
+	start_.notify_all();
+
+	RunTasks(&tasks);
+
+	// Every task is claimed, so once no worker is executing one, all
+	// have completed
+	unique_lock<mutex> lock(mutex_);
+	vector<batch*>::iterator queued = find(batches_.begin(), batches_.end(), &tasks);
+	if (queued != batches_.end()) batches_.erase(queued);
+	while (tasks.busy_workers > 0)
+		done_.wait(lock);
+}
+
+int ThreadPool::thread_count() {
+	lock_guard<mutex> serialise(start_mutex_);
+	return static_cast<int>(threads_.size()) + 1;
+}
+
+void ThreadPool::Worker() {
+	for (;;) {
+		batch *tasks = NULL;
+		{
+			unique_lock<mutex> lock(mutex_);
+			for (;;) {
+				if (stop_) return;
+
+				// Batches whose tasks are all claimed are left to their callers
+				while (!batches_.empty() && batches_.front()->next_task >= batches_.front()->task_count)
+					batches_.erase(batches_.begin());
+				if (!batches_.empty()) break;
+
+				start_.wait(lock);
+			}
+			tasks = batches_.front();
+			++tasks->busy_workers;
+		}
+
+		RunTasks(tasks);
+
+		unique_lock<mutex> lock(mutex_);
+		if (--tasks->busy_workers == 0)
+			done_.notify_all();
+	}
+}
+
+void ThreadPool::RunTasks(batch *tasks) {
+	for (int task_id = tasks->next_task++; task_id < tasks->task_count; task_id = tasks->next_task++)
+		tasks->task(tasks->context, task_id);
+}
@@ -0,0 +1,92 @@
+/* Deathray - An Avisynth plug-in filter for spatial/temporal non-local means de-noising.
+ *
+ * version 1.04
+ *
+ * Copyright 2013, Jawed Ashraf - Deathray@cupidity.f9.co.uk
+ */
+
+#ifndef _THREAD_POOL_H_
+#define _THREAD_POOL_H_
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+
+using namespace std;
+
+// ThreadPool
+// A set of worker threads that execute numbered sets of tasks,
+// e.g. one task per 32x32 tile of a plane.
+//
+// The thread calling Execute also works on the tasks, so a pool for
+// N cores creates N - 1 workers. Workers are started by the first
+// call to Execute, so hosts with GPUs that never filter on the CPU
+// or copy frames through staging memory do not start them.
+class ThreadPool {
+public:
+	ThreadPool();
+
+	// Destructor
+	// Signals any workers that Stop has not joined and detaches them.
+	// The pool is destroyed while the DLL is unloaded, under the
+	// loader lock, which an exiting thread needs, so joining would
+	// never return.
+	~ThreadPool();
+
+	// Execute
+	// Runs task(context, i) for every i from 0 to task_count - 1, spread
+	// across all threads. Returns once every task has completed.
+	//
+	// Batches of concurrent callers run at the same time, each worker
+	// taking tasks from the oldest batch with tasks left.
+	void Execute(
+		const	int		&task_count,
+				void	(*task)(void *context, const int &task_id),
+				void	*context);
+
+	// Stop
+	// Stops and joins the worker threads. Called when a script
+	// environment shuts down, see deathray.cpp. A later Execute
+	// starts new workers.
+	void Stop();
+
+	// thread_count
+	// Count of threads, including the caller, that execute tasks.
+	int thread_count();
+
+private:
+
+	// batch
+	// Tasks of a single call to Execute, on the caller's stack.
+	struct batch {
+		void	(*task)(void*, const int&)	;	// function executing a single task
+		void				*context		;	// client data passed to every task
+		int					task_count		;	// count of tasks
+		atomic<int>			next_task		;	// next task to be claimed
+		int					busy_workers	;	// workers executing tasks of the batch, guarded by mutex_
+	};
+
+	// Start
+	// Starts a worker per hardware thread, less one, unless started.
+	void Start();
+
+	// Worker
+	// Loop run by each worker thread, waiting for work or stop.
+	void Worker();
+
+	// RunTasks
+	// Claims and executes tasks of the batch until none are left.
+	static void RunTasks(batch *tasks);
+
+	vector<thread>		threads_		;	// workers, excluding the threads that call Execute
+	mutex				start_mutex_	;	// serialises Start and Stop
+	mutex				mutex_			;	// guards batches_, stop_ and the batches' busy_workers
+	condition_variable	start_			;	// signalled when a batch of tasks is queued, or on stop
+	condition_variable	done_			;	// signalled when a worker leaves a batch
+	vector<batch*>		batches_		;	// batches with tasks left to claim, oldest first
+	bool				stop_			;	// workers exit when set
+};
+
+#endif // _THREAD_POOL_H_
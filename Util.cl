@@ -6,13 +6,60 @@
  */
 
 #define TILE_SIDE 53
+
+// Tiles hold pixels as floats, or as halves when built with HALF_TILE,
+// which halves the local memory used by each work group. Halves are
+// stored as ushorts, since half is solely a storage format.
+#ifdef HALF_TILE
+#define TILE_PIXEL ushort
+#else
+#define TILE_PIXEL float
+#endif
+
+// Intermediate buffers of multi-frame filtering hold 4 pixels' running
+// sums as a float4, or as 4 halves when built with HALF_INTERMEDIATE,
+// which halves their size and the bandwidth of each pass.
+#ifdef HALF_INTERMEDIATE
+#define INTERMEDIATE ushort
+#define ReadIntermediate(buffer, address) vload_half4(address, (const global half*)(buffer))
+#define WriteIntermediate(value, buffer, address) vstore_half4(value, address, (global half*)(buffer))
+#else
+#define INTERMEDIATE float4
+#define ReadIntermediate(buffer, address) (buffer)[address]
+#define WriteIntermediate(value, buffer, address) (buffer)[address] = (value)
+#endif
 #define USE_SRGB_GAMMA_CURVE 1
 
+// When the program is built as a variant, the filter flags and sample
+// expansion are compiled in as constants, so that loops are unrolled
+// and unused paths are removed. Otherwise each kernel's arguments are
+// used. The arguments are always set by the host.
+#ifdef VARIANT_SAMPLE_EXPAND
+#define SAMPLE_EXPAND(argument) VARIANT_SAMPLE_EXPAND
+#define LINEAR(argument) VARIANT_LINEAR
+#define CORRECTION(argument) VARIANT_CORRECTION
+#define TARGET_MIN(argument) VARIANT_TARGET_MIN
+#define BALANCED(argument) VARIANT_BALANCED
+#else
+#define SAMPLE_EXPAND(argument) (argument)
+#define LINEAR(argument) (argument)
+#define CORRECTION(argument) (argument)
+#define TARGET_MIN(argument) (argument)
+#define BALANCED(argument) (argument)
+#endif
+
 __kernel void Initialise(__global float4 *A, const float x) {
     int pos = get_global_id(0);
 	A[pos] = x;
 }
 
+__kernel void InitialiseHalf(__global half *A, const float x) {
+	// Same as Initialise, for a buffer of halves. x of CL_MAXFLOAT
+	// becomes infinity.
+    int pos = get_global_id(0);
+	vstore_half4((float4)x, pos, A);
+}
+
 // gamma_decode
 // Converts input from gamma space into linear space.
 float gamma_decode(float x) {
@@ -84,34 +131,58 @@ void WritePixel4(
 
 void WriteTile4(
 	float4 store,
-	int x,					// coordinates of a strip ...
-	int y,					// ... of 4 pixels to be written
-	local float *tile) {	// 48x48 portion of plane in local memory
+	int x,						// coordinates of a strip ...
+	int y,						// ... of 4 pixels to be written
+	local TILE_PIXEL *tile) {	// 48x48 portion of plane in local memory
 
+#ifdef HALF_TILE
+	vstore_half4(store, 0, (local half*)tile + ((y * TILE_SIDE) + x));
+#else
 	vstore4(store, 0, tile + ((y * TILE_SIDE) + x));
+#endif
 	write_mem_fence(CLK_LOCAL_MEM_FENCE);		
 }
 
+float ReadTile(
+	int x,						// coordinates of ...
+	int y,						// ... the pixel to be fetched
+	local TILE_PIXEL *tile) {	// 48x48 portion of plane in local memory
+
+#ifdef HALF_TILE
+	return vload_half(0, (local half*)tile + ((y * TILE_SIDE) + x));
+#else
+	return tile[(y * TILE_SIDE) + x];
+#endif
+}
+
 float4 ReadTile4(
-	int x,					// coordinates of a strip ...
-	int y,					// ... of 4 pixels to be fetched
-	local float *tile) {	// 48x48 portion of plane in local memory
+	int x,						// coordinates of a strip ...
+	int y,						// ... of 4 pixels to be fetched
+	local TILE_PIXEL *tile) {	// 48x48 portion of plane in local memory
 
 	float4 result;
 
+#ifdef HALF_TILE
+	result = vload_half4(0, (local half*)tile + ((y * TILE_SIDE) + x));
+#else
 	result = vload4(0, tile + ((y * TILE_SIDE) + x));
+#endif
 	read_mem_fence(CLK_LOCAL_MEM_FENCE);
 	return result;
 }
 
 float16 ReadTile16(
-	int x,					// coordinates of a strip ...
-	int y,					// ... of 16 pixels to be fetched
-	local float *tile) {	// 48x48 portion of plane in local memory
+	int x,						// coordinates of a strip ...
+	int y,						// ... of 16 pixels to be fetched
+	local TILE_PIXEL *tile) {	// 48x48 portion of plane in local memory
 
 	float16 result;
 
+#ifdef HALF_TILE
+	result = vload_half16(0, (local half*)tile + ((y * TILE_SIDE) + x));
+#else
 	result = vload16(0, tile + ((y * TILE_SIDE) + x));
+#endif
 	read_mem_fence(CLK_LOCAL_MEM_FENCE);
 	return result;
 }
@@ -137,7 +208,7 @@ void FetchAndMirror48x48(
 	const		int2		local_id,		// Work item
 	const		int2		source,			// coordinates
 	const		int			linear,			// process plane in linear space instead of gamma space
-	local		float		*tile) {		// existing block of local memory populated with 48x48 pixels
+	local		TILE_PIXEL	*tile) {		// existing block of local memory populated with 48x48 pixels
 	// Fetch pixels from source and populate a 48x48 tile of pixels.
 	//
 	// The tile is defined as a 32x32 region to be filtered plus an 
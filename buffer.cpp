@@ -5,11 +5,59 @@
  * Copyright 2013, Jawed Ashraf - Deathray@cupidity.f9.co.uk
  */
 
+#include <string.h>
+#include <malloc.h>
 #include "buffer.h"
 #include "CLutil.h"
 #include "util.h"
+#include "ThreadPool.h"
+#include "trace.h"
+
+extern cl_context	g_context ;
+extern ThreadPool	g_thread_pool;
+
+// Rows copied by each task of CopyRows, fewer rows are copied by a single thread
+#define ROWS_PER_COPY_TASK 64
+
+// Alignment of host memory used by planes. Zero-copy use of host memory 
+// requires page alignment and rows aligned to cache lines on some devices.
+#define HOST_MEMORY_ALIGNMENT 4096
+#define HOST_MEMORY_PITCH_POWER_OF_2 6
+
+struct row_copy {
+	const unsigned char	*source;
+	size_t				source_pitch;
+	int					row_bytes;
+	int					rows;
+	size_t				dest_pitch;
+	unsigned char		*dest;
+};
+
+static void CopyRowsTask(void *context, const int &task_id) {
+	const row_copy *copy = static_cast<const row_copy*>(context);
+
+	const int first = task_id * ROWS_PER_COPY_TASK;
+	const int last = min(first + ROWS_PER_COPY_TASK, copy->rows);
+	for (int row = first; row < last; ++row)
+		memcpy(copy->dest + row * copy->dest_pitch, copy->source + row * copy->source_pitch, copy->row_bytes);
+}
 
-extern cl_context g_context ;
+void CopyRows(
+	const	unsigned char	*source,
+	const	size_t			&source_pitch,
+	const	int				&row_bytes,
+	const	int				&rows,
+	const	size_t			&dest_pitch,
+			unsigned char	*dest) {
+
+	row_copy copy = {source, source_pitch, row_bytes, rows, dest_pitch, dest};
+	const int task_count = (rows + ROWS_PER_COPY_TASK - 1) / ROWS_PER_COPY_TASK;
+	if (task_count > 1) {
+		g_thread_pool.Execute(task_count, &CopyRowsTask, &copy);
+	} else if (task_count == 1) {
+		CopyRowsTask(&copy, 0);
+	}
+}
 
 // mem
 mem::mem() {
@@ -18,6 +66,10 @@ mem::mem() {
 }
 
 mem::~mem() {
+	Release();
+}
+
+void mem::Release() {
 
 	if (mem_ == NULL) return;
 
@@ -122,13 +174,95 @@ result buffer::CopyFrom(
 	return FILTER_OK;
 }
 
+// staging
+staging::staging() {
+	host_ = NULL;
+	held_ = NULL;
+}
+
+staging::~staging() {
+	Acquire();
+	if (host_ == NULL) return;
+
+	cl_event unmapped = NULL;
+	if (clEnqueueUnmapMemObject(cq_, mem_, host_, 0, NULL, &unmapped) == CL_SUCCESS) {
+		CountEvent(&unmapped);
+		clWaitForEvents(1, &unmapped);
+		ReleaseEvent(unmapped);
+	}
+	host_ = NULL;
+}
+
+void staging::Init(
+	const cl_command_queue	&cq,
+	const size_t			&bytes) {
+
+	cl_int cl_status = CL_SUCCESS;
+
+	cq_ = cq;
+
+	mem_ = clCreateBuffer(g_context,
+						  CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR,
+						  bytes,
+						  NULL,
+						  &cl_status);
+	if (cl_status != CL_SUCCESS) {  
+		g_last_cl_error = cl_status;
+		return;
+	}
+
+	host_ = static_cast<unsigned char*>(clEnqueueMapBuffer(cq_,
+														   mem_,
+														   CL_TRUE,
+														   CL_MAP_READ | CL_MAP_WRITE,
+														   0,
+														   bytes,
+														   0,
+														   NULL,
+														   NULL,
+														   &cl_status));
+	if (cl_status != CL_SUCCESS) {  
+		g_last_cl_error = cl_status;
+		host_ = NULL;
+		return;
+	}
+
+	valid_ = true;
+}
+
+void staging::Acquire() {
+	if (held_ == NULL) return;
+
+	clWaitForEvents(1, &held_);
+	ReleaseEvent(held_);
+	held_ = NULL;
+}
+
+void staging::Hold(const cl_event &event) {
+	RetainEvent(event);
+	held_ = event;
+}
+
 // plane
+plane::plane() {
+	readback_ = NULL;
+	readback_mapped_ = false;
+	host_memory_ = NULL;
+}
+
+plane::~plane() {
+	Release();
+	if (host_memory_ != NULL) _aligned_free(host_memory_);
+	host_memory_ = NULL;
+}
+
 void plane::Init(
 	const cl_command_queue	&cq,
 	const int				&width, 
 	const int				&height,
 	const int				&width_constraint,
-	const int				&height_constraint) {
+	const int				&height_constraint,
+	const bool				&host_memory) {
 
 	cl_int cl_status = CL_SUCCESS;
 
@@ -140,14 +274,39 @@ void plane::Init(
 					   &width_, 
 					   &height_);
 
+	cl_mem_flags flags = CL_MEM_READ_WRITE;
+	size_t pitch = 0;
+	if (host_memory) {
+		pitch = ByPowerOf2(width_ << 2, HOST_MEMORY_PITCH_POWER_OF_2);
+		host_memory_ = static_cast<unsigned char*>(_aligned_malloc(pitch * height_, HOST_MEMORY_ALIGNMENT));
+		if (host_memory_ != NULL) {
+			flags |= CL_MEM_USE_HOST_PTR;
+		} else {
+			pitch = 0;
+		}
+	}
+
 	mem_ = clCreateImage2D(g_context,
-						   CL_MEM_READ_WRITE,
+						   flags,
 						   &GetFormatPixel(),
 						   width_,
 						   height_,
-						   0,
-						   NULL,
+						   pitch,
+						   host_memory_,
 						   &cl_status);
+	if (cl_status != CL_SUCCESS && host_memory_ != NULL) {
+		// The device declined the host memory, so it allocates instead
+		_aligned_free(host_memory_);
+		host_memory_ = NULL;
+		mem_ = clCreateImage2D(g_context,
+							   CL_MEM_READ_WRITE,
+							   &GetFormatPixel(),
+							   width_,
+							   height_,
+							   0,
+							   NULL,
+							   &cl_status);
+	}
 	if (cl_status != CL_SUCCESS) {  
 		g_last_cl_error = cl_status;
 		return;
@@ -168,6 +327,8 @@ result plane::CopyTo(
 
 	cl_int cl_status = CL_SUCCESS;
 
+	// An event is only needed for tracing
+	cl_event copied = NULL;
 	size_t zero_offset[] = {0, 0, 0}; 
 	size_t copy_region[] = {ByPowerOf2(host_cols, 2) >> 2, host_rows, 1};
 	cl_status = clEnqueueWriteImage(cq_,
@@ -180,11 +341,16 @@ result plane::CopyTo(
 									&host_buffer,
 									0,
 									NULL,
-									NULL);
+									Tracing() ? &copied : NULL);
 	if (cl_status != CL_SUCCESS) {  
 		g_last_cl_error = cl_status;
 		return FILTER_COPYING_TO_PLANE_FAILED;
 	}
+	if (copied != NULL) {
+		CountEvent(&copied);
+		TraceCommand("CopyToPlane", copied);
+		ReleaseEvent(copied);
+	}
 
 	valid_ = true;
 	return FILTER_OK;
@@ -220,6 +386,8 @@ result plane::CopyToAsynch(
 		g_last_cl_error = cl_status;
 		return FILTER_COPYING_TO_PLANE_FAILED;
 	}
+	CountEvent(event);
+	TraceCommand("CopyToPlane", *event);
 
 	valid_ = true;
 	return FILTER_OK;
@@ -238,6 +406,9 @@ result plane::CopyFrom(
 	size_t zero_offset[] = {0, 0, 0}; 
 	size_t copy_region[] = {ByPowerOf2(host_cols,2) >> 2, host_rows, 1};
 
+	// An event is only needed for tracing
+	cl_event copied = NULL;
+
 	cl_status = clEnqueueReadImage(cq_,
 								   mem_,
 								   CL_FALSE,
@@ -248,16 +419,22 @@ result plane::CopyFrom(
 								   host_buffer,
 								   0,
 								   NULL,
-								   NULL);
+								   Tracing() ? &copied : NULL);
 	if (cl_status != CL_SUCCESS) {  
 		g_last_cl_error = cl_status;
 		return FILTER_COPYING_FROM_PLANE_FAILED;
 	}
+	if (copied != NULL) {
+		CountEvent(&copied);
+		TraceCommand("CopyFromPlane", copied);
+		ReleaseEvent(copied);
+	}
 
 	return FILTER_OK;
 }
 
 result plane::CopyFromAsynch(
+	const	int				&plane_row,
 	const	int				&host_cols,	 			
 	const	int				&host_rows,	 			
 	const	int				&host_pitch,
@@ -269,13 +446,13 @@ result plane::CopyFromAsynch(
 
 	cl_int cl_status = CL_SUCCESS;
 
-	size_t zero_offset[] = {0, 0, 0}; 
+	size_t origin[] = {0, plane_row, 0}; 
 	size_t copy_region[] = {ByPowerOf2(host_cols,2) >> 2, host_rows, 1};
 
 	cl_status = clEnqueueReadImage(cq_,
 								   mem_,
 								   CL_FALSE,
-								   zero_offset,
+								   origin,
 								   copy_region,
 								   host_pitch,
 								   0,
@@ -287,10 +464,297 @@ result plane::CopyFromAsynch(
 		g_last_cl_error = cl_status;
 		return FILTER_COPYING_FROM_PLANE_FAILED;
 	}
+	CountEvent(event);
+	TraceCommand("CopyFromPlane", *event);
 
 	return FILTER_OK;
 }
 
+result plane::CopyToStagedAsynch(
+			staging			*pinned,
+	const	unsigned char	&host_buffer, 			
+	const	int				&host_cols,	 			
+	const	int				&host_rows,	 			
+	const	int				&host_pitch,
+			cl_event		*event) {
+	
+	if (!valid_) return FILTER_INVALID_PLANE_BUFFER_STATE;
+
+	// The device may still be reading the prior upload through the memory
+	pinned->Acquire();
+
+	valid_ = false;
+
+	const int row_bytes = ByPowerOf2(host_cols, 2);
+	CopyRows(&host_buffer, host_pitch, row_bytes, host_rows, row_bytes, pinned->host());
+
+	cl_int cl_status = CL_SUCCESS;
+
+	size_t zero_offset[] = {0, 0, 0}; 
+	size_t copy_region[] = {row_bytes >> 2, host_rows, 1};
+	cl_status = clEnqueueWriteImage(cq_,
+									mem_,
+									CL_FALSE,
+									zero_offset,
+									copy_region,
+									row_bytes,
+									0,
+									pinned->host(),
+									0,
+									NULL,
+									event);
+	if (cl_status != CL_SUCCESS) {  
+		g_last_cl_error = cl_status;
+		return FILTER_COPYING_TO_PLANE_FAILED;
+	}
+
+	CountEvent(event);
+	TraceCommand("CopyToPlane", *event);
+	pinned->Hold(*event);
+
+	valid_ = true;
+	return FILTER_OK;
+}
+
+result plane::CopyFromStagedAsynch(
+			staging			*pinned,
+	const	int				&plane_row,
+	const	int				&host_cols,	 			
+	const	int				&host_rows,	 			
+	const	int				&host_pitch,
+	const	cl_event		*antecedent,
+			cl_event		*event,
+			unsigned char	*host_buffer) {
+
+	if (!valid_) return FILTER_INVALID_PLANE_BUFFER_STATE;
+
+	cl_int cl_status = CL_SUCCESS;
+
+	// The host may still be copying the prior readback out of the memory
+	pinned->Acquire();
+
+	const int row_bytes = ByPowerOf2(host_cols, 2);
+	size_t origin[] = {0, plane_row, 0}; 
+	size_t copy_region[] = {row_bytes >> 2, host_rows, 1};
+
+	cl_event copied = NULL;
+	cl_status = clEnqueueReadImage(cq_,
+								   mem_,
+								   CL_FALSE,
+								   origin,
+								   copy_region,
+								   row_bytes,
+								   0,
+								   pinned->host(),
+								   1,
+								   antecedent,
+								   &copied);
+	if (cl_status != CL_SUCCESS) {  
+		g_last_cl_error = cl_status;
+		return FILTER_COPYING_FROM_PLANE_FAILED;
+	}
+
+	CountEvent(&copied);
+	TraceCommand("CopyFromPlane", copied);
+
+	readback_mapped_ = false;
+	result status = StartReadback(pinned->host(), row_bytes, host_cols, host_rows, host_pitch, host_buffer, event);
+	if (status != FILTER_OK) return status;
+	pinned->Hold(*event);
+
+	cl_status = clSetEventCallback(copied, CL_COMPLETE, &plane::ReadbackComplete, this);
+	if (cl_status != CL_SUCCESS) {  
+		g_last_cl_error = cl_status;
+		return FILTER_COPYING_FROM_PLANE_FAILED;
+	}
+
+	// Waiting on the user event does not flush the queue
+	clFlush(cq_);
+
+	return FILTER_OK;
+}
+
+result plane::CopyToMappedAsynch(
+	const	unsigned char	&host_buffer, 			
+	const	int				&host_cols,	 			
+	const	int				&host_rows,	 			
+	const	int				&host_pitch,
+			cl_event		*event) {
+	
+	if (!valid_) return FILTER_INVALID_PLANE_BUFFER_STATE;
+
+	valid_ = false;
+
+	cl_int cl_status = CL_SUCCESS;
+
+	const int row_bytes = ByPowerOf2(host_cols, 2);
+	size_t zero_offset[] = {0, 0, 0}; 
+	size_t copy_region[] = {row_bytes >> 2, host_rows, 1};
+	size_t mapped_pitch = 0;
+
+	unsigned char *mapped = static_cast<unsigned char*>(clEnqueueMapImage(cq_,
+																		  mem_,
+																		  CL_TRUE,
+																		  CL_MAP_WRITE,
+																		  zero_offset,
+																		  copy_region,
+																		  &mapped_pitch,
+																		  NULL,
+																		  0,
+																		  NULL,
+																		  NULL,
+																		  &cl_status));
+	if (cl_status != CL_SUCCESS) {  
+		g_last_cl_error = cl_status;
+		return FILTER_COPYING_TO_PLANE_FAILED;
+	}
+
+	CopyRows(&host_buffer, host_pitch, row_bytes, host_rows, mapped_pitch, mapped);
+
+	cl_status = clEnqueueUnmapMemObject(cq_, mem_, mapped, 0, NULL, event);
+	if (cl_status != CL_SUCCESS) {  
+		g_last_cl_error = cl_status;
+		return FILTER_COPYING_TO_PLANE_FAILED;
+	}
+	CountEvent(event);
+	TraceCommand("CopyToPlane", *event);
+
+	valid_ = true;
+	return FILTER_OK;
+}
+
+result plane::CopyFromMappedAsynch(
+	const	int				&plane_row,
+	const	int				&host_cols,	 			
+	const	int				&host_rows,	 			
+	const	int				&host_pitch,
+	const	cl_event		*antecedent,
+			cl_event		*event,
+			unsigned char	*host_buffer) {
+
+	if (!valid_) return FILTER_INVALID_PLANE_BUFFER_STATE;
+
+	cl_int cl_status = CL_SUCCESS;
+
+	const int row_bytes = ByPowerOf2(host_cols, 2);
+	size_t origin[] = {0, plane_row, 0}; 
+	size_t copy_region[] = {row_bytes >> 2, host_rows, 1};
+	size_t mapped_pitch = 0;
+
+	cl_event mapped_event = NULL;
+	unsigned char *mapped = static_cast<unsigned char*>(clEnqueueMapImage(cq_,
+																		  mem_,
+																		  CL_FALSE,
+																		  CL_MAP_READ,
+																		  origin,
+																		  copy_region,
+																		  &mapped_pitch,
+																		  NULL,
+																		  1,
+																		  antecedent,
+																		  &mapped_event,
+																		  &cl_status));
+	if (cl_status != CL_SUCCESS) {  
+		g_last_cl_error = cl_status;
+		return FILTER_COPYING_FROM_PLANE_FAILED;
+	}
+
+	CountEvent(&mapped_event);
+	TraceCommand("CopyFromPlane", mapped_event);
+
+	readback_mapped_ = true;
+	result status = StartReadback(mapped, mapped_pitch, host_cols, host_rows, host_pitch, host_buffer, event);
+	if (status != FILTER_OK) return status;
+
+	cl_status = clSetEventCallback(mapped_event, CL_COMPLETE, &plane::ReadbackComplete, this);
+	if (cl_status != CL_SUCCESS) {  
+		g_last_cl_error = cl_status;
+		return FILTER_COPYING_FROM_PLANE_FAILED;
+	}
+
+	// Waiting on the user event does not flush the queue
+	clFlush(cq_);
+
+	return FILTER_OK;
+}
+
+result plane::StartReadback(
+	const	unsigned char	*source,
+	const	size_t			&source_pitch,
+	const	int				&host_cols,	 			
+	const	int				&host_rows,	 			
+	const	int				&host_pitch,
+			unsigned char	*host_buffer,
+			cl_event		*event) {
+
+	cl_int cl_status = CL_SUCCESS;
+
+	readback_source_		= source;
+	readback_source_pitch_	= source_pitch;
+	readback_host_			= host_buffer;
+	readback_row_bytes_		= ByPowerOf2(host_cols, 2);
+	readback_rows_			= host_rows;
+	readback_host_pitch_	= host_pitch;
+
+	readback_ = clCreateUserEvent(g_context, &cl_status);
+	if (cl_status != CL_SUCCESS) {  
+		g_last_cl_error = cl_status;
+		return FILTER_COPYING_FROM_PLANE_FAILED;
+	}
+	CountEvent(&readback_);
+
+	// The client may release its event before the callback completes it
+	RetainEvent(readback_);
+	*event = readback_;
+
+	return FILTER_OK;
+}
+
+void CL_CALLBACK plane::ReadbackComplete(cl_event event, cl_int status, void *readback_plane) {
+	plane *source = static_cast<plane*>(readback_plane);
+	cl_event readback = source->readback_;
+
+	if (status == CL_COMPLETE) {
+		CopyRows(source->readback_source_,
+				 source->readback_source_pitch_,
+				 source->readback_row_bytes_,
+				 source->readback_rows_,
+				 source->readback_host_pitch_,
+				 source->readback_host_);
+	}
+	ReleaseEvent(event);
+
+	if (source->readback_mapped_) {
+		cl_event unmapped = NULL;
+		cl_int cl_status = clEnqueueUnmapMemObject(source->cq_, 
+												   source->mem_, 
+												   const_cast<unsigned char*>(source->readback_source_),
+												   0,
+												   NULL,
+												   &unmapped);
+		CountEvent(&unmapped);
+		if (cl_status == CL_SUCCESS) 
+			cl_status = clSetEventCallback(unmapped, CL_COMPLETE, &plane::UnmapComplete, source);
+		if (cl_status == CL_SUCCESS) {
+			clFlush(source->cq_);
+			return;
+		}
+		status = cl_status;
+	}
+
+	clSetUserEventStatus(readback, status == CL_COMPLETE ? CL_COMPLETE : status);
+	ReleaseEvent(readback);
+}
+
+void CL_CALLBACK plane::UnmapComplete(cl_event event, cl_int status, void *readback_plane) {
+	plane *source = static_cast<plane*>(readback_plane);
+	cl_event readback = source->readback_;
+
+	ReleaseEvent(event);
+	clSetUserEventStatus(readback, status == CL_COMPLETE ? CL_COMPLETE : status);
+	ReleaseEvent(readback);
+}
+
 cl_image_format GetFormatPixel() {
 	// Image processing uses floating point arithmetic.
 	// The device automatically converts integers between the host
@@ -8,16 +8,22 @@
 #ifndef _BUFFER_H_
 #define _BUFFER_H_
 
+#include <mutex>
 #include <CL/cl.h>
 #include "result.h"
 
+using namespace std;
+
 
 // mem
 // Abstract class used to track the lifetime of all types of buffer on the device.
 class mem {
 public:
 	mem();
-	~mem();
+
+	// Destructor
+	// Releases the OpenCL memory buffer
+	virtual ~mem();
 
 	// obj
 	// Returns the OpenCL memory buffer. Used to manipulate the 
@@ -38,6 +44,10 @@ public:
 	bool valid() {return valid_;}
 
 protected:
+	// Release
+	// Releases the OpenCL memory buffer, if any
+	void Release();
+
 	bool			 valid_ ;	// buffer is not usable unless set up correctly
 	cl_command_queue cq_    ;	// buffer is associated with a single device
 	cl_mem			 mem_   ;	// OpenCL buffer object
@@ -78,6 +88,54 @@ private:
 	virtual void Init() {}
 };
 
+// staging
+// Pinned host memory, allocated by the driver, which is mapped once for
+// the lifetime of the buffer. Copies between a plane and pinned memory
+// are performed by DMA, avoiding the bounce through a driver-owned
+// buffer that copies from pageable memory require.
+class staging: public mem {
+public:
+	staging();
+
+	// Destructor
+	// Waits for the latest copy through the memory, then unmaps it
+	~staging();
+
+	// Init
+	// Allocate and map pinned memory
+	virtual void Init(
+		const cl_command_queue	&cq,	// Specifies the device
+		const size_t			&bytes);// required size in bytes
+
+	// host
+	// Host's view of the pinned memory
+	unsigned char* host() {return host_;}
+
+	// Acquire
+	// Waits until the latest copy through the memory has finished, on
+	// the device and the host, so that the memory can be refilled.
+	void Acquire();
+
+	// Hold
+	// Records the event that completes once the memory is free again.
+	void Hold(const cl_event &event);
+
+	// in_use
+	// Locked by the copy that fills the memory, from Acquire to Hold,
+	// as planes copied by other threads share it
+	mutex& in_use() {return in_use_;}
+
+private:
+	unsigned char	*host_	;	// mapped pointer, valid from Init until destruction
+	cl_event		held_	;	// completion of the latest copy through the memory
+	mutex			in_use_	;	// serialises copies that share the memory
+
+	// Init
+	// Null Init() makes this class instantiable, overriding
+	// the abstract declaration in mem
+	virtual void Init() {}
+};
+
 // plane
 // A 2D read/write image buffer of pixels stored in fours
 // linearly, i.e. four pixels adjacent on a row.
@@ -87,6 +145,12 @@ private:
 //    zero-padded to work-around an underlying CAL bug
 class plane: public mem {
 public:
+	plane();
+
+	// Destructor
+	// Releases the plane before its host memory, if any
+	~plane();
+
 	// Init
 	// Set up a plane based upon pixel dimensions.
 	//
@@ -96,12 +160,18 @@ public:
 	// a kernel that accesses pixels in horizontal strips
 	// of 4 (uchar4, effectively) can specify a 
 	// width_constraint of 2.
+	//
+	// On a device that shares memory with the host, the plane
+	// can be created in page-aligned host memory, so that 
+	// mapping it, for CopyToMappedAsynch and CopyFromMappedAsynch,
+	// costs no copy by the driver.
 	virtual void Init(
 		const cl_command_queue	&cq,					// command queue, corresponds with the device holding the buffer
 		const int				&width,					// width in pixels
 		const int				&height,				// height in pixels
 		const int				&width_constraint,		// power of 2 specifier for width of buffer
-		const int				&height_constraint);	// power of 2 specifier for height of buffer
+		const int				&height_constraint,		// power of 2 specifier for height of buffer
+		const bool				&host_memory);			// plane uses host memory, CL_MEM_USE_HOST_PTR
 
 	// CopyTo
 	// Copy pixels from host buffer to device buffer
@@ -145,6 +215,63 @@ public:
 	//
 	// Event can be used to discern when copy has finished.
 	result CopyFromAsynch(
+		const	int				&plane_row,		// first row of the plane to be copied
+		const	int				&host_cols,	 	// count of pixels per row to be copied		
+		const	int				&host_rows,	 	// count of rows to be copied							
+		const	int				&host_pitch,	// size in pixels of each row of host buffer	
+		const	cl_event		*antecedent,	// event that must complete before this copy can start
+				cl_event		*event,			// event to track completion of this copy
+				unsigned char	*host_buffer);	// host's buffer of floats in row major layout
+
+	// CopyToStagedAsynch
+	// Same as CopyToAsynch, except that pixels are first copied, by all
+	// of the host's cores, into pinned memory from which the device
+	// copies by DMA.
+	result CopyToStagedAsynch(
+				staging			*pinned,		// pinned memory large enough for the pixels being copied
+		const	unsigned char	&host_buffer, 	// host's buffer of pixels in row major layout	
+		const	int				&host_cols,	 	// count of pixels per row to be copied		
+		const	int				&host_rows,	 	// count of rows to be copied		
+		const	int				&host_pitch,	// size in pixels of each row of host buffer
+				cl_event		*event);		// event to track completion of this copy
+
+	// CopyFromStagedAsynch
+	// Same as CopyFromAsynch, except that the device copies by DMA into
+	// pinned memory, from which pixels are copied to the host buffer
+	// by all of the host's cores. 
+	//
+	// Event is a user event that completes once the pixels are in the
+	// host buffer.
+	result CopyFromStagedAsynch(
+				staging			*pinned,		// pinned memory large enough for the pixels being copied
+		const	int				&plane_row,		// first row of the plane to be copied
+		const	int				&host_cols,	 	// count of pixels per row to be copied		
+		const	int				&host_rows,	 	// count of rows to be copied							
+		const	int				&host_pitch,	// size in pixels of each row of host buffer	
+		const	cl_event		*antecedent,	// event that must complete before this copy can start
+				cl_event		*event,			// event to track completion of this copy
+				unsigned char	*host_buffer);	// host's buffer of floats in row major layout
+
+	// CopyToMappedAsynch
+	// Same as CopyToAsynch, for devices that share memory with the host.
+	// The plane is mapped and pixels are written directly into it, by
+	// all of the host's cores.
+	result CopyToMappedAsynch(
+		const	unsigned char	&host_buffer, 	// host's buffer of pixels in row major layout	
+		const	int				&host_cols,	 	// count of pixels per row to be copied		
+		const	int				&host_rows,	 	// count of rows to be copied		
+		const	int				&host_pitch,	// size in pixels of each row of host buffer
+				cl_event		*event);		// event to track completion of this copy
+
+	// CopyFromMappedAsynch
+	// Same as CopyFromAsynch, for devices that share memory with the 
+	// host. Once the antecedent completes the plane is mapped and pixels
+	// are read directly from it, by all of the host's cores.
+	//
+	// Event is a user event that completes once the pixels are in the
+	// host buffer and the plane is unmapped.
+	result CopyFromMappedAsynch(
+		const	int				&plane_row,		// first row of the plane to be copied
 		const	int				&host_cols,	 	// count of pixels per row to be copied		
 		const	int				&host_rows,	 	// count of rows to be copied							
 		const	int				&host_pitch,	// size in pixels of each row of host buffer	
@@ -157,12 +284,58 @@ protected:
 	int		height_;	// height of plane buffer
 
 private:
+	// ReadbackComplete
+	// Callback for the device's half of a staged or mapped copy to host.
+	// Copies the pixels to the host buffer then completes the client's
+	// event, or unmaps the plane first if it was mapped.
+	static void CL_CALLBACK ReadbackComplete(cl_event event, cl_int status, void *readback_plane);
+
+	// UnmapComplete
+	// Callback that completes the client's event once a mapped plane
+	// has been unmapped.
+	static void CL_CALLBACK UnmapComplete(cl_event event, cl_int status, void *readback_plane);
+
+	// StartReadback
+	// Records the copy to host that is completed by ReadbackComplete and
+	// creates the client's event.
+	result StartReadback(
+		const	unsigned char	*source,		// pixels as seen by the host once the device's copy completes
+		const	size_t			&source_pitch,	// size in bytes of each row of source
+		const	int				&host_cols,	 	// count of pixels per row to be copied		
+		const	int				&host_rows,	 	// count of rows to be copied							
+		const	int				&host_pitch,	// size in pixels of each row of host buffer	
+				unsigned char	*host_buffer,	// host's buffer
+				cl_event		*event);		// client's event
+
+	unsigned char	*host_memory_	;	// page-aligned memory holding the plane, when using host memory
+	cl_event		readback_		;	// user event completed when the copy to host has finished
+	const unsigned char	*readback_source_;	// pinned or mapped pixels being copied to host
+	size_t			readback_source_pitch_;	// size in bytes of each row of readback_source_
+	unsigned char	*readback_host_	;	// host's buffer receiving the pixels
+	int				readback_row_bytes_;	// bytes copied per row
+	int				readback_rows_	;	// count of rows copied
+	int				readback_host_pitch_;	// size in bytes of each row of readback_host_
+	bool			readback_mapped_;	// plane is mapped and must be unmapped once the copy to host is complete
+
 	// Init
 	// Null Init() makes this class instantiable, overriding
 	// the abstract declaration in mem
 	virtual void Init() {}
 };
 
+// CopyRows
+// Copies rows of pixels between host buffers, with the rows divided
+// into tasks of ROWS_PER_COPY_TASK rows run by g_thread_pool and the
+// calling thread. A copy of a single task runs on the calling thread.
+// Used by staged and mapped copies alike.
+void CopyRows(
+	const	unsigned char	*source,		// first row to be copied
+	const	size_t			&source_pitch,	// size in bytes of each row of source
+	const	int				&row_bytes,		// size in bytes to copy per row
+	const	int				&rows,			// count of rows to be copied
+	const	size_t			&dest_pitch,	// size in bytes of each row of dest
+			unsigned char	*dest);			// first row to be written
+
 // GetFormatPixel
 // Returns a structure containing the correct settings
 // for a 2D buffer of pixels organised in 4s horizontally.
@@ -8,6 +8,60 @@
 #include "buffer_map.h"
 #include "CLutil.h" 
 
+void buffer_map::Init(
+	const	bool	&host_unified_memory,
+	const	size_t	&capacity,
+	const	size_t	&max_alloc) {
+
+	host_unified_memory_	= host_unified_memory;
+	capacity_				= capacity;
+	max_alloc_				= max_alloc;
+}
+
+size_t buffer_map::allocated() {
+	lock_guard<recursive_mutex> lock(mutex_);
+	return allocated_;
+}
+
+size_t buffer_map::available() {
+	lock_guard<recursive_mutex> lock(mutex_);
+	return capacity_ - allocated_;
+}
+
+size_t buffer_map::max_alloc() {
+	return max_alloc_;
+}
+
+size_t buffer_map::PlaneBytes(const int &width, const int &height) {
+	int device_width, device_height;
+	GetFrameDimensions(width, height, 2, 0, &device_width, &device_height);
+
+	// Each element of the plane is 4 pixels
+	return static_cast<size_t>(device_width) * device_height << 2;
+}
+
+size_t buffer_map::StagingBytes(const int &width, const int &height) {
+	return 2 * static_cast<size_t>(ByPowerOf2(width, 2)) * height;
+}
+
+bool buffer_map::Reserve(const size_t &bytes) {
+	lock_guard<recursive_mutex> lock(mutex_);
+
+	if (bytes > capacity_ - allocated_) return false;
+	allocated_ += bytes;
+	return true;
+}
+
+void buffer_map::Release(const size_t &bytes) {
+	lock_guard<recursive_mutex> lock(mutex_);
+	allocated_ -= bytes;
+}
+
+void buffer_map::Account(const int &index, const size_t &bytes) {
+	lock_guard<recursive_mutex> lock(mutex_);
+	bytes_map_[index] = bytes;
+}
+
 int buffer_map::NewIndex() {
 
 	if (buffer_map_.size() != 0)
@@ -17,9 +71,11 @@ int buffer_map::NewIndex() {
 }
 
 result buffer_map::Append(mem **new_mem, int *new_index) {
+	lock_guard<recursive_mutex> lock(mutex_);
 
 	pair<map<int, mem*>::iterator, bool> insertionStatus;
 
+	CountSetup();
 	*new_index = NewIndex();
 	insertionStatus = buffer_map_.insert(pair<int, mem*>(*new_index, *new_mem));
 
@@ -36,13 +92,18 @@ result buffer_map::AllocBuffer(
 
 	result status = FILTER_OK;
 
+	if (bytes > max_alloc_ || !Reserve(bytes)) return FILTER_BUFFER_ALLOCATION_FAILED;
+
 	buffer *new_float_buffer = new buffer;
 	new_float_buffer->Init(cq, bytes);
 	if (new_float_buffer->valid()) {
 		mem *new_mem = new_float_buffer;
 		status = Append(&new_mem, new_index);
+		if (status == FILTER_OK) Account(*new_index, bytes);
 		return status;
 	} else {
+		delete new_float_buffer;
+		Release(bytes);
 		return FILTER_BUFFER_ALLOCATION_FAILED;
 	}
 }
@@ -53,7 +114,7 @@ result buffer_map::CopyToBuffer(
 	const	size_t	&bytes) {
 
 	buffer *destination;
-	destination = static_cast<buffer*>(buffer_map_[index]);
+	destination = static_cast<buffer*>(Find(index));
 	return destination->CopyTo(host_buffer, bytes);
 }
 
@@ -63,7 +124,7 @@ result buffer_map::CopyFromBuffer(
 			void	*host_buffer) {
 
 	buffer *source;
-	source = static_cast<buffer*>(buffer_map_[index]);
+	source = static_cast<buffer*>(Find(index));
 	return source->CopyFrom(bytes, host_buffer);
 }
 
@@ -75,17 +136,91 @@ result buffer_map::AllocPlane(
 
 	result status = FILTER_OK;
 
+	const size_t bytes = PlaneBytes(width, height);
+	if (!Reserve(bytes)) return FILTER_PLANE_ALLOCATION_FAILED;
+
 	plane *new_plane = new plane;
-	new_plane->Init(cq, width, height, 2, 0);
+	new_plane->Init(cq, width, height, 2, 0, host_unified_memory_);
 	if (new_plane->valid()) {
 		mem *new_mem = new_plane;
 		status = Append(&new_mem, new_index);
+		if (status == FILTER_OK) Account(*new_index, bytes);
+		if (status == FILTER_OK && !host_unified_memory_) AllocStaging(cq, width, height, *new_index);
 		return status;
 	} else {
+		delete new_plane;
+		Release(bytes);
 		return FILTER_PLANE_ALLOCATION_FAILED;
 	}
 }
 
+void buffer_map::AllocStaging(
+	const	cl_command_queue	&cq,	
+	const	int					&width, 
+	const	int					&height,
+	const	int					&index) {
+
+	lock_guard<recursive_mutex> lock(mutex_);
+
+	staging_pool *pool = NULL;
+	for (size_t i = 0; i < staging_pools_.size() && pool == NULL; ++i) {
+		staging_pool *candidate = staging_pools_[i];
+		if (candidate->cq == cq && candidate->width == width && candidate->height == height) pool = candidate;
+	}
+
+	if (pool == NULL) {
+		const size_t bytes = StagingBytes(width, height) / 2;
+		pool = new staging_pool;
+		pool->cq		= cq;
+		pool->width		= width;
+		pool->height	= height;
+		pool->next		= 0;
+		pool->planes	= 0;
+		for (int i = 0; i < 2; ++i) {
+			pool->pinned[i] = NULL;
+			if (!Reserve(bytes)) continue;
+
+			staging *new_staging = new staging;
+			new_staging->Init(cq, bytes);
+			if (new_staging->valid()) {
+				pool->pinned[i] = new_staging;
+			} else {
+				delete new_staging;
+				Release(bytes);
+			}
+		}
+		staging_pools_.push_back(pool);
+	}
+
+	++pool->planes;
+	staging_map_[index] = pool;
+}
+
+void buffer_map::DestroyStaging(const int &index) {
+	lock_guard<recursive_mutex> lock(mutex_);
+
+	map<int, staging_pool*>::iterator found = staging_map_.find(index);
+	if (found == staging_map_.end()) return;
+
+	staging_pool *pool = found->second;
+	staging_map_.erase(found);
+	if (--pool->planes > 0) return;
+
+	const size_t bytes = StagingBytes(pool->width, pool->height) / 2;
+	for (int i = 0; i < 2; ++i) {
+		if (pool->pinned[i] == NULL) continue;
+		delete pool->pinned[i];
+		Release(bytes);
+	}
+	for (size_t i = 0; i < staging_pools_.size(); ++i) {
+		if (staging_pools_[i] == pool) {
+			staging_pools_.erase(staging_pools_.begin() + i);
+			break;
+		}
+	}
+	delete pool;
+}
+
 result buffer_map::CopyToPlane(
 	const	int		&index,
 	const	byte	&host_buffer, 			
@@ -94,7 +229,7 @@ result buffer_map::CopyToPlane(
 	const	int		&host_pitch) {
 
 	plane *destination;
-	destination = static_cast<plane*>(buffer_map_[index]);
+	destination = static_cast<plane*>(Find(index));
 	return destination->CopyTo(host_buffer, host_cols, host_rows, host_pitch);
 }
 
@@ -107,7 +242,14 @@ result buffer_map::CopyToPlaneAsynch(
 			cl_event	*event) {
 
 	plane *destination;
-	destination = static_cast<plane*>(buffer_map_[index]);
+	destination = static_cast<plane*>(Find(index));
+	if (host_unified_memory_) 
+		return destination->CopyToMappedAsynch(host_buffer, host_cols, host_rows, host_pitch, event);
+	staging *staged = NextStaging(index);
+	if (staged != NULL) {
+		lock_guard<mutex> in_use(staged->in_use());
+		return destination->CopyToStagedAsynch(staged, host_buffer, host_cols, host_rows, host_pitch, event);
+	}
 	return destination->CopyToAsynch(host_buffer, host_cols, host_rows, host_pitch, event);
 }
 
@@ -119,12 +261,13 @@ result buffer_map::CopyFromPlane(
 			byte	*host_buffer) {
 
 	plane *source;
-	source = static_cast<plane*>(buffer_map_[index]);
+	source = static_cast<plane*>(Find(index));
 	return source->CopyFrom(host_cols, host_rows, host_pitch, host_buffer);
 }
 
 result buffer_map::CopyFromPlaneAsynch(
 	const	int			&index,
+	const	int			&plane_row,
 	const	int			&host_cols,	 			
 	const	int			&host_rows,	 			
 	const	int			&host_pitch,
@@ -133,30 +276,39 @@ result buffer_map::CopyFromPlaneAsynch(
 			byte		*host_buffer) {
 
 	plane *source;
-	source = static_cast<plane*>(buffer_map_[index]);
-	return source->CopyFromAsynch(host_cols, host_rows, host_pitch, antecedent, event, host_buffer);
+	source = static_cast<plane*>(Find(index));
+	if (host_unified_memory_) 
+		return source->CopyFromMappedAsynch(plane_row, host_cols, host_rows, host_pitch, antecedent, event, host_buffer);
+	staging *staged = NextStaging(index);
+	if (staged != NULL) {
+		lock_guard<mutex> in_use(staged->in_use());
+		return source->CopyFromStagedAsynch(staged, plane_row, host_cols, host_rows, host_pitch, antecedent, event, host_buffer);
+	}
+	return source->CopyFromAsynch(plane_row, host_cols, host_rows, host_pitch, antecedent, event, host_buffer);
 }
 
 void buffer_map::Destroy(const int &index) { 
+	lock_guard<recursive_mutex> lock(mutex_);
+
 	if (! ValidIndex(index)) return;	
 		
-	// Check reference count
-	cl_uint reference_count = 0;
-	clGetMemObjectInfo(buffer_map_[index]->obj(),
-					   CL_MEM_REFERENCE_COUNT,
-					   sizeof(cl_uint),
-					   &reference_count,
-					   0);
-
-	// Repeatedly release it to ensure it will be destroyed
-	for (cl_uint i = 0; i < reference_count; ++i) {
-		clReleaseMemObject(buffer_map_[index]->obj());
-	}
+	// Repeatedly releases the buffer to ensure it will be destroyed, 
+	// before freeing any host memory it uses
+	delete buffer_map_[index];
 
 	buffer_map_.erase(index);
+
+	if (bytes_map_.count(index) > 0) {
+		allocated_ -= bytes_map_[index];
+		bytes_map_.erase(index);
+	}
+
+	DestroyStaging(index);
 }
 
 void buffer_map::DestroyAll() {
+	lock_guard<recursive_mutex> lock(mutex_);
+
 	map<int, mem*>::iterator each_buffer;
 	map<int, mem*>::iterator next_buffer;
 	each_buffer = buffer_map_.begin();
@@ -170,9 +322,27 @@ void buffer_map::DestroyAll() {
 }
 
 bool buffer_map::ValidIndex(const int &index) {
+	lock_guard<recursive_mutex> lock(mutex_);
 	return buffer_map_.count(index) > 0;
 }
 
 cl_mem* buffer_map::ptr(const int &index) {
-	return buffer_map_[index]->ptr();
+	return Find(index)->ptr();
+}
+
+mem* buffer_map::Find(const int &index) {
+	lock_guard<recursive_mutex> lock(mutex_);
+	return buffer_map_[index];
+}
+
+staging* buffer_map::NextStaging(const int &index) {
+	lock_guard<recursive_mutex> lock(mutex_);
+	map<int, staging_pool*>::iterator found = staging_map_.find(index);
+	if (found == staging_map_.end()) return NULL;
+
+	// Either memory serves when the other could not be pinned
+	staging_pool *pool = found->second;
+	staging *pinned = pool->pinned[pool->next];
+	pool->next ^= 1;
+	return (pinned != NULL) ? pinned : pool->pinned[pool->next];
 }
@@ -9,6 +9,8 @@
 #define _BUFFER_MAP_H_
 
 #include <map>
+#include <vector>
+#include <mutex>
 #include "buffer.h"
 #include "util.h"
 
@@ -18,11 +20,59 @@
 // Buffers can be either plain old data or 
 // 8-bit pixels of luma or chroma data, 
 // known as "plane".
+//
+// Asynchronous copies of planes are made through pinned staging
+// memory. Planes of the same size copied through the same queue
+// share a pool of two, which copies alternate between. On devices
+// that share memory with the host, planes are instead held in host
+// memory and mapped for copies, without copying by the driver.
+//
+// Filter instances on separate threads share the device's map,
+// so the map is locked while buffers are added, found or removed.
+//
+// Bytes allocated by all instances are counted against the device's
+// memory, so that an allocation that cannot fit fails before the
+// driver is asked for it, and so that instances can plan their
+// footprint against what remains.
 class buffer_map {
 public:
-	buffer_map() {}
+	buffer_map() : host_unified_memory_(false), capacity_(0), max_alloc_(0), allocated_(0) {}
 	~buffer_map() {}
 
+	// Init
+	// Records whether the device shares memory with the host,
+	// which selects mapping instead of staging for copies, and
+	// the limits of the device's memory.
+	void Init(
+		const	bool	&host_unified_memory,
+		const	size_t	&capacity,			// bytes of global memory on the device
+		const	size_t	&max_alloc);		// largest single buffer in bytes
+
+	// allocated
+	// Bytes held by buffers and planes in the map
+	size_t allocated();
+
+	// available
+	// Bytes of the device's memory not held by buffers and planes in the map
+	size_t available();
+
+	// max_alloc
+	// Bytes of the largest single buffer the device can allocate
+	size_t max_alloc();
+
+	// PlaneBytes
+	// Bytes on the device of a plane, including padding, see AllocPlane
+	static size_t PlaneBytes(
+		const	int		&width,			// width in pixels
+		const	int		&height);		// rows
+
+	// StagingBytes
+	// Bytes of pinned memory of the staging pool shared by planes of
+	// this size on a queue, see AllocPlane. Counted as device memory.
+	static size_t StagingBytes(
+		const	int		&width,			// width in pixels
+		const	int		&height);		// rows
+
 	// AllocBuffer
 	// Creates a new OpenCL buffer on the device and puts it in the map
 	// of open buffers.
@@ -71,7 +121,8 @@ public:
 		const	int		&host_pitch);	// size in pixels of each row of host buffer
 
 	// CopyToPlaneAsynch
-	// Copy pixels from host buffer to plane.
+	// Copy pixels from host buffer to plane, via staging or by
+	// mapping the plane.
 	// Method returns immediately, i.e. copy completion 
 	// is not guaranteed upon return. Event can be used
 	// to discern when copy has finished.
@@ -95,7 +146,8 @@ public:
 				byte	*host_buffer);	// host's buffer of pixels in row major layout			
 
 	// CopyFromPlaneAsynch
-	// Copy pixels from plane to host buffer.
+	// Copy pixels from plane to host buffer, via staging or by
+	// mapping the plane.
 	// Method returns immediately, i.e. copy completion 
 	// is not guaranteed upon return. 
 	// 
@@ -105,6 +157,7 @@ public:
 	// Event can be used to discern when copy has finished.
 	result CopyFromPlaneAsynch(
 		const	int			&index,			// index of the device buffer
+		const	int			&plane_row,		// first row of the plane to be copied
 		const	int			&host_cols,	 	// count of pixels per row to be copied				
 		const	int			&host_rows,	 	// count of rows to be copied							
 		const	int			&host_pitch,	// size in pixels of each row of host buffer
@@ -140,7 +193,66 @@ private:
 	// Checks that the buffer has been setup
 	bool ValidIndex(const int &index);
 
-	map<int, mem*> buffer_map_;
+	// Find
+	// Buffer or plane in the map
+	mem* Find(const int &index);
+
+	// NextStaging
+	// Staging memory for the plane's next copy, or NULL if the plane
+	// has none
+	staging* NextStaging(const int &index);
+
+	// Reserve
+	// Counts the bytes against the device's memory, returning false
+	// if they do not fit
+	bool Reserve(const size_t &bytes);
+
+	// Release
+	// Returns reserved bytes to the device's memory
+	void Release(const size_t &bytes);
+
+	// Account
+	// Records the reserved bytes of a new buffer or plane, so that
+	// Destroy returns them
+	void Account(const int &index, const size_t &bytes);
+
+	// staging_pool
+	// Pinned staging memory shared by the planes of a size that are
+	// copied through a queue. Copies alternate between the two, so 
+	// that one is filled or emptied while the device copies the other.
+	struct staging_pool {
+		cl_command_queue	cq			;	// queue of the planes' copies
+		int					width		;	// width of the planes in pixels
+		int					height		;	// rows of the planes
+		staging				*pinned[2]	;	// memory, NULL where it could not be pinned
+		int					next		;	// memory used by the next copy
+		int					planes		;	// count of planes using the pool
+	};
+
+	// AllocStaging
+	// Adds the plane to the staging pool of its queue and size, creating
+	// the pool if necessary. If pinned memory is not available the plane
+	// is copied directly instead.
+	void AllocStaging(
+		const	cl_command_queue	&cq,		// device specific command queue
+		const	int					&width,		// width in pixels
+		const	int					&height,	// rows
+		const	int					&index);	// map index of the plane
+
+	// DestroyStaging
+	// Removes the plane from its staging pool, destroying the pool once
+	// no plane uses it.
+	void DestroyStaging(const int &index);
+
+	map<int, mem*>		buffer_map_			;	// buffers and planes
+	vector<staging_pool*> staging_pools_	;	// pinned staging memory, by queue and size of plane
+	map<int, staging_pool*>	staging_map_	;	// staging pool of each plane, by index of plane
+	map<int, size_t>	bytes_map_			;	// bytes of buffers and planes, by index
+	bool				host_unified_memory_;	// planes are mapped instead of staged
+	size_t				capacity_			;	// bytes of global memory on the device
+	size_t				max_alloc_			;	// largest single buffer in bytes
+	size_t				allocated_			;	// bytes held by buffers and planes in the map
+	recursive_mutex		mutex_				;	// guards the maps against concurrent filter instances
 };
 
 #endif // _BUFFER_MAP_H_
\ No newline at end of file
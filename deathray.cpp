@@ -7,14 +7,26 @@
 
 
 #include <windows.h>
+#include <sstream>
+#include <fstream>
+#include <assert.h>
+#include <float.h>
+#include <string.h>
+#include <crtdbg.h>
+#include <atomic>
 #include "clutil.h"
 #include "device.h"
 #include "deathray.h"
 #include "SingleFrame.h"
 #include "MultiFrame.h"
 #include "MultiFrameRequest.h"
-
-#define DEVICE 0 // Filter architecture supports use of a single device
+#include "SingleFrameCPU.h"
+#include "MultiFrameCPU.h"
+#include "NLMHost.h"
+#include "ThreadPool.h"
+#include "nlm_algorithm.h"
+#include "Autotune.h"
+#include "trace.h"
 
 device	*g_devices		= NULL;
 int		g_device_count	= 0;
@@ -22,21 +34,23 @@ int		g_device_count	= 0;
 bool	g_opencl_available = false;
 bool	g_opencl_failed_to_initialise = false;
 
-// Buffer containing the gaussian weights
-int g_gaussian = 0;
+// Host engine, used when no OpenCL device is available
+bool		g_cpu_engine = false;
+ThreadPool	g_thread_pool;
 
-SingleFrame g_SingleFrame_Y;
-SingleFrame g_SingleFrame_U;
-SingleFrame g_SingleFrame_V;
+// Serialises the start of OpenCL by instances created on separate threads
+mutex		g_start_mutex;
 
-MultiFrame g_MultiFrame_Y; 
-MultiFrame g_MultiFrame_U;
-MultiFrame g_MultiFrame_V;
+// StopThreadPool
+// Joins the workers of g_thread_pool when a script environment shuts
+// down, before Avisynth unloads the plug-in, see ThreadPool::~ThreadPool
+void __cdecl StopThreadPool(void *user_data, IScriptEnvironment *env) {
+	g_thread_pool.Stop();
+}
 
-void GaussianGenerator(const float &sigma, const int &device_id) {
+void GaussianWeights(const float &sigma, float *gaussian) {
 	float two_sigma_squared = 2 * sigma * sigma;
 
-	float gaussian[49]; 
 	float gaussian_sum = 0;
 
 	for (int y = -3; y < 4; ++y) {
@@ -50,8 +64,88 @@ void GaussianGenerator(const float &sigma, const int &device_id) {
 	for (int i = 0; i < 49; ++i)
 		gaussian[i] /= gaussian_sum;
 
-	g_devices[device_id].buffers_.AllocBuffer(g_devices[device_id].cq(), 49 * sizeof(float), &g_gaussian);
-	g_devices[device_id].buffers_.CopyToBuffer(g_gaussian, gaussian, 49 * sizeof(float));
+	// The 7x7 kernel is the product of this 1-dimensional kernel with itself,
+	// used by NLM_SEPARABLE
+	gaussian_sum = 0;
+	for (int x = -3; x < 4; ++x) {
+		gaussian[49 + x + 3] = exp(-(x * x) / two_sigma_squared);
+		gaussian_sum += gaussian[49 + x + 3];
+	}
+
+	for (int i = 49; i < 56; ++i)
+		gaussian[i] /= gaussian_sum;
+}
+
+// Rows copied from each neighbouring band, matching the 8-pixel apron
+// of the tiles filtered by the kernels
+#define BAND_APRON 8
+
+// Minimum rows of a band, so that the apron is a small fraction of it
+#define BAND_MINIMUM_ROWS 32
+
+// SplitBands
+// Divides the rows of a plane into a band per device. Bands are copied
+// with an apron from each neighbour, so that pixels near the edge of a 
+// band are filtered with real pixels rather than mirrored pixels.
+void SplitBands(const int &height, const int &band_count, frame_band *bands) {
+	const int step = (height + band_count - 1) / band_count;
+	for (int i = 0; i < band_count; ++i) {
+		const int start = min(i * step, height);
+		const int end = min(start + step, height);
+		bands[i].first			= max(start - BAND_APRON, 0);
+		bands[i].apron			= start - bands[i].first;
+		bands[i].rows			= end - start;
+		bands[i].device_rows	= min(end + BAND_APRON, height) - bands[i].first;
+	}
+}
+
+// Largest number a half holds
+#define HALF_MAXIMUM 65504
+
+// HalfSumsFit
+// Running sums of multi frame filtering add up a weight of at most 1
+// for each of the (6x+1)^2 samples around a pixel, in each of the 
+// 2t+1 frames, and pixels of at most 1. Halves hold them, i.e. hi
+// applies, while the largest possible sum is at most HALF_MAXIMUM.
+bool HalfSumsFit(const int &sample_expand, const int &temporal_radius) {
+	const int side = 6 * sample_expand + 1;
+	return side * side * (2 * temporal_radius + 1) <= HALF_MAXIMUM;
+}
+
+void GaussianGenerator(const float &sigma, const int &device_id, int *gaussian_buffer) {
+	float gaussian[56]; 
+	GaussianWeights(sigma, gaussian);
+
+	g_devices[device_id].buffers_.AllocBuffer(g_devices[device_id].cq(), 56 * sizeof(float), gaussian_buffer);
+	g_devices[device_id].buffers_.CopyToBuffer(*gaussian_buffer, gaussian, 56 * sizeof(float));
+}
+
+// StartDevices
+// Starts OpenCL on the first call, for all instances. Without an 
+// OpenCL device, filtering falls back to the host's cores.
+result StartDevices() {
+	lock_guard<mutex> serialise(g_start_mutex);
+
+	// The outcome is kept for later callers, each on its own thread
+	static result status = FILTER_OK;
+	static cl_int cl_error = CL_SUCCESS;
+	if (g_devices != NULL || g_cpu_engine) {
+		g_last_cl_error = cl_error;
+		return status;
+	}
+
+	int device_count = 0;
+	status = StartOpenCL(&device_count);
+	cl_error = g_last_cl_error;
+	if (device_count != 0) {
+		g_opencl_available = true;
+	} else {
+		g_opencl_failed_to_initialise = true;
+		g_cpu_engine = true;
+		status = FILTER_OK;
+	}
+
+	return status;
 }
 
 deathray::deathray(PClip child, 
@@ -65,6 +159,19 @@ deathray::deathray(PClip child,
 				   int correction,
 				   int target_min,
 				   int balanced,
+				   int algorithm,
+				   int pipelined,
+				   int prefetch_depth,
+				   int max_devices,
+				   int split,
+				   int half_tile,
+				   int tune,
+				   int tune_half_tile,
+				   int weight_cache,
+				   int fused,
+				   int half_intermediate,
+				   int memory_budget,
+				   const char *trace,
 				   IScriptEnvironment *env) :	GenericVideoFilter(child),
 												h_Y_(static_cast<float>(h_Y/10000.)), 
 												h_UV_(static_cast<float>(h_UV/10000.)), 
@@ -76,244 +183,871 @@ deathray::deathray(PClip child,
 												correction_(correction),
 												target_min_(target_min),
 												balanced_(balanced),
-												env_(env){
+												algorithm_(algorithm),
+												pipelined_(pipelined),
+												prefetch_depth_(prefetch_depth),
+												max_devices_(max_devices),
+												device_count_(1),
+												split_(split),
+												half_tile_(half_tile),
+												tune_(tune),
+												tune_half_tile_(tune_half_tile),
+												weight_cache_(weight_cache),
+												fused_(fused),
+												half_intermediate_(half_intermediate),
+												memory_budget_(memory_budget),
+												traced_(false),
+												initialised_(false),
+												start_status_(FILTER_OK),
+												start_cl_error_(CL_SUCCESS),
+												next_set_(0) {
+	for (int i = 0; i < MAX_DEVICES; ++i) {
+		gaussian_[i] = 0;
+		tuning_[i].algorithm = algorithm;
+		tuning_[i].half_tile = half_tile;
+	}
+	sets_.push_back(new filter_set);
+
+	// Tracing starts before OpenCL, so that queues are profiled
+	if (trace != NULL && *trace != '\0') {
+		TraceOpen(trace);
+		traced_ = true;
+	}
+
+	// Sums that halves cannot hold would become infinite, so they are
+	// kept as floats
+	if (half_intermediate_ && !HalfSumsFit(sample_expand_, max(temporal_radius_Y_, temporal_radius_UV_))) {
+		half_intermediate_ = 0;
+		ostringstream note;
+		note << "hi set to false, as sums of x=" << sample_expand_ << " and t=" << max(temporal_radius_Y_, temporal_radius_UV_) << " are too large for halves";
+		TraceNote(note.str());
+	}
+
+	// OpenCL starts while the rest of the script is parsed and its
+	// sources are opened, instead of delaying the first frame
+	if (h_Y_ > 0.f || h_UV_ > 0.f)
+		starter_ = thread(&deathray::Start, this);
 }
 
-result deathray::Init() {
-	if (g_devices != NULL) return FILTER_OK;
+deathray::~deathray() {
+	lock_guard<mutex> serialise(mutex_);
 
-	// No point continuing, as prior attempt failed
-	if (g_opencl_failed_to_initialise) return FILTER_ERROR;
+	if (starter_.joinable()) starter_.join();
 
-	int device_count = 0;
-	result status = StartOpenCL(&device_count);
-	if (device_count != 0) {
-		g_opencl_available = true;
-		GaussianGenerator(sigma_, DEVICE);
-		status = SetupFilters(DEVICE);
+	// Copies to the device may still be reading the held frames
+	for (size_t i = 0; i < sets_.size(); ++i) {
+		if (sets_[i]->pipelined_frame >= 0) MultiFrameFinish(*sets_[i], 0);
+	}
+
+	if (device_count_ > 1 && !split_) {
+		for (int i = 0; i < device_count_; ++i) 
+			Collect(i);
+	}
+
+	for (size_t i = 0; i < sets_.size(); ++i) 
+		delete sets_[i];
+
+	if (initialised_ && !g_cpu_engine) {
+		for (int i = 0; i < device_count_; ++i)
+			g_devices[i].buffers_.Destroy(gaussian_[i]);
+	}
+
+	if (traced_) TraceClose();
+}
+
+void deathray::Start() {
+	start_status_ = StartDevices();
+	start_cl_error_ = g_last_cl_error;
+	if (start_status_ != FILTER_OK || g_cpu_engine) return;
+
+	device_count_ = (max_devices_ == 0) ? g_device_count : min(max_devices_, g_device_count);
+	if (device_count_ > MAX_DEVICES) device_count_ = MAX_DEVICES;
+
+	// Variants used by the luma and chroma filters, see SingleFrame::Init
+	// and MultiFrame::InitKernels, are built now so that they are ready
+	// when the filters are configured. Solely multi frame filtering uses
+	// half intermediates.
+	const int half_intermediate_Y = temporal_radius_Y_ > 0 ? half_intermediate_ : 0;
+	const int half_intermediate_UV = temporal_radius_UV_ > 0 ? half_intermediate_ : 0;
+	for (int i = 0; i < device_count_; ++i) {
+		GaussianGenerator(sigma_, i, &gaussian_[i]);
+		if (h_Y_ > 0.f) 
+			g_devices[i].Variant(VariantOptions(sample_expand_, linear_, correction_, target_min_, balanced_, half_tile_, half_intermediate_Y));
+		if (h_UV_ > 0.f) 
+			g_devices[i].Variant(VariantOptions(sample_expand_, 0, correction_, target_min_, 0, half_tile_, half_intermediate_UV));
+	}
+}
+
+result deathray::Init(filter_set &set) {
+	if (initialised_) return FILTER_OK;
+
+	// Waits for whatever Start has yet to complete
+	if (starter_.joinable()) starter_.join();
+
+	result status = start_status_;
+	if (status != FILTER_OK) return status;
+
+	if (g_cpu_engine) {
+		status = CPUInit(set);
 	} else {
-		g_opencl_failed_to_initialise = true;
+		// Bands too short to be worth splitting leave devices to filter separate frames
+		if (device_count_ < 2 || heightUV_ < BAND_MINIMUM_ROWS * device_count_) split_ = 0;
+		if (split_) {
+			SplitBands(heightY_, device_count_, bands_Y_);
+			SplitBands(heightUV_, device_count_, bands_UV_);
+		}
+
+		// Devices filtering separate frames never see each other's weight
+		// maps, so a map saved on one device would never be read
+		if (device_count_ > 1 && !split_) weight_cache_ = 0;
+
+		if (tune_) {
+			for (int i = 0; i < device_count_; ++i) 
+				Tune(set, i);
+		}
+
+		// Degrading changes parameters shared by the devices, so all
+		// devices are planned before any is configured
+		PlanMemory(set);
+
+		for (int i = 0; i < device_count_ && status == FILTER_OK; ++i) 
+			status = SetupFilters(set, i);
 	}
 
+	lock_guard<mutex> serialise(mutex_);
+	initialised_ = (status == FILTER_OK);
 	return status;
 }
 
-result deathray::SetupFilters(const int &device_id) {
+filter_set* deathray::TakeSet(IScriptEnvironment *env, unique_lock<mutex> *held) {
+	filter_set *set = sets_[0];
+	{
+		lock_guard<mutex> serialise(mutex_);
+
+		if (initialised_ && !g_cpu_engine && device_count_ == 1) {
+			for (size_t i = 0; i < sets_.size(); ++i) {
+				if (sets_[i]->in_use.try_lock()) {
+					*held = unique_lock<mutex>(sets_[i]->in_use, adopt_lock);
+					return sets_[i];
+				}
+			}
+
+			// Every set is in use, so another is added, else the call
+			// waits for the sets in turn
+			if (AddSet(env)) {
+				*held = unique_lock<mutex>(sets_.back()->in_use);
+				return sets_.back();
+			}
+			set = sets_[next_set_++ % sets_.size()];
+		}
+	}
+
+	*held = unique_lock<mutex>(set->in_use);
+	return set;
+}
+
+bool deathray::AddSet(IScriptEnvironment *env) {
+	if (sets_.size() >= MAX_FILTER_SETS) return false;
+
+	// Frames kept by the device's frame_cache make way for filters, 
+	// while the instance's budget is shared by its sets
+	const size_t footprint = Footprint(0);
+	size_t budget = g_devices[0].buffers_.available() + g_devices[0].frames_.idle_bytes();
+	if (memory_budget_ > 0) {
+		const size_t limit = static_cast<size_t>(memory_budget_) << 20;
+		const size_t used = sets_.size() * footprint;
+		budget = min(budget, limit > used ? limit - used : 0);
+	}
+	if (footprint > budget) return false;
+	g_devices[0].frames_.Reclaim(footprint);
+
+	filter_set *set = new filter_set;
+	set->env = env;
+
+	result status = FILTER_OK;
+	if ((temporal_radius_Y_ == 0 && h_Y_ > 0.f) || (temporal_radius_UV_ == 0 && h_UV_ > 0.f))
+		status = SingleFrameInit(*set, 0);
+	if (status == FILTER_OK && ((temporal_radius_Y_ > 0 && h_Y_ > 0.f) || (temporal_radius_UV_ > 0 && h_UV_ > 0.f)))
+		status = MultiFrameInit(*set, 0);
+
+	// Filtering continues with the sets already configured
+	if (status != FILTER_OK) {
+		delete set;
+		return false;
+	}
+
+	sets_.push_back(set);
+	return true;
+}
+
+void deathray::Tune(filter_set &set, const int &device_id) {
+	const kernel_tuning requested = {algorithm_, half_tile_};
+
+	// The luma plane is representative, unless it is not filtered
+	if (h_Y_ > 0.f) {
+		Autotune(device_id, row_sizeY_, heightY_, src_pitchY_, set.srcpY, h_Y_, sample_expand_, linear_, correction_, target_min_, balanced_, requested, tune_half_tile_, gaussian_[device_id], &tuning_[device_id]);
+	} else {
+		Autotune(device_id, row_sizeUV_, heightUV_, src_pitchUV_, set.srcpU, h_UV_, sample_expand_, 0, correction_, target_min_, 0, requested, tune_half_tile_, gaussian_[device_id], &tuning_[device_id]);
+	}
+}
+
+result deathray::CPUInit(filter_set &set) {
+	result status = FILTER_OK;
+
+	GaussianWeights(sigma_, host_gaussian_);
+
+	if (temporal_radius_Y_ == 0 && h_Y_ > 0.f) {
+		status = single_frame_CPU_Y_.Init(row_sizeY_, heightY_, src_pitchY_, dst_pitchY_, h_Y_, sample_expand_, linear_, correction_, target_min_, balanced_, algorithm_, host_gaussian_);
+		if (status != FILTER_OK) set.env->ThrowError("Single-frame CPU initialisation failed, status=%d", status);	
+	}
+	if (temporal_radius_UV_ == 0 && h_UV_ > 0.f) {
+		status = single_frame_CPU_U_.Init(row_sizeUV_, heightUV_, src_pitchUV_, dst_pitchUV_, h_UV_, sample_expand_, 0, correction_, target_min_, 0, algorithm_, host_gaussian_);
+		if (status != FILTER_OK) set.env->ThrowError("Single-frame CPU initialisation failed, status=%d", status);	
+		status = single_frame_CPU_V_.Init(row_sizeUV_, heightUV_, src_pitchUV_, dst_pitchUV_, h_UV_, sample_expand_, 0, correction_, target_min_, 0, algorithm_, host_gaussian_);
+		if (status != FILTER_OK) set.env->ThrowError("Single-frame CPU initialisation failed, status=%d", status);	
+	}
+
+	if (temporal_radius_Y_ > 0 && h_Y_ > 0.f) {
+		status = multi_frame_CPU_Y_.Init(temporal_radius_Y_, row_sizeY_, heightY_, src_pitchY_, dst_pitchY_, h_Y_, sample_expand_, linear_, correction_, target_min_, balanced_, algorithm_, host_gaussian_);
+		if (status != FILTER_OK) set.env->ThrowError("Multi-frame CPU initialisation failed, status=%d", status);	
+	}
+	if (temporal_radius_UV_ > 0 && h_UV_ > 0.f) {
+		status = multi_frame_CPU_U_.Init(temporal_radius_UV_, row_sizeUV_, heightUV_, src_pitchUV_, dst_pitchUV_, h_UV_, sample_expand_, 0, correction_, target_min_, 0, algorithm_, host_gaussian_);
+		if (status != FILTER_OK) set.env->ThrowError("Multi-frame CPU initialisation failed, status=%d", status);	
+		status = multi_frame_CPU_V_.Init(temporal_radius_UV_, row_sizeUV_, heightUV_, src_pitchUV_, dst_pitchUV_, h_UV_, sample_expand_, 0, correction_, target_min_, 0, algorithm_, host_gaussian_);
+		if (status != FILTER_OK) set.env->ThrowError("Multi-frame CPU initialisation failed, status=%d", status);	
+	}
+
+	return status;
+}
+
+size_t deathray::Footprint(const int &device_id) {
+	const int asynchronous = (pipelined_ || device_count_ > 1) ? 1 : 0;
+	const int height_Y = split_ ? bands_Y_[device_id].device_rows : heightY_;
+	const int height_UV = split_ ? bands_UV_[device_id].device_rows : heightUV_;
+	const int algorithm = tuning_[device_id].algorithm;
+
+	size_t bytes = 0;
+	if (temporal_radius_Y_ == 0 && h_Y_ > 0.f)
+		bytes += SingleFrame::Footprint(row_sizeY_, height_Y, 1);
+	if (temporal_radius_UV_ == 0 && h_UV_ > 0.f)
+		bytes += SingleFrame::Footprint(row_sizeUV_, height_UV, 2);
+	if (temporal_radius_Y_ > 0 && h_Y_ > 0.f)
+		bytes += MultiFrame::Footprint(temporal_radius_Y_, row_sizeY_, height_Y, sample_expand_, balanced_, algorithm, half_intermediate_, asynchronous, weight_cache_, fused_);
+	if (temporal_radius_UV_ > 0 && h_UV_ > 0.f)
+		bytes += 2 * MultiFrame::Footprint(temporal_radius_UV_, row_sizeUV_, height_UV, sample_expand_, 0, algorithm, half_intermediate_, asynchronous, weight_cache_, fused_);
+
+	return bytes;
+}
+
+void deathray::PlanMemory(filter_set &set) {
+	const int weight_cache = weight_cache_;
+	const int pipelined = pipelined_;
+
+	for (int i = 0; i < device_count_; ++i) {
+		// Frames kept by the device's frame_cache make way for filters
+		size_t budget = g_devices[i].buffers_.available() + g_devices[i].frames_.idle_bytes();
+		if (memory_budget_ > 0) budget = min(budget, static_cast<size_t>(memory_budget_) << 20);
+
+		// hi changes results, so is left to the user
+		while (Footprint(i) > budget) {
+			if (weight_cache_ > 0) {
+				weight_cache_ >>= 1;
+			} else if (pipelined_) {
+				pipelined_ = 0;
+			} else {
+				set.env->ThrowError("Deathray: filters need %u MB of memory on device %d but %u MB are available%s", static_cast<unsigned int>(Footprint(i) >> 20), i, static_cast<unsigned int>(budget >> 20), half_intermediate_ ? "" : ", hi=true uses less");
+			}
+		}
+		g_devices[i].frames_.Reclaim(Footprint(i));
+	}
+
+	// The script asked for more speed than fits, so each change is reported
+	if (weight_cache_ != weight_cache) {
+		ostringstream note;
+		note << "sym reduced from " << weight_cache << " to " << weight_cache_ << " to fit video memory";
+		TraceNote(note.str());
+	}
+	if (pipelined_ != pipelined) TraceNote("p set to false to fit video memory");
+}
+
+result deathray::SetupFilters(filter_set &set, const int &device_id) {
 	result status = FILTER_OK;
 
 	if ((temporal_radius_Y_ == 0 && h_Y_ > 0.f) || (temporal_radius_UV_ == 0 && h_UV_ > 0.f)) {
-		status = SingleFrameInit(device_id);
-		if (status != FILTER_OK) env_->ThrowError("Single-frame initialisation failed, status=%d and OpenCL status=%d", status, g_last_cl_error);	
+		status = SingleFrameInit(set, device_id);
+		if (status != FILTER_OK) set.env->ThrowError("Single-frame initialisation failed, status=%d and OpenCL status=%d", status, g_last_cl_error);	
 	}
 	if ((temporal_radius_Y_ > 0 && h_Y_ > 0.f) || (temporal_radius_UV_ > 0 && h_UV_ > 0.f)) {
-		status = MultiFrameInit(device_id);
-		if (status != FILTER_OK) env_->ThrowError("Multi-frame initialisation failed, status=%d and OpenCL status=%d", status, g_last_cl_error);	
+		status = MultiFrameInit(set, device_id);
+		if (status != FILTER_OK) set.env->ThrowError("Multi-frame initialisation failed, status=%d and OpenCL status=%d", status, g_last_cl_error);	
 	}	
 
 	return status;
 }
 
 PVideoFrame __stdcall deathray::GetFrame(int n, IScriptEnvironment *env) {
-    src_ = child->GetFrame(n, env);
-    dst_ = env->NewVideoFrame(vi);
+	const LARGE_INTEGER start = TraceTime();
+
+	// Each call uses the frames, pointers and device objects of a set
+	// that no other call is using, see TakeSet
+	unique_lock<mutex> held;
+	filter_set &set = *TakeSet(env, &held);
+	set.env = env;
+
+	if (prefetch_depth_ > 0) {
+		// device_count_ is set by Start, see Init
+		if (starter_.joinable()) starter_.join();
+
+		// Frames required by this call and by the frames filtered ahead of it
+		const int radius = max(temporal_radius_Y_, temporal_radius_UV_);
+		prefetcher_.Init(child, prefetch_depth_, vi.num_frames);
+		const int ahead = (device_count_ > 1) ? device_count_ : (pipelined_ ? 1 : 0);
+		prefetcher_.Target(n, n - radius, n + radius + ahead);
+	}
+
+	// Once devices filter frames in turn, each frame is fetched and
+	// allocated by Launch, see ScheduledFrame
+	const bool scheduled = initialised_ && !g_cpu_engine && device_count_ > 1 && !split_;
+	if (!scheduled) {
+		set.src = FetchFrame(set, n);
+		set.dst = env->NewVideoFrame(vi);
 
-	InitPointers();
-	InitDimensions();
+		InitPointers(set);
 
-	if (h_Y_ == 0.f)					PassThroughLuma();
-	if (h_UV_ == 0.f)					PassThroughChroma();
-	if (h_Y_ == 0.f && h_UV_ == 0.f)	return dst_;
+		// Dimensions are the same for every frame, while other sets use them
+		if (!initialised_) InitDimensions(set);
+
+		if (h_Y_ == 0.f)					PassThroughLuma(set);
+		if (h_UV_ == 0.f)					PassThroughChroma(set);
+		if (h_Y_ == 0.f && h_UV_ == 0.f)	return set.dst;
+	}
 
 	result status = FILTER_OK;
-	status = Init();
+	status = Init(set);
 	if (status != FILTER_OK || !(vi.IsPlanar())) { 
 		if (g_opencl_failed_to_initialise) {
-			env->ThrowError("Deathray: Error in OpenCL status=%d frame %d and OpenCL status=%d", status, n, g_last_cl_error);
+			// Start ran on starter_, which kept its own g_last_cl_error
+			const cl_int cl_error = (start_status_ != FILTER_OK) ? start_cl_error_ : g_last_cl_error;
+			env->ThrowError("Deathray: Error in OpenCL status=%d frame %d and OpenCL status=%d", status, n, cl_error);
 		} else {
 			env->ThrowError("Deathray: Check that clip is planar format - status=%d frame %d", status, n);
 		}
 	}
 
-	if ((temporal_radius_Y_ == 0 && h_Y_ > 0.f) || (temporal_radius_UV_ == 0 && h_UV_ > 0.f))
-		SingleFrameExecute();
+	if (g_cpu_engine) {
+		if ((temporal_radius_Y_ == 0 && h_Y_ > 0.f) || (temporal_radius_UV_ == 0 && h_UV_ > 0.f))
+			SingleFrameExecuteCPU(set);
+
+		if ((temporal_radius_Y_ > 0 && h_Y_ > 0.f) || (temporal_radius_UV_ > 0 && h_UV_ > 0.f))
+			MultiFrameExecuteCPU(set, n);
 
-	if ((temporal_radius_Y_ > 0 && h_Y_ > 0.f) || (temporal_radius_UV_ > 0 && h_UV_ > 0.f))
-		MultiFrameExecute(n);
+		TraceSpan("GetFrame", n, start);
+		return set.dst;
+	}
 
-	return dst_;
+	const int setup_count = SetupCount();
+	PVideoFrame filtered = set.dst;
+
+	if (device_count_ > 1 && !split_) {
+		filtered = ScheduledFrame(set, n);
+	} else if (split_) {
+		SplitFrame(set, n);
+	} else {
+		if ((temporal_radius_Y_ == 0 && h_Y_ > 0.f) || (temporal_radius_UV_ == 0 && h_UV_ > 0.f))
+			SingleFrameExecute(set, n);
+
+		if ((temporal_radius_Y_ > 0 && h_Y_ > 0.f) || (temporal_radius_UV_ > 0 && h_UV_ > 0.f)) {
+			if (pipelined_)
+				MultiFramePipelined(set, n);
+			else
+				MultiFrameExecute(set, n);
+		}
+	}
+
+	// Once every frame of the temporal window, and those filtered ahead,
+	// has passed through the filters, filtering creates no kernels or 
+	// buffers. Debug builds check this, as does DeathraySoak, see CountSetup
+	const int warm = 2 * max(temporal_radius_Y_, temporal_radius_UV_) + 2 + device_count_;
+	if (++set.frames_filtered > warm) assert(SetupCount() == setup_count);
+
+	TraceSpan("GetFrame", n, start);
+	return filtered;
 }
 
-void deathray::InitPointers() {
-    srcpY_ = src_->GetReadPtr(PLANAR_Y);
-    srcpU_ = src_->GetReadPtr(PLANAR_U);
-    srcpV_ = src_->GetReadPtr(PLANAR_V);    
+PVideoFrame deathray::FetchFrame(filter_set &set, const int &n) {
+	const LARGE_INTEGER start = TraceTime();
+	PVideoFrame fetched = prefetch_depth_ > 0 ? prefetcher_.GetFrame(n, set.env) : child->GetFrame(n, set.env);
+	TraceSpan("child GetFrame", n, start);
+	return fetched;
+}
 
-    dstpY_ = dst_->GetWritePtr(PLANAR_Y);
-    dstpU_ = dst_->GetWritePtr(PLANAR_U);
-    dstpV_ = dst_->GetWritePtr(PLANAR_V);    
+void deathray::Prefetch(filter_set &set) {
+	if (prefetch_depth_ == 0) return;
+
+	const LARGE_INTEGER start = TraceTime();
+	prefetcher_.Fetch(set.env);
+	TraceSpan("prefetch", -1, start);
 }
 
-void deathray::InitDimensions() {
-    src_pitchY_ = src_->GetPitch(PLANAR_Y);
-    src_pitchUV_ = src_->GetPitch(PLANAR_V);
+void deathray::InitPointers(filter_set &set) {
+    set.srcpY = set.src->GetReadPtr(PLANAR_Y);
+    set.srcpU = set.src->GetReadPtr(PLANAR_U);
+    set.srcpV = set.src->GetReadPtr(PLANAR_V);    
+
+    set.dstpY = set.dst->GetWritePtr(PLANAR_Y);
+    set.dstpU = set.dst->GetWritePtr(PLANAR_U);
+    set.dstpV = set.dst->GetWritePtr(PLANAR_V);    
+
+	set.src_offsetY = 0;
+	set.src_offsetUV = 0;
+}
 
-	dst_pitchY_ = dst_->GetPitch(PLANAR_Y);
-    dst_pitchUV_ = dst_->GetPitch(PLANAR_V);
+void deathray::InitBandPointers(filter_set &set, const int &device_id) {
+	InitPointers(set);
+
+	const frame_band &band_Y = bands_Y_[device_id];
+	const frame_band &band_UV = bands_UV_[device_id];
+
+	set.src_offsetY		= band_Y.first * src_pitchY_;
+	set.src_offsetUV	= band_UV.first * src_pitchUV_;
+
+	set.srcpY += set.src_offsetY;
+	set.srcpU += set.src_offsetUV;
+	set.srcpV += set.src_offsetUV;
+
+	set.dstpY += (band_Y.first + band_Y.apron) * dst_pitchY_;
+	set.dstpU += (band_UV.first + band_UV.apron) * dst_pitchUV_;
+	set.dstpV += (band_UV.first + band_UV.apron) * dst_pitchUV_;
+}
+
+void deathray::InitDimensions(filter_set &set) {
+    src_pitchY_ = set.src->GetPitch(PLANAR_Y);
+    src_pitchUV_ = set.src->GetPitch(PLANAR_V);
+
+	dst_pitchY_ = set.dst->GetPitch(PLANAR_Y);
+    dst_pitchUV_ = set.dst->GetPitch(PLANAR_V);
                 
-    row_sizeY_ = src_->GetRowSize(PLANAR_Y); 
-    row_sizeUV_ = src_->GetRowSize(PLANAR_V); 
+    row_sizeY_ = set.src->GetRowSize(PLANAR_Y); 
+    row_sizeUV_ = set.src->GetRowSize(PLANAR_V); 
               
-    heightY_ = src_->GetHeight(PLANAR_Y);
-    heightUV_ = src_->GetHeight(PLANAR_V);
+    heightY_ = set.src->GetHeight(PLANAR_Y);
+    heightUV_ = set.src->GetHeight(PLANAR_V);
 }
 
-void deathray::PassThroughLuma() {
-	env_->BitBlt(dstpY_, dst_pitchY_, srcpY_, src_pitchY_, row_sizeY_, heightY_);
+void deathray::PassThroughLuma(filter_set &set) {
+	set.env->BitBlt(set.dstpY, dst_pitchY_, set.srcpY, src_pitchY_, row_sizeY_, heightY_);
 }
 
-void deathray::PassThroughChroma() {
-	env_->BitBlt(dstpV_, dst_pitchUV_, srcpV_, src_pitchUV_, row_sizeUV_, heightUV_);
-	env_->BitBlt(dstpU_, dst_pitchUV_, srcpU_, src_pitchUV_, row_sizeUV_, heightUV_);
+void deathray::PassThroughChroma(filter_set &set) {
+	set.env->BitBlt(set.dstpV, dst_pitchUV_, set.srcpV, src_pitchUV_, row_sizeUV_, heightUV_);
+	set.env->BitBlt(set.dstpU, dst_pitchUV_, set.srcpU, src_pitchUV_, row_sizeUV_, heightUV_);
 }
 
-result deathray::SingleFrameInit(const int &device_id) {
+result deathray::SingleFrameInit(filter_set &set, const int &device_id) {
 	result status = FILTER_OK;
 			
+	// When split, the device filters its band of each plane
+	const int height_Y = split_ ? bands_Y_[device_id].device_rows : heightY_;
+	const int height_UV = split_ ? bands_UV_[device_id].device_rows : heightUV_;
+
+	// Instances filtering the same planes of the same clip share frames on the device
+	const int first_row_Y = split_ ? bands_Y_[device_id].first : 0;
+	const int first_row_UV = split_ ? bands_UV_[device_id].first : 0;
+
 	if (temporal_radius_Y_ == 0 && h_Y_ > 0.f) {
-		status = g_SingleFrame_Y.Init(device_id, row_sizeY_, heightY_, src_pitchY_, dst_pitchY_, h_Y_, sample_expand_, linear_, correction_, target_min_, balanced_);
+		status = set.single_frame_Y[device_id].Init(device_id, row_sizeY_, height_Y, src_pitchY_, dst_pitchY_, 1, h_Y_, sample_expand_, linear_, correction_, target_min_, balanced_, tuning_[device_id].algorithm, tuning_[device_id].half_tile, gaussian_[device_id]);
 		if (status != FILTER_OK) return status;
+		if (split_) set.single_frame_Y[device_id].Band(bands_Y_[device_id].apron, bands_Y_[device_id].rows);
+		set.single_frame_Y[device_id].Share(child.operator->(), 0, first_row_Y);
 	}
 
 	if (temporal_radius_UV_ == 0 && h_UV_ > 0.f) {
-		status = g_SingleFrame_U.Init(device_id, row_sizeUV_, heightUV_, src_pitchUV_, dst_pitchUV_, h_UV_, sample_expand_, 0, correction_, target_min_, 0);
-		if (status != FILTER_OK) return status;
-
-		status = g_SingleFrame_V.Init(device_id, row_sizeUV_, heightUV_, src_pitchUV_, dst_pitchUV_, h_UV_, sample_expand_, 0, correction_, target_min_, 0);
+		// U and V share all parameters, so they are filtered as a pair
+		status = set.single_frame_UV[device_id].Init(device_id, row_sizeUV_, height_UV, src_pitchUV_, dst_pitchUV_, 2, h_UV_, sample_expand_, 0, correction_, target_min_, 0, tuning_[device_id].algorithm, tuning_[device_id].half_tile, gaussian_[device_id]);
 		if (status != FILTER_OK) return status;
+		if (split_) set.single_frame_UV[device_id].Band(bands_UV_[device_id].apron, bands_UV_[device_id].rows);
+		set.single_frame_UV[device_id].Share(child.operator->(), 1, first_row_UV);
 	}
 
 	return status;
 }
 
-void deathray::SingleFrameExecute() {	
-	cl_uint wait_list_length = 0;
-	cl_event wait_list[3];
+void deathray::SingleFrameLaunch(filter_set &set, const int &device_id, const int &n, cl_event *wait_list, cl_uint *wait_list_length) {
 	result status;
 
 	if (temporal_radius_Y_ == 0 && h_Y_ > 0.f) {
-		status = g_SingleFrame_Y.CopyTo(srcpY_);
-		if (status != FILTER_OK) env_->ThrowError("Deathray: Copy Y to device status=%d and OpenCL status=%d", status, g_last_cl_error);
+		status = set.single_frame_Y[device_id].CopyTo(n, set.srcpY);
+		if (status != FILTER_OK) set.env->ThrowError("Deathray: Copy Y to device status=%d and OpenCL status=%d", status, g_last_cl_error);
 	}
 	if (temporal_radius_UV_ == 0 && h_UV_ > 0.f) {
-		status = g_SingleFrame_U.CopyTo(srcpU_);
-		if (status != FILTER_OK) env_->ThrowError("Deathray: Copy U to device status=%d and OpenCL status=%d", status, g_last_cl_error);
-		status = g_SingleFrame_V.CopyTo(srcpV_);
-		if (status != FILTER_OK) env_->ThrowError("Deathray: Copy V to device status=%d and OpenCL status=%d", status, g_last_cl_error);
+		status = set.single_frame_UV[device_id].CopyTo(n, set.srcpU, set.srcpV);
+		if (status != FILTER_OK) set.env->ThrowError("Deathray: Copy UV to device status=%d and OpenCL status=%d", status, g_last_cl_error);
 	}
 
 	if (temporal_radius_Y_ == 0 && h_Y_ > 0.f) {
-		status = g_SingleFrame_Y.Execute();
-		if (status != FILTER_OK) env_->ThrowError("Deathray: Execute Y kernel status=%d and OpenCL status=%d", status, g_last_cl_error);
-		status = g_SingleFrame_Y.CopyFrom(dstpY_, wait_list);
-		if (status != FILTER_OK) env_->ThrowError("Deathray: Copy Y to host status=%d and OpenCL status=%d", status, g_last_cl_error);
-		++wait_list_length;
+		status = set.single_frame_Y[device_id].Execute();
+		if (status != FILTER_OK) set.env->ThrowError("Deathray: Execute Y kernel status=%d and OpenCL status=%d", status, g_last_cl_error);
+		status = set.single_frame_Y[device_id].CopyFrom(set.dstpY, wait_list + (*wait_list_length)++);
+		if (status != FILTER_OK) set.env->ThrowError("Deathray: Copy Y to host status=%d and OpenCL status=%d", status, g_last_cl_error);
 	}
 
 	if (temporal_radius_UV_ == 0 && h_UV_ > 0.f) {
-		g_SingleFrame_U.Execute();
-		if (status != FILTER_OK) env_->ThrowError("Deathray: Execute U kernel status=%d and OpenCL status=%d", status, g_last_cl_error);
-		g_SingleFrame_U.CopyFrom(dstpU_, wait_list + wait_list_length++);
-		if (status != FILTER_OK) env_->ThrowError("Deathray: Copy U to host status=%d and OpenCL status=%d", status, g_last_cl_error);
-		g_SingleFrame_V.Execute();
-		if (status != FILTER_OK) env_->ThrowError("Deathray: Execute V kernel status=%d and OpenCL status=%d", status, g_last_cl_error);
-		g_SingleFrame_V.CopyFrom(dstpV_, wait_list + wait_list_length++);
-		if (status != FILTER_OK) env_->ThrowError("Deathray: Copy V to host status=%d and OpenCL status=%d", status, g_last_cl_error);
+		status = set.single_frame_UV[device_id].Execute();
+		if (status != FILTER_OK) set.env->ThrowError("Deathray: Execute UV kernel status=%d and OpenCL status=%d", status, g_last_cl_error);
+		status = set.single_frame_UV[device_id].CopyFrom(set.dstpU, wait_list + *wait_list_length, set.dstpV, wait_list + *wait_list_length + 1);
+		if (status != FILTER_OK) set.env->ThrowError("Deathray: Copy UV to host status=%d and OpenCL status=%d", status, g_last_cl_error);
+		*wait_list_length += 2;
 	}
+}
+
+void deathray::SingleFrameExecute(filter_set &set, const int &n) {	
+	cl_uint wait_list_length = 0;
+	cl_event wait_list[3];
+
+	SingleFrameLaunch(set, 0, n, wait_list, &wait_list_length);
+	Prefetch(set);
 
 	clWaitForEvents(wait_list_length, wait_list);
+	for (cl_uint i = 0; i < wait_list_length; ++i)
+		ReleaseEvent(wait_list[i]);
 }
 
-result deathray::MultiFrameInit(const int &device_id) {
+result deathray::MultiFrameInit(filter_set &set, const int &device_id) {
 	result status = FILTER_OK;
 
+	// Filtering is asynchronous when pipelined or when devices filter 
+	// frames in parallel
+	const int asynchronous = (pipelined_ || device_count_ > 1) ? 1 : 0;
+
+	// When split, the device filters its band of each plane
+	const int height_Y = split_ ? bands_Y_[device_id].device_rows : heightY_;
+	const int height_UV = split_ ? bands_UV_[device_id].device_rows : heightUV_;
+
+	// Instances filtering the same planes of the same clip share frames on the device
+	const int first_row_Y = split_ ? bands_Y_[device_id].first : 0;
+	const int first_row_UV = split_ ? bands_UV_[device_id].first : 0;
+
 	if (temporal_radius_Y_ > 0 && h_Y_ > 0.f) {
-		status = g_MultiFrame_Y.Init(device_id, temporal_radius_Y_, row_sizeY_, heightY_, src_pitchY_, dst_pitchY_, h_Y_, sample_expand_, linear_, correction_, target_min_, balanced_);
+		status = set.multi_frame_Y[device_id].Init(device_id, temporal_radius_Y_, row_sizeY_, height_Y, src_pitchY_, dst_pitchY_, h_Y_, sample_expand_, linear_, correction_, target_min_, balanced_, tuning_[device_id].algorithm, tuning_[device_id].half_tile, half_intermediate_, asynchronous, weight_cache_, fused_, gaussian_[device_id]);
 		if (status != FILTER_OK) return status;
+		if (split_) set.multi_frame_Y[device_id].Band(bands_Y_[device_id].apron, bands_Y_[device_id].rows);
+		set.multi_frame_Y[device_id].Share(child.operator->(), 0, first_row_Y);
 	}
 
 	if (temporal_radius_UV_ > 0 && h_UV_ > 0.f) {
-		status = g_MultiFrame_U.Init(device_id, temporal_radius_UV_, row_sizeUV_, heightUV_, src_pitchUV_, dst_pitchUV_, h_UV_, sample_expand_, 0, correction_, target_min_, 0);
+		status = set.multi_frame_U[device_id].Init(device_id, temporal_radius_UV_, row_sizeUV_, height_UV, src_pitchUV_, dst_pitchUV_, h_UV_, sample_expand_, 0, correction_, target_min_, 0, tuning_[device_id].algorithm, tuning_[device_id].half_tile, half_intermediate_, asynchronous, weight_cache_, fused_, gaussian_[device_id]);
 		if (status != FILTER_OK) return status;
+		if (split_) set.multi_frame_U[device_id].Band(bands_UV_[device_id].apron, bands_UV_[device_id].rows);
+		set.multi_frame_U[device_id].Share(child.operator->(), 1, first_row_UV);
 
-		status = g_MultiFrame_V.Init(device_id, temporal_radius_UV_, row_sizeUV_, heightUV_, src_pitchUV_, dst_pitchUV_, h_UV_, sample_expand_, 0, correction_, target_min_, 0);
+		status = set.multi_frame_V[device_id].Init(device_id, temporal_radius_UV_, row_sizeUV_, height_UV, src_pitchUV_, dst_pitchUV_, h_UV_, sample_expand_, 0, correction_, target_min_, 0, tuning_[device_id].algorithm, tuning_[device_id].half_tile, half_intermediate_, asynchronous, weight_cache_, fused_, gaussian_[device_id]);
 		if (status != FILTER_OK) return status;
+		if (split_) set.multi_frame_V[device_id].Band(bands_UV_[device_id].apron, bands_UV_[device_id].rows);
+		set.multi_frame_V[device_id].Share(child.operator->(), 2, first_row_UV);
 	}
 
 	return status;
 }
 
-void deathray::MultiFrameCopy(const int &n) {
+void deathray::MultiFrameCopy(filter_set &set, const int &device_id, const int &n, vector<PVideoFrame> *fetched) {
 	result status = FILTER_OK;
 
 	int frame_number;
 	if (temporal_radius_Y_ > 0 && h_Y_ > 0.f) {
-		MultiFrameRequest frames_Y;
-		g_MultiFrame_Y.SupplyFrameNumbers(n, &frames_Y);
+		MultiFrameRequest &frames_Y = set.requests[0];
+		set.multi_frame_Y[device_id].SupplyFrameNumbers(n, &frames_Y);
 		while (frames_Y.GetFrameNumber(&frame_number)) {
-			PVideoFrame Y = child->GetFrame(frame_number, env_);
-			const unsigned char* ptr_Y = Y->GetReadPtr(PLANAR_Y);
-			frames_Y.Supply(frame_number, ptr_Y);
+			fetched->push_back(FetchFrame(set, frame_number));
+			frames_Y.Supply(frame_number, fetched->back()->GetReadPtr(PLANAR_Y) + set.src_offsetY);
 		}
-		status = g_MultiFrame_Y.CopyTo(&frames_Y);
-		if (status != FILTER_OK ) env_->ThrowError("Deathray: Copy Y to device, status=%d and OpenCL status=%d", status, g_last_cl_error);
+		status = set.multi_frame_Y[device_id].CopyTo(&frames_Y);
+		if (status != FILTER_OK ) set.env->ThrowError("Deathray: Copy Y to device, status=%d and OpenCL status=%d", status, g_last_cl_error);
 	}
 
 	if (temporal_radius_UV_ > 0 && h_UV_ > 0.f) {
-		MultiFrameRequest frames_U;
-		MultiFrameRequest frames_V;
-		g_MultiFrame_U.SupplyFrameNumbers(n, &frames_U);
-		g_MultiFrame_V.SupplyFrameNumbers(n, &frames_V);
+		MultiFrameRequest &frames_U = set.requests[1];
+		MultiFrameRequest &frames_V = set.requests[2];
+		set.multi_frame_U[device_id].SupplyFrameNumbers(n, &frames_U);
+		set.multi_frame_V[device_id].SupplyFrameNumbers(n, &frames_V);
 		while (frames_U.GetFrameNumber(&frame_number)) {
-			PVideoFrame UV = child->GetFrame(frame_number, env_);
-			const unsigned char* ptr_U = UV->GetReadPtr(PLANAR_U);
-			const unsigned char* ptr_V = UV->GetReadPtr(PLANAR_V);
-			frames_U.Supply(frame_number, ptr_U);
-			frames_V.Supply(frame_number, ptr_V);
+			fetched->push_back(FetchFrame(set, frame_number));
+			frames_U.Supply(frame_number, fetched->back()->GetReadPtr(PLANAR_U) + set.src_offsetUV);
+			frames_V.Supply(frame_number, fetched->back()->GetReadPtr(PLANAR_V) + set.src_offsetUV);
 		}
-		status = g_MultiFrame_U.CopyTo(&frames_U);
-		if (status != FILTER_OK ) env_->ThrowError("Deathray: Copy U to device, status=%d and OpenCL status=%d", status, g_last_cl_error);
-		status = g_MultiFrame_V.CopyTo(&frames_V);
-		if (status != FILTER_OK ) env_->ThrowError("Deathray: Copy V to device, status=%d and OpenCL status=%d", status, g_last_cl_error);
+
+		// The device's frame_cache may still hold a frame's U plane
+		// after its V plane has been evicted
+		while (frames_V.GetFrameNumber(&frame_number)) {
+			fetched->push_back(FetchFrame(set, frame_number));
+			frames_V.Supply(frame_number, fetched->back()->GetReadPtr(PLANAR_V) + set.src_offsetUV);
+		}
+		status = set.multi_frame_U[device_id].CopyTo(&frames_U);
+		if (status != FILTER_OK ) set.env->ThrowError("Deathray: Copy U to device, status=%d and OpenCL status=%d", status, g_last_cl_error);
+		status = set.multi_frame_V[device_id].CopyTo(&frames_V);
+		if (status != FILTER_OK ) set.env->ThrowError("Deathray: Copy V to device, status=%d and OpenCL status=%d", status, g_last_cl_error);
 	}
 }
 
-void deathray::MultiFrameExecute(const int &n) {
+void deathray::MultiFrameExecute(filter_set &set, const int &n) {
 	cl_uint wait_list_length = 0;
 	cl_event wait_list[3];
+
+	// Frames fetched from the child are held until they have been copied
+	MultiFrameLaunch(set, 0, n, &set.fetched);
+	MultiFrameCopyFrom(set, 0, wait_list, &wait_list_length);
+	Prefetch(set);
+
+	clWaitForEvents(wait_list_length, wait_list);
+	for (cl_uint i = 0; i < wait_list_length; ++i)
+		ReleaseEvent(wait_list[i]);
+	set.fetched.clear();
+}
+
+void deathray::MultiFrameLaunch(filter_set &set, const int &device_id, const int &n, vector<PVideoFrame> *fetched) {
 	result status = FILTER_OK;
 
-	MultiFrameCopy(n);
+	MultiFrameCopy(set, device_id, n, fetched);
 
 	if (temporal_radius_Y_ > 0 && h_Y_ > 0.f) {
-		status = g_MultiFrame_Y.Execute();
-		if (status != FILTER_OK) env_->ThrowError("Deathray: Execute Y kernel status=%d and OpenCL status=%d", status, g_last_cl_error);
-		status = g_MultiFrame_Y.CopyFrom(dstpY_, wait_list);
-		if (status != FILTER_OK) env_->ThrowError("Deathray: Copy Y to host status=%d and OpenCL status=%d", status, g_last_cl_error);
-		++wait_list_length;
+		status = set.multi_frame_Y[device_id].Execute();
+		if (status != FILTER_OK) set.env->ThrowError("Deathray: Execute Y kernel status=%d and OpenCL status=%d", status, g_last_cl_error);
+	}
+
+	if (temporal_radius_UV_ > 0 && h_UV_ > 0.f) {
+		status = set.multi_frame_U[device_id].Execute();
+		if (status != FILTER_OK) set.env->ThrowError("Deathray: Execute U kernel status=%d and OpenCL status=%d", status, g_last_cl_error);
+		status = set.multi_frame_V[device_id].Execute();
+		if (status != FILTER_OK) set.env->ThrowError("Deathray: Execute V kernel status=%d and OpenCL status=%d", status, g_last_cl_error);
+	}
+}
+
+void deathray::MultiFrameCopyFrom(filter_set &set, const int &device_id, cl_event *wait_list, cl_uint *wait_list_length) {
+	result status = FILTER_OK;
+
+	if (temporal_radius_Y_ > 0 && h_Y_ > 0.f) {
+		status = set.multi_frame_Y[device_id].CopyFrom(set.dstpY, wait_list + (*wait_list_length)++);
+		if (status != FILTER_OK) set.env->ThrowError("Deathray: Copy Y to host status=%d and OpenCL status=%d", status, g_last_cl_error);
+	}
+
+	if (temporal_radius_UV_ > 0 && h_UV_ > 0.f) {
+		status = set.multi_frame_U[device_id].CopyFrom(set.dstpU, wait_list + (*wait_list_length)++);
+		if (status != FILTER_OK) set.env->ThrowError("Deathray: Copy U to host status=%d and OpenCL status=%d", status, g_last_cl_error);
+		status = set.multi_frame_V[device_id].CopyFrom(set.dstpV, wait_list + (*wait_list_length)++);
+		if (status != FILTER_OK) set.env->ThrowError("Deathray: Copy V to host status=%d and OpenCL status=%d", status, g_last_cl_error);
 	}
+}
+
+void deathray::MultiFrameFinish(filter_set &set, const int &device_id) {
+	if (temporal_radius_Y_ > 0 && h_Y_ > 0.f) 
+		set.multi_frame_Y[device_id].Finish();
 
 	if (temporal_radius_UV_ > 0 && h_UV_ > 0.f) {
-		g_MultiFrame_U.Execute();
-		if (status != FILTER_OK) env_->ThrowError("Deathray: Execute U kernel status=%d and OpenCL status=%d", status, g_last_cl_error);
-		g_MultiFrame_U.CopyFrom(dstpU_, wait_list + wait_list_length++);
-		if (status != FILTER_OK) env_->ThrowError("Deathray: Copy U to host status=%d and OpenCL status=%d", status, g_last_cl_error);
-		g_MultiFrame_V.Execute();
-		if (status != FILTER_OK) env_->ThrowError("Deathray: Execute V kernel status=%d and OpenCL status=%d", status, g_last_cl_error);
-		g_MultiFrame_V.CopyFrom(dstpV_, wait_list + wait_list_length++);
-		if (status != FILTER_OK) env_->ThrowError("Deathray: Copy V to host status=%d and OpenCL status=%d", status, g_last_cl_error);
+		set.multi_frame_U[device_id].Finish();
+		set.multi_frame_V[device_id].Finish();
+	}
+}
+
+void deathray::MultiFramePipelined(filter_set &set, const int &n) {
+	cl_uint wait_list_length = 0;
+	cl_event wait_list[3];
+
+	// Unless the prior call speculatively filtered frame n, its work is
+	// abandoned and frame n is filtered now
+	if (n != set.pipelined_frame) {
+		MultiFrameFinish(set, 0);
+		set.pipelined_fetched.clear();
+		MultiFrameLaunch(set, 0, n, &set.pipelined_fetched);
+	}
+
+	// Copies of frame n to host are enqueued before frame n + 1's work, so
+	// that they are not held up behind it
+	MultiFrameCopyFrom(set, 0, wait_list, &wait_list_length);
+
+	// Frame n + 1 is copied to the device and filtered while frame n
+	// is returned
+	set.pipelined_frame = -1;
+	if (n + 1 < vi.num_frames) {
+		MultiFrameLaunch(set, 0, n + 1, &set.fetched);
+		set.pipelined_frame = n + 1;
+	}
+	Prefetch(set);
+
+	clWaitForEvents(wait_list_length, wait_list);
+	for (cl_uint i = 0; i < wait_list_length; ++i)
+		ReleaseEvent(wait_list[i]);
+
+	// Frame n's copies to the device are complete, so its fetched frames
+	// can be released, but those of frame n + 1 are held
+	set.pipelined_fetched.swap(set.fetched);
+	set.fetched.clear();
+}
+
+PVideoFrame deathray::ScheduledFrame(filter_set &set, const int &n) {
+	int device_id = InFlight(n);
+
+	// Seeking abandons the frames that were filtered speculatively
+	if (device_id < 0) {
+		for (int i = 0; i < device_count_; ++i) 
+			Collect(i);
+		device_id = 0;
+		Launch(set, device_id, n);
+	}
+
+	// Idle devices start on the frames that are expected to follow
+	ScheduleAhead(set, n);
+	Prefetch(set);
+
+	PVideoFrame filtered = Collect(device_id);
+
+	// The device that filtered frame n starts on a later frame
+	ScheduleAhead(set, n);
+
+	return filtered;
+}
+
+void deathray::ScheduleAhead(filter_set &set, const int &n) {
+	int device_id = 0;
+	for (int ahead = n + 1; ahead < n + 1 + device_count_ && ahead < vi.num_frames; ++ahead) {
+		if (InFlight(ahead) >= 0) continue;
+		while (device_id < device_count_ && in_flight_[device_id].frame >= 0) 
+			++device_id;
+		if (device_id == device_count_) return;
+		Launch(set, device_id, ahead);
+	}
+}
+
+int deathray::InFlight(const int &n) {
+	for (int i = 0; i < device_count_; ++i) {
+		if (in_flight_[i].frame == n) return i;
+	}
+	return -1;
+}
+
+void deathray::Launch(filter_set &set, const int &device_id, const int &n) {
+	in_flight &frame = in_flight_[device_id];
+
+	frame.frame = n;
+	frame.src = FetchFrame(set, n);
+	frame.dst = set.env->NewVideoFrame(vi);
+	frame.event_count = 0;
+
+	set.src = frame.src;
+	set.dst = frame.dst;
+	InitPointers(set);
+
+	if (h_Y_ == 0.f)	PassThroughLuma(set);
+	if (h_UV_ == 0.f)	PassThroughChroma(set);
+
+	if ((temporal_radius_Y_ == 0 && h_Y_ > 0.f) || (temporal_radius_UV_ == 0 && h_UV_ > 0.f))
+		SingleFrameLaunch(set, device_id, n, frame.events, &frame.event_count);
+
+	if ((temporal_radius_Y_ > 0 && h_Y_ > 0.f) || (temporal_radius_UV_ > 0 && h_UV_ > 0.f)) {
+		MultiFrameLaunch(set, device_id, n, &frame.fetched);
+		MultiFrameCopyFrom(set, device_id, frame.events, &frame.event_count);
+	}
+}
+
+PVideoFrame deathray::Collect(const int &device_id) {
+	in_flight &frame = in_flight_[device_id];
+
+	PVideoFrame filtered = frame.dst;
+	if (frame.frame < 0) return filtered;
+
+	clWaitForEvents(frame.event_count, frame.events);
+	for (cl_uint i = 0; i < frame.event_count; ++i)
+		ReleaseEvent(frame.events[i]);
+
+	frame.frame = -1;
+	frame.event_count = 0;
+	frame.src = PVideoFrame();
+	frame.dst = PVideoFrame();
+	frame.fetched.clear();
+
+	return filtered;
+}
+
+void deathray::SplitFrame(filter_set &set, const int &n) {
+	cl_uint wait_list_length = 0;
+	cl_event wait_list[3 * MAX_DEVICES];
+
+	// Frames fetched from the child are held until they have been copied
+	for (int i = 0; i < device_count_; ++i) {
+		InitBandPointers(set, i);
+
+		if ((temporal_radius_Y_ == 0 && h_Y_ > 0.f) || (temporal_radius_UV_ == 0 && h_UV_ > 0.f))
+			SingleFrameLaunch(set, i, n, wait_list, &wait_list_length);
+
+		if ((temporal_radius_Y_ > 0 && h_Y_ > 0.f) || (temporal_radius_UV_ > 0 && h_UV_ > 0.f)) {
+			MultiFrameLaunch(set, i, n, &set.fetched);
+			MultiFrameCopyFrom(set, i, wait_list, &wait_list_length);
+		}
 	}
+	InitPointers(set);
+	Prefetch(set);
 
 	clWaitForEvents(wait_list_length, wait_list);
+	for (cl_uint i = 0; i < wait_list_length; ++i)
+		ReleaseEvent(wait_list[i]);
+	set.fetched.clear();
+}
+
+void deathray::SingleFrameExecuteCPU(filter_set &set) {
+	if (temporal_radius_Y_ == 0 && h_Y_ > 0.f) {
+		single_frame_CPU_Y_.CopyTo(set.srcpY);
+		single_frame_CPU_Y_.Execute();
+		single_frame_CPU_Y_.CopyFrom(set.dstpY);
+	}
+
+	if (temporal_radius_UV_ == 0 && h_UV_ > 0.f) {
+		single_frame_CPU_U_.CopyTo(set.srcpU);
+		single_frame_CPU_U_.Execute();
+		single_frame_CPU_U_.CopyFrom(set.dstpU);
+		single_frame_CPU_V_.CopyTo(set.srcpV);
+		single_frame_CPU_V_.Execute();
+		single_frame_CPU_V_.CopyFrom(set.dstpV);
+	}
+}
+
+void deathray::MultiFrameExecuteCPU(filter_set &set, const int &n) {
+	result status = FILTER_OK;
+
+	// Frames fetched from the child are held until their planes
+	// have been converted, so that the read pointers stay valid
+	int frame_number;
+	if (temporal_radius_Y_ > 0 && h_Y_ > 0.f) {
+		MultiFrameRequest &frames_Y = set.requests[0];
+		multi_frame_CPU_Y_.SupplyFrameNumbers(n, &frames_Y);
+		while (frames_Y.GetFrameNumber(&frame_number)) {
+			set.fetched.push_back(FetchFrame(set, frame_number));
+			frames_Y.Supply(frame_number, set.fetched.back()->GetReadPtr(PLANAR_Y));
+		}
+		status = multi_frame_CPU_Y_.CopyTo(&frames_Y);
+		if (status != FILTER_OK ) set.env->ThrowError("Deathray: Convert Y on host, status=%d", status);
+		multi_frame_CPU_Y_.Execute();
+		multi_frame_CPU_Y_.CopyFrom(set.dstpY);
+	}
+
+	if (temporal_radius_UV_ > 0 && h_UV_ > 0.f) {
+		MultiFrameRequest &frames_U = set.requests[1];
+		MultiFrameRequest &frames_V = set.requests[2];
+		multi_frame_CPU_U_.SupplyFrameNumbers(n, &frames_U);
+		multi_frame_CPU_V_.SupplyFrameNumbers(n, &frames_V);
+		while (frames_U.GetFrameNumber(&frame_number)) {
+			set.fetched.push_back(FetchFrame(set, frame_number));
+			frames_U.Supply(frame_number, set.fetched.back()->GetReadPtr(PLANAR_U));
+			frames_V.Supply(frame_number, set.fetched.back()->GetReadPtr(PLANAR_V));
+		}
+		status = multi_frame_CPU_U_.CopyTo(&frames_U);
+		if (status != FILTER_OK ) set.env->ThrowError("Deathray: Convert U on host, status=%d", status);
+		status = multi_frame_CPU_V_.CopyTo(&frames_V);
+		if (status != FILTER_OK ) set.env->ThrowError("Deathray: Convert V on host, status=%d", status);
+		multi_frame_CPU_U_.Execute();
+		multi_frame_CPU_U_.CopyFrom(set.dstpU);
+		multi_frame_CPU_V_.Execute();
+		multi_frame_CPU_V_.CopyFrom(set.dstpV);
+	}
+	set.fetched.clear();
 }
 
 AVSValue __cdecl CreateDeathray(AVSValue args, void *user_data, IScriptEnvironment *env) {
@@ -347,6 +1081,39 @@ AVSValue __cdecl CreateDeathray(AVSValue args, void *user_data, IScriptEnvironme
 
 	int balanced = args[10].AsBool(false) ? 1 : 0;
 
+	int algorithm = args[11].AsInt(NLM_GAUSSIAN);
+	if (algorithm < NLM_GAUSSIAN || algorithm > NLM_SEPARABLE) algorithm = NLM_GAUSSIAN;
+
+	int pipelined = args[12].AsBool(false) ? 1 : 0;
+
+	int prefetch_depth = args[13].AsInt(0);
+	if (prefetch_depth < 0) prefetch_depth = 0;
+	if (prefetch_depth > 32) prefetch_depth = 32;
+
+	int max_devices = args[14].AsInt(1);
+	if (max_devices < 0) max_devices = 1;
+
+	int split = args[15].AsBool(false) ? 1 : 0;
+
+	int half_tile = args[16].AsBool(false) ? 1 : 0;
+
+	int tune = args[17].AsBool(false) ? 1 : 0;
+
+	// ht set by the script is kept by tuning
+	int tune_half_tile = args[16].Defined() ? 0 : 1;
+
+	int weight_cache = args[18].AsInt(0);
+	if (weight_cache < 0) weight_cache = 0;
+
+	int fused = args[19].AsBool(false) ? 1 : 0;
+
+	int half_intermediate = args[20].AsBool(false) ? 1 : 0;
+
+	int memory_budget = args[21].AsInt(0);
+	if (memory_budget < 0) memory_budget = 0;
+
+	const char *trace = args[22].AsString("");
+
 	return new deathray(args[0].AsClip(),
 						h_Y, 
 						h_UV, 
@@ -358,11 +1125,490 @@ AVSValue __cdecl CreateDeathray(AVSValue args, void *user_data, IScriptEnvironme
 						correction,
 						target_min,
 						balanced,
+						algorithm,
+						pipelined,
+						prefetch_depth,
+						max_devices,
+						split,
+						half_tile,
+						tune,
+						tune_half_tile,
+						weight_cache,
+						fused,
+						half_intermediate,
+						memory_budget,
+						trace,
 						env);
 }
 
+// DeathrayCache
+// Builds the OpenCL program and its variants and caches them for every
+// device, so that the first script to use Deathray does not wait for 
+// compilation. Run as:
+//
+// rundll32 Deathray.dll,DeathrayCache [x ...]
+//
+// where the optional list of values of x restricts the variants built.
+#pragma comment(linker, "/EXPORT:DeathrayCache=_DeathrayCache@16")
+extern "C" void CALLBACK DeathrayCache(HWND window, HINSTANCE instance, LPSTR command_line, int show) {
+	StartDevices();
+	if (g_devices == NULL) return;
+
+	vector<int> expansions;
+	istringstream requested((command_line != NULL) ? command_line : "");
+	int sample_expand;
+	while (requested >> sample_expand) {
+		if (sample_expand >= 1 && sample_expand <= 14) expansions.push_back(sample_expand);
+	}
+	if (expansions.empty()) {
+		for (sample_expand = 1; sample_expand <= 14; ++sample_expand) 
+			expansions.push_back(sample_expand);
+	}
+
+	// Each of linear, correction, target_min, balanced, half_tile and 
+	// half_intermediate is a bit of flags
+	for (int i = 0; i < g_device_count; ++i) {
+		for (size_t j = 0; j < expansions.size(); ++j) {
+			for (int flags = 0; flags < 64; ++flags) 
+				g_devices[i].Variant(VariantOptions(expansions[j], flags & 1, (flags >> 1) & 1, (flags >> 2) & 1, (flags >> 3) & 1, (flags >> 4) & 1, (flags >> 5) & 1));
+		}
+	}
+}
+
+// Plane size and temporal radius of the synthetic clip filtered by the
+// self tests, DeathraySoak and DeathrayCompare
+#define TEST_WIDTH 640
+#define TEST_HEIGHT 360
+#define TEST_RADIUS 2
+
+// Count of distinct synthetic frames, repeated through the clip
+#define TEST_PATTERNS 8
+
+// sym budget of DeathraySoak, which keeps every pair of frames of the radius
+#define SOAK_WEIGHT_CACHE 160
+
+// References to events that callbacks of the driver may release after
+// the wait for a frame returns, e.g. of a readback, see DeathraySoak
+#define SOAK_EVENT_SLACK 4
+
+// Count of frames compared by DeathrayCompare
+#define COMPARE_FRAMES 16
+
+// Largest temporal radius at which hi applies with x=8, see HalfSumsFit,
+// at which DeathrayCompare checks that the sums of hi stay finite
+#define COMPARE_HALF_RADIUS 13
+
+// SyntheticPatterns
+// Frames of the synthetic clip: a gradient with noise, so that every
+// pixel has a distinct window and the filter has noise to remove.
+void SyntheticPatterns(vector<vector<unsigned char> > *patterns) {
+	patterns->assign(TEST_PATTERNS, vector<unsigned char>(TEST_WIDTH * TEST_HEIGHT));
+	srand(1);
+	for (int i = 0; i < TEST_PATTERNS; ++i) {
+		for (int y = 0; y < TEST_HEIGHT; ++y) {
+			for (int x = 0; x < TEST_WIDTH; ++x) {
+				const int pixel = (x + y) * 192 / (TEST_WIDTH + TEST_HEIGHT) + 32 + (rand() & 31) - 16;
+				(*patterns)[i][y * TEST_WIDTH + x] = static_cast<unsigned char>(pixel);
+			}
+		}
+	}
+}
+
+// FilterSynthetic
+// Filters frame n of the synthetic clip, waiting for the result.
+result FilterSynthetic(
+			MultiFrame							*filter,
+	const	int									&n,
+	const	vector<vector<unsigned char> >		&patterns,
+			MultiFrameRequest					*request,
+			unsigned char						*filtered) {
+
+	int frame_number;
+	filter->SupplyFrameNumbers(n, request);
+	while (request->GetFrameNumber(&frame_number)) 
+		request->Supply(frame_number, &patterns[(frame_number + TEST_PATTERNS) % TEST_PATTERNS][0]);
+
+	cl_event copied = NULL;
+	result status = filter->CopyTo(request);
+	if (status == FILTER_OK) status = filter->Execute();
+	if (status == FILTER_OK) status = filter->CopyFrom(filtered, &copied);
+	if (status == FILTER_OK) {
+		clWaitForEvents(1, &copied);
+		ReleaseEvent(copied);
+	}
+	return status;
+}
+
+// Heap allocations counted by AllocationHook
+static atomic<int> g_allocations(0);
+
+// AllocationHook
+// Counts allocations and reallocations of the CRT's heap, other than
+// the CRT's own. The CRT calls hooks solely in debug builds.
+int __cdecl AllocationHook(int type, void *data, size_t bytes, int block_type, long request, const unsigned char *file, int line) {
+	if (block_type != _CRT_BLOCK && (type == _HOOK_ALLOC || type == _HOOK_REALLOC)) ++g_allocations;
+	return TRUE;
+}
+
+// soak_result
+// Growth found by SoakDevice from the first frame after the window
+// filled until the last frame
+struct soak_result {
+	soak_result() : failed(true), created(0), allocations(0), events(0) {}
+
+	bool failed		;	// filtering failed
+	int created		;	// kernels and buffers created, see CountSetup
+	int allocations	;	// heap allocations, see AllocationHook
+	int events		;	// references to events not released, see LiveEvents
+};
+
+// SoakDevice
+// Filters frame_count synthetic frames in order on the device, with
+// frames shared through its frame_cache and weight maps saved.
+soak_result SoakDevice(const int &device_id, const int &frame_count, const vector<vector<unsigned char> > &patterns) {
+	int gaussian = 0;
+	GaussianGenerator(1.f, device_id, &gaussian);
+
+	soak_result found;
+	{
+		MultiFrame filter;
+		result status = filter.Init(device_id, TEST_RADIUS, TEST_WIDTH, TEST_HEIGHT, TEST_WIDTH, TEST_WIDTH, 1.f, 1, 0, 0, 0, 0, NLM_GAUSSIAN, 0, 0, 0, SOAK_WEIGHT_CACHE, 0, gaussian);
+		if (status == FILTER_OK) {
+			filter.Share(&patterns, 0, 0);
+
+			vector<unsigned char> filtered(TEST_WIDTH * TEST_HEIGHT);
+			MultiFrameRequest request;
+			const int warm = 2 * TEST_RADIUS + 2;
+			int setup_count = SetupCount();
+			int live_events = LiveEvents();
+			_CRT_ALLOC_HOOK prior_hook = NULL;
+			for (int n = 0; n < frame_count && status == FILTER_OK; ++n) {
+				if (n == warm) {
+					setup_count = SetupCount();
+					live_events = LiveEvents();
+					g_allocations = 0;
+					prior_hook = _CrtSetAllocHook(AllocationHook);
+				}
+				status = FilterSynthetic(&filter, n, patterns, &request, &filtered[0]);
+			}
+			_CrtSetAllocHook(prior_hook);
+
+			if (status == FILTER_OK) {
+				found.failed		= false;
+				found.created		= SetupCount() - setup_count;
+				found.allocations	= g_allocations;
+				found.events		= LiveEvents() - live_events;
+			}
+		}
+	}
+
+	g_devices[device_id].buffers_.Destroy(gaussian);
+	return found;
+}
+
+// DeathraySoak
+// Checks that filtering allocates no buffers, creates no kernels, 
+// allocates nothing on the heap and leaks no events once the temporal
+// window has filled, by filtering synthetic frames on each device. 
+// Run as:
+//
+// rundll32 Deathray.dll,DeathraySoak [frames]
+//
+// where frames defaults to 1000. The result for each device is written
+// to soak.txt in the program cache folder. Heap allocations are solely
+// counted by debug builds.
+#pragma comment(linker, "/EXPORT:DeathraySoak=_DeathraySoak@16")
+extern "C" void CALLBACK DeathraySoak(HWND window, HINSTANCE instance, LPSTR command_line, int show) {
+	ofstream report((ProgramCacheFolder() + "soak.txt").c_str());
+
+	StartDevices();
+	if (g_devices == NULL) {
+		report << "No OpenCL device" << endl;
+		return;
+	}
+
+	int frame_count = 1000;
+	istringstream requested((command_line != NULL) ? command_line : "");
+	requested >> frame_count;
+	frame_count = max(frame_count, 2 * TEST_RADIUS + 3);
+
+	vector<vector<unsigned char> > patterns;
+	SyntheticPatterns(&patterns);
+
+	for (int i = 0; i < g_device_count; ++i) {
+		const soak_result found = SoakDevice(i, frame_count, patterns);
+		report << "Device " << i << ": " << frame_count << " frames, ";
+		if (found.failed) {
+			report << "FAILED, OpenCL status=" << g_last_cl_error << endl;
+		} else if (found.created > 0 || found.allocations > 0 || found.events > SOAK_EVENT_SLACK) {
+			report << "FAILED after the window filled: " 
+				   << found.created << " kernels or buffers created, " 
+				   << found.allocations << " heap allocations, "
+				   << found.events << " events not released" << endl;
+		} else {
+			report << "passed" << endl;
+		}
+	}
+}
+
+// difference
+// Differences between two filterings of the same frames
+struct difference {
+	difference() : largest(0), differing(0), pixels(0) {}
+
+	int largest			;	// largest absolute difference of a pixel, in levels
+	size_t differing	;	// count of pixels that differ
+	size_t pixels		;	// count of pixels compared
+};
+
+// Compare
+// Accumulates the differences between the filtered planes.
+void Compare(const vector<unsigned char> &expected, const vector<unsigned char> &actual, difference *found) {
+	for (size_t i = 0; i < expected.size(); ++i) {
+		const int level = abs(static_cast<int>(expected[i]) - static_cast<int>(actual[i]));
+		found->largest = max(found->largest, level);
+		if (level > 0) ++found->differing;
+	}
+	found->pixels += expected.size();
+}
+
+// ReportDifference
+// Writes a line of DeathrayCompare's report.
+void ReportDifference(const string &comparison, const difference &found, ofstream *report) {
+	*report << comparison << ": ";
+	if (found.pixels == 0) {
+		*report << "FAILED, OpenCL status=" << g_last_cl_error << endl;
+		return;
+	}
+	*report << "largest difference " << found.largest << " levels, " 
+			<< 100. * found.differing / found.pixels << "% of pixels differ" << endl;
+}
+
+// CompareHalfIntermediate
+// Filters the synthetic clip on the device with intermediate sums held
+// as floats and as halves, i.e. hi, and compares the results.
+difference CompareHalfIntermediate(const int &device_id, const int &sample_expand, const int &temporal_radius, const vector<vector<unsigned char> > &patterns) {
+	int gaussian = 0;
+	GaussianGenerator(1.f, device_id, &gaussian);
+
+	difference found;
+	{
+		MultiFrame floats;
+		MultiFrame halves;
+		result status = floats.Init(device_id, temporal_radius, TEST_WIDTH, TEST_HEIGHT, TEST_WIDTH, TEST_WIDTH, 1.f, sample_expand, 0, 1, 0, 0, NLM_GAUSSIAN, 0, 0, 0, 0, 0, gaussian);
+		if (status == FILTER_OK) status = halves.Init(device_id, temporal_radius, TEST_WIDTH, TEST_HEIGHT, TEST_WIDTH, TEST_WIDTH, 1.f, sample_expand, 0, 1, 0, 0, NLM_GAUSSIAN, 0, 1, 0, 0, 0, gaussian);
+
+		vector<unsigned char> expected(TEST_WIDTH * TEST_HEIGHT);
+		vector<unsigned char> actual(TEST_WIDTH * TEST_HEIGHT);
+		MultiFrameRequest request;
+		difference compared;
+		for (int n = 0; n < COMPARE_FRAMES && status == FILTER_OK; ++n) {
+			status = FilterSynthetic(&floats, n, patterns, &request, &expected[0]);
+			if (status == FILTER_OK) status = FilterSynthetic(&halves, n, patterns, &request, &actual[0]);
+			if (status == FILTER_OK) Compare(expected, actual, &compared);
+		}
+		if (status == FILTER_OK) found = compared;
+	}
+
+	g_devices[device_id].buffers_.Destroy(gaussian);
+	return found;
+}
+
+// CompareSpatialCPU
+// Filters the synthetic frames spatially on the device and on the host,
+// and compares the results.
+difference CompareSpatialCPU(const int &device_id, const vector<vector<unsigned char> > &patterns) {
+	int gaussian = 0;
+	GaussianGenerator(1.f, device_id, &gaussian);
+	float host_gaussian[56];
+	GaussianWeights(1.f, host_gaussian);
+
+	difference found;
+	{
+		SingleFrame device_filter;
+		SingleFrameCPU host_filter;
+		result status = device_filter.Init(device_id, TEST_WIDTH, TEST_HEIGHT, TEST_WIDTH, TEST_WIDTH, 1, 1.f, 1, 0, 1, 0, 0, NLM_GAUSSIAN, 0, gaussian);
+		if (status == FILTER_OK) status = host_filter.Init(TEST_WIDTH, TEST_HEIGHT, TEST_WIDTH, TEST_WIDTH, 1.f, 1, 0, 1, 0, 0, NLM_GAUSSIAN, host_gaussian);
+
+		vector<unsigned char> expected(TEST_WIDTH * TEST_HEIGHT);
+		vector<unsigned char> actual(TEST_WIDTH * TEST_HEIGHT);
+		difference compared;
+		for (int n = 0; n < TEST_PATTERNS && status == FILTER_OK; ++n) {
+			cl_event copied = NULL;
+			status = device_filter.CopyTo(n, &patterns[n][0]);
+			if (status == FILTER_OK) status = device_filter.Execute();
+			if (status == FILTER_OK) status = device_filter.CopyFrom(&expected[0], &copied);
+			if (status != FILTER_OK) break;
+			clWaitForEvents(1, &copied);
+			ReleaseEvent(copied);
+
+			status = host_filter.CopyTo(&patterns[n][0]);
+			if (status == FILTER_OK) status = host_filter.Execute();
+			if (status == FILTER_OK) status = host_filter.CopyFrom(&actual[0]);
+			if (status == FILTER_OK) Compare(expected, actual, &compared);
+		}
+		if (status == FILTER_OK) found = compared;
+	}
+
+	g_devices[device_id].buffers_.Destroy(gaussian);
+	return found;
+}
+
+// CompareTemporalCPU
+// Filters the synthetic clip temporally on the device and on the host,
+// and compares the results.
+difference CompareTemporalCPU(const int &device_id, const vector<vector<unsigned char> > &patterns) {
+	int gaussian = 0;
+	GaussianGenerator(1.f, device_id, &gaussian);
+	float host_gaussian[56];
+	GaussianWeights(1.f, host_gaussian);
+
+	difference found;
+	{
+		MultiFrame device_filter;
+		MultiFrameCPU host_filter;
+		result status = device_filter.Init(device_id, TEST_RADIUS, TEST_WIDTH, TEST_HEIGHT, TEST_WIDTH, TEST_WIDTH, 1.f, 1, 0, 1, 0, 0, NLM_GAUSSIAN, 0, 0, 0, 0, 0, gaussian);
+		if (status == FILTER_OK) status = host_filter.Init(TEST_RADIUS, TEST_WIDTH, TEST_HEIGHT, TEST_WIDTH, TEST_WIDTH, 1.f, 1, 0, 1, 0, 0, NLM_GAUSSIAN, host_gaussian);
+
+		vector<unsigned char> expected(TEST_WIDTH * TEST_HEIGHT);
+		vector<unsigned char> actual(TEST_WIDTH * TEST_HEIGHT);
+		MultiFrameRequest request;
+		difference compared;
+		int frame_number;
+		for (int n = 0; n < COMPARE_FRAMES && status == FILTER_OK; ++n) {
+			status = FilterSynthetic(&device_filter, n, patterns, &request, &expected[0]);
+			if (status != FILTER_OK) break;
+
+			host_filter.SupplyFrameNumbers(n, &request);
+			while (request.GetFrameNumber(&frame_number)) 
+				request.Supply(frame_number, &patterns[(frame_number + TEST_PATTERNS) % TEST_PATTERNS][0]);
+			status = host_filter.CopyTo(&request);
+			if (status == FILTER_OK) status = host_filter.Execute();
+			if (status == FILTER_OK) status = host_filter.CopyFrom(&actual[0]);
+			if (status == FILTER_OK) Compare(expected, actual, &compared);
+		}
+		if (status == FILTER_OK) found = compared;
+	}
+
+	g_devices[device_id].buffers_.Destroy(gaussian);
+	return found;
+}
+
+// CompareSIMD
+// Filters tiles of the synthetic frames on the host with the strip filter
+// of simd and with Filter4Host, with every combination of the options that
+// change its arithmetic, and returns the count of floats of the sums that
+// are not bit for bit identical. Returns -1 when the strip filter of simd
+// isn't compiled or the CPU can't run it.
+int CompareSIMD(const host_simd &simd, const vector<vector<unsigned char> > &patterns) {
+	int strip_width = 0;
+	const filter_strip filter = SelectFilterStrip(simd, &strip_width);
+	if (DetectHostSIMD() < simd || filter == &Filter4Host) return -1;
+
+	float host_gaussian[56];
+	GaussianWeights(1.f, host_gaussian);
+
+	vector<float> target_plane(TEST_WIDTH * TEST_HEIGHT);
+	vector<float> sample_plane(TEST_WIDTH * TEST_HEIGHT);
+	ReadPlaneHost(&patterns[0][0], TEST_WIDTH, TEST_HEIGHT, TEST_WIDTH, 0, &target_plane[0]);
+	ReadPlaneHost(&patterns[1][0], TEST_WIDTH, TEST_HEIGHT, TEST_WIDTH, 0, &sample_plane[0]);
+
+	const int tile_count = k_host_tile_size * k_host_tile_size;
+	int differing = 0;
+
+	// The top-left tile mirrors its apron, the other is inside the frame
+	for (int tile = 0; tile < 2; ++tile) {
+		float target_storage[k_host_tile_storage] = {0.f};
+		float sample_storage[k_host_tile_storage] = {0.f};
+		float *target_tile = target_storage + k_host_tile_padding;
+		float *sample_tile = sample_storage + k_host_tile_padding;
+		FetchAndMirror48x48Host(&target_plane[0], TEST_WIDTH, TEST_HEIGHT, tile * 5 * k_host_tile_size, tile * 3 * k_host_tile_size, target_tile);
+		FetchAndMirror48x48Host(&sample_plane[0], TEST_WIDTH, TEST_HEIGHT, tile * 5 * k_host_tile_size, tile * 3 * k_host_tile_size, sample_tile);
+
+		for (int option = 0; option < 16; ++option) {
+			const int reweight		= option & 1;
+			const int target_min	= (option >> 1) & 1;
+			const int balanced		= (option >> 2) & 1;
+			const int sample_expand	= (option >> 3) + 1;
+			const float *samples	= reweight ? target_tile : sample_tile;
+
+			vector<float> expected(3 * tile_count, 0.f);
+			for (int i = 0; i < tile_count; ++i) expected[2 * tile_count + i] = target_min ? FLT_MAX : 0.f;
+			vector<float> actual(expected);
+
+			FilterTileHost(NLM_GAUSSIAN, &Filter4Host, 4, k_host_tile_size, k_host_tile_size, 1.f, sample_expand, target_tile, samples,
+						   host_gaussian, reweight, target_min, balanced, &expected[0], &expected[tile_count], &expected[2 * tile_count]);
+			FilterTileHost(NLM_GAUSSIAN, filter, strip_width, k_host_tile_size, k_host_tile_size, 1.f, sample_expand, target_tile, samples,
+						   host_gaussian, reweight, target_min, balanced, &actual[0], &actual[tile_count], &actual[2 * tile_count]);
+
+			for (int i = 0; i < 3 * tile_count; ++i) 
+				if (memcmp(&expected[i], &actual[i], sizeof(float)) != 0) ++differing;
+		}
+	}
+	return differing;
+}
+
+// ReportSIMD
+// Writes a line of DeathrayCompare's report for the strip filter of simd.
+void ReportSIMD(const string &comparison, const host_simd &simd, const vector<vector<unsigned char> > &patterns, ofstream *report) {
+	const int differing = CompareSIMD(simd, patterns);
+	*report << comparison << ": ";
+	if (differing < 0) {
+		*report << "not supported by this build or CPU" << endl;
+	} else if (differing > 0) {
+		*report << "FAILED, " << differing << " floats differ" << endl;
+	} else {
+		*report << "identical" << endl;
+	}
+}
+
+// DeathrayCompare
+// Measures how far hi, and filtering on the CPU, stray from the results
+// of the GPU with floating point intermediate sums, on synthetic frames
+// filtered with the default parameters, spatially and with tY=2. hi is
+// also measured with x=8 and the largest tY at which it applies. Before
+// the devices are used, each SIMD strip filter of the CPU engine must
+// match Filter4Host bit for bit, see CompareSIMD. Run as:
+//
+// rundll32 Deathray.dll,DeathrayCompare
+//
+// The differences found on each device are written to compare.txt in 
+// the program cache folder.
+#pragma comment(linker, "/EXPORT:DeathrayCompare=_DeathrayCompare@16")
+extern "C" void CALLBACK DeathrayCompare(HWND window, HINSTANCE instance, LPSTR command_line, int show) {
+	ofstream report((ProgramCacheFolder() + "compare.txt").c_str());
+	report.setf(ios::fixed);
+	report.precision(3);
+
+	vector<vector<unsigned char> > patterns;
+	SyntheticPatterns(&patterns);
+
+	ReportSIMD("CPU, SSE4.1 against Filter4Host", HOST_SIMD_SSE41, patterns, &report);
+	ReportSIMD("CPU, AVX2 against Filter4Host", HOST_SIMD_AVX2, patterns, &report);
+	ReportSIMD("CPU, AVX-512 against Filter4Host", HOST_SIMD_AVX512, patterns, &report);
+
+	StartDevices();
+	if (g_devices == NULL) {
+		report << "No OpenCL device" << endl;
+		return;
+	}
+
+	for (int i = 0; i < g_device_count; ++i) {
+		ostringstream device_name;
+		device_name << "Device " << i;
+		ReportDifference(device_name.str() + ", hi against floats", CompareHalfIntermediate(i, 1, TEST_RADIUS, patterns), &report);
+		ReportDifference(device_name.str() + ", hi against floats, x=8", CompareHalfIntermediate(i, 8, COMPARE_HALF_RADIUS, patterns), &report);
+		ReportDifference(device_name.str() + ", CPU against GPU, spatial", CompareSpatialCPU(i, patterns), &report);
+		ReportDifference(device_name.str() + ", CPU against GPU, temporal", CompareTemporalCPU(i, patterns), &report);
+	}
+
+	// The CPU filters started the pool's workers, joined before rundll32 unloads the DLL
+	g_thread_pool.Stop();
+}
+
 extern "C" __declspec(dllexport) const char* __stdcall AvisynthPluginInit2(IScriptEnvironment *env) {
 
-    env->AddFunction("deathray", "c[hY]f[hUV]f[tY]i[tUV]i[s]f[x]i[l]b[c]b[z]b[b]b", CreateDeathray, 0);
+    env->AtExit(StopThreadPool, NULL);
+    env->AddFunction("deathray", "c[hY]f[hUV]f[tY]i[tUV]i[s]f[x]i[l]b[c]b[z]b[b]b[a]i[p]b[pf]i[md]i[sf]b[ht]b[tune]b[sym]i[ft]b[hi]b[mem]i[trace]s", CreateDeathray, 0);
     return "Deathray";
 }
@@ -8,71 +8,271 @@
 #ifndef _DEATHRAY_
 #define _DEATHRAY_
 
+#include <vector>
+#include <mutex>
+#include <thread>
 #include "avisynth.h"
 #include "result.h"
 #include "buffer_map.h"
+#include "device.h"
+#include "SingleFrame.h"
+#include "MultiFrame.h"
+#include "SingleFrameCPU.h"
+#include "MultiFrameCPU.h"
+#include "Prefetcher.h"
+#include "Autotune.h"
+
+// in_flight
+// A frame being filtered by a device, ahead of its return
+struct in_flight {
+	in_flight() : frame(-1), event_count(0) {}
+
+	int frame					;	// frame number, or -1 when the device is idle
+	PVideoFrame src				;	// frame being filtered
+	PVideoFrame dst				;	// filtered frame
+	vector<PVideoFrame> fetched	;	// frames from the child, held until copied to the device
+	cl_event events[3]			;	// completion of copies of filtered planes to dst
+	cl_uint event_count			;	// count of events
+};
+
+// frame_band
+// Rows of a plane filtered by a device when frames are split across
+// devices
+struct frame_band {
+	int first		;	// first row of the host plane that is copied to the device
+	int apron		;	// rows copied from the neighbouring band above, which are not returned
+	int rows		;	// rows filtered and returned by the device
+	int device_rows	;	// rows copied to the device, including aprons above and below
+};
+
+// Count of filter sets of an instance, i.e. of frames it filters at
+// the same time for Avisynth's threads
+#define MAX_FILTER_SETS 4
+
+// filter_set
+// Filters on each device, and the frame being filtered with them. Each
+// call to GetFrame uses a set of its own, so that calls on several of
+// Avisynth's threads filter frames at the same time, each with its own
+// queues and kernel instances. See deathray::TakeSet.
+struct filter_set {
+	filter_set() : env(NULL), pipelined_frame(-1), src_offsetY(0), src_offsetUV(0), frames_filtered(0) {}
+
+	mutex in_use					;	// held by the call filtering with the set
+	IScriptEnvironment *env			;	// environment of the calling thread
+	PVideoFrame src					;	// frame being filtered
+	PVideoFrame dst					;	// filtered frame
+	const unsigned char *srcpY		;	// planes of src
+	const unsigned char *srcpU		;
+	const unsigned char *srcpV		;
+	unsigned char *dstpY			;	// planes of dst
+	unsigned char *dstpU			;
+	unsigned char *dstpV			;
+	int pipelined_frame				;	// frame filtered speculatively by the prior call, or -1
+	vector<PVideoFrame> pipelined_fetched;	// frames fetched from the child for pipelined_frame
+	vector<PVideoFrame> fetched		;	// frames fetched from the child for the frame being launched, emptied but not freed after each frame
+	MultiFrameRequest requests[3]	;	// frames required by the Y, U and V multi frame filters, reused for every frame
+	int src_offsetY					;	// offset in bytes of the luma band within frames from the child, when split
+	int src_offsetUV				;	// offset in bytes of the chroma band within frames from the child, when split
+	int frames_filtered				;	// count of frames filtered, for the check of debug builds, see CountSetup
+
+	SingleFrame single_frame_Y[MAX_DEVICES]		;
+	SingleFrame single_frame_UV[MAX_DEVICES]	;	// filters both chroma planes with each launch
+	MultiFrame multi_frame_Y[MAX_DEVICES]		;
+	MultiFrame multi_frame_U[MAX_DEVICES]		;
+	MultiFrame multi_frame_V[MAX_DEVICES]		;
+};
 
 class deathray : public GenericVideoFilter {
 public:
 
-	deathray(PClip _child, double h_Y, double h_UV, int t_Y, int t_UV, double sigma, int sample_expand, int linear, int correction, int target_min, int balanced, IScriptEnvironment* env);
+	deathray(PClip _child, double h_Y, double h_UV, int t_Y, int t_UV, double sigma, int sample_expand, int linear, int correction, int target_min, int balanced, int algorithm, int pipelined, int prefetch_depth, int max_devices, int split, int half_tile, int tune, int tune_half_tile, int weight_cache, int fused, int half_intermediate, int memory_budget, const char *trace, IScriptEnvironment* env);
 
-	~deathray(){};
+	~deathray();
 
 	PVideoFrame __stdcall GetFrame(int n, IScriptEnvironment* env);
 
 private:
+	// Start
+	// Runs on a thread started by the constructor. Starts OpenCL,
+	// then generates the gaussian weights and builds the kernel 
+	// variants on each device used by this instance.
+	void Start();
+
+	// TakeSet
+	// Locks a filter set for the calling thread until held is released.
+	// Once configured, calls filtering separate frames on a single 
+	// device take sets of their own, adding sets as concurrent calls 
+	// need them. Otherwise, i.e. while configuring, on the CPU, or when
+	// devices split or take turns on frames, calls share the first set,
+	// as they share the scheduler and every device.
+	filter_set* TakeSet(IScriptEnvironment *env, unique_lock<mutex> *held);
+
+	// AddSet
+	// Configures another filter set on the device, unless MAX_FILTER_SETS
+	// are configured or the set does not fit in the device's memory or
+	// the instance's budget. Returns false if no set is added.
+	bool AddSet(IScriptEnvironment *env);
+
 	// Init
-	// Verifies that OpenCL is ready to go and that at least
-	// one device is ready.
-	result Init();
+	// Waits for Start, verifies that OpenCL is ready to go and
+	// that at least one device is ready, then configures this 
+	// instance's filters on the first call.
+	result Init(filter_set &set);
+
+	// Tune
+	// Chooses the fastest kernel configuration for the device,
+	// using the current frame.
+	void Tune(filter_set &set, const int &device_id);
+
+	// CPUInit
+	// Configure the host engine's single frame and multi
+	// frame filtering, when no OpenCL device is available.
+	result CPUInit(filter_set &set);
+
+	// Footprint
+	// Bytes of the device's memory used by the instance's filters,
+	// with the current parameters.
+	size_t Footprint(const int &device_id);
+
+	// PlanMemory
+	// Before any filter is configured, compares the footprint on each
+	// device with the memory available to the instance. Parameters are
+	// degraded until the filters fit, trading speed for memory in the
+	// order: weight maps, then pipelining. If the
+	// filters still do not fit, the script stops with an error,
+	// instead of an allocation failing partway through configuration.
+	void PlanMemory(filter_set &set);
 
 	// SetupFilters
-	// Configure the global classes for single frame and multi
-	// frame filtering.
-	result SetupFilters(const int &device_id);
+	// Configure the instance's objects for single frame and multi
+	// frame filtering on the device.
+	result SetupFilters(filter_set &set, const int &device_id);
+
+	// FetchFrame
+	// Gets frame n from the child, via the prefetcher when
+	// prefetching.
+	PVideoFrame FetchFrame(filter_set &set, const int &n);
+
+	// Prefetch
+	// Fetches the frames queued by the prefetcher on the calling
+	// thread, while the devices filter the frames launched by the call.
+	void Prefetch(filter_set &set);
 
 	// InitPointers
 	// Get the pointers for single frame filtering
-	void InitPointers();
+	void InitPointers(filter_set &set);
+
+	// InitBandPointers
+	// Get the pointers for the device's band of each plane,
+	// when frames are split across devices
+	void InitBandPointers(filter_set &set, const int &device_id);
 	
 	// InitDimensions
 	// Get the dimensions for filtering
-	void InitDimensions();
+	void InitDimensions(filter_set &set);
 
 	// PassThroughLuma
 	// Puts unfiltered luma in destination
-	void PassThroughLuma();
+	void PassThroughLuma(filter_set &set);
 	
 	// PassThroughChroma
 	// Puts unfiltered chroma in destination
-	void PassThroughChroma();
+	void PassThroughChroma(filter_set &set);
 
 	// SingleFrameInit
 	// Configure the plane-specific objects
 	// for single frame filtering
-	result SingleFrameInit(const int &device_id);
+	result SingleFrameInit(filter_set &set, const int &device_id);
+
+	// SingleFrameLaunch
+	// Copies frame n to the device, filters and copies back to host
+	// any combination of Y, U and V, without waiting. An 
+	// event for each copy to host is appended to wait_list.
+	void SingleFrameLaunch(filter_set &set, const int &device_id, const int &n, cl_event *wait_list, cl_uint *wait_list_length);
 
 	// SingleFrameExecute
 	// Filter a single plane for any combination
 	// of Y, U and V
-	void SingleFrameExecute();
+	void SingleFrameExecute(filter_set &set, const int &n);
 
 	// MultiFrameInit
 	// Configure the plane-type specific objects
 	// for multi frame filtering
-	result MultiFrameInit(const int &device_id);
+	result MultiFrameInit(filter_set &set, const int &device_id);
 
 	// MultiFrameCopy
 	// Queries each plane type for the frame numbers
 	// it requires, then provides the relevant host pointers
 	// and activates the copy of host data to the device.
-	void MultiFrameCopy(const int &n);
+	// Frames fetched from the child are appended to fetched,
+	// which must be held until the copies have completed.
+	void MultiFrameCopy(filter_set &set, const int &device_id, const int &n, vector<PVideoFrame> *fetched);
 
 	// MultiFrameExecute
 	// Filter a single plane for any combination
 	// of Y, U and V over the entire temporal range.
-	void MultiFrameExecute(const int &n);
+	void MultiFrameExecute(filter_set &set, const int &n);
+
+	// MultiFrameLaunch
+	// Copies frames to the device and enqueues filtering of
+	// frame n for any combination of Y, U and V, without 
+	// waiting for completion.
+	void MultiFrameLaunch(filter_set &set, const int &device_id, const int &n, vector<PVideoFrame> *fetched);
+
+	// MultiFrameCopyFrom
+	// Enqueues copies to host of the launched frame. An event
+	// for each copy is appended to wait_list.
+	void MultiFrameCopyFrom(filter_set &set, const int &device_id, cl_event *wait_list, cl_uint *wait_list_length);
+
+	// MultiFrameFinish
+	// Waits for all multi frame copies and filtering to complete.
+	void MultiFrameFinish(filter_set &set, const int &device_id);
+
+	// MultiFramePipelined
+	// Returns frame n, which is usually already filtered, while
+	// frame n + 1 is copied to the device and filtered.
+	void MultiFramePipelined(filter_set &set, const int &n);
+
+	// ScheduledFrame
+	// Returns frame n when devices filter frames in parallel. 
+	// Each idle device is given one of the frames that follow 
+	// n, so frames are filtered out of order but returned in 
+	// order.
+	PVideoFrame ScheduledFrame(filter_set &set, const int &n);
+
+	// ScheduleAhead
+	// Launches the frames after n that are not in flight on
+	// idle devices.
+	void ScheduleAhead(filter_set &set, const int &n);
+
+	// InFlight
+	// Returns the device filtering frame n, or -1.
+	int InFlight(const int &n);
+
+	// Launch
+	// Starts filtering frame n on an idle device.
+	void Launch(filter_set &set, const int &device_id, const int &n);
+
+	// Collect
+	// Waits for the device's frame, which is returned, leaving
+	// the device idle.
+	PVideoFrame Collect(const int &device_id);
+
+	// SplitFrame
+	// Filters frame n with each plane split into a band per
+	// device.
+	void SplitFrame(filter_set &set, const int &n);
+
+	// SingleFrameExecuteCPU
+	// Filter a single plane for any combination
+	// of Y, U and V on the host's cores
+	void SingleFrameExecuteCPU(filter_set &set);
+
+	// MultiFrameExecuteCPU
+	// Filter a single plane for any combination
+	// of Y, U and V over the entire temporal range
+	// on the host's cores
+	void MultiFrameExecuteCPU(filter_set &set, const int &n);
 
 	float h_Y_				;	// strength of luma noise reduction
 	float h_UV_				;	// strength of chroma noise reduction
@@ -84,21 +284,46 @@ private:
 	int correction_			;	// apply a post-filtering correction
 	int target_min_			;	// target pixel is weighted using minimum weight of samples, not maximum
 	int balanced_			;	// balanced tonal range de-noising
+	int algorithm_			;	// method used to compute window distances, see nlm_algorithm
+	int pipelined_			;	// multi frame filtering of the next frame overlaps the return of this frame
+	int prefetch_depth_		;	// count of frames fetched from the child ahead of need, 0 for no prefetching
+	Prefetcher prefetcher_	;	// fetches frames from the child ahead of their use, see Prefetch
+	int max_devices_		;	// count of devices requested, 0 for all devices
+	int device_count_		;	// count of devices filtering frames in parallel
+	in_flight in_flight_[MAX_DEVICES];	// frame being filtered by each device
+	int split_				;	// each frame is split into bands across devices, instead of devices filtering separate frames
+	int half_tile_			;	// kernels hold tiles as halves in local memory
+	int tune_				;	// kernel configuration of each device is chosen by benchmarking
+	int tune_half_tile_		;	// benchmarking chooses half_tile, as the script did not set it
+	kernel_tuning tuning_[MAX_DEVICES];	// kernel configuration used by each device
+	int weight_cache_		;	// megabytes of weights shared by pairs of frames in multi frame filtering, 0 for none
+	int fused_				;	// multi frame filtering of each plane is performed by a single kernel
+	int half_intermediate_	;	// intermediate buffers of multi frame filtering hold halves
+	int memory_budget_		;	// megabytes of device memory the instance may use, 0 for all that is available
+	bool traced_			;	// instance opened a trace, closed on destruction, see TraceOpen
+	frame_band bands_Y_[MAX_DEVICES];	// luma band filtered by each device, when split
+	frame_band bands_UV_[MAX_DEVICES];	// chroma band filtered by each device, when split
+	bool initialised_		;	// filters of this instance have been configured
+	thread starter_			;	// runs Start, joined by the first Init
+	result start_status_	;	// result of Start
+	cl_int start_cl_error_	;	// OpenCL status of Start's failure, as g_last_cl_error is per thread
+	mutex mutex_			;	// guards initialised_ and the filter sets while a call takes one
+	vector<filter_set*> sets_;	// filters of this instance, the first configured by Init, see TakeSet
+	size_t next_set_		;	// set that the next call waits for, when every set is in use
 
-	// Following are standard Avisynth properties of environment, source and destination: frames and planes
-	IScriptEnvironment *env_;
-
-	PVideoFrame src_;
-	PVideoFrame dst_;
-
-	const unsigned char *srcpY_;
-	const unsigned char *srcpU_;
-	const unsigned char *srcpV_;
+	// Gaussian weights of this instance, for each device, shared by the filter sets
+	int gaussian_[MAX_DEVICES]					;	// buffer containing the gaussian weights
 
-	unsigned char *dstpY_;
-    unsigned char *dstpU_;
-    unsigned char *dstpV_;    
+	// Filters of this instance on the host's cores, when no OpenCL device is available
+	float host_gaussian_[56]					;	// gaussian weights
+	SingleFrameCPU single_frame_CPU_Y_			;
+	SingleFrameCPU single_frame_CPU_U_			;
+	SingleFrameCPU single_frame_CPU_V_			;
+	MultiFrameCPU multi_frame_CPU_Y_			;
+	MultiFrameCPU multi_frame_CPU_U_			;
+	MultiFrameCPU multi_frame_CPU_V_			;
 
+	// Following are standard Avisynth properties of source and destination planes, the same for every frame
     int src_pitchY_;
     int src_pitchUV_;
 
@@ -8,10 +8,12 @@
 #include "device.h"
 #include "CLutil.h"
 #include "result.h"
+#include "trace.h"
 
 
 device::device() {
 	id_ = NULL;
+	host_unified_memory_ = false;
 }
 
 device::~device(void) {
@@ -20,6 +22,25 @@ device::~device(void) {
 
 void device::Init(const cl_device_id &single_device) {
 	id_ = single_device;
+
+	cl_bool unified = CL_FALSE;
+	cl_device_type type = 0;
+	clGetDeviceInfo(id_, CL_DEVICE_HOST_UNIFIED_MEMORY, sizeof(cl_bool), &unified, NULL);
+	clGetDeviceInfo(id_, CL_DEVICE_TYPE, sizeof(cl_device_type), &type, NULL);
+	host_unified_memory_ = (unified == CL_TRUE) || (type & CL_DEVICE_TYPE_CPU) != 0;
+
+	// A 32-bit process cannot address more than size_t counts, which
+	// is also the limit if the device does not report its memory
+	const cl_ulong addressable = static_cast<size_t>(-1);
+	cl_ulong capacity = addressable;
+	cl_ulong max_alloc = addressable;
+	clGetDeviceInfo(id_, CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(cl_ulong), &capacity, NULL);
+	clGetDeviceInfo(id_, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(cl_ulong), &max_alloc, NULL);
+	buffers_.Init(host_unified_memory_, static_cast<size_t>(min(capacity, addressable)), static_cast<size_t>(min(max_alloc, addressable)));
+
+	// The frame_cache's queue lasts for the process, so it is profiled
+	// in case a trace is opened later
+	frames_.Init(&buffers_, cq(true));
 }
 
 result device::KernelInit(const cl_program &program, const size_t &kernel_count, const string *kernels) {
@@ -43,14 +64,36 @@ cl_kernel device::kernel(const string &kernel) {
 }
 
 cl_kernel device::NewKernelInstance(const string &kernel) {
+	CountSetup();
 	return clCreateKernel(program_, kernel.c_str(), NULL);
 }
 
-cl_command_queue device::cq() {
+cl_kernel device::NewKernelInstance(const string &kernel, const string &variant) {
+	CountSetup();
+	cl_program program = Variant(variant);
+	return clCreateKernel((program != NULL) ? program : program_, kernel.c_str(), NULL);
+}
+
+cl_program device::Variant(const string &options) {
+	lock_guard<mutex> serialise(variants_mutex_);
+
+	map<string, cl_program>::iterator found = variants_.find(options);
+	if (found != variants_.end()) return found->second;
+
+	// A failed build is recorded too, so that it is not repeated
+	cl_program program = NULL;
+	if (BuildProgram(1, &id_, options, g_program_source, &program) != FILTER_OK) program = NULL;
+	variants_[options] = program;
+	return program;
+}
+
+cl_command_queue device::cq(const bool &profiled) {
 
+	// Commands are timed when tracing, see TraceCommand
+	const cl_command_queue_properties properties = CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE | ((profiled || Tracing()) ? CL_QUEUE_PROFILING_ENABLE : 0);
 	cl_command_queue new_cq = clCreateCommandQueue(g_context, 
 												   id_, 
-												   CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE,
+												   properties,
 												   NULL);
 
 	return new_cq;
@@ -9,8 +9,10 @@
 #define _DEVICE_H_
 
 #include <map>
+#include <mutex>
 #include <CL/cl.h>
 #include "buffer_map.h"
+#include "frame_cache.h"
 
 
 // device
@@ -59,20 +61,50 @@ public:
 	// or objects set arguments on a named kernel, concurrently.
 	cl_kernel NewKernelInstance(const string &kernel);
 
+	// NewKernelInstance
+	// Returns an independent instance of a kernel from the program
+	// variant built with the options, see VariantOptions. If the 
+	// variant cannot be built the kernel is taken from the program
+	// that reads all flags from its arguments.
+	cl_kernel NewKernelInstance(const string &kernel, const string &variant);
+
+	// Variant
+	// Returns the program built with the options, building it on
+	// first use, or NULL if it cannot be built.
+	cl_program Variant(const string &options);
+
+	// id
+	// OpenCL identifier of the device
+	cl_device_id id() {return id_;}
+
+	// host_unified_memory
+	// Indicates that the device shares memory with the host, e.g. an 
+	// APU or a CPU.
+	bool host_unified_memory() {return host_unified_memory_;}
+
 	// cq
 	// Returns a new command queue. 
 	// This command queue can be shared by multiple objects or 
 	// used exclusively by the object that calls this method.
-	cl_command_queue		cq();
+	// Profiling is enabled if a trace is open, see TraceOpen, or if
+	// profiled is true.
+	cl_command_queue		cq(const bool &profiled = false);
 
 	buffer_map				buffers_;	// set of buffers on the device - TODO make private and create methods in this class
+	frame_cache				frames_;	// planes of frames shared by filter instances
 
 private:
 	cl_device_id			id_;		// sequence number of the device
 	map<string, cl_kernel>	kernel_;	// set of kernel objects that have been pre-compiled
 	cl_program				program_;	// program object used to generate new instances of named kernels
+	bool					host_unified_memory_;	// device and host share memory
+	map<string, cl_program>	variants_;	// programs built with filter flags compiled in, by build options
+	mutex					variants_mutex_;	// serialises building of variants by concurrent instances
 };
 
+// Maximum count of devices used for filtering
+#define MAX_DEVICES 8
+
 extern device*				g_devices ;
 
 #endif // _DEVICE_H_
@@ -0,0 +1,242 @@
+/* Deathray - An Avisynth plug-in filter for spatial/temporal non-local means de-noising.
+ *
+ * version 1.04
+ *
+ * Copyright 2013, Jawed Ashraf - Deathray@cupidity.f9.co.uk
+ */
+
+#include "frame_cache.h"
+#include "util.h"
+#include "CLutil.h"
+
+frame_cache::~frame_cache() {
+	for (size_t i = 0; i < entries_.size(); ++i) {
+		if (entries_[i].copied != NULL) ReleaseEvent(entries_[i].copied);
+	}
+	if (cq_ != NULL) clReleaseCommandQueue(cq_);
+}
+
+void frame_cache::Init(
+			buffer_map			*buffers,
+	const	cl_command_queue	&cq) {
+
+	buffers_	= buffers;
+	cq_			= cq;
+}
+
+frame_cache::entry* frame_cache::Find(const frame_key &key) {
+	if (key.clip == NULL) return NULL;
+
+	for (size_t i = 0; i < entries_.size(); ++i) {
+		const entry &each = entries_[i];
+		if (each.key.clip == key.clip &&
+			each.key.plane == key.plane &&
+			each.key.first_row == key.first_row &&
+			each.key.width == key.width &&
+			each.key.height == key.height &&
+			each.key.frame_number == key.frame_number)
+			return &entries_[i];
+	}
+	return NULL;
+}
+
+frame_cache::entry* frame_cache::Copied(
+	const	frame_key			&key,
+			unique_lock<mutex>	*lock) {
+
+	// A failed copy leaves the plane holding no frame, so it is not found
+	entry *found = Find(key);
+	while (found != NULL && found->copying) {
+		enqueued_.wait(*lock);
+		found = Find(key);
+	}
+	return found;
+}
+
+frame_cache::entry* frame_cache::LeastRecentlyUsed(
+	const	bool	&any_size,
+	const	int		&width,
+	const	int		&height) {
+
+	entry *oldest = NULL;
+	for (size_t i = 0; i < entries_.size(); ++i) {
+		entry &each = entries_[i];
+		if (each.references > 0) continue;
+		if (!any_size && (each.key.width != width || each.key.height != height)) continue;
+		if (oldest == NULL || each.used < oldest->used) oldest = &each;
+	}
+	return oldest;
+}
+
+void frame_cache::Evict(entry *idle) {
+	if (idle->copied != NULL) ReleaseEvent(idle->copied);
+	buffers_->Destroy(idle->plane);
+	idle_bytes_ -= idle->bytes;
+	entries_.erase(entries_.begin() + (idle - &entries_[0]));
+}
+
+bool frame_cache::Spare(const entry &idle) {
+	int idle_count = 0;
+	int held_count = 0;
+	for (size_t i = 0; i < entries_.size(); ++i) {
+		const entry &each = entries_[i];
+		if (each.key.width != idle.key.width || each.key.height != idle.key.height) continue;
+		if (each.references > 0)
+			++held_count;
+		else
+			++idle_count;
+	}
+	return idle_count > 1 || held_count == 0;
+}
+
+void frame_cache::Trim() {
+	const size_t share = (buffers_->available() + idle_bytes_) / FRAME_CACHE_SHARE;
+	while (idle_bytes_ > share) {
+		entry *oldest = NULL;
+		for (size_t i = 0; i < entries_.size(); ++i) {
+			entry &each = entries_[i];
+			if (each.references > 0 || !Spare(each)) continue;
+			if (oldest == NULL || each.used < oldest->used) oldest = &each;
+		}
+		if (oldest == NULL) return;
+		Evict(oldest);
+	}
+}
+
+bool frame_cache::Acquire(
+	const	frame_key	&key,
+			int			*plane,
+			cl_event	*copied) {
+
+	unique_lock<mutex> lock(mutex_);
+
+	entry *found = Copied(key, &lock);
+	if (found == NULL) return false;
+
+	if (found->references++ == 0) idle_bytes_ -= found->bytes;
+	*plane = found->plane;
+	*copied = found->copied;
+	return true;
+}
+
+result frame_cache::Insert(
+	const	frame_key	&key,
+	const	byte		&host_buffer,
+	const	int			&host_pitch,
+			int			*plane,
+			cl_event	*copied) {
+
+	unique_lock<mutex> lock(mutex_);
+
+	// Another instance may have copied the frame since Acquire
+	entry *found = Copied(key, &lock);
+	if (found != NULL) {
+		if (found->references++ == 0) idle_bytes_ -= found->bytes;
+		*plane = found->plane;
+		*copied = found->copied;
+		return FILTER_OK;
+	}
+
+	found = LeastRecentlyUsed(false, key.width, key.height);
+	if (found != NULL) {
+		// The plane's prior copy is complete before it is overwritten
+		if (found->copied != NULL) {
+			clWaitForEvents(1, &found->copied);
+			ReleaseEvent(found->copied);
+			found->copied = NULL;
+		}
+		idle_bytes_ -= found->bytes;
+	} else {
+		// Refills are bounded by the cache's share, so are not counted as
+		// setup by the filter that asked for the frame
+		ExemptSetup(true);
+		entry new_entry = {key, 0, 0, NULL, buffer_map::PlaneBytes(key.width, key.height), 0, false};
+		result status = buffers_->AllocPlane(cq_, key.width, key.height, &new_entry.plane);
+
+		// Idle planes of other sizes make way for the new plane
+		entry *oldest;
+		while (status != FILTER_OK && (oldest = LeastRecentlyUsed(true, 0, 0)) != NULL) {
+			Evict(oldest);
+			status = buffers_->AllocPlane(cq_, key.width, key.height, &new_entry.plane);
+		}
+		ExemptSetup(false);
+		if (status != FILTER_OK) return status;
+
+		entries_.push_back(new_entry);
+		found = &entries_.back();
+	}
+
+	// The reference keeps the plane from being evicted or reused while
+	// the copy is enqueued without the lock, during which entries_ may
+	// change, so the entry is found again by its plane
+	found->key = key;
+	found->references = 1;
+	found->copying = true;
+	const int reserved = found->plane;
+	lock.unlock();
+
+	cl_event enqueued = NULL;
+	result status = buffers_->CopyToPlaneAsynch(reserved, host_buffer, key.width, key.height, host_pitch, &enqueued);
+
+	lock.lock();
+	for (size_t i = 0; i < entries_.size(); ++i) {
+		if (entries_[i].plane == reserved) found = &entries_[i];
+	}
+	found->copying = false;
+	if (status != FILTER_OK) {
+		// The plane is idle, holding no frame
+		found->key.clip = NULL;
+		found->copied = NULL;
+		found->references = 0;
+		found->used = tick_++;
+		idle_bytes_ += found->bytes;
+	} else {
+		found->copied = enqueued;
+		*plane = found->plane;
+		*copied = found->copied;
+	}
+	lock.unlock();
+	enqueued_.notify_all();
+
+	return status;
+}
+
+void frame_cache::Release(const int &plane) {
+	lock_guard<mutex> lock(mutex_);
+
+	for (size_t i = 0; i < entries_.size(); ++i) {
+		entry &each = entries_[i];
+		if (each.plane != plane) continue;
+
+		if (--each.references > 0) return;
+
+		each.used = tick_++;
+		idle_bytes_ += each.bytes;
+		Trim();
+		return;
+	}
+}
+
+void frame_cache::Forget(const void *clip) {
+	if (clip == NULL) return;
+
+	lock_guard<mutex> lock(mutex_);
+
+	for (size_t i = 0; i < entries_.size(); ++i) {
+		entry &each = entries_[i];
+		if (each.references == 0 && each.key.clip == clip) each.key.clip = NULL;
+	}
+}
+
+void frame_cache::Reclaim(const size_t &bytes) {
+	lock_guard<mutex> lock(mutex_);
+
+	entry *oldest;
+	while (buffers_->available() < bytes && (oldest = LeastRecentlyUsed(true, 0, 0)) != NULL)
+		Evict(oldest);
+}
+
+size_t frame_cache::idle_bytes() {
+	lock_guard<mutex> lock(mutex_);
+	return idle_bytes_;
+}
@@ -0,0 +1,178 @@
+/* Deathray - An Avisynth plug-in filter for spatial/temporal non-local means de-noising.
+ *
+ * version 1.04
+ *
+ * Copyright 2013, Jawed Ashraf - Deathray@cupidity.f9.co.uk
+ */
+
+#ifndef _FRAME_CACHE_H_
+#define _FRAME_CACHE_H_
+
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <CL/cl.h>
+#include "buffer_map.h"
+
+using namespace std;
+
+// Planes without references are kept in up to 1 / FRAME_CACHE_SHARE of
+// the device's memory that is not used by filters
+#define FRAME_CACHE_SHARE 4
+
+// frame_key
+// Identifies a plane of a frame of a clip, as copied to a device
+struct frame_key {
+	const void *clip	;	// source clip, or NULL when the plane is private to the filter that copies it
+	int plane			;	// 0 for Y, 1 for U, 2 for V
+	int first_row		;	// first row of the host plane that is copied, when a band is filtered
+	int width			;	// width in pixels
+	int height			;	// rows
+	int frame_number	;	// frame of the clip
+};
+
+// frame_cache
+// Planes of frames on a device, shared by filter instances that
+// read the same plane of the same frame of the same clip, e.g. when
+// a script compares two strengths of Deathray on one source.
+//
+// Each plane is copied from the host once, by the instance that
+// first needs it, and is counted by references. The instances'
+// kernels wait for the event of that copy.
+//
+// A plane without references is idle. Idle planes keep their frames,
+// so that seeking back, or stepping through frames out of order,
+// finds frames without copying them again. When a new frame is 
+// copied, the least recently used idle plane of the same size takes
+// it, so that filtering does not allocate per frame. Idle planes are
+// limited to a share of the device's memory, see FRAME_CACHE_SHARE,
+// except that one idle plane of each size in use is always kept, and
+// are destroyed, least recently used first, when filters need their
+// memory.
+//
+// Once a filter that shares frames is destroyed, idle planes of its
+// clip are no longer found, as another clip may later take the
+// clip's address.
+//
+// Planes are allocated with the cache's own queue, so that copies
+// to them do not depend on the instance that allocated them.
+//
+// The copy of a frame to a plane, including its copy to staging
+// memory on the host, is made outside the cache's lock, so that
+// instances, or calls on separate threads, copy frames at the same
+// time. Others that want the frame wait until its copy is enqueued.
+class frame_cache {
+public:
+	frame_cache() : buffers_(NULL), cq_(NULL), idle_bytes_(0), tick_(0) {}
+
+	// Destructor
+	// Planes are destroyed with the rest of the device's buffers
+	~frame_cache();
+
+	// Init
+	// Records the device's buffers, in which planes are allocated,
+	// and the queue used for copies.
+	void Init(
+				buffer_map			*buffers,
+		const	cl_command_queue	&cq);
+
+	// Acquire
+	// Returns true with a reference to the plane holding the frame,
+	// and the event of its copy, when another instance holds it or
+	// an idle plane kept it.
+	bool Acquire(
+		const	frame_key	&key,
+				int			*plane,		// map index of the plane
+				cl_event	*copied);	// copy of the frame to the plane
+
+	// Insert
+	// As Acquire, but when no instance holds the frame it is copied
+	// from the host, to an idle plane or to a new plane. The plane is
+	// reserved under the lock, then the copy is enqueued without it.
+	result Insert(
+		const	frame_key	&key,
+		const	byte		&host_buffer,	// host's buffer of pixels in row major layout
+		const	int			&host_pitch,	// size in pixels of each row of host buffer
+				int			*plane,			// map index of the plane
+				cl_event	*copied);		// copy of the frame to the plane
+
+	// Release
+	// Gives up a reference to the plane. The plane may be copied to as
+	// soon as this returns, so no kernel that reads it may be pending.
+	void Release(const int &plane);
+
+	// Forget
+	// Idle planes of the clip are no longer found. Called when a filter
+	// that shares the clip's frames is destroyed.
+	void Forget(const void *clip);
+
+	// Reclaim
+	// Destroys idle planes, least recently used first, until the bytes
+	// are available on the device or no idle plane remains.
+	void Reclaim(const size_t &bytes);
+
+	// idle_bytes
+	// Bytes of the device's memory held by idle planes
+	size_t idle_bytes();
+
+private:
+
+	// entry
+	// A plane and the frame it holds
+	struct entry {
+		frame_key key		;	// frame held by the plane
+		int plane			;	// map index of the plane
+		int references		;	// count of Frame objects using the plane, 0 when idle
+		cl_event copied		;	// copy of the frame to the plane
+		size_t bytes		;	// size of the plane on the device
+		unsigned int used	;	// tick of the latest release, orders idle planes by recency
+		bool copying		;	// Insert is enqueueing the copy of the frame, so copied is not yet set
+	};
+
+	// Find
+	// Entry holding the frame, whether held or idle, or NULL
+	entry* Find(const frame_key &key);
+
+	// Copied
+	// Entry holding the frame once no Insert is enqueueing its copy,
+	// waiting with the lock until then, or NULL
+	entry* Copied(
+		const	frame_key			&key,
+				unique_lock<mutex>	*lock);
+
+	// LeastRecentlyUsed
+	// Idle entry that was released first, whose plane has the size
+	// unless any size is accepted, or NULL
+	entry* LeastRecentlyUsed(
+		const	bool	&any_size,
+		const	int		&width,
+		const	int		&height);
+
+	// Evict
+	// Destroys the plane of the idle entry
+	void Evict(entry *idle);
+
+	// Spare
+	// True unless the idle entry is the last idle plane of a size that
+	// is held by another entry. That plane is kept, however little
+	// memory is left, so that the next frame copied takes it instead
+	// of allocating a plane
+	bool Spare(const entry &idle);
+
+	// Trim
+	// Destroys spare idle planes, least recently used first, until 
+	// they hold no more than their share of the device's memory. 
+	// Only Reclaim, and Insert when an allocation fails, destroy the
+	// last idle plane of a size in use
+	void Trim();
+
+	buffer_map			*buffers_	;	// buffers of the device, in which planes are allocated
+	cl_command_queue	cq_			;	// queue for copies of frames to planes
+	vector<entry>		entries_	;	// planes, whether held or idle
+	size_t				idle_bytes_	;	// bytes of idle planes
+	unsigned int		tick_		;	// count of releases
+	mutex				mutex_		;	// guards the entries against concurrent filter instances
+	condition_variable	enqueued_	;	// signalled when Insert has enqueued a copy, or failed to
+};
+
+#endif // _FRAME_CACHE_H_
@@ -10,7 +10,7 @@ void Filter4(
 	const		float	h,						// strength of denoising
 	const		int		sample_expand,			// factor to expand sample radius
 				float16	*target_window,			// a window of 10x7 pixels, centred upon the 4 pixels being filtered
-	local		float	*sample_tile,			// factor to expand sample radius
+	local	TILE_PIXEL	*sample_tile,			// factor to expand sample radius
 	constant	float	*gaussian,				// 49 weights of guassian kernel
 	const		int		reweight_target_pixel,	// when target plane is the sampling plane, the target pixel is reweighted
 	const		int		target_min,				// target pixel is weighted using minimum weight of samples, not maximum
@@ -90,4 +90,366 @@ void Filter4(
 
 	sample_centre_pixel = ReadTile4(target.x, target.y, sample_tile);
 	*all_samples_average +=  reweight_target_pixel ? *target_weight * sample_centre_pixel : 0.f;
-}
\ No newline at end of file
+}
+
+#define SYMMETRIC_OFFSETS	49	// sample offsets held by a weight map, one per sample window of the 7x7 arrangement
+
+void FilterSymmetric(
+	const		int2	target,					// tile coordinates of left-hand pixel of 4 pixels in a horizontal strip
+	const		int2	pixel,					// plane coordinates of left-hand pixel of the strip
+	const		int		width,					// width in pixels
+	const		int		height,					// height in pixels
+	const		float	h,						// strength of denoising
+				float16	*target_window,			// a window of 10x7 pixels, centred upon the 4 pixels being filtered
+	local	TILE_PIXEL	*sample_tile,			// tile of the sample plane
+	constant	float	*gaussian,				// 49 weights of guassian kernel
+	const		int		target_min,				// target pixel is weighted using minimum weight of samples, not maximum
+	const		int		reuse,					// weights are read from the map instead of being stored in it
+	global		float	*weight_map,			// weight of every sample offset for every pixel of the plane
+	const		int		map_width,				// width, in pixels, of each offset's weights in the map
+	const		int		map_height,				// height, in rows, of each offset's weights in the map
+				float4	*all_samples_average,	// running sum of weighted pixel values
+				float4	*all_samples_weight,	// running sum of weights
+				float4  *target_weight) {		// weight chosen from across all sample planes that will be used for target pixel
+
+	// Same as Filter4 with a sample_expand of 1, without balanced
+	// weighting, for a sample plane that is not the target plane.
+	//
+	// The distance between a window in frame n and a window in frame m
+	// is the same whichever of the frames is the target. So the weights
+	// computed when n is the target are stored, at the pixel of the 
+	// target and the offset of the sample, and when m is the target
+	// they are read from the pixel of the sample and the opposite 
+	// offset instead of being computed.
+	//
+	// Weights are read solely when the windows of the target and of
+	// all its samples lie within the plane. Otherwise mirroring at the
+	// plane's edges can give the two frames different windows.
+
+	const int kernel_radius = 3;
+	const int map_plane = map_width * map_height;
+
+	const bool inside = pixel.x >= 2 * kernel_radius && pixel.x + 3 + 2 * kernel_radius < width &&
+						pixel.y >= 2 * kernel_radius && pixel.y + 2 * kernel_radius < height;
+
+	float4 sample_centre_pixel;
+	const float4 invert = 1.f;
+	const float4 factor = 0.f;
+	int2 offset;
+	for (offset.y = -kernel_radius; offset.y <= kernel_radius; ++offset.y) {
+		for (offset.x = -kernel_radius; offset.x <= kernel_radius; ++offset.x) {
+			int2 sample = target + offset;
+			float4 sample_weight;
+			if (reuse && inside) {
+				int opposite = (kernel_radius - offset.y) * (2 * kernel_radius + 1) + kernel_radius - offset.x;
+				sample_weight = vload4(0, weight_map + opposite * map_plane + (pixel.y + offset.y) * map_width + pixel.x + offset.x);
+			} else {
+				int gaussian_position = 0;
+				float4 euclidean_distance = 0.f;
+				int target_row = 0;
+				for (int y = -kernel_radius; y < kernel_radius + 1; ++y, ++target_row) {
+					float16 sample_window_row = ReadTile16(sample.x - kernel_radius,
+														   sample.y + y, 
+														   sample_tile);
+
+					float4 diff = (invert - factor * target_window[target_row].s0123) * (target_window[target_row].s0123 - sample_window_row.s0123);
+					euclidean_distance += gaussian[gaussian_position] * (diff * diff);
+					diff = (invert - factor * target_window[target_row].s6789) * (target_window[target_row].s6789 - sample_window_row.s6789);
+					euclidean_distance += gaussian[gaussian_position] * (diff * diff);
+
+					diff = (invert - factor * target_window[target_row].s1234) * (target_window[target_row].s1234 - sample_window_row.s1234);
+					euclidean_distance += gaussian[gaussian_position + 1] * (diff * diff);
+					diff = (invert - factor * target_window[target_row].s5678) * (target_window[target_row].s5678 - sample_window_row.s5678);
+					euclidean_distance += gaussian[gaussian_position + 1] * (diff * diff);
+
+					diff = (invert - factor * target_window[target_row].s2345) * (target_window[target_row].s2345 - sample_window_row.s2345);
+					euclidean_distance += gaussian[gaussian_position + 2] * (diff * diff);
+					diff = (invert - factor * target_window[target_row].s4567) * (target_window[target_row].s4567 - sample_window_row.s4567);
+					euclidean_distance += gaussian[gaussian_position + 2] * (diff * diff);
+
+					diff = (invert - factor * target_window[target_row].s3456) * (target_window[target_row].s3456 - sample_window_row.s3456);
+					euclidean_distance += gaussian[gaussian_position + 3] * (diff * diff);
+
+					gaussian_position += 7;
+				}
+
+				sample_weight = exp(-euclidean_distance / h);
+
+				if (!reuse) {
+					int position = (kernel_radius + offset.y) * (2 * kernel_radius + 1) + kernel_radius + offset.x;
+					vstore4(sample_weight, 0, weight_map + position * map_plane + pixel.y * map_width + pixel.x);
+				}
+			}
+
+			*target_weight = target_min 
+						   ? min(*target_weight, sample_weight) 
+						   : max(*target_weight, sample_weight);
+
+			*all_samples_weight += sample_weight;
+
+			sample_centre_pixel = ReadTile4(sample.x, sample.y, sample_tile);
+			*all_samples_average += sample_weight * sample_centre_pixel;
+		}
+	}
+	*target_weight = max(*target_weight, 0.004f);
+}
+
+#define INTEGRAL_REGION		38	// side of the region covered by the windows of the 32x32 target pixels
+#define INTEGRAL_ORIGIN		5	// tile coordinates of the region's top-left pixel
+#define INTEGRAL_SIDE		39	// region plus a leading row and column of zeroes
+#define INTEGRAL_ENTRIES	6	// squared differences computed by each of the 256 work items
+
+void IntegralTargetPixels(
+	const		int2	local_id,		// work item
+	local	TILE_PIXEL	*target_tile,	// 48x48 tile containing the target pixels' windows
+				float	*target_pixels) {	// INTEGRAL_ENTRIES pixels for which this work item computes differences
+
+	// Each work item computes the same entries of the integral region for
+	// every sample offset, so the target pixels it needs are fetched once.
+
+	int linear_id = (local_id.y << 3) + local_id.x;
+	for (int i = 0; i < INTEGRAL_ENTRIES; ++i) {
+		int entry = min(linear_id + (i << 8), INTEGRAL_REGION * INTEGRAL_REGION - 1);
+		int2 position = (int2)(entry % INTEGRAL_REGION, entry / INTEGRAL_REGION) + INTEGRAL_ORIGIN;
+		target_pixels[i] = ReadTile(position.x, position.y, target_tile);
+	}
+}
+
+void FilterIntegral(
+	const		int2	local_id,				// work item
+	const		int2	target,					// tile coordinates of left-hand pixel of 4 pixels in a horizontal strip
+	const		float	h,						// strength of denoising
+	const		int		sample_expand,			// factor to expand sample radius
+				float	*target_pixels,			// pixels fetched by IntegralTargetPixels
+	local	TILE_PIXEL	*sample_tile,			// 48x48 tile from which samples are taken
+	local		float	*integral,				// INTEGRAL_SIDE x INTEGRAL_SIDE integral image of squared differences
+	const		int		reweight_target_pixel,	// when target plane is the sampling plane, the target pixel is reweighted
+	const		int		target_min,				// target pixel is weighted using minimum weight of samples, not maximum
+	const		int		balanced,				// balanced tonal range de-noising
+				float4	*all_samples_average,	// running sum of weighted pixel values
+				float4	*all_samples_weight,	// running sum of weights
+				float4  *target_weight) {		// weight chosen from across all sample planes that will be used for target pixel
+
+	// Computes the box-weighted average of the target pixels' windows
+	// against all sample windows from the tile.
+	//
+	// Each sample offset is applied to the entire tile at once. The work
+	// group computes the squared differences between the target tile and 
+	// the offset sample tile, then sums them into an integral image from 
+	// which each 7x7 window distance is read with 4 lookups. The cost per
+	// sample is therefore independent of the window size.
+	//
+	// Every work item uses the sample bounds that Filter4 would use, so
+	// sample_expand suffers the same errors at the tile borders.
+
+	int kernel_radius = 3;
+	int sample_radius = kernel_radius * sample_expand;
+	int linear_id = (local_id.y << 3) + local_id.x;
+
+	int2 sample_start = max(target - sample_radius, 3);
+	int2 sample_end	  = (int2)(min(target.x + sample_radius, 41), min(target.y + sample_radius, 44));
+
+	// Sample offsets for the work group span the bounds of all its work items
+	int2 offset_start = max((int2)(-sample_radius), (int2)(3 - 36, 3 - 39));
+	int2 offset_end	  = min((int2)(sample_radius), (int2)(41 - 8, 44 - 8));
+
+	const float invert = 1.f;					// bias difference with an inversion...
+	const float factor = balanced ? 0.5f: 0.f;	// ... and range limiter, towards highlights and away from shadows 
+	float inversion[INTEGRAL_ENTRIES];
+	for (int i = 0; i < INTEGRAL_ENTRIES; ++i)
+		inversion[i] = invert - factor * target_pixels[i];
+
+	// Leading row and column of the integral image are zero
+	if (linear_id < INTEGRAL_SIDE) {
+		integral[linear_id] = 0.f;
+		integral[linear_id * INTEGRAL_SIDE] = 0.f;
+	}
+
+	// Corners of the integral image for the 7x7 windows of the 4 target pixels
+	int window_top	  = (target.y - kernel_radius - INTEGRAL_ORIGIN) * INTEGRAL_SIDE;
+	int window_bottom = window_top + (2 * kernel_radius + 1) * INTEGRAL_SIDE;
+	int window_left	  = target.x - kernel_radius - INTEGRAL_ORIGIN;
+	int window_right  = window_left + 2 * kernel_radius + 1;
+
+	float4 sample_centre_pixel;
+	int2 offset;
+	for (offset.y = offset_start.y; offset.y <= offset_end.y; ++offset.y) {
+		for (offset.x = offset_start.x; offset.x <= offset_end.x; ++offset.x) {
+			for (int i = 0; i < INTEGRAL_ENTRIES; ++i) {
+				int entry = linear_id + (i << 8);
+				if (entry < INTEGRAL_REGION * INTEGRAL_REGION) {
+					int2 position = (int2)(entry % INTEGRAL_REGION, entry / INTEGRAL_REGION);
+					int2 sample = clamp(position + INTEGRAL_ORIGIN + offset, 0, 47);
+					float diff = inversion[i] * (target_pixels[i] - ReadTile(sample.x, sample.y, sample_tile));
+					integral[(position.y + 1) * INTEGRAL_SIDE + position.x + 1] = diff * diff;
+				}
+			}
+			barrier(CLK_LOCAL_MEM_FENCE);
+
+			if (linear_id < INTEGRAL_REGION) {	// running sum along each row
+				int row = (linear_id + 1) * INTEGRAL_SIDE;
+				float sum = 0.f;
+				for (int x = 1; x < INTEGRAL_SIDE; ++x) {
+					sum += integral[row + x];
+					integral[row + x] = sum;
+				}
+			}
+			barrier(CLK_LOCAL_MEM_FENCE);
+
+			if (linear_id < INTEGRAL_REGION) {	// running sum down each column
+				int column = linear_id + 1;
+				float sum = 0.f;
+				for (int y = 1; y < INTEGRAL_SIDE; ++y) {
+					sum += integral[y * INTEGRAL_SIDE + column];
+					integral[y * INTEGRAL_SIDE + column] = sum;
+				}
+			}
+			barrier(CLK_LOCAL_MEM_FENCE);
+
+			int2 sample = target + offset;
+			if (sample.x >= sample_start.x && sample.x <= sample_end.x &&
+				sample.y >= sample_start.y && sample.y <= sample_end.y) {
+
+				float4 euclidean_distance = vload4(0, integral + window_bottom + window_right)
+										  - vload4(0, integral + window_top + window_right)
+										  - vload4(0, integral + window_bottom + window_left)
+										  + vload4(0, integral + window_top + window_left);
+
+				float4 sample_weight = exp(-euclidean_distance / (49.f * h));
+
+				*target_weight = target_min 
+							   ? min(*target_weight, sample_weight) 
+							   : max(*target_weight, sample_weight);
+
+				sample_weight = (offset.x == 0 && offset.y == 0 && reweight_target_pixel) 
+							  ? 0.f 
+							  : sample_weight;
+
+				*all_samples_weight += sample_weight;
+
+				sample_centre_pixel = ReadTile4(sample.x, sample.y, sample_tile);
+				*all_samples_average += sample_weight * sample_centre_pixel;
+			}
+			barrier(CLK_LOCAL_MEM_FENCE);
+		}
+	}
+	*target_weight = max(*target_weight, 0.004f);
+	*all_samples_weight += reweight_target_pixel ? *target_weight : 0.f;
+
+	sample_centre_pixel = ReadTile4(target.x, target.y, sample_tile);
+	*all_samples_average +=  reweight_target_pixel ? *target_weight * sample_centre_pixel : 0.f;
+}
+
+#define SEPARABLE_COLUMNS	38	// columns of the tile covered by the windows of the 32x32 target pixels
+#define SEPARABLE_ORIGIN	5	// tile coordinates of the left-hand column
+
+void FilterSeparable(
+	const		int2	local_id,				// work item
+	const		int2	target,					// tile coordinates of left-hand pixel of 4 pixels in a horizontal strip
+	const		float	h,						// strength of denoising
+	const		int		sample_expand,			// factor to expand sample radius
+				float16	*target_window,			// a window of 10x7 pixels, centred upon the 4 pixels being filtered
+	local	TILE_PIXEL	*sample_tile,			// 48x48 tile from which samples are taken
+	constant	float	*gaussian,				// 49 weights of guassian kernel followed by the 7 weights of its 1-dimensional equivalent
+	local		float	*column_distance,		// 32 x SEPARABLE_COLUMNS weighted column distances, one row per row of work items
+	const		int		reweight_target_pixel,	// when target plane is the sampling plane, the target pixel is reweighted
+	const		int		target_min,				// target pixel is weighted using minimum weight of samples, not maximum
+	const		int		balanced,				// balanced tonal range de-noising
+				float4	*all_samples_average,	// running sum of weighted pixel values
+				float4	*all_samples_weight,	// running sum of weights
+				float4  *target_weight) {		// weight chosen from across all sample planes that will be used for target pixel
+
+	// Computes the gaussian-weighted average of the target pixels' windows
+	// against all sample windows from the tile, the same as Filter4.
+	//
+	// The 7x7 gaussian is the product of a 1-dimensional gaussian applied
+	// vertically and then horizontally. For each sample offset every work
+	// item computes the vertically weighted distance of each column of its
+	// 4 pixels, which it shares through local memory with the work items
+	// either side. Each window's distance is then the horizontally 
+	// weighted sum of 7 column distances. This is 14 multiply-adds per
+	// pixel instead of 49.
+	//
+	// Every work item uses the sample bounds that Filter4 would use, so
+	// sample_expand suffers the same errors at the tile borders.
+
+	int kernel_radius = 3;
+	int sample_radius = kernel_radius * sample_expand;
+
+	int2 sample_start = max(target - sample_radius, 3);
+	int2 sample_end	  = (int2)(min(target.x + sample_radius, 41), min(target.y + sample_radius, 44));
+
+	// Sample offsets for the work group span the bounds of all its work items
+	int2 offset_start = max((int2)(-sample_radius), (int2)(3 - 36, 3 - 39));
+	int2 offset_end	  = min((int2)(sample_radius), (int2)(41 - 8, 44 - 8));
+
+	constant float *weight = gaussian + 49;
+
+	const float invert = 1.f;					// bias difference with an inversion...
+	const float factor = balanced ? 0.5f: 0.f;	// ... and range limiter, towards highlights and away from shadows 
+
+	float target_pixels[7][16];
+	for (int y = 0; y < 2 * kernel_radius + 1; ++y)
+		vstore16(target_window[y], 0, target_pixels[y]);
+
+	// Of the 10 columns in the target window, a work item computes the 
+	// distances of its own 4 and, at the edges of the work group, the 3 
+	// beyond them
+	int first_column = (local_id.x == 0) ? 0 : 3;
+	int last_column	 = (local_id.x == 7) ? 9 : 6;
+	local float *columns = column_distance + local_id.y * SEPARABLE_COLUMNS + target.x - kernel_radius - SEPARABLE_ORIGIN;
+
+	float4 sample_centre_pixel;
+	int2 offset;
+	for (offset.y = offset_start.y; offset.y <= offset_end.y; ++offset.y) {
+		for (offset.x = offset_start.x; offset.x <= offset_end.x; ++offset.x) {
+			int2 sample = target + offset;
+
+			// Rows of work items share bounds vertically
+			if (sample.y >= sample_start.y && sample.y <= sample_end.y) {
+				for (int c = 0; c < 10; ++c) {
+					if (c >= first_column && c <= last_column) {
+						int x = clamp(sample.x - kernel_radius + c, 0, 47);
+						float distance = 0.f;
+						for (int y = 0; y < 2 * kernel_radius + 1; ++y) {
+							float sample_pixel = ReadTile(x, sample.y - kernel_radius + y, sample_tile);
+							float diff = (invert - factor * target_pixels[y][c]) * (target_pixels[y][c] - sample_pixel);
+							distance += weight[y] * (diff * diff);
+						}
+						columns[c] = distance;
+					}
+				}
+			}
+			barrier(CLK_LOCAL_MEM_FENCE);
+
+			if (sample.x >= sample_start.x && sample.x <= sample_end.x &&
+				sample.y >= sample_start.y && sample.y <= sample_end.y) {
+
+				float4 euclidean_distance = 0.f;
+				for (int x = 0; x < 2 * kernel_radius + 1; ++x)
+					euclidean_distance += weight[x] * vload4(0, columns + x);
+
+				float4 sample_weight = exp(-euclidean_distance / h);
+
+				*target_weight = target_min 
+							   ? min(*target_weight, sample_weight) 
+							   : max(*target_weight, sample_weight);
+
+				sample_weight = (offset.x == 0 && offset.y == 0 && reweight_target_pixel) 
+							  ? 0.f 
+							  : sample_weight;
+
+				*all_samples_weight += sample_weight;
+
+				sample_centre_pixel = ReadTile4(sample.x, sample.y, sample_tile);
+				*all_samples_average += sample_weight * sample_centre_pixel;
+			}
+			barrier(CLK_LOCAL_MEM_FENCE);
+		}
+	}
+	*target_weight = max(*target_weight, 0.004f);
+	*all_samples_weight += reweight_target_pixel ? *target_weight : 0.f;
+
+	sample_centre_pixel = ReadTile4(target.x, target.y, sample_tile);
+	*all_samples_average +=  reweight_target_pixel ? *target_weight * sample_centre_pixel : 0.f;
+}
@@ -0,0 +1,20 @@
+/* Deathray - An Avisynth plug-in filter for spatial/temporal non-local means de-noising.
+ *
+ * version 1.04
+ *
+ * Copyright 2013, Jawed Ashraf - Deathray@cupidity.f9.co.uk
+ */
+
+#ifndef NLM_ALGORITHM_H_
+#define NLM_ALGORITHM_H_
+
+// nlm_algorithm
+// Method used to compute the distance between the target pixel's window
+// and each sample window. Set by the a parameter of the filter.
+enum nlm_algorithm {
+	NLM_GAUSSIAN,	// 7x7 gaussian-weighted windows, Filter4
+	NLM_INTEGRAL,	// 7x7 box-weighted windows read from an integral image, FilterIntegral
+	NLM_SEPARABLE	// 7x7 gaussian-weighted windows, weighted vertically then horizontally, FilterSeparable
+};
+
+#endif // NLM_ALGORITHM_H_
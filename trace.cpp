@@ -0,0 +1,217 @@
+/* Deathray - An Avisynth plug-in filter for spatial/temporal non-local means de-noising.
+ *
+ * version 1.04
+ *
+ * Copyright 2013, Jawed Ashraf - Deathray@cupidity.f9.co.uk
+ */
+
+#include <fstream>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include "trace.h"
+
+// span
+// A host span or a device command, timed in microseconds from TraceOpen
+struct span {
+	string name			;	// function or kernel
+	int frame			;	// frame number, or -1
+	int process			;	// 1 for host threads, 2 for device queues
+	unsigned int track	;	// host thread id, or index of the queue
+	double start		;	// time at start
+	double duration		;	// time taken, or negative for a note
+};
+
+// command
+// A command awaiting completion of its event
+struct command {
+	string name			;	// kernel or copy
+	double enqueued		;	// time when enqueued
+};
+
+mutex					g_trace_mutex		;	// guards the trace against concurrent instances and event callbacks
+atomic<int>				g_trace_users(0)	;	// instances that have opened the trace
+string					g_trace_path		;	// file written by the final TraceClose
+LARGE_INTEGER			g_trace_origin		;	// host time of the first TraceOpen
+LARGE_INTEGER			g_trace_frequency	;	// ticks of host time per second
+vector<span>			g_trace_spans		;	// spans recorded so far
+vector<cl_command_queue> g_trace_queues		;	// queues in the order their commands completed, numbering device tracks
+
+// Microseconds
+// Host time relative to the opening of the trace
+double Microseconds(const LARGE_INTEGER &time) {
+	return 1e6 * static_cast<double>(time.QuadPart - g_trace_origin.QuadPart) / g_trace_frequency.QuadPart;
+}
+
+// QueueTrack
+// Index of the queue, amongst those with traced commands
+unsigned int QueueTrack(const cl_command_queue &queue) {
+	for (size_t i = 0; i < g_trace_queues.size(); ++i) {
+		if (g_trace_queues[i] == queue) return static_cast<unsigned int>(i);
+	}
+	g_trace_queues.push_back(queue);
+	return static_cast<unsigned int>(g_trace_queues.size() - 1);
+}
+
+// Escaped
+// The text as a JSON string, without its quotes. Names of clips and
+// kernels, and notes, may contain quotes, backslashes or control
+// characters.
+string Escaped(const string &text) {
+	static const char hex[] = "0123456789abcdef";
+
+	string escaped;
+	for (size_t i = 0; i < text.size(); ++i) {
+		const unsigned char c = static_cast<unsigned char>(text[i]);
+		if (c == '"' || c == '\\') {
+			escaped += '\\';
+			escaped += c;
+		} else if (c < 0x20) {
+			escaped += "\\u00";
+			escaped += hex[c >> 4];
+			escaped += hex[c & 15];
+		} else {
+			escaped += c;
+		}
+	}
+	return escaped;
+}
+
+// WriteTrace
+// Writes the spans in Chrome's trace event format
+void WriteTrace() {
+	ofstream file(g_trace_path.c_str());
+	file << "{\"traceEvents\":[\n"
+		 << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"Host\"}},\n"
+		 << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":2,\"args\":{\"name\":\"OpenCL\"}}";
+
+	for (size_t i = 0; i < g_trace_queues.size(); ++i)
+		file << ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":2,\"tid\":" << i << ",\"args\":{\"name\":\"Queue " << i << "\"}}";
+
+	file.setf(ios::fixed);
+	file.precision(3);
+	for (size_t i = 0; i < g_trace_spans.size(); ++i) {
+		const span &each = g_trace_spans[i];
+		file << ",\n{\"name\":\"" << Escaped(each.name) << "\",\"pid\":" << each.process
+			 << ",\"tid\":" << each.track << ",\"ts\":" << each.start;
+		if (each.duration < 0.) {
+			file << ",\"ph\":\"i\",\"s\":\"g\"";
+		} else {
+			file << ",\"ph\":\"X\",\"dur\":" << each.duration;
+		}
+		if (each.frame >= 0) file << ",\"args\":{\"frame\":" << each.frame << "}";
+		file << "}";
+	}
+	file << "\n]}\n";
+}
+
+// TraceComplete
+// Callback of a traced command's event, which records the command's
+// execution on the device
+void CL_CALLBACK TraceComplete(cl_event event, cl_int status, void *traced) {
+	command *completed = static_cast<command*>(traced);
+
+	cl_ulong queued = 0;
+	cl_ulong start = 0;
+	cl_ulong end = 0;
+	cl_command_queue queue = NULL;
+	if (status == CL_COMPLETE &&
+		clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_QUEUED, sizeof(cl_ulong), &queued, NULL) == CL_SUCCESS &&
+		clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, NULL) == CL_SUCCESS &&
+		clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL) == CL_SUCCESS &&
+		clGetEventInfo(event, CL_EVENT_COMMAND_QUEUE, sizeof(cl_command_queue), &queue, NULL) == CL_SUCCESS) {
+
+		lock_guard<mutex> lock(g_trace_mutex);
+		if (g_trace_users > 0) {
+			span device_span = {completed->name, 
+								-1, 
+								2, 
+								QueueTrack(queue), 
+								completed->enqueued + 1e-3 * static_cast<double>(start - queued), 
+								1e-3 * static_cast<double>(end - start)};
+			g_trace_spans.push_back(device_span);
+		}
+	}
+
+	clReleaseEvent(event);
+	delete completed;
+}
+
+void TraceOpen(const string &path) {
+	lock_guard<mutex> lock(g_trace_mutex);
+
+	if (g_trace_users++ > 0) return;
+
+	g_trace_path = path;
+	g_trace_spans.clear();
+	g_trace_queues.clear();
+	QueryPerformanceFrequency(&g_trace_frequency);
+	QueryPerformanceCounter(&g_trace_origin);
+}
+
+void TraceClose() {
+	lock_guard<mutex> lock(g_trace_mutex);
+
+	if (g_trace_users == 0 || --g_trace_users > 0) return;
+
+	WriteTrace();
+	g_trace_spans.clear();
+	g_trace_queues.clear();
+}
+
+bool Tracing() {
+	return g_trace_users > 0;
+}
+
+LARGE_INTEGER TraceTime() {
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	return now;
+}
+
+void TraceSpan(
+	const	char			*name,
+	const	int				&frame,
+	const	LARGE_INTEGER	&start) {
+
+	if (!Tracing()) return;
+
+	const LARGE_INTEGER end = TraceTime();
+
+	lock_guard<mutex> lock(g_trace_mutex);
+	if (g_trace_users == 0) return;
+
+	const double start_time = Microseconds(start);
+	span host_span = {name, frame, 1, GetCurrentThreadId(), start_time, Microseconds(end) - start_time};
+	g_trace_spans.push_back(host_span);
+}
+
+void TraceNote(const string &text) {
+	OutputDebugStringA(("Deathray: " + text + "\n").c_str());
+
+	if (!Tracing()) return;
+
+	lock_guard<mutex> lock(g_trace_mutex);
+	if (g_trace_users == 0) return;
+
+	span note = {text, -1, 1, GetCurrentThreadId(), Microseconds(TraceTime()), -1.};
+	g_trace_spans.push_back(note);
+}
+
+void TraceCommand(
+	const	string			&name,
+	const	cl_event		&event) {
+
+	if (!Tracing() || event == NULL) return;
+
+	command *traced = new command;
+	traced->name = name;
+	traced->enqueued = Microseconds(TraceTime());
+
+	// The client may release the event before it completes
+	clRetainEvent(event);
+	if (clSetEventCallback(event, CL_COMPLETE, &TraceComplete, traced) != CL_SUCCESS) {
+		clReleaseEvent(event);
+		delete traced;
+	}
+}
@@ -0,0 +1,71 @@
+/* Deathray - An Avisynth plug-in filter for spatial/temporal non-local means de-noising.
+ *
+ * version 1.04
+ *
+ * Copyright 2013, Jawed Ashraf - Deathray@cupidity.f9.co.uk
+ */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <windows.h>
+#include <string>
+#include <CL/cl.h>
+
+using namespace std;
+
+// Tracing
+// When the trace parameter names a file, the time spent on each frame
+// is written to it as JSON, for viewing in chrome://tracing or Perfetto.
+//
+// Host spans, around GetFrame and the child's GetFrame, are merged with
+// the execution of each kernel and copy on the devices, as timed by
+// OpenCL's profiling of commands. A command's device timestamps are
+// placed on the host's timeline relative to the host's time when it was
+// enqueued, which corresponds with CL_PROFILING_COMMAND_QUEUED.
+//
+// Tracing costs a small allocation per command and per span, so it is
+// for diagnosis rather than encoding.
+
+// TraceOpen
+// Starts tracing to the file. Queues created while tracing have
+// profiling enabled, see device::cq, as does the queue of each device's
+// frame_cache, whenever it was created. When instances open traces 
+// concurrently, the first file named receives all of their spans.
+void TraceOpen(const string &path);
+
+// TraceClose
+// Writes the file when every instance that opened a trace has closed
+// it. Commands that have not completed are missing from the file.
+void TraceClose();
+
+// Tracing
+// True while a trace is open.
+bool Tracing();
+
+// TraceTime
+// Host time at the start of a span.
+LARGE_INTEGER TraceTime();
+
+// TraceSpan
+// Records a span of the calling thread, from start until now.
+void TraceSpan(
+	const	char			*name,
+	const	int				&frame,		// frame number shown with the span, or -1
+	const	LARGE_INTEGER	&start);
+
+// TraceNote
+// Reports a change made to the filter's parameters, or another event
+// the user should know of. Written to the debugger's output, e.g.
+// DebugView, and as an instant in the trace when one is open.
+void TraceNote(const string &text);
+
+// TraceCommand
+// Records the execution of the command, once it completes. Called as
+// soon as the command is enqueued. Commands on queues without profiling
+// are not recorded.
+void TraceCommand(
+	const	string			&name,
+	const	cl_event		&event);	// event of the command, may be NULL
+
+#endif // _TRACE_H_
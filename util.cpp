@@ -92,3 +92,19 @@ result GetSourceFromResource(int resource_id, string *source) {
 
 	return FILTER_OK ; 
 }
+
+// Instances on other threads may be configuring their filters
+static __declspec(thread) int t_setup_count = 0 ;
+static __declspec(thread) bool t_setup_exempt = false ;
+
+void CountSetup() {
+	if (!t_setup_exempt) ++t_setup_count ;
+}
+
+int SetupCount() {
+	return t_setup_count ;
+}
+
+void ExemptSetup(const bool &exempt) {
+	t_setup_exempt = exempt ;
+}
@@ -60,4 +60,20 @@ void GetFrameDimensions(
 // listed in resource.h.
 result GetSourceFromResource(int resource_id, string *source);
 
+// CountSetup
+// Counts the creation of a kernel or a device buffer by the calling
+// thread. Filters create both while they are configured, after which
+// filtering creates neither, see deathray::GetFrame and DeathraySoak.
+//
+// SetupCount
+// Count of creations by the calling thread.
+//
+// ExemptSetup
+// While exempt, creations by the calling thread are not counted. The
+// device's frame_cache refills planes it has evicted, within its share
+// of memory, whenever a seek or another instance needs them.
+void CountSetup();
+int SetupCount();
+void ExemptSetup(const bool &exempt);
+
 #endif // _UTIL_H_